@@ -19,37 +19,37 @@
 #define ECCACHE_INCLUDED
 
 #include <zarafa/zcdefs.h>
+#include <deque>
 #include <list>
 #include <string>
 #include <vector>
 #include <cassert>
+#include <pthread.h>
 
 #include <zarafa/platform.h>
 
 class ECLogger;
 
-template<typename Key>
-class KeyEntry _zcp_final {
-public:
-	Key key;
-	time_t ulLastAccess;
-};
-
-template<typename Key>
-bool KeyEntryOrder(const KeyEntry<Key> &a, const KeyEntry<Key> &b) {
-	return a.ulLastAccess < b.ulLastAccess;
-}
-
 template<typename Value>
 unsigned int GetCacheAdditionalSize(const Value &val) {
 	return 0;
 }
 
+// Selects the ECShardedCache segment of a key; works for all integral ids.
+template<typename Key>
+size_t GetCacheShardHash(const Key &key) {
+	return key;
+}
+
 class ECsCacheEntry {
 public:
-	ECsCacheEntry() { ulLastAccess = 0; }
+	ECsCacheEntry() { ulLastAccess = 0; bReferenced = false; ulClockSeq = 0; }
 
 	time_t 	ulLastAccess;
+	// Second-chance bit for the CLOCK eviction in ECCache
+	bool	bReferenced;
+	// Identifies the queue slot of this entry in ECCache
+	unsigned long ulClockSeq;
 };
 
 class ECCacheBase
@@ -65,8 +65,8 @@ public:
 	
 	size_type MaxSize() const { return m_ulMaxSize; }
 	long MaxAge() const { return m_lMaxAge; }
-	size_type HitCount() const { return m_ulCacheHit; }
-	size_type ValidCount() const { return m_ulCacheValid; }
+	virtual size_type HitCount() const { return m_ulCacheHit; }
+	virtual size_type ValidCount() const { return m_ulCacheValid; }
 
 	// Decrement the valid count. Used from ECCacheManger::GetCell.
 	void DecrementValidCount() { 
@@ -95,6 +95,22 @@ private:
 };
 
 
+/*
+ * ECCache evicts with the CLOCK (second chance) algorithm. Every key is
+ * queued on m_clock when it is inserted; a cache hit only sets the
+ * bReferenced bit of the entry. When the cache is full, keys are taken
+ * from the front of the queue: referenced entries get their bit cleared
+ * and are requeued, the first unreferenced entry is evicted. Lookup,
+ * insert and eviction are therefore all (amortized) constant time, and
+ * no purge ever has to look at the complete map.
+ *
+ * Keys are tracked by value, not by iterator, since not all map types
+ * keep iterators valid on insert and erase. Each queue slot carries a
+ * sequence number which is also stored in the entry. A key removed through
+ * RemoveCacheItem() stays in the queue until it is popped or the queue is
+ * compacted, but its slot no longer matches the entry when the key is
+ * added again, so such stale slots are skipped.
+ */
 template<typename _MapType>
 class ECCache _zcp_final : public ECCacheBase
 {
@@ -104,12 +120,13 @@ public:
 	
 	ECCache(const std::string &strCachename, size_type ulMaxSize, long lMaxAge)
 		: ECCacheBase(strCachename, ulMaxSize, lMaxAge)
-		, m_ulSize(0)
+		, m_ulSize(0), m_ulClockSeq(0)
 	{ }
 	
 	ECRESULT ClearCache()
 	{
 		m_map.clear();
+		m_clock.clear();
 		m_ulSize = 0;
 		ClearCounters();
 		return erSuccess;
@@ -123,7 +140,7 @@ public:
 	size_type Size() const _zcp_override
 	{
 		// it works with map and hash_map
-		return (m_map.size() * (sizeof(typename _MapType::value_type) + sizeof(_MapType) )) + m_ulSize;
+		return (m_map.size() * (sizeof(typename _MapType::value_type) + sizeof(_MapType) + sizeof(key_type))) + m_ulSize;
 	}
 
 	ECRESULT RemoveCacheItem(const key_type &key) 
@@ -134,9 +151,8 @@ public:
 		if (iter == m_map.end())
 			return ZARAFA_E_NOT_FOUND;
 
-		m_ulSize -= GetCacheAdditionalSize(iter->second);
-		m_ulSize -= GetCacheAdditionalSize(key);
-		m_map.erase(iter);
+		EraseItem(iter);
+		CompactClock();
 		return erSuccess;
 	}
 	
@@ -151,29 +167,17 @@ public:
 		if (iter != m_map.end()) {
 			// Cache age of the cached item, if expired remove the item from the cache
 			if (MaxAge() != 0 && (long)(tNow - iter->second.ulLastAccess) >= MaxAge()) {
-				/*
-				 * Because of templates, there is no guarantee
-				 * that m_map keeps iterators valid while
-				 * elements are deleted from it. Track them in
-				 * a separate delete list.
-				 */
-				std::vector<key_type> dl;
-
-				// Loop through all items and check
-				for (iter = m_map.begin(); iter != m_map.end(); ++iter)
-					if ((long)(tNow - iter->second.ulLastAccess) >= MaxAge())
-						dl.push_back(iter->first);
-				for (typename std::vector<key_type>::const_iterator i = dl.begin(); i != dl.end(); ++i)
-					m_map.erase(*i);
+				EraseItem(iter);
+				// Items older than this one are at the front of the clock
+				ExpireItems(tNow);
 				er = ZARAFA_E_NOT_FOUND;
 			} else {
 				*lppValue = &iter->second;
 				// If we have an aging cache, we don't update the timestamp,
 				// so we can't keep a value longer in the cache than the max age.
-				// If we have a non-aging cache, we need to update it,
-				// to see the oldest 5% to purge from the cache.
 				if (MaxAge() == 0)
 					iter->second.ulLastAccess = tNow;
+				iter->second.bReferenced = true;
 				er = erSuccess;
 			}
 		} else {
@@ -204,6 +208,7 @@ public:
 		typedef typename _MapType::value_type value_type;
 		typedef typename _MapType::iterator iterator;
 		std::pair<iterator,bool> result;
+		unsigned long ulClockSeq;
 
 		if (MaxSize() == 0)
 			return erSuccess;
@@ -213,8 +218,12 @@ public:
 		if (result.second == false) {
 			// The key already exists but its value is unmodified. So update it now
 			m_ulSize += (int)(GetCacheAdditionalSize(value) - GetCacheAdditionalSize(result.first->second));
+			// The entry keeps its place in the queue
+			ulClockSeq = result.first->second.ulClockSeq;
 			result.first->second = value;
+			result.first->second.ulClockSeq = ulClockSeq;
 			result.first->second.ulLastAccess = GetProcessTime();
+			result.first->second.bReferenced = true;
 			// Since there is a very small chance that we need to purge the cache, we're skipping that here.
 		} else {
 			// We just inserted a new entry.
@@ -222,8 +231,11 @@ public:
 			m_ulSize += GetCacheAdditionalSize(key);
 			
 			result.first->second.ulLastAccess = GetProcessTime();
+			result.first->second.bReferenced = false;
+			result.first->second.ulClockSeq = ++m_ulClockSeq;
+			m_clock.push_back(clock_slot_type(key, m_ulClockSeq));
 			
-			UpdateCache(0.05F);
+			UpdateCache();
 		}
 
 		return erSuccess;
@@ -237,50 +249,241 @@ public:
 	}
 
 private:
-	ECRESULT PurgeCache(float ratio)
+	typedef std::pair<key_type, unsigned long> clock_slot_type;
+
+	/**
+	 * Find the entry a queue slot refers to.
+	 *
+	 * @return the entry, or m_map.end() when the slot is stale: its key
+	 *         was removed, and possibly added again in another slot
+	 */
+	typename _MapType::iterator FindSlot(const clock_slot_type &slot)
 	{
-		std::list<KeyEntry<key_type> > lstEntries;
-		typename std::list<KeyEntry<key_type> >::iterator iterEntry;
-		typename _MapType::iterator iterMap;
+		typename _MapType::iterator iterMap = m_map.find(slot.first);
 
-		for (iterMap = m_map.begin(); iterMap != m_map.end(); ++iterMap) {
-			KeyEntry<key_type> k;
-			k.key = iterMap->first;
-			k.ulLastAccess = iterMap->second.ulLastAccess;
+		if (iterMap != m_map.end() && iterMap->second.ulClockSeq != slot.second)
+			return m_map.end();
+		return iterMap;
+	}
 
-			lstEntries.push_back(k);
-		}
+	void EraseItem(typename _MapType::iterator iter)
+	{
+		m_ulSize -= GetCacheAdditionalSize(iter->second);
+		m_ulSize -= GetCacheAdditionalSize(iter->first);
+		m_map.erase(iter);
+	}
+
+	/**
+	 * Evict one item using the CLOCK algorithm.
+	 *
+	 * Every key in the queue is passed at most twice, so this loop is
+	 * bounded even when all items have been referenced.
+	 *
+	 * @return false if the cache was empty
+	 */
+	bool EvictItem()
+	{
+		typename _MapType::iterator iterMap;
 
-		lstEntries.sort(KeyEntryOrder<key_type>);
+		while (!m_clock.empty()) {
+			iterMap = FindSlot(m_clock.front());
+			if (iterMap == m_map.end()) {
+				// Stale slot, key already removed from the map
+				m_clock.pop_front();
+				continue;
+			}
+			if (iterMap->second.bReferenced) {
+				iterMap->second.bReferenced = false;
+				m_clock.push_back(m_clock.front());
+				m_clock.pop_front();
+				continue;
+			}
+			m_clock.pop_front();
+			EraseItem(iterMap);
+			return true;
+		}
+		return false;
+	}
 
-		// We now have a list of all cache items, sorted by access time, (oldest first)
-		unsigned int ulDelete = (unsigned int)(m_map.size() * ratio);
+	/**
+	 * Remove expired items from the front of the clock.
+	 *
+	 * Keys are queued in insertion order, so the oldest items of an aging
+	 * cache are at the front. Scanning stops at the first live item, so an
+	 * item which was updated after insertion may shield older ones until
+	 * they are looked up themselves.
+	 */
+	void ExpireItems(time_t tNow)
+	{
+		typename _MapType::iterator iterMap;
 
-		// Remove the oldest ulDelete entries from the cache, removing [ratio] % of all
-		// cache entries.
-		for (iterEntry = lstEntries.begin(); iterEntry != lstEntries.end() && ulDelete > 0; ++iterEntry, --ulDelete) {
-			iterMap = m_map.find(iterEntry->key);
-			assert(iterMap != m_map.end());
-			m_ulSize -= GetCacheAdditionalSize(iterMap->second);
-			m_ulSize -= GetCacheAdditionalSize(iterMap->first);
-			m_map.erase(iterMap);
+		while (!m_clock.empty()) {
+			iterMap = FindSlot(m_clock.front());
+			if (iterMap == m_map.end()) {
+				m_clock.pop_front();
+				continue;
+			}
+			if ((long)(tNow - iterMap->second.ulLastAccess) < MaxAge())
+				break;
+			m_clock.pop_front();
+			EraseItem(iterMap);
 		}
+	}
 
-		return erSuccess;
+	/**
+	 * Drop stale slots once they make up more than half of the queue. The
+	 * live slots keep their order, so the oldest items stay at the front
+	 * for ExpireItems(). The cost is amortized over the removals that made
+	 * it necessary.
+	 */
+	void CompactClock()
+	{
+		typename std::deque<clock_slot_type>::const_iterator iterSlot;
+		std::deque<clock_slot_type> clock;
+
+		if (m_clock.size() <= 2 * m_map.size() + 64)
+			return;
+		for (iterSlot = m_clock.begin(); iterSlot != m_clock.end(); ++iterSlot)
+			if (FindSlot(*iterSlot) != m_map.end())
+				clock.push_back(*iterSlot);
+		m_clock.swap(clock);
 	}
 	
-	ECRESULT UpdateCache(float ratio)
+	ECRESULT UpdateCache()
 	{
-		if( Size() > MaxSize()) {
-			PurgeCache(ratio);
-		}
+		// Evict just enough items to get back under the limit
+		while (Size() > MaxSize() && EvictItem())
+			;
 
 		return erSuccess;
 	}
 
 private:
 	_MapType			m_map;	
+	std::deque<clock_slot_type>	m_clock;
 	size_type			m_ulSize;
+	unsigned long		m_ulClockSeq;
+};
+
+/*
+ * ECShardedCache splits one logical cache into independently locked
+ * ECCache segments, selected by GetCacheShardHash() of the key, so that
+ * threads looking up different objects do not contend on a single mutex.
+ * The memory limit is divided evenly over the segments. Statistics are
+ * reported as the sum over all segments, under the name of the cache.
+ *
+ * Callers must hold Mutex(key) while using Shard(key), and any pointer
+ * returned by GetCacheItem() is only valid while that lock is held.
+ */
+template<typename _MapType>
+class ECShardedCache _zcp_final : public ECCacheBase
+{
+public:
+	typedef typename _MapType::key_type		key_type;
+	typedef ECCache<_MapType>				cache_type;
+
+	ECShardedCache(const std::string &strCachename, size_type ulMaxSize, long lMaxAge, unsigned int ulShards)
+		: ECCacheBase(strCachename, ulMaxSize, lMaxAge)
+	{
+		if (ulShards == 0)
+			ulShards = 1;
+		for (unsigned int i = 0; i < ulShards; ++i)
+			m_vSegments.push_back(new Segment(strCachename, ulMaxSize / ulShards, lMaxAge));
+	}
+
+	~ECShardedCache()
+	{
+		for (size_t i = 0; i < m_vSegments.size(); ++i)
+			delete m_vSegments[i];
+	}
+
+	cache_type &Shard(const key_type &key) { return m_vSegments[SegmentOf(key)]->cache; }
+	pthread_mutex_t &Mutex(const key_type &key) { return m_vSegments[SegmentOf(key)]->hMutex; }
+
+	// Segment access by index, for batch operations that group keys per segment
+	size_t ShardCount() const { return m_vSegments.size(); }
+	size_t ShardIndex(const key_type &key) const { return SegmentOf(key); }
+	cache_type &ShardAt(size_t ulIndex) { return m_vSegments[ulIndex]->cache; }
+	pthread_mutex_t &MutexAt(size_t ulIndex) { return m_vSegments[ulIndex]->hMutex; }
+
+	ECRESULT ClearCache()
+	{
+		for (size_t i = 0; i < m_vSegments.size(); ++i) {
+			pthread_mutex_lock(&m_vSegments[i]->hMutex);
+			m_vSegments[i]->cache.ClearCache();
+			pthread_mutex_unlock(&m_vSegments[i]->hMutex);
+		}
+		return erSuccess;
+	}
+
+	count_type ItemCount() const _zcp_override
+	{
+		count_type ulCount = 0;
+
+		for (size_t i = 0; i < m_vSegments.size(); ++i) {
+			pthread_mutex_lock(&m_vSegments[i]->hMutex);
+			ulCount += m_vSegments[i]->cache.ItemCount();
+			pthread_mutex_unlock(&m_vSegments[i]->hMutex);
+		}
+		return ulCount;
+	}
+
+	size_type Size() const _zcp_override
+	{
+		return Sum(&cache_type::Size);
+	}
+
+	size_type HitCount() const _zcp_override
+	{
+		return Sum(&cache_type::HitCount);
+	}
+
+	size_type ValidCount() const _zcp_override
+	{
+		return Sum(&cache_type::ValidCount);
+	}
+
+private:
+	struct Segment {
+		Segment(const std::string &strCachename, size_type ulMaxSize, long lMaxAge)
+			: cache(strCachename, ulMaxSize, lMaxAge)
+		{
+			pthread_mutexattr_t mattr;
+
+			pthread_mutexattr_init(&mattr);
+			pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+			pthread_mutex_init(&hMutex, &mattr);
+			pthread_mutexattr_destroy(&mattr);
+		}
+
+		~Segment() { pthread_mutex_destroy(&hMutex); }
+
+		pthread_mutex_t	hMutex;
+		cache_type		cache;
+	};
+
+	size_t SegmentOf(const key_type &key) const
+	{
+		return GetCacheShardHash(key) % m_vSegments.size();
+	}
+
+	size_type Sum(size_type (cache_type::*lpfnGetter)() const) const
+	{
+		size_type ulTotal = 0;
+
+		for (size_t i = 0; i < m_vSegments.size(); ++i) {
+			pthread_mutex_lock(&m_vSegments[i]->hMutex);
+			ulTotal += (m_vSegments[i]->cache.*lpfnGetter)();
+			pthread_mutex_unlock(&m_vSegments[i]->hMutex);
+		}
+		return ulTotal;
+	}
+
+	// No copies, the segments are owned
+	ECShardedCache(const ECShardedCache &);
+	ECShardedCache &operator=(const ECShardedCache &);
+
+	std::vector<Segment *>	m_vSegments;
 };
 
 #endif // ndef ECCACHE_INCLUDED
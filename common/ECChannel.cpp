@@ -29,11 +29,14 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <linux/rtnetlink.h>
 #endif
 
+#include <algorithm>
 #include <cerrno>
+#include <climits>
 #include <mapicode.h>
 
 #ifdef _DEBUG
@@ -232,6 +235,10 @@ ECChannel::ECChannel(int fd) {
     
 	this->fd = fd;
 	lpSSL = NULL;
+	m_ulReadPos = 0;
+	m_ulReadEnd = 0;
+	m_bCorked = false;
+	m_bPending = false;
 	
 	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&flag), sizeof(flag));
 	*peer_atxt = '\0';
@@ -267,6 +274,13 @@ HRESULT ECChannel::HrEnableTLS(ECLogger *const lpLogger) {
 
 	SSL_clear(lpSSL);
 
+	/*
+	 * Anything the client pipelined after the STARTTLS command was sent
+	 * in plaintext and must not be processed as if it came through the
+	 * encrypted channel.
+	 */
+	m_ulReadPos = m_ulReadEnd = 0;
+
 	if (SSL_set_fd(lpSSL, fd) != 1) {
 		lpLogger->Log(EC_LOGLEVEL_ERROR, "ECChannel::HrEnableTLS(): SSL_set_fd failed");
 		hr = MAPI_E_CALL_FAILED;
@@ -297,11 +311,7 @@ HRESULT ECChannel::HrGets(char *szBuffer, ULONG ulBufSize, ULONG *lpulRead) {
 	if (!szBuffer || !lpulRead)
 		return MAPI_E_INVALID_PARAMETER;
 
-	if (lpSSL)
-		lpRet = SSL_gets(szBuffer, &len);
-	else
-		lpRet = fd_gets(szBuffer, &len);
-
+	lpRet = buf_gets(szBuffer, &len);
 	if (lpRet) {
 		*lpulRead = len;
 		return hrSuccess;
@@ -321,63 +331,51 @@ HRESULT ECChannel::HrGets(char *szBuffer, ULONG ulBufSize, ULONG *lpulRead) {
  * @retval MAPI_E_TOO_BIG more data in the network buffer than requested to read
  */
 HRESULT ECChannel::HrReadLine(std::string * strBuffer, ULONG ulMaxBuffer) {
-	HRESULT hr = hrSuccess;
-	ULONG ulRead = 0;
-
 	if(!strBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 
-	char buffer[65536];
-
 	// clear the buffer before appending
 	strBuffer->clear();
 
-	do {
-		hr = HrGets(buffer, 65536, &ulRead);
-		if (hr != hrSuccess)
-			break;
+	while (true) {
+		if (m_ulReadPos == m_ulReadEnd && !FillBuffer())
+			return MAPI_E_CALL_FAILED;
 
-		strBuffer->append(buffer, ulRead);
-		if (strBuffer->size() > ulMaxBuffer) {
-			hr = MAPI_E_TOO_BIG;
+		const char *lpStart = m_szReadBuf + m_ulReadPos;
+		size_t ulAvail = m_ulReadEnd - m_ulReadPos;
+		const char *lpNewline = (const char *)memchr(lpStart, '\n', ulAvail);
+		size_t ulLen = lpNewline ? lpNewline - lpStart + 1 : ulAvail;
+
+		strBuffer->append(lpStart, ulLen);
+		m_ulReadPos += ulLen;
+
+		if (lpNewline)
 			break;
-		}
-	} while (ulRead == 65535);	// zero-terminator is not counted
+		if (strBuffer->size() > ulMaxBuffer)
+			return MAPI_E_TOO_BIG;
+	}
 
-	return hr;
+	//remove the lf or crlf
+	strBuffer->resize(strBuffer->size() - 1);
+	if (!strBuffer->empty() && (*strBuffer)[strBuffer->size() - 1] == '\r')
+		strBuffer->resize(strBuffer->size() - 1);
+
+	if (strBuffer->size() > ulMaxBuffer)
+		return MAPI_E_TOO_BIG;
+
+	return hrSuccess;
 }
 
 HRESULT ECChannel::HrWriteString(const char *szBuffer)
 {
-	HRESULT hr = hrSuccess;
-
 	if(!szBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 
-	if (lpSSL) {
-		if (SSL_write(lpSSL, szBuffer, (int)strlen(szBuffer)) < 1)
-			hr = MAPI_E_CALL_FAILED;
-	}
-	else {
-		if (send(fd, szBuffer, (int)strlen(szBuffer), 0) < 1)
-			hr = MAPI_E_CALL_FAILED;
-	}
-
-	return hr;
+	return HrWriteRaw(szBuffer, strlen(szBuffer));
 }
 
 HRESULT ECChannel::HrWriteString(const std::string & strBuffer) {
-	HRESULT hr = hrSuccess;
-
-	if (lpSSL) {
-		if (SSL_write(lpSSL, strBuffer.c_str(), (int)strBuffer.size()) < 1)
-			hr = MAPI_E_CALL_FAILED;
-	} else {
-		if (send(fd, strBuffer.c_str(), (int)strBuffer.size(), 0) < 1)
-			hr = MAPI_E_CALL_FAILED;
-	}
-
-	return hr;
+	return HrWriteRaw(strBuffer.c_str(), strBuffer.size());
 }
 
 /**
@@ -393,20 +391,51 @@ HRESULT ECChannel::HrWriteString(const std::string & strBuffer) {
  * @retval		MAPI_E_CALL_FAILED	unable to write data to socket
  */
 HRESULT ECChannel::HrWriteLine(const char *szBuffer, int len) {
-	std::string strLine;
-
 	if (len == 0)
-		strLine.assign(szBuffer);
-	else
-		strLine.assign(szBuffer, len);
+		len = strlen(szBuffer);
 
-	strLine += "\r\n";
-	
-	return HrWriteString(strLine);
+	if (lpSSL) {
+		std::string strLine(szBuffer, len);
+
+		strLine += "\r\n";
+		return HrWriteRaw(strLine.c_str(), strLine.size());
+	}
+
+	// gather data and line ending in a single packet without copying
+	struct iovec iov[2];
+	int iovcnt = 2;
+	struct iovec *lpiov = iov;
+
+	iov[0].iov_base = const_cast<char *>(szBuffer);
+	iov[0].iov_len = len;
+	iov[1].iov_base = const_cast<char *>("\r\n");
+	iov[1].iov_len = 2;
+	m_bPending = m_bCorked;
+
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, lpiov, iovcnt);
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n < 1)
+			return MAPI_E_CALL_FAILED;
+
+		while (iovcnt > 0 && (size_t)n >= lpiov->iov_len) {
+			n -= lpiov->iov_len;
+			++lpiov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			lpiov->iov_base = (char *)lpiov->iov_base + n;
+			lpiov->iov_len -= n;
+		}
+	}
+
+	return hrSuccess;
 }
 
 HRESULT ECChannel::HrWriteLine(const std::string & strBuffer) {
-	return HrWriteString(strBuffer + "\r\n");
+	return HrWriteLine(strBuffer.c_str(), strBuffer.size());
 }
 
 /**
@@ -417,66 +446,64 @@ HRESULT ECChannel::HrWriteLine(const std::string & strBuffer) {
  * @param[in] ulByteCount Amount of bytes to discard 
  *
  * @retval MAPI_E_NETWORK_ERROR Unable to read bytes.
- * @retval MAPI_E_CALL_FAILED Reading wrong amount of data.
  */
 HRESULT ECChannel::HrReadAndDiscardBytes(ULONG ulByteCount) {
 	ULONG ulTotRead = 0;
-	char szBuffer[4096];
 
 	while (ulTotRead < ulByteCount) {
-		ULONG ulBytesLeft = ulByteCount - ulTotRead;
-		ULONG ulRead = ulBytesLeft > sizeof szBuffer ? sizeof szBuffer : ulBytesLeft;
-
-		if (lpSSL)
-			ulRead = SSL_read(lpSSL, szBuffer, ulRead);
-		else
-			ulRead = recv(fd, szBuffer, ulRead, 0);
-
-		if (ulRead == (ULONG)-1) {
-			if (errno == EINTR)
-				continue;
-
+		if (m_ulReadPos == m_ulReadEnd && !FillBuffer())
 			return MAPI_E_NETWORK_ERROR;
-		}
 
-		if (ulRead == 0 || ulRead > ulByteCount)
-			return MAPI_E_NETWORK_ERROR;
+		ULONG ulRead = std::min<size_t>(ulByteCount - ulTotRead, m_ulReadEnd - m_ulReadPos);
 
+		m_ulReadPos += ulRead;
 		ulTotRead += ulRead;
 	}
 
-	return (ulTotRead == ulByteCount) ? hrSuccess : MAPI_E_CALL_FAILED;
+	return hrSuccess;
 }
 
+/**
+ * Read an exact amount of bytes
+ *
+ * Data already in the read buffer is used first; large remainders are
+ * read directly into szBuffer, bypassing the read buffer.
+ *
+ * @param[out] szBuffer Buffer of at least ulByteCount + 1 bytes, which will
+ *                      be zero-terminated
+ * @param[in] ulByteCount Amount of bytes to read
+ *
+ * @retval MAPI_E_NETWORK_ERROR Unable to read bytes.
+ */
 HRESULT ECChannel::HrReadBytes(char *szBuffer, ULONG ulByteCount) {
-	ULONG ulRead = 0;
 	ULONG ulTotRead = 0;
 
 	if(!szBuffer)
 		return MAPI_E_INVALID_PARAMETER;
 
-	while(ulTotRead < ulByteCount) {
-		if (lpSSL)
-			ulRead = SSL_read(lpSSL, szBuffer + ulTotRead, ulByteCount - ulTotRead);
-		else
-			ulRead = recv(fd, szBuffer + ulTotRead, ulByteCount - ulTotRead, 0);
+	while (ulTotRead < ulByteCount) {
+		ULONG ulBytesLeft = ulByteCount - ulTotRead;
 
-		if (ulRead == (ULONG)-1) {
-			if (errno == EINTR)
-				continue;
+		if (m_ulReadPos < m_ulReadEnd) {
+			ULONG ulRead = std::min<size_t>(ulBytesLeft, m_ulReadEnd - m_ulReadPos);
 
-			return MAPI_E_NETWORK_ERROR;
-		}
+			memcpy(szBuffer + ulTotRead, m_szReadBuf + m_ulReadPos, ulRead);
+			m_ulReadPos += ulRead;
+			ulTotRead += ulRead;
+		} else if (ulBytesLeft >= sizeof(m_szReadBuf)) {
+			int n = ReadRaw(szBuffer + ulTotRead, ulBytesLeft);
 
-		if (ulRead == 0 || ulRead > ulByteCount)
+			if (n <= 0)
+				return MAPI_E_NETWORK_ERROR;
+			ulTotRead += n;
+		} else if (!FillBuffer()) {
 			return MAPI_E_NETWORK_ERROR;
-
-		ulTotRead += ulRead;
+		}
 	}
 
 	szBuffer[ulTotRead] = '\0';
 
-	return (ulTotRead == ulByteCount) ? hrSuccess : MAPI_E_CALL_FAILED;
+	return hrSuccess;
 }
 
 HRESULT ECChannel::HrReadBytes(std::string * strBuffer, ULONG ulByteCount) {
@@ -516,9 +543,15 @@ HRESULT ECChannel::HrSelect(int seconds) {
 	if(fd >= FD_SETSIZE)
 	    return MAPI_E_NOT_ENOUGH_MEMORY;
 #endif
+	if (m_ulReadPos < m_ulReadEnd)
+		return hrSuccess;
 	if(lpSSL && SSL_pending(lpSSL))
 		return hrSuccess;
 
+	// do not keep the other side waiting for our response
+	if (m_bPending)
+		HrCork(false);
+
 	FD_ZERO(&fds);
 	FD_SET(fd, &fds);
 
@@ -540,6 +573,39 @@ HRESULT ECChannel::HrSelect(int seconds) {
 	return hrSuccess;
 }
 
+/**
+ * Hold back partial packets on the socket
+ *
+ * While corked, written data is only sent out in full packets, so that a
+ * response made up of many HrWriteLine() calls does not end up as many
+ * small packets. Uncorking sends out whatever is still pending. When output
+ * is pending before blocking on a read, the socket is uncorked, so the client
+ * never waits for data we are holding back; it stays uncorked until the
+ * next HrCork(true).
+ *
+ * @param[in] bCork true to start gathering, false to flush
+ *
+ * @retval MAPI_E_NO_SUPPORT The platform has no TCP_CORK
+ */
+HRESULT ECChannel::HrCork(bool bCork) {
+#ifdef TCP_CORK
+	int flag = bCork ? 1 : 0;
+
+	if (m_bCorked == bCork)
+		return hrSuccess;
+
+	// fails on e.g. unix sockets, which do not need it
+	if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag)) < 0)
+		return MAPI_E_CALL_FAILED;
+
+	m_bCorked = bCork;
+	m_bPending = false;
+	return hrSuccess;
+#else
+	return MAPI_E_NO_SUPPORT;
+#endif
+}
+
 bool ECChannel::UsingSsl() {
 	return lpSSL != NULL;
 }
@@ -548,6 +614,58 @@ bool ECChannel::sslctx() {
 	return lpCTX != NULL;
 }
 
+/**
+ * Read data from the connection, bypassing the read buffer
+ *
+ * Pending corked output is sent first by uncorking, as we might block
+ * waiting for the other side to answer it.
+ *
+ * @return amount of bytes read, 0 when the other side closed the
+ *         connection, or -1 on error
+ */
+int ECChannel::ReadRaw(char *buf, size_t len) {
+	int n;
+
+	if (m_bPending)
+		HrCork(false);
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	do {
+		if (lpSSL)
+			n = SSL_read(lpSSL, buf, len);
+		else
+			n = recv(fd, buf, len, 0);
+	} while (n == -1 && errno == EINTR);
+
+	return n < 0 ? -1 : n;
+}
+
+/**
+ * Read more data from the connection into the read buffer
+ *
+ * @return false when nothing could be read: error, or the other side has
+ *         closed its writing socket
+ */
+bool ECChannel::FillBuffer() {
+	if (m_ulReadPos > 0) {
+		memmove(m_szReadBuf, m_szReadBuf + m_ulReadPos, m_ulReadEnd - m_ulReadPos);
+		m_ulReadEnd -= m_ulReadPos;
+		m_ulReadPos = 0;
+	}
+
+	if (m_ulReadEnd == sizeof(m_szReadBuf))
+		return false;
+
+	int n = ReadRaw(m_szReadBuf + m_ulReadEnd, sizeof(m_szReadBuf) - m_ulReadEnd);
+	if (n <= 0)
+		return false;
+
+	m_ulReadEnd += n;
+	return true;
+}
+
 /** 
  * read from buffer until \n is found, or buffer length is reached
  * return buffer always contains \0 in the end, so max read from network is *lpulLen -1
@@ -557,8 +675,9 @@ bool ECChannel::sslctx() {
  * 
  * @return NULL on error, or buf
  */
-char * ECChannel::fd_gets(char *buf, int *lpulLen) {
-	char *newline = NULL, *bp = buf;
+char * ECChannel::buf_gets(char *buf, int *lpulLen) {
+	const char *newline = NULL;
+	char *bp = buf;
 	int len = *lpulLen;
 
 	if (--len < 1)
@@ -569,44 +688,25 @@ char * ECChannel::fd_gets(char *buf, int *lpulLen) {
 		 * Return NULL when we read nothing:
 		 * other side has closed its writing socket.
 		 */
-		int n = recv(fd, bp, len, MSG_PEEK);
-
-		if (n == 0)
+		if (m_ulReadPos == m_ulReadEnd && !FillBuffer())
 			return NULL;
 
-		if (n == -1) {
-			if (errno == EINTR)
-				continue;
+		const char *lpStart = m_szReadBuf + m_ulReadPos;
+		int n = std::min<size_t>(len, m_ulReadEnd - m_ulReadPos);
 
-			return NULL;
-		}
+		if ((newline = (const char *)memchr(lpStart, '\n', n)) != NULL)
+			n = newline - lpStart + 1;
 
-		if ((newline = (char *)memchr((void *)bp, '\n', n)) != NULL)
-			n = newline - bp + 1;
-
-	retry:
-		int recv_n = recv(fd, bp, n, 0);
-
-		if (recv_n == 0)
-			return NULL;
-
-		if (recv_n == -1) {
-			if (errno == EINTR)
-				goto retry;
-
-			return NULL;
-		}
-
-		bp += recv_n;
-		len -= recv_n;
-	}
-	while(!newline && len > 0);
+		memcpy(bp, lpStart, n);
+		m_ulReadPos += n;
+		bp += n;
+		len -= n;
+	} while (!newline && len > 0);
 
 	//remove the lf or crlf
-	if(newline){
+	if (newline) {
 		--bp;
-		--newline;
-		if(newline >= buf && *newline == '\r')
+		if (bp > buf && bp[-1] == '\r')
 			--bp;
 	}
 
@@ -616,43 +716,32 @@ char * ECChannel::fd_gets(char *buf, int *lpulLen) {
 	return buf;
 }
 
-char * ECChannel::SSL_gets(char *buf, int *lpulLen) {
-	char *newline, *bp = buf;
-	int len = *lpulLen;
-	int n = 0;
+/**
+ * Write all data to the connection
+ *
+ * @retval MAPI_E_CALL_FAILED unable to write data to socket
+ */
+HRESULT ECChannel::HrWriteRaw(const char *szBuffer, size_t len) {
+	m_bPending = m_bCorked;
 
-	if (--len < 1)
-		return NULL;
+	while (len > 0) {
+		int n;
 
-	do {
-		/*
-		 * Return NULL when we read nothing:
-		 * other side has closed its writing socket.
-		 */
-		if ((n = SSL_peek(lpSSL, bp, len)) <= 0)
-			return NULL;
-
-		if ((newline = (char *)memchr((void *)bp, '\n', n)) != NULL)
-			n = newline - bp + 1;
+		if (lpSSL)
+			n = SSL_write(lpSSL, szBuffer, (int)len);
+		else
+			n = send(fd, szBuffer, len, 0);
 
-		if ((n = SSL_read(lpSSL, bp, n)) < 0)
-			return NULL;
+		if (n == -1 && errno == EINTR && !lpSSL)
+			continue;
+		if (n < 1)
+			return MAPI_E_CALL_FAILED;
 
-		bp += n;
+		szBuffer += n;
 		len -= n;
-	} while (!newline && len > 0);
-	
-	//remove the lf or crlf
-	if(newline){
-		--bp;
-		--newline;
-		if(newline >= buf && *newline == '\r')
-			--bp;
 	}
 
-	*bp = '\0';
-	*lpulLen = (int)(bp - buf);
-	return buf;
+	return hrSuccess;
 }
 
 void ECChannel::SetIPAddress(const struct sockaddr *sa, size_t slen)
@@ -16,8 +16,12 @@
  */
 
 #include <zarafa/platform.h>
+#include <zarafa/threadutil.h>
 #include "ECFifoBuffer.h"
 
+#include <algorithm>
+#include <cstring>
+
 #ifdef _DEBUG
 #define new DEBUG_NEW
 #undef THIS_FILE
@@ -25,7 +29,10 @@ static const char THIS_FILE[] = __FILE__;
 #endif
 
 ECFifoBuffer::ECFifoBuffer(size_type ulMaxSize)
-	: m_ulMaxSize(ulMaxSize)
+	: m_lpStorage(new unsigned char[ulMaxSize])
+	, m_ulMaxSize(ulMaxSize)
+	, m_ulHead(0)
+	, m_ulSize(0)
 	, m_bReaderClosed(false)
 	, m_bWriterClosed(false)
 {
@@ -40,6 +47,8 @@ ECFifoBuffer::~ECFifoBuffer()
 	pthread_mutex_destroy(&m_hMutex);
 	pthread_cond_destroy(&m_hCondNotFull);
 	pthread_cond_destroy(&m_hCondNotEmpty);
+	pthread_cond_destroy(&m_hCondFlushed);
+	delete[] m_lpStorage;
 }
 
 /**
@@ -52,7 +61,7 @@ ECFifoBuffer::~ECFifoBuffer()
  *
  * @retval	erSuccess					The data was successfully written.
  * @retval	ZARAFA_E_INVALID_PARAMETER	lpBuf is NULL.
- * @retval	ZARAFA_E_NOT_ENOUGH_MEMORY	There was not enough memory available to store the data.
+ * @retval	ZARAFA_E_NOT_ENOUGH_MEMORY	The buffer has no storage.
  * @retval	ZARAFA_E_TIMEOUT			Not all data was writting within the specified time limit.
  *										The amount of data that was written is returned in lpcbWritten.
  * @retval	ZARAFA_E_NETWORK_ERROR		The buffer was closed prior to this call.
@@ -76,41 +85,27 @@ ECRESULT ECFifoBuffer::Write(const void *lpBuf, size_type cbBuf, unsigned int ul
 		return erSuccess;
 	}
 
+	if (m_ulMaxSize == 0)
+		return ZARAFA_E_NOT_ENOUGH_MEMORY;
+
 	if (ulTimeoutMs > 0)
 		deadline = GetDeadline(ulTimeoutMs);
 
-	pthread_mutex_lock(&m_hMutex);
-
 	while (cbWritten < cbBuf) {
-		while (IsFull()) {
-		    if (IsClosed(cfRead)) {
-				er = ZARAFA_E_NETWORK_ERROR;
-				goto exit;
-			}
-
-			if (ulTimeoutMs > 0) {
-				if (pthread_cond_timedwait(&m_hCondNotFull, &m_hMutex, &deadline) == ETIMEDOUT) {
-					er = ZARAFA_E_TIMEOUT;
-					goto exit;
-				}
-			} else
-				pthread_cond_wait(&m_hCondNotFull, &m_hMutex);
-		}
+		void *lpSpan = NULL;
+		size_type cbSpan = 0;
 
-		const size_type cbNow = std::min(cbBuf - cbWritten, m_ulMaxSize - m_storage.size());
-		try {
-			m_storage.insert(m_storage.end(), lpData + cbWritten, lpData + cbWritten + cbNow);
-		} catch (const std::bad_alloc &) {
-			er = ZARAFA_E_NOT_ENOUGH_MEMORY;
-			goto exit;
-		}
-		pthread_cond_signal(&m_hCondNotEmpty);
+		er = WaitWriteSpan(&lpSpan, &cbSpan, ulTimeoutMs > 0 ? &deadline : NULL);
+		if (er != erSuccess)
+			break;
+
+		// The span is only accessed by us until it is committed, so no need to lock while copying
+		const size_type cbNow = std::min(cbBuf - cbWritten, cbSpan);
+		memcpy(lpSpan, lpData + cbWritten, cbNow);
+		CommitWrite(cbNow);
 		cbWritten += cbNow;
 	}
 
-exit:
-	pthread_mutex_unlock(&m_hMutex);
-
 	if (lpcbWritten && (er == erSuccess || er == ZARAFA_E_TIMEOUT))
 		*lpcbWritten = cbWritten;
 
@@ -151,37 +146,21 @@ ECRESULT ECFifoBuffer::Read(void *lpBuf, size_type cbBuf, unsigned int ulTimeout
 
 	if (ulTimeoutMs > 0)
 		deadline = GetDeadline(ulTimeoutMs);
-	
-	pthread_mutex_lock(&m_hMutex);
 
 	while (cbRead < cbBuf) {
-		while (IsEmpty()) {
-			if (IsClosed(cfWrite)) 
-				goto exit;
-
-			if (ulTimeoutMs > 0) {
-				if (pthread_cond_timedwait(&m_hCondNotEmpty, &m_hMutex, &deadline) == ETIMEDOUT) {
-					er = ZARAFA_E_TIMEOUT;
-					goto exit;
-				}
-			} else
-				pthread_cond_wait(&m_hCondNotEmpty, &m_hMutex);
-		}
+		const void *lpSpan = NULL;
+		size_type cbSpan = 0;
 
-		const size_type cbNow = std::min(cbBuf - cbRead, m_storage.size());
-		storage_type::iterator iEndNow = m_storage.begin() + cbNow;
-		std::copy(m_storage.begin(), iEndNow, lpData + cbRead);
-		m_storage.erase(m_storage.begin(), iEndNow);
-		pthread_cond_signal(&m_hCondNotFull);
+		er = WaitReadSpan(&lpSpan, &cbSpan, ulTimeoutMs > 0 ? &deadline : NULL);
+		if (er != erSuccess || cbSpan == 0)
+			// Error, or the writer closed the buffer
+			break;
+
+		const size_type cbNow = std::min(cbBuf - cbRead, cbSpan);
+		memcpy(lpData + cbRead, lpSpan, cbNow);
+		CommitRead(cbNow);
 		cbRead += cbNow;
 	}
-	
-	if(IsEmpty() && IsClosed(cfWrite)) {
-		pthread_cond_signal(&m_hCondFlushed);
-	}
-
-exit:
-	pthread_mutex_unlock(&m_hMutex);
 
 	if (lpcbRead && (er == erSuccess || er == ZARAFA_E_TIMEOUT))
 		*lpcbRead = cbRead;
@@ -189,6 +168,189 @@ exit:
 	return er;
 }
 
+/**
+ * Get the next contiguous region of free space in the FIFO, blocking until
+ * there is free space. The data written into the region becomes available to
+ * the reader after calling CommitWrite().
+ *
+ * @param[out]	lppBuf			Pointer to the free space.
+ * @param[out]	lpcbBuf			The size of the free space (in bytes), at least 1.
+ * @param[in]	ulTimeoutMs		The maximum amount that this function may block.
+ *
+ * @retval	erSuccess					The span was returned.
+ * @retval	ZARAFA_E_INVALID_PARAMETER	lppBuf or lpcbBuf is NULL.
+ * @retval	ZARAFA_E_NOT_ENOUGH_MEMORY	The buffer has no storage.
+ * @retval	ZARAFA_E_TIMEOUT			No space became available within the specified time limit.
+ * @retval	ZARAFA_E_NETWORK_ERROR		The buffer was closed.
+ */
+ECRESULT ECFifoBuffer::GetWriteSpan(void **lppBuf, size_type *lpcbBuf, unsigned int ulTimeoutMs)
+{
+	struct timespec deadline = {0};
+
+	if (lppBuf == NULL || lpcbBuf == NULL)
+		return ZARAFA_E_INVALID_PARAMETER;
+
+	if (IsClosed(cfWrite))
+		return ZARAFA_E_NETWORK_ERROR;
+
+	if (m_ulMaxSize == 0)
+		return ZARAFA_E_NOT_ENOUGH_MEMORY;
+
+	if (ulTimeoutMs > 0)
+		deadline = GetDeadline(ulTimeoutMs);
+
+	return WaitWriteSpan(lppBuf, lpcbBuf, ulTimeoutMs > 0 ? &deadline : NULL);
+}
+
+/**
+ * Make data written into a span from GetWriteSpan() available to the reader.
+ *
+ * @param[in]	cbWritten		The amount of data written into the span (in bytes).
+ *
+ * @retval	erSuccess					The data was added to the FIFO.
+ * @retval	ZARAFA_E_INVALID_PARAMETER	cbWritten is larger than the free space.
+ */
+ECRESULT ECFifoBuffer::CommitWrite(size_type cbWritten)
+{
+	if (cbWritten == 0)
+		return erSuccess;
+
+	scoped_lock lock(m_hMutex);
+
+	if (cbWritten > m_ulMaxSize - m_ulSize)
+		return ZARAFA_E_INVALID_PARAMETER;
+
+	// The reader only waits when the buffer is empty
+	if (IsEmpty())
+		pthread_cond_signal(&m_hCondNotEmpty);
+	m_ulSize += cbWritten;
+
+	return erSuccess;
+}
+
+/**
+ * Get the next contiguous region of data in the FIFO, blocking until there is
+ * data. The data stays in the FIFO until CommitRead() is called.
+ *
+ * @param[out]	lppBuf			Pointer to the data.
+ * @param[out]	lpcbBuf			The size of the data (in bytes). This is 0 when the
+ *								writer closed the buffer and all data has been read.
+ * @param[in]	ulTimeoutMs		The maximum amount that this function may block.
+ *
+ * @retval	erSuccess					The span was returned.
+ * @retval	ZARAFA_E_INVALID_PARAMETER	lppBuf or lpcbBuf is NULL.
+ * @retval	ZARAFA_E_TIMEOUT			No data became available within the specified time limit.
+ * @retval	ZARAFA_E_NETWORK_ERROR		The buffer was closed for reading.
+ */
+ECRESULT ECFifoBuffer::GetReadSpan(const void **lppBuf, size_type *lpcbBuf, unsigned int ulTimeoutMs)
+{
+	struct timespec deadline = {0};
+
+	if (lppBuf == NULL || lpcbBuf == NULL)
+		return ZARAFA_E_INVALID_PARAMETER;
+
+	if (IsClosed(cfRead))
+		return ZARAFA_E_NETWORK_ERROR;
+
+	if (ulTimeoutMs > 0)
+		deadline = GetDeadline(ulTimeoutMs);
+
+	return WaitReadSpan(lppBuf, lpcbBuf, ulTimeoutMs > 0 ? &deadline : NULL);
+}
+
+/**
+ * Remove data that was returned by GetReadSpan() from the FIFO.
+ *
+ * @param[in]	cbRead			The amount of data consumed from the span (in bytes).
+ *
+ * @retval	erSuccess					The data was removed from the FIFO.
+ * @retval	ZARAFA_E_INVALID_PARAMETER	cbRead is larger than the amount of data in the FIFO.
+ */
+ECRESULT ECFifoBuffer::CommitRead(size_type cbRead)
+{
+	// Nothing to do, and the buffer may have no storage to wrap around
+	if (cbRead == 0)
+		return erSuccess;
+
+	scoped_lock lock(m_hMutex);
+
+	if (cbRead > m_ulSize)
+		return ZARAFA_E_INVALID_PARAMETER;
+
+	// The writer only waits when the buffer is full
+	if (IsFull())
+		pthread_cond_signal(&m_hCondNotFull);
+	m_ulHead = (m_ulHead + cbRead) % m_ulMaxSize;
+	m_ulSize -= cbRead;
+
+	if (IsEmpty() && IsClosed(cfWrite))
+		pthread_cond_signal(&m_hCondFlushed);
+
+	return erSuccess;
+}
+
+/**
+ * Wait until there is free space and return the first contiguous free region.
+ *
+ * @param[out]	lppBuf			Pointer to the free space.
+ * @param[out]	lpcbBuf			The size of the free space.
+ * @param[in]	lpDeadline		The time until which to wait, or NULL to wait indefinitely.
+ */
+ECRESULT ECFifoBuffer::WaitWriteSpan(void **lppBuf, size_type *lpcbBuf, const struct timespec *lpDeadline)
+{
+	scoped_lock lock(m_hMutex);
+
+	while (IsFull()) {
+		if (IsClosed(cfRead))
+			return ZARAFA_E_NETWORK_ERROR;
+
+		if (lpDeadline != NULL) {
+			if (pthread_cond_timedwait(&m_hCondNotFull, &m_hMutex, lpDeadline) == ETIMEDOUT)
+				return ZARAFA_E_TIMEOUT;
+		} else
+			pthread_cond_wait(&m_hCondNotFull, &m_hMutex);
+	}
+
+	// The free space may wrap around the end of the storage
+	const size_type ulTail = (m_ulHead + m_ulSize) % m_ulMaxSize;
+	*lppBuf = m_lpStorage + ulTail;
+	*lpcbBuf = std::min(m_ulMaxSize - m_ulSize, m_ulMaxSize - ulTail);
+
+	return erSuccess;
+}
+
+/**
+ * Wait until there is data and return the first contiguous region of data.
+ *
+ * @param[out]	lppBuf			Pointer to the data.
+ * @param[out]	lpcbBuf			The size of the data, 0 if the writer closed the buffer.
+ * @param[in]	lpDeadline		The time until which to wait, or NULL to wait indefinitely.
+ */
+ECRESULT ECFifoBuffer::WaitReadSpan(const void **lppBuf, size_type *lpcbBuf, const struct timespec *lpDeadline)
+{
+	scoped_lock lock(m_hMutex);
+
+	while (IsEmpty()) {
+		if (IsClosed(cfWrite)) {
+			*lppBuf = m_lpStorage + m_ulHead;
+			*lpcbBuf = 0;
+			return erSuccess;
+		}
+
+		if (lpDeadline != NULL) {
+			if (pthread_cond_timedwait(&m_hCondNotEmpty, &m_hMutex, lpDeadline) == ETIMEDOUT)
+				return ZARAFA_E_TIMEOUT;
+		} else
+			pthread_cond_wait(&m_hCondNotEmpty, &m_hMutex);
+	}
+
+	// The data may wrap around the end of the storage
+	*lppBuf = m_lpStorage + m_ulHead;
+	*lpcbBuf = std::min(m_ulSize, m_ulMaxSize - m_ulHead);
+
+	return erSuccess;
+}
+
 /**
  * Close a buffer.
  * This causes new writes to the buffer to fail with ZARAFA_E_NETWORK_ERROR and all
@@ -19,16 +19,23 @@
 #define ECFIFOBUFFER_H
 
 #include <zarafa/zcdefs.h>
-#include <deque>
+#include <cstddef>
 #include <pthread.h>
 
 #include <zarafa/ZarafaCode.h>
 
-// Thread safe buffer for FIFO operations
+/*
+ * Thread safe buffer for FIFO operations between a single writer and a single reader.
+ *
+ * The data is stored in a fixed size ring buffer. Next to Read() and Write(), which copy
+ * the data, the reader and writer can access the buffer in place through spans: Get*Span()
+ * returns the largest contiguous region that can be read or written, and Commit*() marks
+ * (part of) it as consumed or produced. A span stays valid until it is committed, since
+ * the other side never touches that region.
+ */
 class ECFifoBuffer _zcp_final {
 public:
-	typedef std::deque<unsigned char>	storage_type;
-	typedef storage_type::size_type		size_type;
+	typedef size_t		size_type;
 	enum close_flags { cfRead = 1, cfWrite = 2 };
 
 public:
@@ -37,6 +44,10 @@ public:
 	
 	ECRESULT Write(const void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbWritten);
 	ECRESULT Read(void *lpBuf, size_type cbBuf, unsigned int ulTimeoutMs, size_type *lpcbRead);
+	ECRESULT GetWriteSpan(void **lppBuf, size_type *lpcbBuf, unsigned int ulTimeoutMs);
+	ECRESULT CommitWrite(size_type cbWritten);
+	ECRESULT GetReadSpan(const void **lppBuf, size_type *lpcbBuf, unsigned int ulTimeoutMs);
+	ECRESULT CommitRead(size_type cbRead);
 	ECRESULT Close(close_flags flags);
 	ECRESULT Flush();
 
@@ -49,10 +60,15 @@ private:
 	// prohibit copy
 	ECFifoBuffer(const ECFifoBuffer &);
 	ECFifoBuffer& operator=(const ECFifoBuffer &);
+
+	ECRESULT WaitWriteSpan(void **lppBuf, size_type *lpcbBuf, const struct timespec *lpDeadline);
+	ECRESULT WaitReadSpan(const void **lppBuf, size_type *lpcbBuf, const struct timespec *lpDeadline);
 	
 private:
-	storage_type	m_storage;
+	unsigned char	*m_lpStorage;
 	size_type		m_ulMaxSize;
+	size_type		m_ulHead;		// offset of the first byte to read
+	size_type		m_ulSize;		// number of bytes in the buffer
 	bool			m_bReaderClosed;
 	bool            m_bWriterClosed;
 
@@ -79,15 +95,15 @@ inline bool ECFifoBuffer::IsClosed(ULONG flags) const {
 }
 
 inline bool ECFifoBuffer::IsEmpty() const {
-	return m_storage.empty();
+	return m_ulSize == 0;
 }
 
 inline bool ECFifoBuffer::IsFull() const {
-	return m_storage.size() == m_ulMaxSize;
+	return m_ulSize == m_ulMaxSize;
 }
 
 inline unsigned long ECFifoBuffer::Size() {
-	return m_storage.size();
+	return m_ulSize;
 }
 
 #endif // ndef ECFIFOBUFFER_H
@@ -19,12 +19,19 @@
 #include <cassert>
 #include <zarafa/ECKeyTable.h> 
 #include <zarafa/ustringutil.h>
+#include <new>
 #ifdef _DEBUG
 #define new DEBUG_NEW
 #undef THIS_FILE
 static const char THIS_FILE[] = __FILE__;
 #endif
 
+// Number of rows allocated at once by an ECKeyTable
+#define ROW_SLAB_SIZE	1024
+
+// Sort keys are aligned within the row data, since float keys are read as a double
+#define SORTKEY_ALIGN(n)	(((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
 bool operator!=(const sObjectTableKey& a, const sObjectTableKey& b)
 {
 	return !(a.ulObjId==b.ulObjId && a.ulOrderId == b.ulOrderId);
@@ -101,36 +108,57 @@ ECTableRow::ECTableRow(sObjectTableKey sKey, unsigned int ulSortCols,
 	             lpFlags, lppSortData);
 }
 
+/*
+ * All sort data of a row lives in one block: the key pointers, the key
+ * lengths, the flags and then the keys themselves.
+ */
 void ECTableRow::initSortCols(unsigned int ulSortCols, const int *lpSortLen,
     const unsigned char *lpFlags, unsigned char **lppSortData)
 {
 	unsigned int i=0;
 	int len = 0;
+	size_t cbData = 0;
+	unsigned char *lpKey = NULL;
 
 	this->ulSortCols = ulSortCols;
-	
-	if(lpFlags) {
-		this->lpFlags = new unsigned char [ ulSortCols ];
-		memcpy(this->lpFlags, lpFlags, ulSortCols * sizeof(this->lpFlags[0]));
-	} else {
-		this->lpFlags = NULL;
+	this->m_lpSortData = NULL;
+	this->lpSortLen = NULL;
+	this->lppSortKeys = NULL;
+	this->lpFlags = NULL;
+
+	if (ulSortCols == 0)
+		return;
+
+	assert(lpSortLen != NULL);
+
+	cbData = SORTKEY_ALIGN(ulSortCols * (sizeof(unsigned char *) + sizeof(int) + (lpFlags ? 1 : 0)));
+	for (i = 0; i < ulSortCols; ++i) {
+		len = lpSortLen[i];
+		cbData += SORTKEY_ALIGN(len < 0 ? -len : len);
 	}
-	this->lpSortLen = new int [ulSortCols];
-	this->lppSortKeys = new unsigned char *[ulSortCols];
+
+	this->m_lpSortData = new unsigned char[cbData];
+	this->lppSortKeys = (unsigned char **)this->m_lpSortData;
+	this->lpSortLen = (int *)(this->m_lpSortData + ulSortCols * sizeof(unsigned char *));
 
 	// Copy sort lengths
-	assert(ulSortCols == 0 || lpSortLen != NULL);
-	if (ulSortCols != 0)
-		memcpy(this->lpSortLen, lpSortLen, sizeof(unsigned int) * ulSortCols);
+	memcpy(this->lpSortLen, lpSortLen, sizeof(int) * ulSortCols);
+
+	if(lpFlags) {
+		this->lpFlags = (unsigned char *)(this->lpSortLen + ulSortCols);
+		memcpy(this->lpFlags, lpFlags, ulSortCols * sizeof(this->lpFlags[0]));
+	}
 
 	// Copy sort keys
+	lpKey = this->m_lpSortData + SORTKEY_ALIGN(ulSortCols * (sizeof(unsigned char *) + sizeof(int) + (lpFlags ? 1 : 0)));
 	for (i = 0; i < ulSortCols; ++i) {
 		len = lpSortLen[i];
 		len = len < 0 ? -len : len;
 
-		this->lppSortKeys[i] = new unsigned char[len];
-
-		memcpy(this->lppSortKeys[i], lppSortData[i], len);
+		this->lppSortKeys[i] = lpKey;
+		if (len > 0)
+			memcpy(lpKey, lppSortData[i], len);
+		lpKey += SORTKEY_ALIGN(len);
 	}
 }
 
@@ -149,6 +177,34 @@ ECTableRow::ECTableRow(const ECTableRow &other)
 	initSortCols(other.ulSortCols, other.lpSortLen, other.lpFlags, other.lppSortKeys);
 }
 
+/*
+ * Copies a row, optionally pointing at the sort data of the other row
+ * instead of copying it. The other row must then outlive this one.
+ */
+ECTableRow::ECTableRow(const ECTableRow &other, bool fShareSortData)
+{
+	this->sKey = other.sKey;
+	this->lpParent = NULL;
+	this->lpLeft = NULL;
+	this->lpRight = NULL;
+	this->fLeft = 0;
+	this->ulBranchCount = 0;
+	this->fRoot = false;
+	this->ulHeight = 0;
+	this->fHidden = other.fHidden;
+
+	if (!fShareSortData) {
+		initSortCols(other.ulSortCols, other.lpSortLen, other.lpFlags, other.lppSortKeys);
+		return;
+	}
+
+	this->ulSortCols = other.ulSortCols;
+	this->m_lpSortData = NULL;
+	this->lpSortLen = other.lpSortLen;
+	this->lppSortKeys = other.lppSortKeys;
+	this->lpFlags = other.lpFlags;
+}
+
 ECTableRow& ECTableRow::operator=(const ECTableRow &other)
 {
     if(this == &other)
@@ -162,17 +218,8 @@ ECTableRow& ECTableRow::operator=(const ECTableRow &other)
 
 void ECTableRow::freeSortCols()
 {
-	unsigned int i=0;
-
-	delete[] lpSortLen;
-	if(lppSortKeys)
-	{
-		for (i = 0; i < ulSortCols; ++i)
-			delete [] lppSortKeys[i];
-
-		delete [] lppSortKeys;
-	}
-	delete[] lpFlags;
+	delete[] m_lpSortData;
+	m_lpSortData = NULL;
 }
 
 ECTableRow::~ECTableRow()
@@ -296,11 +343,12 @@ unsigned int ECTableRow::GetObjectSize(void) const
 {
 	unsigned int ulSize = sizeof(*this);
 
-	if (ulSortCols > 0)
+	// Shared sort data is accounted to the row that owns it
+	if (ulSortCols > 0 && m_lpSortData != NULL)
 	{
-		ulSize+= (sizeof(unsigned char) + sizeof(unsigned char) + sizeof(unsigned int)) * ulSortCols; // flag, SortKey, Sortlen
+		ulSize+= (sizeof(unsigned char) + sizeof(unsigned char *) + sizeof(int)) * ulSortCols; // flag, SortKey, Sortlen
 		for (unsigned int i = 0; i < ulSortCols; ++i)
-			ulSize += lpSortLen[i];
+			ulSize += SORTKEY_ALIGN(lpSortLen[i] < 0 ? -lpSortLen[i] : lpSortLen[i]);
 	}
 
 	return ulSize;
@@ -318,6 +366,9 @@ ECKeyTable::ECKeyTable()
 	// The start of bookmark, the first 3 (0,1,2) are default
 	m_ulBookmarkPosition = 3;
 
+	m_lpFreeRows = NULL;
+	m_ulSlabUsed = ROW_SLAB_SIZE;
+
 
 	// g++ doesn't like static initializers on existing variables
 	pthread_mutexattr_t mattr;
@@ -333,6 +384,57 @@ ECKeyTable::~ECKeyTable()
 	pthread_mutex_destroy(&mLock);
 }
 
+/*
+ * Rows are allocated from slabs of ROW_SLAB_SIZE rows, so building and
+ * tearing down large tables does not hit the allocator for every row.
+ * Freed slots are reused through m_lpFreeRows; the slabs themselves are
+ * only released when the table is cleared. Must be called with mLock held.
+ */
+void *ECKeyTable::AllocRow()
+{
+	static const size_t cbSlot = sizeof(ECTableRow) > sizeof(void *) ? sizeof(ECTableRow) : sizeof(void *);
+	void *lpSlot = NULL;
+
+	if (m_lpFreeRows != NULL) {
+		lpSlot = m_lpFreeRows;
+		m_lpFreeRows = *(void **)lpSlot;
+	} else {
+		if (m_ulSlabUsed == ROW_SLAB_SIZE) {
+			m_vSlabs.push_back(::operator new(cbSlot * ROW_SLAB_SIZE));
+			m_ulSlabUsed = 0;
+		}
+		lpSlot = (char *)m_vSlabs.back() + cbSlot * m_ulSlabUsed++;
+	}
+
+	return lpSlot;
+}
+
+ECTableRow *ECKeyTable::NewRow(const sObjectTableKey *lpsRowItem,
+    unsigned int ulSortCols, const unsigned int *lpSortLen,
+    const unsigned char *lpFlags, unsigned char **lppSortData, bool fHidden)
+{
+	return new(AllocRow()) ECTableRow(*lpsRowItem, ulSortCols, lpSortLen, lpFlags, lppSortData, fHidden);
+}
+
+void ECKeyTable::FreeRow(ECTableRow *lpRow)
+{
+	lpRow->~ECTableRow();
+	*(void **)lpRow = m_lpFreeRows;
+	m_lpFreeRows = lpRow;
+}
+
+void ECKeyTable::FreeSlabs()
+{
+	std::vector<void *>::const_iterator iterSlab;
+
+	for (iterSlab = m_vSlabs.begin(); iterSlab != m_vSlabs.end(); ++iterSlab)
+		::operator delete(*iterSlab);
+
+	m_vSlabs.clear();
+	m_lpFreeRows = NULL;
+	m_ulSlabUsed = ROW_SLAB_SIZE;
+}
+
 // Propagate this node's counts up to the root
 ECRESULT ECKeyTable::UpdateCounts(ECTableRow *lpRow)
 {
@@ -492,7 +594,7 @@ ECRESULT ECKeyTable::UpdateRow(UpdateType ulType,
 
 			// Delete this uncoupled node
 			InvalidateBookmark(lpRow); //ignore errors
-			delete lpRow;
+			FreeRow(lpRow);
 
 			// Remove the row from the id map
 			mapRow.erase(*lpsRowItem);
@@ -520,7 +622,7 @@ ECRESULT ECKeyTable::UpdateRow(UpdateType ulType,
 				*lpulAction = TABLE_ROW_MODIFY;
 
 			// Create a new node
-			lpNewRow = new ECTableRow(*lpsRowItem, ulSortCols, lpSortLen, lpFlags, lppSortData, fHidden);
+			lpNewRow = NewRow(lpsRowItem, ulSortCols, lpSortLen, lpFlags, lppSortData, fHidden);
 
 			if(iterMap->second == lpCurrent) {
 			    fRelocateCursor = true;
@@ -561,7 +663,7 @@ ECRESULT ECKeyTable::UpdateRow(UpdateType ulType,
 				}
 				
 				// Delete the unused new node
-				delete lpNewRow;
+				FreeRow(lpNewRow);
 				goto exit;
 			} else {
 				// new row data is different, so delete the old row now
@@ -569,7 +671,7 @@ ECRESULT ECKeyTable::UpdateRow(UpdateType ulType,
 
 				if(er != erSuccess){
 					// Delete the unused new node
-					if(lpNewRow) delete lpNewRow;
+					if(lpNewRow) FreeRow(lpNewRow);
 
 					goto exit;
 				}
@@ -583,7 +685,7 @@ ECRESULT ECKeyTable::UpdateRow(UpdateType ulType,
 
 		// Create the row that we will be inserting
 		if(lpNewRow == NULL)
-			lpNewRow = new ECTableRow(*lpsRowItem, ulSortCols, lpSortLen, lpFlags, lppSortData, fHidden);
+			lpNewRow = NewRow(lpsRowItem, ulSortCols, lpSortLen, lpFlags, lppSortData, fHidden);
 
 		// Do a binary search in the tree
 		while(1) {
@@ -691,7 +793,7 @@ ECRESULT ECKeyTable::Clear()
 				lpParent->lpRight = NULL;
 
 			// delete this node
-			delete lpRow;
+			FreeRow(lpRow);
 
 			// continue with parent
 			lpRow = lpParent;
@@ -704,6 +806,7 @@ ECRESULT ECKeyTable::Clear()
 	lpRoot->ulBranchCount = 0;
 
 	mapRow.clear();
+	FreeSlabs();
 
 	// Remove all bookmarks
 	m_mapBookmarks.clear();
@@ -713,6 +816,61 @@ ECRESULT ECKeyTable::Clear()
 	return erSuccess;
 }
 
+/**
+ * Replace all rows with a copy of the rows in another table
+ *
+ * The tree of lpSource is copied node by node, so no sort keys need to be
+ * compared. The cursor is reset to the beginning and all bookmarks are
+ * removed.
+ *
+ * @param[in] lpSource Table to copy the rows from
+ * @param[in] bShareSortData Point at the sort data of lpSource instead of copying
+ * it. lpSource must then stay alive and must not be modified until this table
+ * has been cleared.
+ *
+ * @return result
+ */
+ECRESULT ECKeyTable::CopyRows(ECKeyTable *lpSource, bool bShareSortData)
+{
+	Clear();
+
+	pthread_mutex_lock(&mLock);
+	pthread_mutex_lock(&lpSource->mLock);
+
+	if (lpSource->lpRoot->lpLeft)
+		lpRoot->lpLeft = CopyTree(lpSource->lpRoot->lpLeft, lpRoot, bShareSortData);
+	if (lpSource->lpRoot->lpRight)
+		lpRoot->lpRight = CopyTree(lpSource->lpRoot->lpRight, lpRoot, bShareSortData);
+
+	lpRoot->ulBranchCount = lpSource->lpRoot->ulBranchCount;
+	lpRoot->ulHeight = lpSource->lpRoot->ulHeight;
+
+	pthread_mutex_unlock(&lpSource->mLock);
+	pthread_mutex_unlock(&mLock);
+
+	return erSuccess;
+}
+
+// Copy a branch of another table below lpParent, must be called with mLock held
+ECTableRow *ECKeyTable::CopyTree(const ECTableRow *lpSource, ECTableRow *lpParent, bool bShareSortData)
+{
+	ECTableRow *lpRow = new(AllocRow()) ECTableRow(*lpSource, bShareSortData);
+
+	lpRow->lpParent = lpParent;
+	lpRow->fLeft = lpSource->fLeft;
+	lpRow->ulBranchCount = lpSource->ulBranchCount;
+	lpRow->ulHeight = lpSource->ulHeight;
+
+	if (lpSource->lpLeft)
+		lpRow->lpLeft = CopyTree(lpSource->lpLeft, lpRow, bShareSortData);
+	if (lpSource->lpRight)
+		lpRow->lpRight = CopyTree(lpSource->lpRight, lpRow, bShareSortData);
+
+	mapRow[lpRow->sKey] = lpRow;
+
+	return lpRow;
+}
+
 ECRESULT ECKeyTable::SeekId(const sObjectTableKey *lpsRowItem)
 {
 	ECRESULT er = erSuccess;
@@ -1513,7 +1671,7 @@ unsigned int ECKeyTable::GetObjectSize()
 
 	pthread_mutex_lock(&mLock);
 	
-	ulSize += MEMORY_USAGE_MAP(mapRow.size(), ECTableRowMap);
+	ulSize += MEMORY_USAGE_HASHMAP(mapRow.size(), ECTableRowMap);
 
 	for (iterRow = mapRow.begin(); iterRow != mapRow.end(); ++iterRow)
 		ulSize += iterRow->second->GetObjectSize();
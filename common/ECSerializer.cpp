@@ -24,6 +24,8 @@
 #include "ECFifoBuffer.h"
 #include "ECSerializer.h"
 
+#include <algorithm>
+
 #ifdef _DEBUG
 #undef THIS_FILE
 static const char THIS_FILE[]=__FILE__;
@@ -197,12 +199,8 @@ ECRESULT ECFifoSerializer::SetBuffer(void *lpBuffer)
 ECRESULT ECFifoSerializer::Write(const void *ptr, size_t size, size_t nmemb)
 {
 	ECRESULT er = erSuccess;
-	union {
-		char c[8];
-		short s;
-		int i;
-		long long ll;
-	} tmp;
+	long long tmp[512];
+	size_t ulChunk = 0;
 
 	if (m_mode != serialize)
 		return ZARAFA_E_NO_SUPPORT;
@@ -215,21 +213,22 @@ ECRESULT ECFifoSerializer::Write(const void *ptr, size_t size, size_t nmemb)
 		er = m_lpBuffer->Write(ptr, nmemb, STR_DEF_TIMEOUT, NULL);
 		break;
 	case 2:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.s = htons(((const short *)ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, NULL);
-		}
-		break;
 	case 4:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.i = htonl(((const int *)ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, NULL);
-		}
-		break;
 	case 8:
-		for (size_t x = 0; x < nmemb && er == erSuccess; ++x) {
-			tmp.ll = htonll(((const long long *)ptr)[x]);
-			er = m_lpBuffer->Write(&tmp, size, STR_DEF_TIMEOUT, NULL);
+		// Convert a chunk of values at a time, so the fifo is written once per chunk instead of once per value
+		ulChunk = sizeof(tmp) / size;
+		for (size_t x = 0; x < nmemb && er == erSuccess; x += ulChunk) {
+			size_t n = std::min(ulChunk, nmemb - x);
+
+			for (size_t y = 0; y < n; ++y) {
+				if (size == 2)
+					((short *)tmp)[y] = htons(((const short *)ptr)[x + y]);
+				else if (size == 4)
+					((int *)tmp)[y] = htonl(((const int *)ptr)[x + y]);
+				else
+					tmp[y] = htonll(((const long long *)ptr)[x + y]);
+			}
+			er = m_lpBuffer->Write(tmp, n * size, STR_DEF_TIMEOUT, NULL);
 		}
 		break;
 	default:
@@ -286,38 +285,46 @@ ECRESULT ECFifoSerializer::Read(void *ptr, size_t size, size_t nmemb)
 ECRESULT ECFifoSerializer::Skip(size_t size, size_t nmemb)
 {
 	ECRESULT er = erSuccess;
-	char *buf = NULL;
+	const void *lpSpan = NULL;
+	ECFifoBuffer::size_type cbSpan = 0;
+	size_t cbSkip = size * nmemb;
 
-	try {
-		buf = new char[size*nmemb];
-	} catch(...) {
-		er = ZARAFA_E_NOT_ENOUGH_MEMORY;
-	}
-	if (er != erSuccess)
-		goto exit;
+	if (m_mode != deserialize)
+		return ZARAFA_E_NO_SUPPORT;
 
-	er = Read(buf, size, nmemb);
+	// Drop the data in place, without copying it out of the fifo
+	while (cbSkip > 0) {
+		er = m_lpBuffer->GetReadSpan(&lpSpan, &cbSpan, STR_DEF_TIMEOUT);
+		if (er != erSuccess)
+			return er;
+		if (cbSpan == 0)
+			return ZARAFA_E_CALL_FAILED;
+
+		cbSpan = std::min(cbSpan, cbSkip);
+		m_lpBuffer->CommitRead(cbSpan);
+		m_ulRead += cbSpan;
+		cbSkip -= cbSpan;
+	}
 
-exit:
-	delete[] buf;
 	return er;
 }
 
 ECRESULT ECFifoSerializer::Flush()
 {
 	ECRESULT er;
-	size_t cbRead = 0;
-	char buf[16384];
+	const void *lpSpan = NULL;
+	ECFifoBuffer::size_type cbSpan = 0;
 	
+	// Drop all remaining data, until the writer closes the fifo
 	while(true) {
-		er = m_lpBuffer->Read(buf, sizeof(buf), STR_DEF_TIMEOUT, &cbRead);
+		er = m_lpBuffer->GetReadSpan(&lpSpan, &cbSpan, STR_DEF_TIMEOUT);
 		if (er != erSuccess)
 			return er;
-
-		m_ulRead += cbRead;
-
-		if(cbRead < sizeof(buf))
+		if (cbSpan == 0)
 			break;
+
+		m_lpBuffer->CommitRead(cbSpan);
+		m_ulRead += cbSpan;
 	}
 	return er;
 }
@@ -50,6 +50,75 @@ static inline struct timeval operator-(const struct timeval &lhs, const struct t
 
 
 
+////////////////////////////////
+// ECThreadScaler implementation
+////////////////////////////////
+
+/**
+ * Construct an ECThreadScaler instance.
+ * @param[in]	ulMinThreads	The amount of threads to keep when idle.
+ * @param[in]	ulMaxThreads	The maximum amount of threads, or 0 for no limit.
+ * @param[in]	dblMaxAge		The queue age in seconds above which threads are added, or 0 to never add threads.
+ * @param[in]	dblCooldown		The time in seconds the queue must have been empty before threads are removed, at least 1.
+ */
+ECThreadScaler::ECThreadScaler(unsigned ulMinThreads, unsigned ulMaxThreads, double dblMaxAge, double dblCooldown)
+: m_dblLastBusy(0)
+{
+	setLimits(ulMinThreads, ulMaxThreads, dblMaxAge, dblCooldown);
+}
+
+/**
+ * Change the limits of the scaler. See the constructor for the parameters.
+ */
+void ECThreadScaler::setLimits(unsigned ulMinThreads, unsigned ulMaxThreads, double dblMaxAge, double dblCooldown)
+{
+	m_ulMinThreads = ulMinThreads;
+	m_ulMaxThreads = ulMaxThreads == 0 ? 0 : std::max(ulMinThreads, ulMaxThreads);
+	m_dblMaxAge = dblMaxAge;
+	// Idle threads would otherwise time out immediately and be restarted on the next queued item
+	m_dblCooldown = std::max(dblCooldown, 1.0);
+}
+
+/**
+ * Get the amount of threads to start for the current queue age. At most one
+ * thread is added per call, so a burst of old items grows the pool gradually
+ * instead of doubling it on every check.
+ *
+ * @param[in]	ulThreads		The current amount of threads.
+ * @param[in]	dblQueueAge		The age in seconds of the oldest queued item, or 0 when the queue is empty.
+ * @param[in]	dblNow			The current time in seconds.
+ * @returns the amount of threads to start.
+ */
+unsigned ECThreadScaler::threadsToAdd(unsigned ulThreads, double dblQueueAge, double dblNow)
+{
+	unsigned ulAdd = 0;
+
+	if (dblQueueAge <= 0)
+		return 0;
+
+	m_dblLastBusy = dblNow;
+	if (m_dblMaxAge <= 0 || dblQueueAge <= m_dblMaxAge)
+		return 0;
+
+	if (m_ulMaxThreads == 0 || ulThreads < m_ulMaxThreads)
+		ulAdd = 1;
+
+	return ulAdd;
+}
+
+/**
+ * Check if an idle thread may exit.
+ * @param[in]	ulThreads		The current amount of threads.
+ * @param[in]	dblNow			The current time in seconds.
+ * @retval	true when above the minimum and the queue was empty for the cooldown period.
+ */
+bool ECThreadScaler::canRemoveThread(unsigned ulThreads, double dblNow) const
+{
+	return ulThreads > m_ulMinThreads && dblNow - m_dblLastBusy >= m_dblCooldown;
+}
+
+
+
 //////////////////////////////
 // ECThreadPool implementation
 //////////////////////////////
@@ -129,25 +198,8 @@ void ECThreadPool::setThreadCount(unsigned ulThreadCount, bool bWait)
 		pthread_cond_broadcast(&m_hCondition);
 	}
 
-	else {
-		unsigned ulThreadsToAdd = ulThreadCount - threadCount();
-		
-		if (ulThreadsToAdd <= m_ulTermReq)
-			m_ulTermReq -= ulThreadsToAdd;
-		
-		else {
-			ulThreadsToAdd -= m_ulTermReq;
-			m_ulTermReq = 0;
-			
-			for (unsigned i = 0; i < ulThreadsToAdd; ++i) {
-				pthread_t hThread;
-		
-				pthread_create(&hThread, NULL, &threadFunc, this);
-				set_thread_name(hThread, "ECThreadPool");
-				m_setThreads.insert(hThread);
-			}
-		}
-	}
+	else
+		startThreads(ulThreadCount - threadCount());
 	
 	while (bWait && m_setThreads.size() > ulThreadCount) {
 		pthread_cond_wait(&m_hCondTerminated, &m_hMutex);
@@ -234,14 +286,8 @@ bool ECThreadPool::getNextTask(STaskInfo *lpsTaskInfo)
 		pthread_cond_wait(&m_hCondition, &m_hMutex);
 		
 	if (bTerminate) {
-		ThreadSet::iterator iThread = std::find_if(m_setThreads.begin(), m_setThreads.end(), &isCurrentThread);
-		ASSERT(iThread != m_setThreads.end());
-		
-		m_setTerminated.insert(*iThread);
-		m_setThreads.erase(iThread);
+		terminateCurrent();
 		--m_ulTermReq;
-	
-		pthread_cond_signal(&m_hCondTerminated);
 		return false;
 	}
 	
@@ -251,6 +297,47 @@ bool ECThreadPool::getNextTask(STaskInfo *lpsTaskInfo)
 	return true;
 }
 
+/**
+ * Start worker threads, or cancel pending termination requests first.
+ * Must be called with m_hMutex locked.
+ * @param[in]	ulThreads	The amount of threads to add.
+ */
+void ECThreadPool::startThreads(unsigned ulThreads)
+{
+	ASSERT(pthread_mutex_trylock(&m_hMutex) != 0);
+
+	if (ulThreads <= m_ulTermReq) {
+		m_ulTermReq -= ulThreads;
+		return;
+	}
+
+	ulThreads -= m_ulTermReq;
+	m_ulTermReq = 0;
+
+	for (unsigned i = 0; i < ulThreads; ++i) {
+		pthread_t hThread;
+
+		pthread_create(&hThread, NULL, &threadFunc, this);
+		set_thread_name(hThread, "ECThreadPool");
+		m_setThreads.insert(hThread);
+	}
+}
+
+/**
+ * Move the calling worker thread to the set of terminated threads.
+ * Must be called with m_hMutex locked.
+ */
+void ECThreadPool::terminateCurrent()
+{
+	ThreadSet::iterator iThread = std::find_if(m_setThreads.begin(), m_setThreads.end(), &isCurrentThread);
+	ASSERT(iThread != m_setThreads.end());
+
+	m_setTerminated.insert(*iThread);
+	m_setThreads.erase(iThread);
+
+	pthread_cond_signal(&m_hCondTerminated);
+}
+
 /**
  * Call pthread_join on all terminated threads for cleanup.
  */
@@ -38,6 +38,10 @@ struct sockaddr;
 // writing all the data at once, instead of via multiple write() calls. Also, 
 // this ensures that the ECChannel class is responsible for reading, writing
 // and culling newline characters.
+//
+// Incoming data is read in blocks into a per-connection buffer, from which
+// lines and byte counts are served, in both plain and SSL mode. Responses
+// consisting of several lines can be gathered into full packets with HrCork().
 
 class ECChannel _zcp_final {
 public:
@@ -57,6 +61,7 @@ public:
 	HRESULT HrReadAndDiscardBytes(ULONG ulByteCount);
 
 	HRESULT HrSelect(int seconds);
+	HRESULT HrCork(bool bCork);
 
 	void SetIPAddress(const struct sockaddr *, size_t);
 	const char *peer_addr(void) const;
@@ -76,8 +81,16 @@ private:
 	struct sockaddr_storage peer_sockaddr;
 	socklen_t peer_salen;
 
-	char *fd_gets(char *buf, int *lpulLen);
-	char *SSL_gets(char *buf, int *lpulLen);
+	char m_szReadBuf[16384];
+	size_t m_ulReadPos;	// first unconsumed byte in m_szReadBuf
+	size_t m_ulReadEnd;	// end of valid data in m_szReadBuf
+	bool m_bCorked;
+	bool m_bPending;	// data written since corking
+
+	int ReadRaw(char *buf, size_t len);
+	bool FillBuffer();
+	char *buf_gets(char *buf, int *lpulLen);
+	HRESULT HrWriteRaw(const char *szBuffer, size_t len);
 };
 
 /* helpers to open socket */
@@ -48,6 +48,10 @@
  * This could optimised by only sorting the first X characters, and expanding the sort key
  * when more precision is required.
  *
+ * To keep the per-row overhead down, all sort data of a row (lengths, flags and keys) is
+ * stored in a single allocation, the row objects themselves are allocated in slabs owned
+ * by the ECKeyTable, and rows are found by id through a hash map.
+ *
  * This structure will be hogging the largest amount of memory of all the server-side components,
  * that's for sure.
  *
@@ -57,6 +61,13 @@
 
 #include <list>
 #include <map>
+#include <vector>
+
+#if __cplusplus >= 201100L
+#include <unordered_map>
+#else
+#include <boost/unordered_map.hpp>
+#endif
 
 #include <pthread.h>
 
@@ -77,6 +88,14 @@ struct ObjectTableKeyCompare
 	}
 };
 
+struct ObjectTableKeyHash
+{
+	size_t operator()(const sObjectTableKey& a) const
+	{
+		return (size_t)a.ulObjId * 31 + a.ulOrderId;
+	}
+};
+
 bool operator!=(const sObjectTableKey& a, const sObjectTableKey& b);
 bool operator==(const sObjectTableKey& a, const sObjectTableKey& b);
 bool operator<(const sObjectTableKey& a, const sObjectTableKey& b);
@@ -93,6 +112,7 @@ class ECTableRow _zcp_final {
 public:
 	ECTableRow(sObjectTableKey sKey, unsigned int ulSortCols, const unsigned int *lpSortLen, const unsigned char *lpFlags, unsigned char **lppSortData, bool fHidden);
 	ECTableRow(const ECTableRow &other);
+	ECTableRow(const ECTableRow &other, bool fShareSortData);
 	~ECTableRow();
 
 	unsigned int GetObjectSize(void) const;
@@ -108,6 +128,8 @@ private:
 	void initSortCols(unsigned int ulSortCols, const int *lpSortLen, const unsigned char *lpFlags, unsigned char ** lppSortData);
 	void freeSortCols();
 	ECTableRow& operator = (const ECTableRow &other);
+
+	unsigned char *m_lpSortData;	// Single allocation holding the arrays and keys below, NULL if shared with another row
 public:
 	sObjectTableKey	sKey;
 
@@ -127,7 +149,11 @@ public:
 	bool		fHidden;		// The row is hidden (is it non-existent for all purposes)
 };
 
-typedef std::map<sObjectTableKey, ECTableRow*, ObjectTableKeyCompare>  ECTableRowMap;
+#if __cplusplus >= 201100L
+typedef std::unordered_map<sObjectTableKey, ECTableRow*, ObjectTableKeyHash>  ECTableRowMap;
+#else
+typedef boost::unordered_map<sObjectTableKey, ECTableRow*, ObjectTableKeyHash>  ECTableRowMap;
+#endif
 
 typedef struct {
 	unsigned int	ulFirstRowPosition;
@@ -157,6 +183,7 @@ public:
 	ECRESULT	GetRowCount(unsigned int *ulRowCount, unsigned int *ulCurrentRow);
 	ECRESULT	QueryRows(unsigned int ulRows, ECObjectTableList* lpRowList, bool bDirBackward, unsigned int ulFlags, bool bShowHidden = false);
 	ECRESULT	Clear();
+	ECRESULT	CopyRows(ECKeyTable *lpSource, bool bShareSortData);
 
 	ECRESULT	GetBookmark(unsigned int ulbkPosition, int* lpbkPosition);
 	ECRESULT	CreateBookmark(unsigned int* lpulbkPosition);
@@ -197,12 +224,22 @@ private:
 	void		Next();
 	void		Prev();
 
+	// Row allocation from the slabs
+	void		*AllocRow();
+	ECTableRow	*NewRow(const sObjectTableKey *lpsRowItem, unsigned int ulSortCols, const unsigned int *lpSortLen, const unsigned char *lpFlags, unsigned char **lppSortData, bool fHidden);
+	ECTableRow	*CopyTree(const ECTableRow *lpSource, ECTableRow *lpParent, bool bShareSortData);
+	void		FreeRow(ECTableRow *lpRow);
+	void		FreeSlabs();
+
 	pthread_mutex_t			mLock;			// Locks the entire b-tree
 	ECTableRow				*lpRoot;		// The root node, which is infinitely 'low', ie all nodes are such that *node > *root
 	ECTableRow				*lpCurrent;		// The current node
 	ECTableRowMap			mapRow;
 	ECBookmarkMap			m_mapBookmarks;
 	unsigned int			m_ulBookmarkPosition;
+	std::vector<void *>		m_vSlabs;		// Memory for the rows, ROW_SLAB_SIZE rows each
+	void					*m_lpFreeRows;	// Free list of row slots, linked through the slots themselves
+	unsigned int			m_ulSlabUsed;	// Number of slots used in the last slab
 };
 
 #define EC_TABLE_NOADVANCE 1
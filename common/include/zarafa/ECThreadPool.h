@@ -25,6 +25,33 @@
 
 class ECTask;
 
+/**
+ * This class decides when a pool of worker threads should grow or shrink. The
+ * pool grows when the oldest queued item is older than the target age, and
+ * shrinks back to the minimum once it has had no queued items for the cooldown
+ * period. It does not lock; the owner of the pool must serialize the calls.
+ */
+class ECThreadScaler _zcp_final {
+public:
+	ECThreadScaler(unsigned ulMinThreads, unsigned ulMaxThreads, double dblMaxAge, double dblCooldown);
+
+	void setLimits(unsigned ulMinThreads, unsigned ulMaxThreads, double dblMaxAge, double dblCooldown);
+	unsigned threadsToAdd(unsigned ulThreads, double dblQueueAge, double dblNow);
+	bool canRemoveThread(unsigned ulThreads, double dblNow) const;
+
+	unsigned minThreads() const { return m_ulMinThreads; }
+	unsigned maxThreads() const { return m_ulMaxThreads; }
+	double maxAge() const { return m_dblMaxAge; }
+	double cooldown() const { return m_dblCooldown; }
+
+private:
+	unsigned	m_ulMinThreads;
+	unsigned	m_ulMaxThreads;		// 0 for no limit
+	double		m_dblMaxAge;		// 0 to never grow above the minimum
+	double		m_dblCooldown;
+	double		m_dblLastBusy;
+};
+
 /**
  * This class represents a thread pool with a fixed amount of worker threads.
  * The amount of workers can be modified at run time, but is not automatically
@@ -55,6 +82,8 @@ public:
 	
 private:	// methods
 	virtual bool getNextTask(STaskInfo *lpsTaskInfo);
+	void startThreads(unsigned ulThreads);
+	void terminateCurrent();
 	void joinTerminated();
 	
 private:	// static methods
@@ -42,6 +42,7 @@ public:
 	void swap(ECLocale &other);
 
 	operator const locale_t&() const { return m_locale; }
+	const char *getName() const { return m_localeid.c_str(); }
 
 private:
 	locale_t	m_locale;
@@ -112,6 +113,7 @@ ECRESULT LocaleIdToLocaleName(const char *lpszLocaleID, const char **lppszLocale
 void createSortKeyData(const char *s, int nCap, const ECLocale &locale, unsigned int *lpcbKey, unsigned char **lppKey);
 void createSortKeyData(const wchar_t *s, int nCap, const ECLocale &locale,unsigned int *lpcbKey, unsigned char **lppKey);
 void createSortKeyDataFromUTF8(const char *s, int nCap, const ECLocale &locale, unsigned int *lpcbKey, unsigned char **lppKey);
+void createSortKeysDataFromUTF8(unsigned int cValues, const char **lppszValues, int nCap, const ECLocale &locale, unsigned int *lpcbKeys, unsigned char **lppKeys);
 ECSortKey createSortKeyFromUTF8(const char *s, int nCap, const ECLocale &locale);
 
 int compareSortKeys(unsigned int cbKey1, const unsigned char *lpKey1, unsigned int cbKey2, const unsigned char *lpKey2);
@@ -70,7 +70,8 @@ At some point we need to rewqrite these functions to do all the conversion on th
 #include <cassert>
 
 #ifdef ZCP_USES_ICU
-#include <memory>
+#include <map>
+#include <pthread.h>
 #include <unicode/unorm.h>
 #include <unicode/coll.h>
 #include <unicode/tblcoll.h>
@@ -81,11 +82,7 @@ At some point we need to rewqrite these functions to do all the conversion on th
 #include "ustringutil/utfutil.h"
 
 typedef UTF32Iterator	WCharIterator;
-#if __cplusplus >= 201100L
-typedef std::unique_ptr<Collator> unique_ptr_Collator;
-#else
-typedef std::auto_ptr<Collator> unique_ptr_Collator;
-#endif
+typedef std::map<std::string, Collator *> CollatorMap;
 
 #else
 #include <cstring>
@@ -98,6 +95,64 @@ typedef std::auto_ptr<Collator> unique_ptr_Collator;
 static const char THIS_FILE[] = __FILE__;
 #endif
 
+#ifdef ZCP_USES_ICU
+static pthread_key_t collator_key;
+static pthread_once_t collator_key_once = PTHREAD_ONCE_INIT;
+
+static void collator_cache_destroy(void *lpParam)
+{
+	CollatorMap *lpCollators = (CollatorMap *)lpParam;
+
+	for (CollatorMap::const_iterator i = lpCollators->begin(); i != lpCollators->end(); ++i)
+		delete i->second;
+	delete lpCollators;
+}
+
+static void collator_key_create(void)
+{
+	pthread_key_create(&collator_key, collator_cache_destroy);
+}
+
+/**
+ * Get the collator for a locale from the cache of the calling thread.
+ *
+ * Creating a collator is expensive compared to using it, so each thread keeps
+ * the collators it has created, keyed by locale name, until it exits. A
+ * collator is not safe to use from multiple threads, hence the per-thread
+ * cache. All callers use the default strength of the locale, so the strength
+ * is not part of the key.
+ *
+ * @param[in]	locale	The locale for which to get the collator.
+ *
+ * @return		The collator, which is owned by the cache.
+ */
+static Collator *GetThreadCollator(const ECLocale &locale)
+{
+	CollatorMap *lpCollators = NULL;
+	CollatorMap::const_iterator iCollator;
+	Collator *lpCollator = NULL;
+	UErrorCode status = U_ZERO_ERROR;
+
+	pthread_once(&collator_key_once, collator_key_create);
+
+	lpCollators = (CollatorMap *)pthread_getspecific(collator_key);
+	if (lpCollators == NULL) {
+		lpCollators = new CollatorMap;
+		pthread_setspecific(collator_key, lpCollators);
+	}
+
+	iCollator = lpCollators->find(locale.getName());
+	if (iCollator != lpCollators->end())
+		return iCollator->second;
+
+	lpCollator = Collator::createInstance(locale, status);
+	if (lpCollator != NULL)
+		lpCollators->insert(CollatorMap::value_type(locale.getName(), lpCollator));
+
+	return lpCollator;
+}
+#endif
+
 #ifndef ZCP_USES_ICU
 ECSortKey::ECSortKey(const unsigned char *lpSortData, unsigned int cbSortData)
 	: m_lpSortData(lpSortData)
@@ -292,12 +347,12 @@ int str_compare(const char *s1, const char *s2, const ECLocale &locale)
 	
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = StringToUnicode(s1);
 	UnicodeString b = StringToUnicode(s2);
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	int r = strcmp(s1, s2);
 	return (r < 0 ? -1 : (r > 0 ? 1 : 0));
@@ -328,7 +383,7 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = StringToUnicode(s1);
 	UnicodeString b = StringToUnicode(s2);
@@ -336,7 +391,7 @@ int str_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	a.foldCase();
 	b.foldCase();
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	int r = strcasecmp_l(s1, s2, locale);
 	return (r < 0 ? -1 : (r > 0 ? 1 : 0));
@@ -533,12 +588,12 @@ int wcs_compare(const wchar_t *s1, const wchar_t *s2, const ECLocale &locale)
 	
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = UTF32ToUnicode((UChar32*)s1);
 	UnicodeString b = UTF32ToUnicode((UChar32*)s2);
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	int r = wcscmp(s1, s2);
 	return (r < 0 ? -1 : (r > 0 ? 1 : 0));
@@ -569,7 +624,7 @@ int wcs_icompare(const wchar_t *s1, const wchar_t *s2, const ECLocale &locale)
 	
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = WCHARToUnicode(s1);
 	UnicodeString b = WCHARToUnicode(s2);
@@ -577,7 +632,7 @@ int wcs_icompare(const wchar_t *s1, const wchar_t *s2, const ECLocale &locale)
 	a.foldCase();
 	b.foldCase();
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	int r = wcscasecmp_l(s1, s2, locale);
 	return (r < 0 ? -1 : (r > 0 ? 1 : 0));
@@ -799,12 +854,12 @@ int u8_compare(const char *s1, const char *s2, const ECLocale &locale)
 
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = UTF8ToUnicode(s1);
 	UnicodeString b = UTF8ToUnicode(s2);
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	convert_context converter;
 	const wchar_t *ws1 = converter.convert_to<WCHAR*>(s1, rawsize(s1), "UTF-8");
@@ -837,7 +892,7 @@ int u8_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	
 #ifdef ZCP_USES_ICU
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
+	Collator *lpCollator = GetThreadCollator(locale);
 
 	UnicodeString a = UTF8ToUnicode(s1);
 	UnicodeString b = UTF8ToUnicode(s2);
@@ -845,7 +900,7 @@ int u8_icompare(const char *s1, const char *s2, const ECLocale &locale)
 	a.foldCase();
 	b.foldCase();
 
-	return ptrCollator->compare(a,b,status);
+	return lpCollator->compare(a,b,status);
 #else
 	convert_context converter;
 	const wchar_t *ws1 = converter.convert_to<WCHAR*>(s1, rawsize(s1), "UTF-8");
@@ -1307,12 +1362,12 @@ ECRESULT LocaleIdToLocaleName(const char *lpszLocaleID, const char **lppszLocale
  *
  * @param[in]	s			The string to compare.
  * @param[in]	nCap		Base the key on the first nCap characters of s (if larger than 0).
- * @param[in]	locale		The locale used to create the sort key.
+ * @param[in]	lpCollator	The collator used to create the sort key.
  *
  * @returns		ECSortKey object containing the blob
  */
 static ECSortKey createSortKey(UnicodeString s, int nCap,
-    const ECLocale &locale)
+    Collator *lpCollator)
 {
 	if (nCap > 1)
 		s.truncate(nCap);
@@ -1323,8 +1378,7 @@ static ECSortKey createSortKey(UnicodeString s, int nCap,
 
 	CollationKey key;
 	UErrorCode status = U_ZERO_ERROR;
-	unique_ptr_Collator ptrCollator(Collator::createInstance(locale, status));
-	ptrCollator->getCollationKey(s, key, status);	// Create a collation key for sorting
+	lpCollator->getCollationKey(s, key, status);	// Create a collation key for sorting
 
 	return key;
 }
@@ -1336,15 +1390,15 @@ static ECSortKey createSortKey(UnicodeString s, int nCap,
  *
  * @param[in]	s			The string to compare.
  * @param[in]	nCap		Base the key on the first nCap characters of s (if larger than 0).
- * @param[in]	locale		The locale used to create the sort key.
+ * @param[in]	lpCollator	The collator used to create the sort key.
  * @param[out]	lpcbKeys	The size in bytes of the returned key.
  * @param[ou]t	lppKey		The returned key.
  */
-static void createSortKeyData(const UnicodeString &s, int nCap, const ECLocale &locale, unsigned int *lpcbKey, unsigned char **lppKey)
+static void createSortKeyData(const UnicodeString &s, int nCap, Collator *lpCollator, unsigned int *lpcbKey, unsigned char **lppKey)
 {
 	unsigned char *lpKey = NULL;
 
-	CollationKey key = createSortKey(s, nCap, locale);
+	CollationKey key = createSortKey(s, nCap, lpCollator);
 
 	int32_t 		cbKeyData = 0;
 	const uint8_t	*lpKeyData = key.getByteArray(cbKeyData);
@@ -1375,7 +1429,7 @@ void createSortKeyData(const char *s, int nCap, const ECLocale &locale, unsigned
 	ASSERT(lppKey != NULL);
 
 #ifdef ZCP_USES_ICU
-	createSortKeyData(UnicodeString(s), nCap, locale, lpcbKey, lppKey);
+	createSortKeyData(UnicodeString(s), nCap, GetThreadCollator(locale), lpcbKey, lppKey);
 #else
 	std::wstring wstrTmp = convert_to<std::wstring>(s);
 	createSortKeyData(wstrTmp.c_str(), nCap, locale, lpcbKey, lppKey);
@@ -1401,7 +1455,7 @@ void createSortKeyData(const wchar_t *s, int nCap, const ECLocale &locale, unsig
 #ifdef ZCP_USES_ICU
 	UnicodeString ustring;
 	ustring = UTF32ToUnicode((const UChar32*)s);
-	createSortKeyData(ustring, nCap, locale, lpcbKey, lppKey);
+	createSortKeyData(ustring, nCap, GetThreadCollator(locale), lpcbKey, lppKey);
 #else
 	ASSERT((locale_t)locale != NULL);
 
@@ -1433,13 +1487,49 @@ void createSortKeyDataFromUTF8(const char *s, int nCap, const ECLocale &locale,
 	ASSERT(lppKey != NULL);
 
 #ifdef ZCP_USES_ICU
-	createSortKeyData(UTF8ToUnicode(s), nCap, locale, lpcbKey, lppKey);
+	createSortKeyData(UTF8ToUnicode(s), nCap, GetThreadCollator(locale), lpcbKey, lppKey);
 #else
 	std::wstring wstrTmp = convert_to<std::wstring>(s, rawsize(s), "UTF-8");
 	createSortKeyData(wstrTmp.c_str(), nCap, locale, lpcbKey, lppKey);
 #endif
 }
 
+/**
+ * Create the sort keys for a number of strings at once, for instance all
+ * values of a single column. This is cheaper than creating the keys one
+ * by one, since the collator is looked up only once.
+ *
+ * @param[in]	cValues		The number of strings.
+ * @param[in]	lppszValues	The strings, encoded in UTF-8. NULL entries get an empty key.
+ * @param[in]	nCap		Base the keys on the first nCap characters of each string (if larger than 0).
+ * @param[in]	locale		The locale used to create the sort keys.
+ * @param[out]	lpcbKeys	Array of cValues entries receiving the size in bytes of each key.
+ * @param[out]	lppKeys		Array of cValues entries receiving the keys.
+ */
+void createSortKeysDataFromUTF8(unsigned int cValues, const char **lppszValues, int nCap, const ECLocale &locale, unsigned int *lpcbKeys, unsigned char **lppKeys)
+{
+	ASSERT(cValues == 0 || lppszValues != NULL);
+	ASSERT(cValues == 0 || lpcbKeys != NULL);
+	ASSERT(cValues == 0 || lppKeys != NULL);
+
+#ifdef ZCP_USES_ICU
+	Collator *lpCollator = GetThreadCollator(locale);
+#endif
+
+	for (unsigned int i = 0; i < cValues; ++i) {
+		if (lppszValues[i] == NULL) {
+			lpcbKeys[i] = 0;
+			lppKeys[i] = NULL;
+			continue;
+		}
+#ifdef ZCP_USES_ICU
+		createSortKeyData(UTF8ToUnicode(lppszValues[i]), nCap, lpCollator, &lpcbKeys[i], &lppKeys[i]);
+#else
+		createSortKeyDataFromUTF8(lppszValues[i], nCap, locale, &lpcbKeys[i], &lppKeys[i]);
+#endif
+	}
+}
+
 
 /**
  * Create a locale independant blob that can be used to sort
@@ -1457,7 +1547,7 @@ ECSortKey createSortKeyFromUTF8(const char *s, int nCap, const ECLocale &locale)
 	ASSERT(s != NULL);
 
 #ifdef ZCP_USES_ICU
-	return createSortKey(UTF8ToUnicode(s), nCap, locale);
+	return createSortKey(UTF8ToUnicode(s), nCap, GetThreadCollator(locale));
 #else
 	unsigned int cbKey = 0;
 	unsigned char *lpKey = NULL;
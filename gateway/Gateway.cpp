@@ -46,6 +46,7 @@
 #include <zarafa/ECChannel.h>
 #include "POP3.h"
 #include "IMAP.h"
+#include "IMAPMessageCache.h"
 #include <zarafa/ecversion.h>
 
 #include "SSLUtil.h"
@@ -234,17 +235,23 @@ static void *Handler(void *lpArg)
 			break;
 		}
 
+		// send the response lines of a command in as few packets as possible
+		lpChannel->HrCork(true);
+
 		if (client->isContinue()) {
 			// we asked the client for more data, do not parse the buffer, but send it "to the previous command"
 			// that last part is currently only HrCmdAuthenticate(), so no difficulties here.
 			// also, PLAIN is the only supported auth method.
 			hr = client->HrProcessContinue(inBuffer);
+			lpChannel->HrCork(false);
 			// no matter what happens, we continue handling the connection.
 			continue;
 		}
 
 		// Process IMAP command
 		hr = client->HrProcessCommand(inBuffer);
+		// uncork, IDLE notifications are written by another thread
+		lpChannel->HrCork(false);
 		if (hr == MAPI_E_NETWORK_ERROR) {
 			lpLogger->Log(EC_LOGLEVEL_ERROR, "Connection error.");
 			bQuit = true;
@@ -317,6 +324,8 @@ int main(int argc, char *argv[]) {
 		{ "imap_generate_utf8", "no", CONFIGSETTING_RELOADABLE },
 		{ "imap_expunge_on_delete", "no", CONFIGSETTING_RELOADABLE },
 		{ "imap_store_rfc822", "yes", CONFIGSETTING_RELOADABLE },
+		{ "imap_cache_size", "64M", CONFIGSETTING_SIZE },
+		{ "imap_search_use_index", "no", CONFIGSETTING_RELOADABLE },
 		{ "disable_plaintext_auth", "no", CONFIGSETTING_RELOADABLE },
 		{ "server_socket", "http://localhost:236/zarafa" },
 		{ "server_hostname", "" },
@@ -610,6 +619,9 @@ static HRESULT running_service(const char *szPath, const char *servicename)
 		goto exit;
 	}
 
+	if (bListenIMAP || bListenIMAPs)
+		IMAPMessageCache::StaticInit(g_lpConfig);
+
 	g_lpLogger->Log(EC_LOGLEVEL_ALWAYS, "Starting zarafa-gateway version " PROJECT_VERSION_GATEWAY_STR " (" PROJECT_SVN_REV_STR "), pid %d", getpid());
 
 	// Mainloop
@@ -791,6 +803,10 @@ static HRESULT running_service(const char *szPath, const char *servicename)
 	else
 		g_lpLogger->Log(EC_LOGLEVEL_NOTICE, "POP3/IMAP Gateway shutdown complete");
 
+	// only free the cache when no thread can be using it anymore
+	if (nChildren == 0)
+		IMAPMessageCache::StaticDeinit();
+
 
 	MAPIUninitialize();
 
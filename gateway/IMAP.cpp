@@ -59,6 +59,7 @@
 #include <zarafa/mapi_ptr.h>
 
 #include "IMAP.h"
+#include "IMAPMessageCache.h"
 using namespace std;
 
 /** 
@@ -3627,6 +3628,12 @@ bool IMAP::IsSpecialFolder(ULONG cbEntryID, LPENTRYID lpEntryID) {
 
 /** 
  * Make a list of all mails in the current selected folder.
+ *
+ * The list is kept between calls and updated incrementally: only the
+ * UID and flag columns of the contents table are scanned, and the
+ * entryid and instance key are only retrieved for messages with a UID
+ * we did not know yet. Selecting the folder that is already in the list
+ * reuses it instead of building a new one.
  * 
  * @param[in] bInitialLoad Create a new clean list of mails (false to append only)
  * @param[in] bResetRecent Update the value of PR_EC_IMAP_MAX_ID for this folder
@@ -3647,15 +3654,24 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
 	int n = 0;
 	SMail sMail;
 	bool bNewMail = false;
-	enum { EID, IKEY, IMAPID, FLAGS, FLAGSTATUS, MSGSTATUS, LAST_VERB, NUM_COLS };
-	SizedSPropTagArray(NUM_COLS, spt) = { NUM_COLS, {PR_ENTRYID, PR_INSTANCE_KEY, PR_EC_IMAP_ID, PR_MESSAGE_FLAGS, PR_FLAG_STATUS, PR_MSG_STATUS, PR_LAST_VERB_EXECUTED} };
+	bool bFullColumns = false;
+	// EID and IKEY must be last, they are left out of the columns when only updating the flags
+	enum { IMAPID, FLAGS, FLAGSTATUS, MSGSTATUS, LAST_VERB, EID, IKEY, NUM_COLS };
+	SizedSPropTagArray(NUM_COLS, spt) = { NUM_COLS, {PR_EC_IMAP_ID, PR_MESSAGE_FLAGS, PR_FLAG_STATUS, PR_MSG_STATUS, PR_LAST_VERB_EXECUTED, PR_ENTRYID, PR_INSTANCE_KEY} };
+	enum { NEW_IMAPID, NEW_EID, NEW_IKEY, NUM_NEW_COLS };
+	SizedSPropTagArray(NUM_NEW_COLS, sptNew) = { NUM_NEW_COLS, {PR_EC_IMAP_ID, PR_ENTRYID, PR_INSTANCE_KEY} };
 	SizedSSortOrderSet(1, sSortUID) = { 1, 0, 0, { { PR_EC_IMAP_ID, TABLE_SORT_ASCEND } } };
-	vector<SMail>::const_iterator iterMail;
+	SPropValue sPropMinUID;
+	SRestriction sRestrictNew;
+	vector<SMail> lstNewMails;
+	map<unsigned int, unsigned int> mapNewUIDs; // Map UID -> offset in lstNewMails
 	map<unsigned int, unsigned int> mapUIDs; // Map UID -> ID
 	map<unsigned int, unsigned int>::iterator iterUID;
+	vector<SMail>::const_iterator iterMail;
 	SPropValue sPropMax;
 	unsigned int ulUnseen = 0;
-	SizedSPropTagArray(2, sPropsFolderIDs) = { 2, { PR_EC_IMAP_MAX_ID, PR_EC_HIERARCHYID } };
+	SizedSPropTagArray(3, sPropsFolderIDs) = { 3, { PR_EC_IMAP_MAX_ID, PR_EC_HIERARCHYID, PR_ENTRYID } };
+	BinaryArray sFolderEntryID;
 	LPSPropValue lpFolderIDs = NULL;
 	ULONG cValues;
 
@@ -3680,6 +3696,23 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
 	if (lpulUIDValidity && lpFolderIDs[1].ulPropTag == PR_EC_HIERARCHYID)
 		*lpulUIDValidity = lpFolderIDs[1].Value.ul;
 
+	// A new list is only needed when another folder is selected; when
+	// the same folder is selected again, the list we have is updated
+	// without sending the changes, since the client starts over anyway.
+	// The hierarchy id is only unique per server, the entryid also holds the store.
+	if (lpFolderIDs[2].ulPropTag == PR_ENTRYID)
+		sFolderEntryID = BinaryArray(lpFolderIDs[2].Value.bin);
+	if (bInitialLoad && (sFolderEntryID.cb == 0 || !(sFolderEntryID == m_sFolderMailsEntryID))) {
+		lstFolderMailEIDs.clear();
+		m_ulLastUid = 0;
+	}
+	m_sFolderMailsEntryID = sFolderEntryID;
+
+	// With an empty list every message is new, so get everything in one pass
+	bFullColumns = lstFolderMailEIDs.empty();
+	if (!bFullColumns)
+		spt.cValues = EID;
+
 	hr = lpFolder->GetContentsTable(MAPI_DEFERRED_ERRORS, &lpTable);
 	if (hr != hrSuccess)
 		goto exit;
@@ -3692,16 +3725,10 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
     if (hr != hrSuccess)
         goto exit;
 
-    // Remember UIDs if needed
-    if(!bInitialLoad)
-        for (iterMail = lstFolderMailEIDs.begin();
-             iterMail != lstFolderMailEIDs.end(); ++iterMail)
+    // Remember UIDs
+    for (iterMail = lstFolderMailEIDs.begin();
+         iterMail != lstFolderMailEIDs.end(); ++iterMail)
 		mapUIDs[iterMail->ulUid] = n++;
-    
-    if(bInitialLoad)
-        lstFolderMailEIDs.clear();
-
-    iterMail = lstFolderMailEIDs.begin();
 
     // Scan MAPI for new and existing messages
 	while(1) {
@@ -3713,16 +3740,20 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
             break;
             
 		for (ulMailnr = 0; ulMailnr < lpRows->cRows; ++ulMailnr) {
-            if (lpRows->aRow[ulMailnr].lpProps[EID].ulPropTag != spt.aulPropTag[EID] ||
-                lpRows->aRow[ulMailnr].lpProps[IKEY].ulPropTag != spt.aulPropTag[IKEY] ||
-                lpRows->aRow[ulMailnr].lpProps[IMAPID].ulPropTag != spt.aulPropTag[IMAPID])
+            if (lpRows->aRow[ulMailnr].lpProps[IMAPID].ulPropTag != spt.aulPropTag[IMAPID])
+                continue;
+            if (bFullColumns &&
+                (lpRows->aRow[ulMailnr].lpProps[EID].ulPropTag != spt.aulPropTag[EID] ||
+                 lpRows->aRow[ulMailnr].lpProps[IKEY].ulPropTag != spt.aulPropTag[IKEY]))
                 continue;
 
             iterUID = mapUIDs.find(lpRows->aRow[ulMailnr].lpProps[IMAPID].Value.ul);
 		    if(iterUID == mapUIDs.end()) {
 		        // There is a new message
-                sMail.sEntryID = BinaryArray(lpRows->aRow[ulMailnr].lpProps[EID].Value.bin);
-                sMail.sInstanceKey = BinaryArray(lpRows->aRow[ulMailnr].lpProps[IKEY].Value.bin);
+                if (bFullColumns) {
+                    sMail.sEntryID = BinaryArray(lpRows->aRow[ulMailnr].lpProps[EID].Value.bin);
+                    sMail.sInstanceKey = BinaryArray(lpRows->aRow[ulMailnr].lpProps[IKEY].Value.bin);
+                }
                 sMail.ulUid = lpRows->aRow[ulMailnr].lpProps[IMAPID].Value.ul;
 
                 // Mark as recent if the message has a UID higher than the last highest read UID
@@ -3733,30 +3764,22 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
                 // Remember flags
                 sMail.strFlags = PropsToFlags(lpRows->aRow[ulMailnr].lpProps, lpRows->aRow[ulMailnr].cValues, sMail.bRecent, false);
 
-                // Put message on the end of our message
-    			lstFolderMailEIDs.push_back(sMail);
-
-                m_ulLastUid = max(sMail.ulUid, m_ulLastUid);
-                bNewMail = true;
-                
-                // Remember the first unseen message
-                if(ulUnseen == 0) {
-                    if(lpRows->aRow[ulMailnr].lpProps[FLAGS].ulPropTag == PR_MESSAGE_FLAGS && (lpRows->aRow[ulMailnr].lpProps[FLAGS].Value.ul & MSGFLAG_READ) == 0) {
-                        ulUnseen = lstFolderMailEIDs.size()-1+1; // size()-1 = last offset, mail ID = position + 1
-                    }
-                }
+                mapNewUIDs[sMail.ulUid] = lstNewMails.size();
+                lstNewMails.push_back(sMail);
             } else {
                 // Check flags
                 std::string strFlags = PropsToFlags(lpRows->aRow[ulMailnr].lpProps, lpRows->aRow[ulMailnr].cValues, lstFolderMailEIDs[iterUID->second].bRecent, false);
                 
                 if(lstFolderMailEIDs[iterUID->second].strFlags != strFlags) {
                     // Flags have changed, notify it
-                    if(bShowUID)
-                        hr = HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (UID " + stringify(lpRows->aRow[ulMailnr].lpProps[IMAPID].Value.ul) + " FLAGS (" + strFlags + "))");
-                    else
-                        hr = HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (FLAGS (" + strFlags + "))");
-					if (hr != hrSuccess)
-						goto exit;
+                    if (!bInitialLoad) {
+                        if(bShowUID)
+                            hr = HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (UID " + stringify(lpRows->aRow[ulMailnr].lpProps[IMAPID].Value.ul) + " FLAGS (" + strFlags + "))");
+                        else
+                            hr = HrResponse(RESP_UNTAGGED, stringify(iterUID->second+1) + " FETCH (FLAGS (" + strFlags + "))");
+                        if (hr != hrSuccess)
+                            goto exit;
+                    }
                     lstFolderMailEIDs[iterUID->second].strFlags = strFlags;
                 }
                     
@@ -3771,23 +3794,92 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
 		lpRows = NULL;
     }
 
+    // Get the entryids of the new messages. The table is sorted on UID, and
+    // new messages almost always have the highest UIDs, so restrict on the
+    // lowest new UID to only receive the rows we need.
+    if (!bFullColumns && !lstNewMails.empty()) {
+        sPropMinUID.ulPropTag = PR_EC_IMAP_ID;
+        sPropMinUID.Value.ul = mapNewUIDs.begin()->first;
+        sRestrictNew.rt = RES_PROPERTY;
+        sRestrictNew.res.resProperty.relop = RELOP_GE;
+        sRestrictNew.res.resProperty.ulPropTag = PR_EC_IMAP_ID;
+        sRestrictNew.res.resProperty.lpProp = &sPropMinUID;
+
+        hr = lpTable->SetColumns((LPSPropTagArray) &sptNew, TBL_BATCH);
+        if (hr != hrSuccess)
+            goto exit;
+
+        hr = lpTable->Restrict(&sRestrictNew, TBL_BATCH);
+        if (hr != hrSuccess)
+            goto exit;
+
+        hr = lpTable->SeekRow(BOOKMARK_BEGINNING, 0, NULL);
+        if (hr != hrSuccess)
+            goto exit;
+
+        while(1) {
+            hr = lpTable->QueryRows(ROWS_PER_REQUEST, 0, &lpRows);
+            if (hr != hrSuccess)
+                goto exit;
+
+            if(lpRows->cRows == 0)
+                break;
+
+            for (ulMailnr = 0; ulMailnr < lpRows->cRows; ++ulMailnr) {
+                if (lpRows->aRow[ulMailnr].lpProps[NEW_IMAPID].ulPropTag != PR_EC_IMAP_ID ||
+                    lpRows->aRow[ulMailnr].lpProps[NEW_EID].ulPropTag != PR_ENTRYID ||
+                    lpRows->aRow[ulMailnr].lpProps[NEW_IKEY].ulPropTag != PR_INSTANCE_KEY)
+                    continue;
+
+                // Messages that arrived after the first scan are picked up next time
+                iterUID = mapNewUIDs.find(lpRows->aRow[ulMailnr].lpProps[NEW_IMAPID].Value.ul);
+                if (iterUID == mapNewUIDs.end())
+                    continue;
+
+                lstNewMails[iterUID->second].sEntryID = BinaryArray(lpRows->aRow[ulMailnr].lpProps[NEW_EID].Value.bin);
+                lstNewMails[iterUID->second].sInstanceKey = BinaryArray(lpRows->aRow[ulMailnr].lpProps[NEW_IKEY].Value.bin);
+            }
+
+            FreeProws(lpRows);
+            lpRows = NULL;
+        }
+    }
+
     // All messages left in mapUIDs have been deleted, so loop through the current list so we can
-    // send the correct EXPUNGE calls; At the same time, count RECENT messages.
+    // send the correct EXPUNGE calls
     ulMailnr = 0;
     while(ulMailnr < lstFolderMailEIDs.size()) {
         if(mapUIDs.find(lstFolderMailEIDs[ulMailnr].ulUid) != mapUIDs.end()) {
-            hr = HrResponse(RESP_UNTAGGED, stringify(ulMailnr+1) + " EXPUNGE");
-			if (hr != hrSuccess)
-				goto exit;
+            if (!bInitialLoad) {
+                hr = HrResponse(RESP_UNTAGGED, stringify(ulMailnr+1) + " EXPUNGE");
+                if (hr != hrSuccess)
+                    goto exit;
+            }
             lstFolderMailEIDs.erase(lstFolderMailEIDs.begin() + ulMailnr);
         } else {
-            if(lstFolderMailEIDs[ulMailnr].bRecent)
-                ++ulRecent;
-                
-            ++iterMail;
             ++ulMailnr;
         }
     }
+
+    // Put new messages on the end of our list; a message that was deleted
+    // before we could get its entryid is left out
+    for (iterMail = lstNewMails.begin(); iterMail != lstNewMails.end(); ++iterMail) {
+        if (iterMail->sEntryID.cb == 0)
+            continue;
+        lstFolderMailEIDs.push_back(*iterMail);
+        m_ulLastUid = max(iterMail->ulUid, m_ulLastUid);
+        bNewMail = true;
+    }
+
+	sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
+
+    // Count RECENT messages, and remember the first unseen message
+    for (ulMailnr = 0; ulMailnr < lstFolderMailEIDs.size(); ++ulMailnr) {
+        if (lstFolderMailEIDs[ulMailnr].bRecent)
+            ++ulRecent;
+        if (ulUnseen == 0 && lstFolderMailEIDs[ulMailnr].strFlags.find("\\Seen") == std::string::npos)
+            ulUnseen = ulMailnr + 1; // mail ID = position + 1
+    }
     
     if (bNewMail || bInitialLoad) {
         hr = HrResponse(RESP_UNTAGGED, stringify(lstFolderMailEIDs.size()) + " EXISTS");
@@ -3798,8 +3890,6 @@ HRESULT IMAP::HrRefreshFolderMails(bool bInitialLoad, bool bResetRecent, bool bS
 			goto exit;
     }
 
-	sort(lstFolderMailEIDs.begin(), lstFolderMailEIDs.end());
-	
     // Save the max UID so that other session will not see the items as \Recent
     if(bResetRecent && ulRecent) {
     	sPropMax.ulPropTag = PR_EC_IMAP_MAX_ID;
@@ -4082,8 +4172,10 @@ HRESULT IMAP::HrPropertyFetch(list<ULONG> &lstMails, vector<string> &lstDataItem
 			setProps.insert(PR_CLIENT_SUBMIT_TIME);
 		} else if (strDataItem.compare("BODY") == 0) {
 			setProps.insert(PR_EC_IMAP_BODY);
+			setProps.insert(PR_CHANGE_KEY);
 		} else if (strDataItem.compare("BODYSTRUCTURE") == 0) {
 			setProps.insert(PR_EC_IMAP_BODYSTRUCTURE);
+			setProps.insert(PR_CHANGE_KEY);
 		} else if (strDataItem.compare("ENVELOPE") == 0) {
 			setProps.insert(m_lpsIMAPTags->aulPropTag[0]);
 		} else if (strDataItem.compare("RFC822.SIZE") == 0) {
@@ -4094,6 +4186,8 @@ HRESULT IMAP::HrPropertyFetch(list<ULONG> &lstMails, vector<string> &lstDataItem
 			setProps.insert(PR_TRANSPORT_MESSAGE_HEADERS_A);
 			// if we have the full body, we can skip some hacks to make headers match with the otherwise regenerated version.
 			setProps.insert(PR_EC_IMAP_EMAIL_SIZE);
+			// key for the generated message cache
+			setProps.insert(PR_CHANGE_KEY);
 
 			// this is where RFC822.HEADER seems to differ from BODY[HEADER] requests
 			// (according to dovecot and courier)
@@ -4103,6 +4197,7 @@ HRESULT IMAP::HrPropertyFetch(list<ULONG> &lstMails, vector<string> &lstDataItem
 			// we don't want PR_EC_IMAP_EMAIL in the table (size problem),
 			// and it must be in sync with PR_EC_IMAP_EMAIL_SIZE anyway, so detect presence from size
 			setProps.insert(PR_EC_IMAP_EMAIL_SIZE);
+			setProps.insert(PR_CHANGE_KEY);
 
 			if (strstr(strDataItem.c_str(), "PEEK") == NULL)
 				bMarkAsRead = true;
@@ -4309,7 +4404,10 @@ HRESULT IMAP::HrPropertyFetchRow(LPSPropValue lpProps, ULONG cValues, string &st
 	LPSTREAM lpStream = NULL;
 	string strFlags;
 	bool bSkipOpen = true;
+	bool bEnvelopeOpen = false;
 	vector<string> vProps;
+	IMAPMessageCache *lpMessageCache = IMAPMessageCache::GetCache();
+	SBinary sEntryID = { lstFolderMailEIDs[ulMailnr].sEntryID.cb, lstFolderMailEIDs[ulMailnr].sEntryID.lpb };
 	
 	// Response always starts with "<id> FETCH ("
 	snprintf(szBuffer, IMAP_RESP_MAX, "%u FETCH (", ulMailnr + 1);
@@ -4344,7 +4442,16 @@ HRESULT IMAP::HrPropertyFetchRow(LPSPropValue lpProps, ULONG cValues, string &st
 			bSkipOpen = false;
 		}
 	}
-	if (!bSkipOpen && m_ulCacheUID != lstFolderMailEIDs[ulMailnr].ulUid) {
+	// a missing envelope is built from the message, not from the cached RFC822 data
+	if (!bSkipOpen && PpropFindProp(lpProps, cValues, m_lpsIMAPTags->aulPropTag[0]) == NULL)
+		bEnvelopeOpen = find(lstDataItems.begin(), lstDataItems.end(), "ENVELOPE") != lstDataItems.end();
+	if (!bSkipOpen && m_ulCacheUID != lstFolderMailEIDs[ulMailnr].ulUid && lpMessageCache) {
+		// another session may already have generated this version of the message
+		lpProp = PpropFindProp(lpProps, cValues, PR_CHANGE_KEY);
+		if (lpProp && lpMessageCache->Get(sEntryID, lpProp->Value.bin, sopt.force_utf8, &m_strCache) == hrSuccess)
+			m_ulCacheUID = lstFolderMailEIDs[ulMailnr].ulUid;
+	}
+	if (!bSkipOpen && (m_ulCacheUID != lstFolderMailEIDs[ulMailnr].ulUid || bEnvelopeOpen)) {
 		// ignore error, we can't print an error halfway to the imap client
 		lpSession->OpenEntry(lstFolderMailEIDs[ulMailnr].sEntryID.cb, (LPENTRYID) lstFolderMailEIDs[ulMailnr].sEntryID.lpb,
 							 &IID_IMessage, MAPI_DEFERRED_ERRORS, &ulObjType, (LPUNKNOWN *) &lpMessage);
@@ -4502,6 +4609,10 @@ HRESULT IMAP::HrPropertyFetchRow(LPSPropValue lpProps, ULONG cValues, string &st
 				if(!sopt.headers_only) {
 					m_ulCacheUID = lstFolderMailEIDs[ulMailnr].ulUid;
 					m_strCache = strMessage;
+
+					lpProp = PpropFindProp(lpProps, cValues, PR_CHANGE_KEY);
+					if (lpProp && lpMessageCache)
+						lpMessageCache->Add(sEntryID, lpProp->Value.bin, sopt.force_utf8, strMessage);
 				}
 			}
 
@@ -5781,6 +5892,42 @@ exit:
 	return hr;
 }
 
+/**
+ * Limit the SEARCH result to the given messages
+ *
+ * Sequence and UID sets in the top-level AND of a SEARCH are applied to the
+ * result in the gateway, instead of being sent to the server as one
+ * restriction per message.
+ *
+ * @param[in] lstMails message numbers from a sequence or UID set
+ * @param[in,out] setMailFilter messages allowed in the result
+ * @param[in,out] bMailFilter false if setMailFilter has not been set yet
+ */
+static void FilterMails(const list<ULONG> &lstMails, set<ULONG> &setMailFilter, bool &bMailFilter)
+{
+	set<ULONG> setMails(lstMails.begin(), lstMails.end());
+
+	if (bMailFilter) {
+		set<ULONG> setBoth;
+
+		set_intersection(setMailFilter.begin(), setMailFilter.end(), setMails.begin(), setMails.end(), inserter(setBoth, setBoth.begin()));
+		setMails.swap(setBoth);
+	}
+	setMailFilter.swap(setMails);
+	bMailFilter = true;
+}
+
+/**
+ * Make a restriction that matches every message
+ */
+static void SetSearchAll(LPSRestriction lpRestriction)
+{
+	lpRestriction->rt = RES_EXIST;
+	lpRestriction->res.resExist.ulReserved1 = 0;
+	lpRestriction->res.resExist.ulReserved2 = 0;
+	lpRestriction->res.resExist.ulPropTag = PR_ENTRYID;
+}
+
 /** 
  * Implements the SEARCH command
  * 
@@ -5813,8 +5960,12 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 	map<unsigned int, unsigned int> mapUIDs;
 	map<unsigned int, unsigned int>::const_iterator iterUID;
 	int n = 0;
+	set<ULONG> setMailFilter;
+	bool bMailFilter = false;
+	bool bTopLevel;
 	SRestriction sAndRestriction;
 	SRestriction sPropertyRestriction;
+	LPSRestriction lpQueryRestrict = NULL;
 	
 	if (strCurrentFolder.empty() || !lpSession) {
 		hr = MAPI_E_CALL_FAILED;
@@ -5917,6 +6068,9 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 		strSearchCriterium = lstSearchCriteria[ulStartCriteria];
 		ToUpper(strSearchCriterium);
 
+		// not nested in an OR or NOT
+		bTopLevel = lstRestrictions.size() == 1;
+
 		if (lstRestrictions.size() == 1) {
 			hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (LPVOID *) &lpRestriction);
 			if (hr != hrSuccess)
@@ -5938,6 +6092,13 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 			if (hr != hrSuccess)
 				goto exit;
 
+			if (bTopLevel) {
+				FilterMails(lstMails, setMailFilter, bMailFilter);
+				SetSearchAll(lpRestriction);
+				++ulStartCriteria;
+				continue;
+			}
+
 			hr = MAPIAllocateMore(sizeof(SRestriction) * lstMails.size(), lpRootRestrict, (LPVOID *) &lpExtraRestriction);
 			if (hr != hrSuccess)
 				goto exit;
@@ -6551,31 +6712,6 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 				goto exit;
 			}
 
-			hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (LPVOID *) &lpExtraRestriction);
-			if (hr != hrSuccess)
-				goto exit;
-
-			lpRestriction->rt = RES_OR;
-			lpRestriction->res.resOr.cRes = 2;
-			lpRestriction->res.resOr.lpRes = lpExtraRestriction;
-			lpRestriction = lpExtraRestriction;
-
-			hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (LPVOID *) &lpExtraRestriction);
-			if (hr != hrSuccess)
-				goto exit;
-
-			lpRestriction[0].rt = RES_AND;
-			lpRestriction[0].res.resAnd.cRes = 2;
-			lpRestriction[0].res.resAnd.lpRes = lpExtraRestriction;
-			lpExtraRestriction[0].rt = RES_EXIST;
-			lpExtraRestriction[0].res.resExist.ulReserved1 = 0;
-			lpExtraRestriction[0].res.resExist.ulReserved2 = 0;
-			lpExtraRestriction[0].res.resExist.ulPropTag = PR_BODY;
-
-			hr = MAPIAllocateMore(sizeof(SPropValue), lpRootRestrict, (LPVOID *) &lpPropVal);
-			if (hr != hrSuccess)
-				goto exit;
-
 			if (iconv)
 				iconv->convert(lstSearchCriteria[ulStartCriteria+1]);
 
@@ -6584,46 +6720,37 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 			if (hr != hrSuccess)
 				goto exit;
 
-			lpExtraRestriction[1].rt = RES_CONTENT;
-			lpExtraRestriction[1].res.resContent.ulFuzzyLevel = lstSearchCriteria[ulStartCriteria+1].size() > 0 ? (FL_SUBSTRING | FL_IGNORECASE) : FL_FULLSTRING;
-			lpExtraRestriction[1].res.resContent.ulPropTag = PR_BODY;
 			memcpy(szBuffer, lstSearchCriteria[ulStartCriteria + 1].c_str(), lstSearchCriteria[ulStartCriteria + 1].size() + 1);
-			// @todo, unicode
-			lpPropVal->ulPropTag = PR_BODY_A;
-			lpPropVal->Value.lpszA = szBuffer;
-			lpExtraRestriction[1].res.resContent.lpProp = lpPropVal;
 
 			hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (LPVOID *) &lpExtraRestriction);
 			if (hr != hrSuccess)
 				goto exit;
 
-			lpRestriction[1].rt = RES_AND;
-			lpRestriction[1].res.resAnd.cRes = 2;
-			lpRestriction[1].res.resAnd.lpRes = lpExtraRestriction;
-			lpExtraRestriction[0].rt = RES_EXIST;
-			lpExtraRestriction[0].res.resExist.ulReserved1 = 0;
-			lpExtraRestriction[0].res.resExist.ulReserved2 = 0;
-			lpExtraRestriction[0].res.resExist.ulPropTag = PR_TRANSPORT_MESSAGE_HEADERS_A;
-
-			hr = MAPIAllocateMore(sizeof(SPropValue), lpRootRestrict, (LPVOID *) &lpPropVal);
+			hr = MAPIAllocateMore(sizeof(SPropValue) * 2, lpRootRestrict, (LPVOID *) &lpPropVal);
 			if (hr != hrSuccess)
 				goto exit;
 
-			if (iconv)
-				iconv->convert(lstSearchCriteria[ulStartCriteria+1]);
+			// Keep this a plain OR of content restrictions on the same term, so the
+			// server can answer it from the search index. A content restriction
+			// does not match when the property is missing, so no RES_EXIST is needed.
+			lpRestriction->rt = RES_OR;
+			lpRestriction->res.resOr.cRes = 2;
+			lpRestriction->res.resOr.lpRes = lpExtraRestriction;
 
-			hr = MAPIAllocateMore(lstSearchCriteria[ulStartCriteria + 1].size() + 1, lpRootRestrict,
-								  (LPVOID *) &szBuffer);
-			if (hr != hrSuccess)
-				goto exit;
+			// @todo, unicode
+			lpPropVal[0].ulPropTag = PR_BODY_A;
+			lpPropVal[0].Value.lpszA = szBuffer;
+			lpExtraRestriction[0].rt = RES_CONTENT;
+			lpExtraRestriction[0].res.resContent.ulFuzzyLevel = szBuffer[0] ? (FL_SUBSTRING | FL_IGNORECASE) : FL_FULLSTRING;
+			lpExtraRestriction[0].res.resContent.ulPropTag = PR_BODY;
+			lpExtraRestriction[0].res.resContent.lpProp = &lpPropVal[0];
 
+			lpPropVal[1].ulPropTag = PR_TRANSPORT_MESSAGE_HEADERS_A;
+			lpPropVal[1].Value.lpszA = szBuffer;
 			lpExtraRestriction[1].rt = RES_CONTENT;
-			lpExtraRestriction[1].res.resContent.ulFuzzyLevel = lstSearchCriteria[ulStartCriteria+1].size() > 0 ? (FL_SUBSTRING | FL_IGNORECASE) : FL_FULLSTRING;
+			lpExtraRestriction[1].res.resContent.ulFuzzyLevel = szBuffer[0] ? (FL_SUBSTRING | FL_IGNORECASE) : FL_FULLSTRING;
 			lpExtraRestriction[1].res.resContent.ulPropTag = PR_TRANSPORT_MESSAGE_HEADERS_A;
-			memcpy(szBuffer, lstSearchCriteria[ulStartCriteria + 1].c_str(), lstSearchCriteria[ulStartCriteria + 1].size() + 1);
-			lpPropVal->ulPropTag = PR_TRANSPORT_MESSAGE_HEADERS_A;
-			lpPropVal->Value.lpszA = szBuffer;
-			lpExtraRestriction[1].res.resContent.lpProp = lpPropVal;
+			lpExtraRestriction[1].res.resContent.lpProp = &lpPropVal[1];
 			ulStartCriteria += 2;
 			}
 		else if (strSearchCriterium.compare("TO") == 0 || strSearchCriterium.compare("CC") == 0 || strSearchCriterium.compare("BCC") == 0) {
@@ -6664,6 +6791,13 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 			if (hr != hrSuccess)
 				goto exit;
 
+			if (bTopLevel) {
+				FilterMails(lstMails, setMailFilter, bMailFilter);
+				SetSearchAll(lpRestriction);
+				ulStartCriteria += 2;
+				continue;
+			}
+
 			hr = MAPIAllocateMore(sizeof(SRestriction) * lstMails.size(), lpRootRestrict, (LPVOID *) &lpExtraRestriction);
 			if (hr != hrSuccess)
 				goto exit;
@@ -6876,22 +7010,36 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
 		lpRestriction->res.resExist.ulPropTag = PR_ENTRYID;
 		lstRestrictions.pop_back();
 	}
-		
-    // Wrap the resulting restriction (lpRootRestrict) in an AND:
-    // AND (lpRootRestrict, EXIST(PR_INSTANCE_KEY)) to make sure that the query
-    // will not be passed to the indexer
-    
-	sPropertyRestriction.rt = RES_EXIST;
-	sPropertyRestriction.res.resExist.ulPropTag = PR_INSTANCE_KEY;
-	
-	sAndRestriction.rt = RES_AND;
-	sAndRestriction.res.resAnd.cRes = 2;
-	if ((hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (void **)&sAndRestriction.res.resAnd.lpRes)) != hrSuccess)
+
+	// nothing can match anymore, don't bother the server
+	if (bMailFilter && setMailFilter.empty())
 		goto exit;
-	sAndRestriction.res.resAnd.lpRes[0] = sPropertyRestriction;
-	sAndRestriction.res.resAnd.lpRes[1] = *lpRootRestrict;
-		
-	hr = HrQueryAllRows(lpTable, (LPSPropTagArray) &spt, &sAndRestriction, NULL, 0, &lpRows);
+
+	/*
+	 * Content restrictions (BODY, SUBJECT, TEXT) in the top-level AND may be
+	 * answered by the server from the search index, the rest of the
+	 * restriction is then only evaluated for those matches. Index matches
+	 * are word based and can lag behind new mail, while IMAP requires
+	 * substring matches, so this is only done when enabled.
+	 */
+	lpQueryRestrict = lpRootRestrict;
+	if (!parseBool(lpConfig->GetSetting("imap_search_use_index"))) {
+		// Wrap the resulting restriction (lpRootRestrict) in an AND:
+		// AND (lpRootRestrict, EXIST(PR_INSTANCE_KEY)) to make sure that the query
+		// will not be passed to the indexer
+		sPropertyRestriction.rt = RES_EXIST;
+		sPropertyRestriction.res.resExist.ulPropTag = PR_INSTANCE_KEY;
+
+		sAndRestriction.rt = RES_AND;
+		sAndRestriction.res.resAnd.cRes = 2;
+		if ((hr = MAPIAllocateMore(sizeof(SRestriction) * 2, lpRootRestrict, (void **)&sAndRestriction.res.resAnd.lpRes)) != hrSuccess)
+			goto exit;
+		sAndRestriction.res.resAnd.lpRes[0] = sPropertyRestriction;
+		sAndRestriction.res.resAnd.lpRes[1] = *lpRootRestrict;
+		lpQueryRestrict = &sAndRestriction;
+	}
+
+	hr = HrQueryAllRows(lpTable, (LPSPropTagArray) &spt, lpQueryRestrict, NULL, 0, &lpRows);
 	if (hr != hrSuccess)
 		goto exit;
 
@@ -6904,6 +7052,8 @@ HRESULT IMAP::HrSearch(vector<string> &lstSearchCriteria, ULONG &ulStartCriteria
             // Found a match for a message that is not in our message list .. skip it
             continue;
         }
+        if (bMailFilter && setMailFilter.find(iterUID->second) == setMailFilter.end())
+            continue;
         
         lstMailnr.push_back(iterUID->second);
     }
@@ -253,6 +253,7 @@ private:
 
 	// vector of mails in the current folder. The index is used for mail number.
 	vector<SMail> lstFolderMailEIDs;
+	BinaryArray m_sFolderMailsEntryID;	/* PR_ENTRYID of the folder in lstFolderMailEIDs */
 	IMsgStore *lpStore;
 	IMsgStore *lpPublicStore;
 
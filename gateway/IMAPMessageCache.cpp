@@ -0,0 +1,173 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <zarafa/platform.h>
+#include <mapicode.h>
+#include <zarafa/ECConfig.h>
+#include <zarafa/stringutil.h>
+#include "IMAPMessageCache.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#undef THIS_FILE
+static const char THIS_FILE[] = __FILE__;
+#endif
+
+IMAPMessageCache *IMAPMessageCache::s_lpCache = NULL;
+
+/**
+ * Create the process wide message cache, if enabled in the configuration
+ *
+ * Must be called before any IMAP session is started.
+ */
+HRESULT IMAPMessageCache::StaticInit(ECConfig *lpConfig)
+{
+	size_t cbMax = atoui(lpConfig->GetSetting("imap_cache_size"));
+
+	if (s_lpCache != NULL)
+		return MAPI_E_CALL_FAILED;
+	if (cbMax > 0)
+		s_lpCache = new IMAPMessageCache(cbMax);
+	return hrSuccess;
+}
+
+HRESULT IMAPMessageCache::StaticDeinit(void)
+{
+	delete s_lpCache;
+	s_lpCache = NULL;
+	return hrSuccess;
+}
+
+/**
+ * @return the process wide message cache, or NULL when caching is disabled
+ */
+IMAPMessageCache *IMAPMessageCache::GetCache(void)
+{
+	return s_lpCache;
+}
+
+IMAPMessageCache::IMAPMessageCache(size_t cbMax) :
+	m_cbMax(cbMax), m_cbSize(0)
+{
+	pthread_mutex_init(&m_hMutex, NULL);
+}
+
+IMAPMessageCache::~IMAPMessageCache()
+{
+	pthread_mutex_destroy(&m_hMutex);
+}
+
+std::string IMAPMessageCache::GetKey(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8)
+{
+	std::string strKey;
+
+	// the entryid length makes the concatenation unambiguous
+	strKey.reserve(sizeof(ULONG) + sEntryID.cb + sChangeKey.cb + 1);
+	strKey.append(reinterpret_cast<const char *>(&sEntryID.cb), sizeof(ULONG));
+	strKey.append(reinterpret_cast<const char *>(sEntryID.lpb), sEntryID.cb);
+	strKey.append(reinterpret_cast<const char *>(sChangeKey.lpb), sChangeKey.cb);
+	// messages generated with imap_generate_utf8 differ
+	strKey.push_back(bUTF8 ? '\1' : '\0');
+	return strKey;
+}
+
+/**
+ * Get a generated message from the cache
+ *
+ * @param[in] sEntryID entryid of the message
+ * @param[in] sChangeKey PR_CHANGE_KEY of the message
+ * @param[in] bUTF8 message was generated with force_utf8
+ * @param[out] lpstrMessage the RFC822 message
+ *
+ * @retval MAPI_E_NOT_FOUND message (in this version) is not in the cache
+ */
+HRESULT IMAPMessageCache::Get(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8, std::string *lpstrMessage)
+{
+	HRESULT hr = hrSuccess;
+	std::map<std::string, CACHEITEM>::iterator iter;
+
+	if (sChangeKey.cb == 0)
+		return MAPI_E_NOT_FOUND;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iter = m_mapMessages.find(GetKey(sEntryID, sChangeKey, bUTF8));
+	if (iter == m_mapMessages.end()) {
+		hr = MAPI_E_NOT_FOUND;
+		goto exit;
+	}
+
+	m_lstLru.splice(m_lstLru.begin(), m_lstLru, iter->second.iterLru);
+	*lpstrMessage = iter->second.strMessage;
+
+exit:
+	pthread_mutex_unlock(&m_hMutex);
+	return hr;
+}
+
+/**
+ * Add a generated message to the cache
+ *
+ * Messages without a change key, or larger than a quarter of the cache,
+ * are not cached.
+ */
+void IMAPMessageCache::Add(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8, const std::string &strMessage)
+{
+	std::string strKey;
+	std::map<std::string, CACHEITEM>::iterator iter;
+
+	if (sChangeKey.cb == 0 || strMessage.size() > m_cbMax / 4)
+		return;
+
+	strKey = GetKey(sEntryID, sChangeKey, bUTF8);
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iter = m_mapMessages.find(strKey);
+	if (iter != m_mapMessages.end()) {
+		// another session generated it concurrently
+		m_lstLru.splice(m_lstLru.begin(), m_lstLru, iter->second.iterLru);
+		goto exit;
+	}
+
+	Evict(strMessage.size());
+
+	m_lstLru.push_front(strKey);
+	iter = m_mapMessages.insert(std::make_pair(strKey, CACHEITEM())).first;
+	iter->second.strMessage = strMessage;
+	iter->second.iterLru = m_lstLru.begin();
+	m_cbSize += strMessage.size();
+
+exit:
+	pthread_mutex_unlock(&m_hMutex);
+}
+
+/**
+ * Remove the least recently used messages until cbNeeded more bytes fit
+ *
+ * Must be called with m_hMutex locked.
+ */
+void IMAPMessageCache::Evict(size_t cbNeeded)
+{
+	while (!m_lstLru.empty() && m_cbSize + cbNeeded > m_cbMax) {
+		std::map<std::string, CACHEITEM>::iterator iter = m_mapMessages.find(m_lstLru.back());
+
+		m_cbSize -= iter->second.strMessage.size();
+		m_mapMessages.erase(iter);
+		m_lstLru.pop_back();
+	}
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef IMAPMESSAGECACHE_H
+#define IMAPMESSAGECACHE_H
+
+#include <zarafa/zcdefs.h>
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
+#include <mapidefs.h>
+
+class ECConfig;
+
+/**
+ * @ingroup gateway_imap
+ * @{
+ */
+
+/**
+ * Cache of RFC822 messages generated for IMAP FETCH commands
+ *
+ * Entries are keyed by the message entryid (which contains the store guid)
+ * and its PR_CHANGE_KEY, so a modified message is never served from the
+ * cache: its old version is simply not found anymore and is evicted when
+ * it falls off the end of the LRU list. The total size of the cached
+ * messages is bounded by the imap_cache_size setting.
+ *
+ * In the thread process model one cache is shared by all IMAP sessions,
+ * in the fork model every connection has its own.
+ */
+class IMAPMessageCache _zcp_final {
+public:
+	static HRESULT StaticInit(ECConfig *lpConfig);
+	static HRESULT StaticDeinit(void);
+	static IMAPMessageCache *GetCache(void);
+
+	IMAPMessageCache(size_t cbMax);
+	~IMAPMessageCache();
+
+	HRESULT Get(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8, std::string *lpstrMessage);
+	void Add(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8, const std::string &strMessage);
+
+private:
+	typedef struct {
+		std::string strMessage;
+		std::list<std::string>::iterator iterLru;
+	} CACHEITEM;
+
+	static std::string GetKey(const SBinary &sEntryID, const SBinary &sChangeKey, bool bUTF8);
+	void Evict(size_t cbNeeded);
+
+	size_t m_cbMax;
+
+	pthread_mutex_t m_hMutex;		// protects everything below
+	std::map<std::string, CACHEITEM> m_mapMessages;
+	std::list<std::string> m_lstLru;	// most recently used at the front
+	size_t m_cbSize;
+
+	static IMAPMessageCache *s_lpCache;
+};
+
+/** @} */
+#endif
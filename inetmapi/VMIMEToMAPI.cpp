@@ -68,6 +68,7 @@
 #include "ECMapiUtils.h"
 #include "ECVMIMEUtils.h"
 #include "outputStreamMAPIAdapter.h"
+#include "inputStreamFILEAdapter.h"
 
 // vcal support
 #include "ICalToMAPI.h"
@@ -78,6 +79,68 @@ static vmime::charset vtm_upgrade_charset(const vmime::charset &);
 
 static const char im_charset_unspec[] = "unspecified";
 
+/**
+ * Find the first occurrence of a string in a stream
+ *
+ * Only a small window of the stream is kept in memory.
+ *
+ * @param[in] vmInput	The stream to search
+ * @param[in] strNeedle	The string to find
+ *
+ * @return offset of the string in the stream, or std::string::npos when not found
+ */
+static string::size_type findInStream(vmime::ref<vmime::utility::seekableInputStream> vmInput, const std::string &strNeedle)
+{
+	char buffer[4096];
+	string strWindow;
+	string::size_type ulWindowOffset = 0;
+	string::size_type ulRead = 0;
+	string::size_type pos = 0;
+
+	vmInput->reset();
+	while (!vmInput->eof()) {
+		ulRead = vmInput->read(buffer, sizeof(buffer));
+		if (ulRead == 0)
+			break;
+		strWindow.append(buffer, ulRead);
+
+		pos = strWindow.find(strNeedle);
+		if (pos != string::npos)
+			return ulWindowOffset + pos;
+
+		// keep the tail, the string may start at the end of this block
+		if (strWindow.size() >= strNeedle.size()) {
+			ulWindowOffset += strWindow.size() - strNeedle.size() + 1;
+			strWindow.erase(0, strWindow.size() - strNeedle.size() + 1);
+		}
+	}
+
+	return string::npos;
+}
+
+/**
+ * Copy part of a stream to a vmime output stream in small blocks
+ *
+ * @param[in] vmInput	The stream to copy from
+ * @param[in] start		Offset in the stream to start copying
+ * @param[in] length	Number of bytes to copy, less when the stream ends earlier
+ * @param[out] os		The stream to copy to
+ */
+static void copyStreamRange(vmime::ref<vmime::utility::seekableInputStream> vmInput, string::size_type start, string::size_type length, vmime::utility::outputStream &os)
+{
+	char buffer[4096];
+	string::size_type ulRead = 0;
+
+	vmInput->seek(start);
+	while (length > 0 && !vmInput->eof()) {
+		ulRead = vmInput->read(buffer, min(length, (string::size_type)sizeof(buffer)));
+		if (ulRead == 0)
+			break;
+		os.write(buffer, ulRead);
+		length -= ulRead;
+	}
+}
+
 /**
  * VMIMEToMAPI default constructor
  *
@@ -138,11 +201,12 @@ VMIMEToMAPI::~VMIMEToMAPI()
  */
 HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string *lpEnvelope, std::string *lpBody, std::string *lpBodyStructure)
 {
+	vmime::ref<vmime::utility::seekableInputStream> vmInput = vmime::create<vmime::utility::inputStreamStringAdapter>(input);
 	vmime::ref<vmime::message> vmMessage = vmime::create<vmime::message>();
 	vmMessage->parse(input);
 
 	if (lpBody || lpBodyStructure)
-		messagePartToStructure(input, vmMessage, lpBody, lpBodyStructure);
+		messagePartToStructure(vmInput, vmMessage, lpBody, lpBodyStructure);
 
 	if (lpEnvelope)
 		*lpEnvelope = createIMAPEnvelope(vmMessage);
@@ -150,6 +214,36 @@ HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string
 	return hrSuccess;
 }
 
+/**
+ * Convert an RFC822 mail in memory to an IMessage MAPI object.
+ *
+ * @param[in]	input	std::string containing the RFC822 mail.
+ * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
+ * @return		MAPI error code.
+ */
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage)
+{
+	return convertVMIMEToMAPI(vmime::create<vmime::utility::inputStreamStringAdapter>(input), input.size(), lpMessage);
+}
+
+/**
+ * Convert an RFC822 mail in a file to an IMessage MAPI object.
+ *
+ * The file is never read into memory as a whole: vmime keeps the
+ * offsets of the body parts, and attachment data is decoded from
+ * the file straight into the attachment streams.
+ *
+ * @param[in]	fpInput	Seekable file containing the RFC822 mail.
+ * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
+ * @return		MAPI error code.
+ */
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(FILE *fpInput, IMessage *lpMessage)
+{
+	vmime::ref<inputStreamFILEAdapter> vmInput = vmime::create<inputStreamFILEAdapter>(fpInput);
+
+	return convertVMIMEToMAPI(vmInput, vmInput->getSize(), lpMessage);
+}
+
 /** 
  * Entry point for the conversion from RFC822 mail to IMessage MAPI object.
  *
@@ -159,12 +253,13 @@ HRESULT VMIMEToMAPI::createIMAPProperties(const std::string &input, std::string
  * fillMAPIMail. Afterwards it may handle signed messages, and set an
  * extra flag when all attachments were marked hidden.
  *
- * @param[in]	input	std::string containing the RFC822 mail.
+ * @param[in]	vmInput	Seekable stream containing the RFC822 mail.
+ * @param[in]	ulSize	Size of the mail in vmInput.
  * @param[out]	lpMessage	Pointer to a message which was already created on a IMAPIFolder.
  * @return		MAPI error code.
  * @retval		MAPI_E_CALL_FAILED	Caught an exception, which breaks the conversion.
  */
-HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage) {
+HRESULT VMIMEToMAPI::convertVMIMEToMAPI(vmime::ref<vmime::utility::seekableInputStream> vmInput, string::size_type ulSize, IMessage *lpMessage) {
 	HRESULT hr = hrSuccess;
 	// signature variables
 	ULONG ulAttNr;
@@ -183,15 +278,18 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 			m_mailState.reset();
 
 		// get raw headers
-		posHeaderEnd = input.find("\r\n\r\n");
+		posHeaderEnd = findInStream(vmInput, "\r\n\r\n");
 		if (posHeaderEnd == std::string::npos) {
 			// input was not rfc compliant, try unix enters
-			posHeaderEnd = input.find("\n\n");
+			posHeaderEnd = findInStream(vmInput, "\n\n");
 			bUnix = true;
 		}
 		if (posHeaderEnd != std::string::npos) {
 			SPropValue sPropHeaders;
-			std::string strHeaders = input.substr(0, posHeaderEnd);
+			std::string strHeaders;
+			vmime::utility::outputStreamStringAdapter osHeaders(strHeaders);
+
+			copyStreamRange(vmInput, 0, posHeaderEnd, osHeaders);
 
 			// make sure we have us-ascii headers
 			if (bUnix)
@@ -203,13 +301,14 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 			HrSetOneProp(lpMessage, &sPropHeaders);
 		}
 
-		// turn buffer into a message
+		// turn stream into a message; body contents stay in the stream until extracted
 		vmime::ref<vmime::message> vmMessage = vmime::create<vmime::message>();
-		vmMessage->parse(input);
+		vmInput->reset();
+		vmMessage->parse(vmInput, ulSize);
 
 		// save imap data first, seems vmMessage may be altered in the rest of the code.
 		if (m_dopt.add_imap_data)
-			createIMAPBody(input, vmMessage, lpMessage);
+			createIMAPBody(vmInput, ulSize, vmMessage, lpMessage);
 
 		hr = fillMAPIMail(vmMessage, lpMessage);
 		if (hr != hrSuccess)
@@ -254,9 +353,8 @@ HRESULT VMIMEToMAPI::convertVMIMEToMAPI(const string &input, IMessage *lpMessage
 
 			// find the original received body
 			// vmime re-generates different headers and spacings, so we can't use this.
-			if (posHeaderEnd != string::npos) {
-				os.write(input.c_str() + posHeaderEnd, input.size() - posHeaderEnd);
-			}
+			if (posHeaderEnd != string::npos)
+				copyStreamRange(vmInput, posHeaderEnd, ulSize - posHeaderEnd, os);
 
 			hr = lpStream->Commit(0);
 			if (hr != hrSuccess)
@@ -3531,45 +3629,64 @@ std::string VMIMEToMAPI::createIMAPEnvelope(vmime::ref<vmime::message> vmMessage
  * Store the complete received email in a hidden property and the size
  * of that property too, for RFC822.SIZE requests.
  * 
- * @param[in] input the received email
+ * @param[in] vmInput the received email
+ * @param[in] ulSize size of the received email
  * @param[in] lpMessage message to store the data in
  * 
  * @return MAPI error code
  */
-HRESULT VMIMEToMAPI::createIMAPBody(const string &input, vmime::ref<vmime::message> vmMessage, IMessage* lpMessage)
+HRESULT VMIMEToMAPI::createIMAPBody(vmime::ref<vmime::utility::seekableInputStream> vmInput, string::size_type ulSize, vmime::ref<vmime::message> vmMessage, IMessage* lpMessage)
 {
-	SPropValue sProps[4];
+	HRESULT hr = hrSuccess;
+	SPropValue sProps[3];
 	string strBody;
 	string strBodyStructure;
+	IStream *lpStream = NULL;
 
-	messagePartToStructure(input, vmMessage, &strBody, &strBodyStructure);
+	messagePartToStructure(vmInput, vmMessage, &strBody, &strBodyStructure);
+
+	// copy the email in blocks, rather than setting it as one property value
+	hr = lpMessage->OpenProperty(PR_EC_IMAP_EMAIL, &IID_IStream, STGM_WRITE|STGM_TRANSACTED, MAPI_CREATE|MAPI_MODIFY, (LPUNKNOWN *)&lpStream);
+	if (hr != hrSuccess)
+		goto exit;
+
+	{
+		outputStreamMAPIAdapter os(lpStream);
+		copyStreamRange(vmInput, 0, ulSize, os);
+	}
+
+	hr = lpStream->Commit(0);
+	if (hr != hrSuccess)
+		goto exit;
 
 	sProps[0].ulPropTag = PR_EC_IMAP_EMAIL_SIZE;
-	sProps[0].Value.ul = input.length();
+	sProps[0].Value.ul = ulSize;
+
+	sProps[1].ulPropTag = PR_EC_IMAP_BODY;
+	sProps[1].Value.lpszA = (char*)strBody.c_str();
 
-	sProps[1].ulPropTag = PR_EC_IMAP_EMAIL;
-	sProps[1].Value.bin.lpb = (BYTE*)input.c_str();
-	sProps[1].Value.bin.cb = input.length();
+	sProps[2].ulPropTag = PR_EC_IMAP_BODYSTRUCTURE;
+	sProps[2].Value.lpszA = (char*)strBodyStructure.c_str();
+	hr = lpMessage->SetProps(3, sProps, NULL);
 
-	sProps[2].ulPropTag = PR_EC_IMAP_BODY;
-	sProps[2].Value.lpszA = (char*)strBody.c_str();
+exit:
+	if (lpStream)
+		lpStream->Release();
 
-	sProps[3].ulPropTag = PR_EC_IMAP_BODYSTRUCTURE;
-	sProps[3].Value.lpszA = (char*)strBodyStructure.c_str();
-	return lpMessage->SetProps(4, sProps, NULL);
+	return hr;
 }
 
 /** 
  * Convert a vmime message to a 
  * 
- * @param[in] input The original email
+ * @param[in] vmInput The original email
  * @param[in] vmBodyPart Any message or body part to convert
  * @param[out] lpSimple BODY result
  * @param[out] lpExtended BODYSTRUCTURE result
  * 
  * @return always success
  */
-HRESULT VMIMEToMAPI::messagePartToStructure(const string &input, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended)
+HRESULT VMIMEToMAPI::messagePartToStructure(vmime::ref<vmime::utility::seekableInputStream> vmInput, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended)
 {
 	HRESULT hr = hrSuccess;
 	list<string> lBody;
@@ -3598,7 +3715,7 @@ HRESULT VMIMEToMAPI::messagePartToStructure(const string &input, vmime::ref<vmim
 			string strBody;
 			string strBodyStructure;
 			for (int i = 0; i < vmBodyPart->getBody()->getPartCount(); ++i) {
-				messagePartToStructure(input, vmBodyPart->getBody()->getPartAt(i), &strBody, &strBodyStructure);
+				messagePartToStructure(vmInput, vmBodyPart->getBody()->getPartAt(i), &strBody, &strBodyStructure);
 				lBody.push_back(strBody);
 				lBodyStructure.push_back(strBodyStructure);
 				strBody.clear();
@@ -3633,7 +3750,7 @@ HRESULT VMIMEToMAPI::messagePartToStructure(const string &input, vmime::ref<vmim
 				*lpExtended = "(" + boost::algorithm::join(lBodyStructure, " ") + ")";
 		} else {
 			// just one part
-			bodyPartToStructure(input, vmBodyPart, lpSimple, lpExtended);
+			bodyPartToStructure(vmInput, vmBodyPart, lpSimple, lpExtended);
 		}
 	}
 	catch (vmime::exception &e) {
@@ -3649,14 +3766,14 @@ HRESULT VMIMEToMAPI::messagePartToStructure(const string &input, vmime::ref<vmim
  * Convert a non-multipart body part to an IMAP BODY and BODYSTRUCTURE
  * string.
  * 
- * @param[in] input The original email
+ * @param[in] vmInput The original email
  * @param[in] vmBodyPart the bodyPart to convert
  * @param[out] lpSimple BODY result
  * @param[out] lpExtended BODYSTRUCTURE result
  * 
  * @return always success
  */
-HRESULT VMIMEToMAPI::bodyPartToStructure(const string &input, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended)
+HRESULT VMIMEToMAPI::bodyPartToStructure(vmime::ref<vmime::utility::seekableInputStream> vmInput, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended)
 {
 	string strPart;
 	list<string> lBody;
@@ -3717,7 +3834,7 @@ HRESULT VMIMEToMAPI::bodyPartToStructure(const string &input, vmime::ref<vmime::
 		lBody.push_back(buffer);
 
 		// body part number of lines
-		buffer = stringify(countBodyLines(input, vmBodyPart->getBody()->getParsedOffset(), vmBodyPart->getBody()->getParsedLength()));
+		buffer = stringify(countBodyLines(vmInput, vmBodyPart->getBody()->getParsedOffset(), vmBodyPart->getBody()->getParsedLength()));
 		lBody.push_back(buffer);
 	} else {
 		// attachment: size only
@@ -3850,24 +3967,28 @@ std::string VMIMEToMAPI::parameterizedFieldToStructure(vmime::ref<vmime::paramet
  * Return the number of lines in a string, with defined start and
  * length.
  * 
- * @param[in] input count number of \n chars in this string
- * @param[in] start start from this point in input
+ * @param[in] vmInput count number of \n chars in this stream
+ * @param[in] start start from this point in vmInput
  * @param[in] length until the end, but no further than this length
  * 
  * @return number of lines
  */
-std::string::size_type VMIMEToMAPI::countBodyLines(const std::string &input, std::string::size_type start, std::string::size_type length)
+std::string::size_type VMIMEToMAPI::countBodyLines(vmime::ref<vmime::utility::seekableInputStream> vmInput, std::string::size_type start, std::string::size_type length)
 {
+	char buffer[4096];
 	string::size_type lines = 0;
-	string::size_type pos = start;
-
-	while (true) {
-		pos = input.find_first_of('\n', pos);
-		if (pos == string::npos || pos > start+length)
+	string::size_type ulRead = 0;
+	// a \n directly after the body is counted too
+	string::size_type remaining = length + 1;
+
+	vmInput->seek(start);
+	while (remaining > 0 && !vmInput->eof()) {
+		ulRead = vmInput->read(buffer, min(remaining, (string::size_type)sizeof(buffer)));
+		if (ulRead == 0)
 			break;
-		++pos;
-		++lines;
-	} 
+		lines += count(buffer, buffer + ulRead, '\n');
+		remaining -= ulRead;
+	}
 
 	return lines;
 }
@@ -19,6 +19,7 @@
 #define VMIMETOMAPI
 
 #include <vmime/vmime.hpp>
+#include <cstdio>
 #include <list>
 #include <mapix.h>
 #include <mapidefs.h>
@@ -65,6 +66,7 @@ public:
 	virtual	~VMIMEToMAPI();
 
 	HRESULT convertVMIMEToMAPI(const std::string &input, IMessage *lpMessage);
+	HRESULT convertVMIMEToMAPI(FILE *fpInput, IMessage *lpMessage);
 	HRESULT createIMAPProperties(const std::string &input, std::string *lpEnvelope, std::string *lpBody, std::string *lpBodyStructure);
 
 private:
@@ -75,6 +77,7 @@ private:
 	sMailState m_mailState;
 	convert_context m_converter;
 
+	HRESULT convertVMIMEToMAPI(vmime::ref<vmime::utility::seekableInputStream> vmInput, std::string::size_type ulSize, IMessage *lpMessage);
 	HRESULT fillMAPIMail(vmime::ref<vmime::message> vmMessage, IMessage *lpMessage);
 	HRESULT dissect_body(vmime::ref<vmime::header> vmHeader, vmime::ref<vmime::body> vmBody, IMessage *lpMessage, bool filterDouble = false, bool appendBody = false);
 	void dissect_message(vmime::ref<vmime::body>, IMessage *);
@@ -107,13 +110,13 @@ private:
 	HRESULT createIMAPEnvelope(vmime::ref<vmime::message> vmMessage, IMessage* lpMessage);
 	std::string createIMAPEnvelope(vmime::ref<vmime::message> vmMessage);
 
-	HRESULT createIMAPBody(const std::string &input, vmime::ref<vmime::message> vmMessage, IMessage* lpMessage);
+	HRESULT createIMAPBody(vmime::ref<vmime::utility::seekableInputStream> vmInput, std::string::size_type ulSize, vmime::ref<vmime::message> vmMessage, IMessage* lpMessage);
 
-	HRESULT messagePartToStructure(const std::string &input, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended);
-	HRESULT bodyPartToStructure(const std::string &input, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended);
+	HRESULT messagePartToStructure(vmime::ref<vmime::utility::seekableInputStream> vmInput, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended);
+	HRESULT bodyPartToStructure(vmime::ref<vmime::utility::seekableInputStream> vmInput, vmime::ref<vmime::bodyPart> vmBodyPart, std::string *lpSimple, std::string *lpExtended);
 	std::string getStructureExtendedFields(vmime::ref<vmime::header> vmHeaderPart);
 	std::string parameterizedFieldToStructure(vmime::ref<vmime::parameterizedHeaderField> vmParamField);
-	std::string::size_type countBodyLines(const std::string &input, std::string::size_type start, std::string::size_type length);
+	std::string::size_type countBodyLines(vmime::ref<vmime::utility::seekableInputStream> vmInput, std::string::size_type start, std::string::size_type length);
 };
 
 #endif
@@ -21,6 +21,7 @@
 /* WARNING */
 /* mapidefs.h may not be included _before_ any vmime include! */
 
+#include <cstdio>
 #include <mapix.h>
 #include <mapidefs.h>
 #include <vector>
@@ -74,6 +75,9 @@ INETMAPI_API ECSender* CreateSender(ECLogger *lpLogger, const std::string &smtp,
 // Read char Buffer and set properties on open lpMessage object
 INETMAPI_API HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore, IAddrBook *lpAddrBook, IMessage *lpMessage, const std::string &input, delivery_options dopt, ECLogger *lpLogger = NULL);
 
+// Read a seekable file and set properties on open lpMessage object; attachments are streamed from the file
+INETMAPI_API HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore, IAddrBook *lpAddrBook, IMessage *lpMessage, FILE *fpInput, delivery_options dopt, ECLogger *lpLogger = NULL);
+
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 // Use this one for retrieving messages not in outgoing que, they already have PR_SENDER_EMAIL/NAME
 // This can be used in making pop3 / imap server
@@ -164,6 +164,32 @@ INETMAPI_API HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore, IA
 	return hr;
 }
 
+// parse rfc822 input from a seekable file, and set props in lpMessage
+INETMAPI_API HRESULT IMToMAPI(IMAPISession *lpSession, IMsgStore *lpMsgStore, IAddrBook *lpAddrBook, IMessage *lpMessage, FILE *fpInput, delivery_options dopt, ECLogger *lpLogger)
+{
+	HRESULT hr = hrSuccess;
+	VMIMEToMAPI *VMToM = NULL;
+
+	// Sanitize options
+	if(!ValidateCharset(dopt.default_charset)) {
+		const char *charset = "iso-8859-15";
+		if(lpLogger)
+			lpLogger->Log(EC_LOGLEVEL_WARNING, "Configured default_charset '%s' is invalid. Reverting to '%s'", dopt.default_charset, charset);
+		dopt.default_charset = charset;
+	}
+
+	VMToM = new VMIMEToMAPI(lpAddrBook, lpLogger, dopt);
+
+	InitializeVMime();
+
+	// fill mapi object from file, attachment data is not kept in memory
+	hr = VMToM->convertVMIMEToMAPI(fpInput, lpMessage);
+
+	delete VMToM;
+
+	return hr;
+}
+
 // Read properties from lpMessage object and fill a buffer with internet rfc822 format message
 INETMAPI_API HRESULT IMToINet(IMAPISession *lpSession, IAddrBook *lpAddrBook, IMessage *lpMessage, char** lppbuf, sending_options sopt, ECLogger *lpLogger)
 {
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <zarafa/platform.h>
+
+// Damn windows header defines max which break C++ header files
+#undef max
+
+#include <sys/stat.h>
+#include "inputStreamFILEAdapter.h"
+
+inputStreamFILEAdapter::inputStreamFILEAdapter(FILE *fp)
+{
+	this->fp = fp;
+}
+
+inputStreamFILEAdapter::~inputStreamFILEAdapter()
+{
+}
+
+vmime::utility::stream::size_type inputStreamFILEAdapter::read(value_type *data, const size_type count)
+{
+	return fread(data, 1, count, fp);
+}
+
+vmime::utility::stream::size_type inputStreamFILEAdapter::skip(const size_type count)
+{
+	off_t before = ftello(fp);
+	off_t after = before;
+
+	if (fseeko(fp, 0, SEEK_END) == 0)
+		after = ftello(fp);
+	if (after - before > (off_t)count)
+		after = before + count;
+	fseeko(fp, after, SEEK_SET);
+
+	return after - before;
+}
+
+void inputStreamFILEAdapter::reset()
+{
+	rewind(fp);
+}
+
+bool inputStreamFILEAdapter::eof() const
+{
+	return feof(fp);
+}
+
+vmime::utility::stream::size_type inputStreamFILEAdapter::getPosition() const
+{
+	return ftello(fp);
+}
+
+void inputStreamFILEAdapter::seek(const size_type pos)
+{
+	fseeko(fp, pos, SEEK_SET);
+}
+
+/**
+ * Get the total size of the file, without moving the read position
+ */
+vmime::utility::stream::size_type inputStreamFILEAdapter::getSize() const
+{
+	struct stat st;
+
+	if (fstat(fileno(fp), &st) != 0)
+		return 0;
+	return st.st_size;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INPUT_STREAM_FILE_ADAPTER_H
+#define INPUT_STREAM_FILE_ADAPTER_H
+
+#include <cstdio>
+#include <vmime/utility/seekableInputStream.hpp>
+
+/**
+ * Seekable vmime input stream reading from a stdio file
+ *
+ * Because the stream is seekable, vmime does not copy body contents
+ * while parsing, but reads them from the file when they are extracted.
+ * The file is not closed by the adapter.
+ */
+class inputStreamFILEAdapter : public vmime::utility::seekableInputStream {
+public:
+	inputStreamFILEAdapter(FILE *fp);
+	virtual ~inputStreamFILEAdapter();
+
+	virtual size_type read(value_type* const data, const size_type count);
+	virtual size_type skip(const size_type count);
+	virtual void reset();
+	virtual bool eof() const;
+
+	virtual size_type getPosition() const;
+	virtual void seek(const size_type pos);
+
+	size_type getSize() const;
+
+private:
+	FILE *fp;
+};
+
+#endif
@@ -57,6 +57,19 @@ ldap_last_modification_attribute = ifelse(TYPE,`OPENLDAP',`modifyTimestamp',`uSN
 # Default ADS MaxPageSize is 1000.
 ldap_page_size = 1000
 
+# Size in bytes of the caches for name and DN lookups, used for logins.
+# Names which are not found in LDAP are cached as well. 0 disables the caches.
+ldap_cache_size = 1M
+
+# Time in seconds after which a cached lookup is done again. 0 disables the
+# name and DN caches. The entries of a changed user are removed when the
+# users are synchronized.
+ldap_cache_lifetime = 300
+
+# Time in seconds after which a name that was not found is looked up again.
+# 0 disables caching names that were not found.
+ldap_cache_negative_lifetime = 30
+
 ##########
 # Object settings
 
@@ -20,6 +20,20 @@
 
 #include <mapidefs.h>
 
+// Target folder of one copy made by IECSpooler::CopyMessageToFolders()
+typedef struct _ECDELIVERYTARGET {
+	ULONG			cbFolderEntryID;
+	LPENTRYID		lpFolderEntryID;
+	ULONG			cValues;		// properties to set on the copy
+	LPSPropValue	lpProps;
+	LPSPropTagArray	lpDelProps;		// properties to remove from the copy, may be NULL
+
+	// Output
+	HRESULT			hResult;
+	ULONG			cbEntryID;		// entryid of the copy, free with MAPIFreeBuffer()
+	LPENTRYID		lpEntryID;
+} ECDELIVERYTARGET;
+
 // This is our special spooler interface
 
 class IECSpooler : public IUnknown {
@@ -29,6 +43,9 @@ public:
 
 	// Removes a message from the master outgoing table
 	virtual HRESULT __stdcall DeleteFromMasterOutgoingTable(ULONG cbEntryID, const ENTRYID *lpEntryID, ULONG ulFlags) = 0;
+
+	// Copies a message into several folders on the server, setting per-target properties on each copy
+	virtual HRESULT __stdcall CopyMessageToFolders(ULONG cbEntryID, const ENTRYID *lpEntryID, ULONG cTargets, ECDELIVERYTARGET *lpTargets, ULONG ulFlags) = 0;
 };
 
 #endif
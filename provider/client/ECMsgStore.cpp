@@ -3272,6 +3272,17 @@ HRESULT ECMsgStore::DeleteFromMasterOutgoingTable(ULONG cbEntryId,
 	return this->lpTransport->HrFinishedMessage(cbEntryId, lpEntryId, EC_SUBMIT_MASTER | ulFlags);
 }
 
+HRESULT ECMsgStore::CopyMessageToFolders(ULONG cbEntryId,
+    const ENTRYID *lpEntryId, ULONG cTargets, ECDELIVERYTARGET *lpTargets,
+    ULONG ulFlags)
+{
+	// Check input/output variables
+	if (lpEntryId == NULL || (cTargets > 0 && lpTargets == NULL))
+		return MAPI_E_INVALID_PARAMETER;
+
+	return this->lpTransport->HrCopyMessageToFolders(cbEntryId, lpEntryId, cTargets, lpTargets, ulFlags);
+}
+
 
 //////////////////////////
 // MAPIOfflineMgr
@@ -4337,6 +4348,17 @@ HRESULT ECMsgStore::xECSpooler::DeleteFromMasterOutgoingTable(ULONG cbEntryID,
 	return hr;
 }
 
+HRESULT ECMsgStore::xECSpooler::CopyMessageToFolders(ULONG cbEntryID,
+    const ENTRYID *lpEntryID, ULONG cTargets, ECDELIVERYTARGET *lpTargets,
+    ULONG ulFlags)
+{
+	TRACE_MAPI(TRACE_ENTRY, "IECSpooler::CopyMessageToFolders", "targets=%u", cTargets);
+	METHOD_PROLOGUE_(ECMsgStore, ECSpooler);
+	HRESULT hr = pThis->CopyMessageToFolders(cbEntryID, lpEntryID, cTargets, lpTargets, ulFlags);
+	TRACE_MAPI(TRACE_RETURN, "IECSpooler::CopyMessageToFolders", "%s", GetMAPIErrorDescription(hr).c_str());
+	return hr;
+}
+
 /////////////////////////////////////////////////////
 // Interface IMAPIOfflineMgr
 //
@@ -102,6 +102,7 @@ public:
 	// IECSpooler
 	virtual HRESULT GetMasterOutgoingTable(ULONG ulFlags, IMAPITable ** lppOutgoingTable);
 	virtual HRESULT DeleteFromMasterOutgoingTable(ULONG cbEntryId, const ENTRYID *lpEntryId, ULONG ulFlags);
+	virtual HRESULT CopyMessageToFolders(ULONG cbEntryId, const ENTRYID *lpEntryId, ULONG cTargets, ECDELIVERYTARGET *lpTargets, ULONG ulFlags);
 
 	// IECServiceAdmin
 	virtual HRESULT CreateStore(ULONG ulStoreType, ULONG cbUserId, LPENTRYID lpUserId, ULONG* lpcbStoreId, LPENTRYID* lppStoreId, ULONG* lpcbRootId, LPENTRYID *lppRootId);
@@ -371,6 +372,7 @@ public:
 		// From IECSpooler
 		virtual HRESULT __stdcall GetMasterOutgoingTable(ULONG ulFlags, IMAPITable **lppOutgoingTable) _zcp_override;
 		virtual HRESULT __stdcall DeleteFromMasterOutgoingTable(ULONG cbEntryID, const ENTRYID *lpEntryID, ULONG ulFlags) _zcp_override;
+		virtual HRESULT __stdcall CopyMessageToFolders(ULONG cbEntryID, const ENTRYID *lpEntryID, ULONG cTargets, ECDELIVERYTARGET *lpTargets, ULONG ulFlags) _zcp_override;
 
 	} m_xECSpooler;
 
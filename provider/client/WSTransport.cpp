@@ -1767,6 +1767,89 @@ exit:
 	return hr;
 }
 
+HRESULT WSTransport::HrCopyMessageToFolders(ULONG cbEntryID,
+    const ENTRYID *lpEntryID, ULONG cTargets, ECDELIVERYTARGET *lpTargets,
+    ULONG ulFlags)
+{
+	HRESULT hr = hrSuccess;
+	ECRESULT er = erSuccess;
+	entryId		sEntryId = {0}; // Do not free
+	struct deliveryTargetArray sTargets = {0};
+	struct copyMessageToFoldersResponse sResponse = {{0}};
+	convert_context converter;
+	ULONG i, j;
+
+	if (lpEntryID == NULL || (cTargets > 0 && lpTargets == NULL))
+		return MAPI_E_INVALID_PARAMETER;
+
+	if ((m_ulServerCapabilities & ZARAFA_CAP_MULTI_COPY) == 0)
+		return MAPI_E_NO_SUPPORT;
+
+	LockSoap();
+
+	hr = CopyMAPIEntryIdToSOAPEntryId(cbEntryID, lpEntryID, &sEntryId, true);
+	if(hr != hrSuccess)
+		goto exit;
+
+	sTargets.__ptr = new deliveryTarget[cTargets];
+	memset(sTargets.__ptr, 0, sizeof(deliveryTarget) * cTargets);
+	sTargets.__size = cTargets;
+
+	for (i = 0; i < cTargets; ++i) {
+		hr = CopyMAPIEntryIdToSOAPEntryId(lpTargets[i].cbFolderEntryID, lpTargets[i].lpFolderEntryID, &sTargets.__ptr[i].sFolderId, true);
+		if (hr != hrSuccess)
+			goto exit;
+
+		sTargets.__ptr[i].sProps.__ptr = new propVal[lpTargets[i].cValues];
+		for (j = 0; j < lpTargets[i].cValues; ++j) {
+			hr = CopyMAPIPropValToSOAPPropVal(&sTargets.__ptr[i].sProps.__ptr[j], &lpTargets[i].lpProps[j], &converter);
+			if (hr != hrSuccess)
+				goto exit;
+			++sTargets.__ptr[i].sProps.__size;
+		}
+
+		if (lpTargets[i].lpDelProps) {
+			sTargets.__ptr[i].sDelProps.__size = lpTargets[i].lpDelProps->cValues;
+			sTargets.__ptr[i].sDelProps.__ptr = (unsigned int *)lpTargets[i].lpDelProps->aulPropTag;
+		}
+	}
+
+	START_SOAP_CALL
+	{
+		if(SOAP_OK != m_lpCmd->ns__copyMessageToFolders(m_ecSessionId, sEntryId, &sTargets, ulFlags, &sResponse))
+			er = ZARAFA_E_NETWORK_ERROR;
+		else
+			er = sResponse.er;
+	}
+	END_SOAP_CALL
+
+	if ((ULONG)sResponse.sResults.__size != cTargets) {
+		hr = MAPI_E_CALL_FAILED;
+		goto exit;
+	}
+
+	for (i = 0; i < cTargets; ++i) {
+		lpTargets[i].cbEntryID = 0;
+		lpTargets[i].lpEntryID = NULL;
+		lpTargets[i].hResult = ZarafaErrorToMAPIError(sResponse.sResults.__ptr[i].er, MAPI_E_NOT_FOUND);
+		if (lpTargets[i].hResult != hrSuccess)
+			continue;
+
+		lpTargets[i].hResult = CopySOAPEntryIdToMAPIEntryId(&sResponse.sResults.__ptr[i].sEntryId, &lpTargets[i].cbEntryID, &lpTargets[i].lpEntryID);
+	}
+
+exit:
+	UnLockSoap();
+
+	if (sTargets.__ptr) {
+		for (i = 0; i < cTargets; ++i)
+			FreePropValArray(&sTargets.__ptr[i].sProps);
+		delete [] sTargets.__ptr;
+	}
+
+	return hr;
+}
+
 HRESULT WSTransport::HrResolveStore(LPGUID lpGuid, ULONG *lpulUserID, ULONG* lpcbStoreID, LPENTRYID* lppStoreID)
 {
 	HRESULT hr = hrSuccess;
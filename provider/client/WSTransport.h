@@ -37,6 +37,7 @@
 #include "ECParentStorage.h"
 #include "ECABLogon.h"
 #include "ECICS.h"
+#include "IECSpooler.h"
 #include <ECCache.h>
 
 class utf8string;
@@ -148,6 +149,9 @@ public:
 	virtual HRESULT HrAbortSubmit(ULONG cbEntryID, LPENTRYID lpEntryID);
 	virtual HRESULT HrIsMessageInQueue(ULONG cbEntryID, LPENTRYID lpEntryID);
 
+	// Copy one message into several folders, see IECSpooler::CopyMessageToFolders()
+	virtual HRESULT HrCopyMessageToFolders(ULONG cbEntryID, const ENTRYID *lpEntryID, ULONG cTargets, ECDELIVERYTARGET *lpTargets, ULONG ulFlags);
+
 	// Get user information
 	virtual HRESULT HrResolveStore(LPGUID lpGuid, ULONG *lpulUserID, ULONG* lpcbStoreID, LPENTRYID* lppStoreID);
 	virtual HRESULT HrResolveUserStore(const utf8string &strUserName, ULONG ulFlags, ULONG *lpulUserID, ULONG* lpcbStoreID, LPENTRYID* lppStoreID, std::string *lpstrRedirServer = NULL);
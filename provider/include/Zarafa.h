@@ -351,9 +351,11 @@ typedef EID * PEID;
 #define ZARAFA_CAP_MAX_ABCHANGEID		0x2000
 // Client can read and write binary anonymous ab properties
 #define ZARAFA_CAP_EXTENDED_ANON		0x4000
+// Server can copy one message into several folders in one call
+#define ZARAFA_CAP_MULTI_COPY			0x8000
 
 // Do *not* use this from a client. This is just what the latest server supports.
-#define ZARAFA_LATEST_CAPABILITIES		ZARAFA_CAP_CRYPT | ZARAFA_CAP_LICENSE_SERVER | ZARAFA_CAP_LOADPROP_ENTRYID | ZARAFA_CAP_EXPORT_PROPTAG | ZARAFA_CAP_IMPERSONATION
+#define ZARAFA_LATEST_CAPABILITIES		ZARAFA_CAP_CRYPT | ZARAFA_CAP_LICENSE_SERVER | ZARAFA_CAP_LOADPROP_ENTRYID | ZARAFA_CAP_EXPORT_PROPTAG | ZARAFA_CAP_IMPERSONATION | ZARAFA_CAP_MULTI_COPY
 
 //
 // Logon flags, sent with ns__logon()
@@ -938,6 +938,32 @@ struct ns:resetFolderCountResponse {
 	unsigned int er;
 };
 
+struct deliveryTarget {
+	entryId sFolderId;
+	struct propValArray sProps;		/* set on the copy */
+	struct propTagArray sDelProps;	/* removed from the copy */
+};
+
+struct deliveryTargetArray {
+	int __size;
+	struct deliveryTarget *__ptr;
+};
+
+struct deliveryResult {
+	unsigned int er;
+	entryId sEntryId;				/* entryid of the copy, if er is 0 */
+};
+
+struct deliveryResultArray {
+	int __size;
+	struct deliveryResult *__ptr;
+};
+
+struct ns:copyMessageToFoldersResponse {
+	struct deliveryResultArray sResults;
+	unsigned int er;
+};
+
 //TableType flags for function ns__tableOpen
 #define TABLETYPE_MS				1	// MessageStore tables
 #define TABLETYPE_AB				2	// Addressbook tables
@@ -977,6 +1003,7 @@ int ns__loadObject(ULONG64 ulSessionId, entryId sEntryId, struct notifySubscribe
 int ns__createFolder(ULONG64 ulSessionId, entryId sParentId, entryId* lpsNewEntryId, unsigned int ulType, char *szName, char *szComment, bool fOpenIfExists, unsigned int ulSyncId, struct xsd__base64Binary sOrigSourceKey, struct ns:createFolderResponse *lpsCreateFolderResponse);
 int ns__deleteObjects(ULONG64 ulSessionId, unsigned int ulFlags, struct entryList *aMessages, unsigned int ulSyncId, unsigned int *result);
 int ns__copyObjects(ULONG64 ulSessionId, struct entryList *aMessages, entryId sDestFolderId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
+int ns__copyMessageToFolders(ULONG64 ulSessionId, entryId sEntryId, struct deliveryTargetArray *lpsTargets, unsigned int ulFlags, struct ns:copyMessageToFoldersResponse *lpsResponse);
 int ns__emptyFolder(ULONG64 ulSessionId, entryId sEntryId,  unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__deleteFolder(ULONG64 ulSessionId, entryId sEntryId, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
 int ns__copyFolder(ULONG64 ulSessionId, entryId sEntryId, entryId sDestFolderId, char *lpszNewFolderName, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result);
@@ -0,0 +1,624 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <zarafa/platform.h>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ECSerializer.h>
+#include <zarafa/ECConfig.h>
+#include <zarafa/ECLogger.h>
+#include <zarafa/stringutil.h>
+#include <zarafa/threadutil.h>
+#include "SOAPUtils.h"
+#include "ECAttachmentCache.h"
+#include "ECStatsCollector.h"
+
+// A single instance may use at most 1/ATTACHMENT_CACHE_OBJECT_RATIO of a cache tier
+#define ATTACHMENT_CACHE_OBJECT_RATIO 8
+
+static ECAttachmentCache *g_lpAttachmentCache = NULL;
+
+/**
+ * Serializer that passes all data on to another serializer, and keeps a
+ * copy of the written data as long as it does not exceed a maximum size.
+ */
+class ECCaptureSerializer _zcp_final : public ECSerializer {
+public:
+	ECCaptureSerializer(ECSerializer *lpSink, size_t cbMax) :
+		m_lpSink(lpSink), m_cbMax(cbMax), m_bOverflow(false)
+	{}
+
+	ECRESULT SetBuffer(void *lpBuffer) _zcp_override { return m_lpSink->SetBuffer(lpBuffer); }
+	ECRESULT Read(void *ptr, size_t size, size_t nmemb) _zcp_override { return m_lpSink->Read(ptr, size, nmemb); }
+	ECRESULT Skip(size_t size, size_t nmemb) _zcp_override { return m_lpSink->Skip(size, nmemb); }
+	ECRESULT Flush(void) _zcp_override { return m_lpSink->Flush(); }
+	ECRESULT Stat(ULONG *lpulRead, ULONG *lpulWritten) _zcp_override { return m_lpSink->Stat(lpulRead, lpulWritten); }
+
+	ECRESULT Write(const void *ptr, size_t size, size_t nmemb) _zcp_override
+	{
+		size_t cbData = size * nmemb;
+
+		if (!m_bOverflow) {
+			if (m_strData.size() + cbData > m_cbMax) {
+				m_bOverflow = true;
+				std::string().swap(m_strData);
+			} else {
+				m_strData.append(static_cast<const char *>(ptr), cbData);
+			}
+		}
+		return m_lpSink->Write(ptr, size, nmemb);
+	}
+
+	bool Captured() const { return !m_bOverflow; }
+	const std::string &GetData() const { return m_strData; }
+
+private:
+	ECSerializer *m_lpSink;
+	size_t m_cbMax;
+	bool m_bOverflow;
+	std::string m_strData;
+};
+
+ECAttachmentCache::ECAttachmentCache(const std::string &strPath, size_t cbDiskMax, size_t cbMemoryMax) :
+	m_strPath(strPath), m_cbDiskMax(cbDiskMax), m_cbMemoryMax(cbMemoryMax),
+	m_cbMemory(0), m_cbDisk(0)
+{
+	pthread_mutex_init(&m_hMutex, NULL);
+}
+
+ECAttachmentCache::~ECAttachmentCache()
+{
+	pthread_mutex_destroy(&m_hMutex);
+}
+
+/**
+ * Prepare the cache directory
+ *
+ * Files left behind by a previous run are removed, since instances may have
+ * been deleted while the server was not running.
+ *
+ * @return Zarafa error code
+ */
+ECRESULT ECAttachmentCache::Init()
+{
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+
+	if (m_cbDiskMax == 0)
+		return erSuccess;
+
+	if (CreatePath(m_strPath.c_str()) != 0) {
+		ec_log_err("Unable to create attachment cache directory \"%s\": %s", m_strPath.c_str(), strerror(errno));
+		return ZARAFA_E_NO_ACCESS;
+	}
+
+	dir = opendir(m_strPath.c_str());
+	if (dir == NULL) {
+		ec_log_err("Unable to open attachment cache directory \"%s\": %s", m_strPath.c_str(), strerror(errno));
+		return ZARAFA_E_NO_ACCESS;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		// Only touch files this cache could have created
+		if (strncmp(entry->d_name, "tmp.", 4) != 0 &&
+		    (entry->d_name[0] == '\0' || strspn(entry->d_name, "0123456789") != strlen(entry->d_name)))
+			continue;
+		if (unlinkat(dirfd(dir), entry->d_name, 0) != 0)
+			ec_log_warn("Unable to remove stale attachment cache file \"%s\": %s", entry->d_name, strerror(errno));
+	}
+	closedir(dir);
+
+	return erSuccess;
+}
+
+bool ECAttachmentCache::IsCacheable(size_t cbSize) const
+{
+	return (m_cbMemoryMax > 0 && cbSize <= m_cbMemoryMax / ATTACHMENT_CACHE_OBJECT_RATIO) ||
+	       (m_cbDiskMax > 0 && cbSize <= m_cbDiskMax / ATTACHMENT_CACHE_OBJECT_RATIO);
+}
+
+size_t ECAttachmentCache::GetMaxObjectSize() const
+{
+	return std::max(m_cbMemoryMax, m_cbDiskMax) / ATTACHMENT_CACHE_OBJECT_RATIO;
+}
+
+std::string ECAttachmentCache::GetFilename(ULONG ulInstanceId)
+{
+	return m_strPath + PATH_SEPARATOR + stringify(ulInstanceId);
+}
+
+bool ECAttachmentCache::Exists(ULONG ulInstanceId)
+{
+	scoped_lock lock(m_hMutex);
+
+	return m_mapMemory.find(ulInstanceId) != m_mapMemory.end() ||
+	       m_mapDisk.find(ulInstanceId) != m_mapDisk.end();
+}
+
+ECRESULT ECAttachmentCache::GetSize(ULONG ulInstanceId, size_t *lpiSize)
+{
+	scoped_lock lock(m_hMutex);
+	std::map<ULONG, MEMITEM>::const_iterator iterMemory;
+	std::map<ULONG, DISKITEM>::const_iterator iterDisk;
+
+	iterMemory = m_mapMemory.find(ulInstanceId);
+	if (iterMemory != m_mapMemory.end()) {
+		*lpiSize = iterMemory->second.strData.size();
+		return erSuccess;
+	}
+
+	iterDisk = m_mapDisk.find(ulInstanceId);
+	if (iterDisk != m_mapDisk.end()) {
+		*lpiSize = iterDisk->second.cbSize;
+		return erSuccess;
+	}
+
+	return ZARAFA_E_NOT_FOUND;
+}
+
+/**
+ * Get the data of a cached instance
+ *
+ * Instances found on disk are read without holding the cache lock; a file
+ * that is evicted meanwhile stays readable through the open descriptor. Disk
+ * hits are promoted to the memory tier.
+ *
+ * @param[in] ulInstanceId Instance to load
+ * @param[out] lpstrData Data of the instance
+ *
+ * @return Zarafa error code
+ * @retval ZARAFA_E_NOT_FOUND Instance is not in the cache
+ */
+ECRESULT ECAttachmentCache::LoadData(ULONG ulInstanceId, std::string *lpstrData)
+{
+	std::map<ULONG, MEMITEM>::iterator iterMemory;
+	std::map<ULONG, DISKITEM>::iterator iterDisk;
+	size_t cbSize = 0;
+	size_t cbRead = 0;
+	ssize_t ret = 0;
+	int fd = -1;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iterMemory = m_mapMemory.find(ulInstanceId);
+	if (iterMemory != m_mapMemory.end()) {
+		m_lstMemoryLru.splice(m_lstMemoryLru.begin(), m_lstMemoryLru, iterMemory->second.iterLru);
+		lpstrData->assign(iterMemory->second.strData);
+		pthread_mutex_unlock(&m_hMutex);
+		return erSuccess;
+	}
+
+	iterDisk = m_mapDisk.find(ulInstanceId);
+	if (iterDisk == m_mapDisk.end()) {
+		pthread_mutex_unlock(&m_hMutex);
+		return ZARAFA_E_NOT_FOUND;
+	}
+
+	m_lstDiskLru.splice(m_lstDiskLru.begin(), m_lstDiskLru, iterDisk->second.iterLru);
+	cbSize = iterDisk->second.cbSize;
+	fd = open(GetFilename(ulInstanceId).c_str(), O_RDONLY);
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (fd == -1) {
+		ec_log_warn("Unable to open cached attachment instance %u: %s", ulInstanceId, strerror(errno));
+		Remove(ulInstanceId);
+		return ZARAFA_E_NOT_FOUND;
+	}
+
+	lpstrData->resize(cbSize);
+	while (cbRead < cbSize) {
+		ret = read(fd, &(*lpstrData)[cbRead], cbSize - cbRead);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		cbRead += ret;
+	}
+	close(fd);
+
+	if (cbRead != cbSize) {
+		ec_log_warn("Short read on cached attachment instance %u, removing it from the cache", ulInstanceId);
+		lpstrData->clear();
+		Remove(ulInstanceId);
+		return ZARAFA_E_NOT_FOUND;
+	}
+
+	if (m_cbMemoryMax > 0 && cbSize <= m_cbMemoryMax / ATTACHMENT_CACHE_OBJECT_RATIO)
+		StoreMemory(ulInstanceId, reinterpret_cast<const unsigned char *>(lpstrData->data()), cbSize);
+
+	return erSuccess;
+}
+
+ECRESULT ECAttachmentCache::Load(struct soap *soap, ULONG ulInstanceId, size_t *lpiSize, unsigned char **lppData)
+{
+	ECRESULT er = erSuccess;
+	std::string strData;
+
+	er = LoadData(ulInstanceId, &strData);
+	if (er != erSuccess)
+		return er;
+
+	*lppData = s_alloc<unsigned char>(soap, strData.size());
+	memcpy(*lppData, strData.data(), strData.size());
+	*lpiSize = strData.size();
+
+	return erSuccess;
+}
+
+ECRESULT ECAttachmentCache::Load(ULONG ulInstanceId, size_t *lpiSize, ECSerializer *lpSink)
+{
+	ECRESULT er = erSuccess;
+	std::string strData;
+
+	er = LoadData(ulInstanceId, &strData);
+	if (er != erSuccess)
+		return er;
+
+	er = lpSink->Write(strData.data(), 1, strData.size());
+	if (er != erSuccess)
+		return er;
+
+	*lpiSize = strData.size();
+	return erSuccess;
+}
+
+/**
+ * Add instance data to the cache
+ *
+ * The data is added to each tier it fits in. Data that is too large for the
+ * cache is ignored.
+ *
+ * @param[in] ulInstanceId Instance the data belongs to
+ * @param[in] lpData Instance data
+ * @param[in] cbData Size of lpData
+ */
+void ECAttachmentCache::Store(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData)
+{
+	if (m_cbMemoryMax > 0 && cbData <= m_cbMemoryMax / ATTACHMENT_CACHE_OBJECT_RATIO)
+		StoreMemory(ulInstanceId, lpData, cbData);
+	if (m_cbDiskMax > 0 && cbData <= m_cbDiskMax / ATTACHMENT_CACHE_OBJECT_RATIO)
+		StoreDisk(ulInstanceId, lpData, cbData);
+}
+
+void ECAttachmentCache::StoreMemory(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData)
+{
+	scoped_lock lock(m_hMutex);
+	MEMITEM sItem;
+
+	if (m_mapMemory.find(ulInstanceId) != m_mapMemory.end())
+		return;
+
+	while (!m_lstMemoryLru.empty() && m_cbMemory + cbData > m_cbMemoryMax)
+		RemoveMemory(m_lstMemoryLru.back());
+
+	m_lstMemoryLru.push_front(ulInstanceId);
+	sItem.iterLru = m_lstMemoryLru.begin();
+	m_mapMemory[ulInstanceId] = sItem;
+	m_mapMemory[ulInstanceId].strData.assign(reinterpret_cast<const char *>(lpData), cbData);
+	m_cbMemory += cbData;
+}
+
+/**
+ * Write instance data to the disk tier
+ *
+ * The data is written to a temporary file without holding the cache lock.
+ * The rename to its final name and the index update are done together under
+ * the lock, so readers and Remove() never see a file that is not indexed.
+ */
+void ECAttachmentCache::StoreDisk(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData)
+{
+	std::string strTemplate = m_strPath + PATH_SEPARATOR + "tmp.XXXXXX";
+	std::vector<char> vFilename(strTemplate.begin(), strTemplate.end());
+	DISKITEM sItem;
+	size_t cbWritten = 0;
+	ssize_t ret = 0;
+	int fd = -1;
+
+	vFilename.push_back('\0');
+	fd = mkstemp(&vFilename[0]);
+	if (fd == -1) {
+		ec_log_warn("Unable to create attachment cache file in \"%s\": %s", m_strPath.c_str(), strerror(errno));
+		return;
+	}
+
+	while (cbWritten < cbData) {
+		ret = write(fd, lpData + cbWritten, cbData - cbWritten);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		cbWritten += ret;
+	}
+
+	if (close(fd) != 0 || cbWritten != cbData) {
+		ec_log_warn("Unable to write attachment cache file for instance %u: %s", ulInstanceId, strerror(errno));
+		unlink(&vFilename[0]);
+		return;
+	}
+
+	scoped_lock lock(m_hMutex);
+
+	if (m_mapDisk.find(ulInstanceId) != m_mapDisk.end()) {
+		unlink(&vFilename[0]);
+		return;
+	}
+
+	if (rename(&vFilename[0], GetFilename(ulInstanceId).c_str()) != 0) {
+		ec_log_warn("Unable to rename attachment cache file for instance %u: %s", ulInstanceId, strerror(errno));
+		unlink(&vFilename[0]);
+		return;
+	}
+
+	while (!m_lstDiskLru.empty() && m_cbDisk + cbData > m_cbDiskMax)
+		RemoveDisk(m_lstDiskLru.back());
+
+	m_lstDiskLru.push_front(ulInstanceId);
+	sItem.cbSize = cbData;
+	sItem.iterLru = m_lstDiskLru.begin();
+	m_mapDisk[ulInstanceId] = sItem;
+	m_cbDisk += cbData;
+}
+
+void ECAttachmentCache::Remove(ULONG ulInstanceId)
+{
+	scoped_lock lock(m_hMutex);
+
+	RemoveMemory(ulInstanceId);
+	RemoveDisk(ulInstanceId);
+}
+
+// Call with m_hMutex locked
+void ECAttachmentCache::RemoveMemory(ULONG ulInstanceId)
+{
+	std::map<ULONG, MEMITEM>::iterator iterMemory = m_mapMemory.find(ulInstanceId);
+
+	if (iterMemory == m_mapMemory.end())
+		return;
+
+	m_cbMemory -= iterMemory->second.strData.size();
+	m_lstMemoryLru.erase(iterMemory->second.iterLru);
+	m_mapMemory.erase(iterMemory);
+}
+
+// Call with m_hMutex locked
+void ECAttachmentCache::RemoveDisk(ULONG ulInstanceId)
+{
+	std::map<ULONG, DISKITEM>::iterator iterDisk = m_mapDisk.find(ulInstanceId);
+
+	if (iterDisk == m_mapDisk.end())
+		return;
+
+	if (unlink(GetFilename(ulInstanceId).c_str()) != 0 && errno != ENOENT)
+		ec_log_warn("Unable to remove attachment cache file for instance %u: %s", ulInstanceId, strerror(errno));
+
+	m_cbDisk -= iterDisk->second.cbSize;
+	m_lstDiskLru.erase(iterDisk->second.iterLru);
+	m_mapDisk.erase(iterDisk);
+}
+
+/**
+ * Create the attachment cache shared by all attachment storage objects,
+ * when enabled in the configuration.
+ *
+ * @param[in] lpConfig The server configuration object
+ *
+ * @return Zarafa error code
+ */
+ECRESULT ECCachedAttachment::StaticInit(ECConfig *lpConfig)
+{
+	ECRESULT er = erSuccess;
+	const char *lpszPath = lpConfig->GetSetting("attachment_cache_path");
+	size_t cbDiskMax = atoll(lpConfig->GetSetting("attachment_cache_size"));
+	size_t cbMemoryMax = atoll(lpConfig->GetSetting("attachment_cache_memory_size"));
+
+	if (cbDiskMax > 0 && (lpszPath == NULL || *lpszPath == '\0')) {
+		ec_log_warn("No attachment_cache_path set, disabling the attachment disk cache");
+		cbDiskMax = 0;
+	}
+	if (cbDiskMax > 0 && strcmp(lpszPath, lpConfig->GetSetting("attachment_path")) == 0) {
+		ec_log_err("attachment_cache_path must not be the same as attachment_path, disabling the attachment disk cache");
+		cbDiskMax = 0;
+	}
+	if (cbDiskMax == 0 && cbMemoryMax == 0)
+		return erSuccess;
+
+	g_lpAttachmentCache = new ECAttachmentCache(lpszPath == NULL ? "" : lpszPath, cbDiskMax, cbMemoryMax);
+	er = g_lpAttachmentCache->Init();
+	if (er != erSuccess) {
+		delete g_lpAttachmentCache;
+		g_lpAttachmentCache = NULL;
+		return er;
+	}
+
+	ec_log_info("Attachment cache enabled: %lu bytes on disk, %lu bytes in memory",
+		static_cast<unsigned long>(cbDiskMax), static_cast<unsigned long>(cbMemoryMax));
+	return erSuccess;
+}
+
+ECRESULT ECCachedAttachment::StaticDeinit(void)
+{
+	delete g_lpAttachmentCache;
+	g_lpAttachmentCache = NULL;
+	return erSuccess;
+}
+
+ECAttachmentCache *ECCachedAttachment::GetCache(void)
+{
+	return g_lpAttachmentCache;
+}
+
+ECCachedAttachment::ECCachedAttachment(ECDatabase *lpDatabase, ECAttachmentStorage *lpBackend, ECAttachmentCache *lpCache) :
+	ECAttachmentStorage(lpDatabase, 0), m_lpBackend(lpBackend), m_lpCache(lpCache),
+	m_bTransaction(false)
+{
+	m_lpBackend->AddRef();
+}
+
+ECCachedAttachment::~ECCachedAttachment()
+{
+	m_lpBackend->Release();
+}
+
+bool ECCachedAttachment::ExistAttachmentInstance(ULONG ulInstanceId)
+{
+	if (m_lpCache->Exists(ulInstanceId))
+		return true;
+	return m_lpBackend->ExistAttachmentInstance(ulInstanceId);
+}
+
+ECRESULT ECCachedAttachment::LoadAttachmentInstance(struct soap *soap, ULONG ulInstanceId, size_t *lpiSize, unsigned char **lppData)
+{
+	ECRESULT er = erSuccess;
+
+	if (m_lpCache->Load(soap, ulInstanceId, lpiSize, lppData) == erSuccess) {
+		g_lpStatsCollector->Increment(SCN_ATTACHMENT_CACHE_HITS);
+		return erSuccess;
+	}
+	g_lpStatsCollector->Increment(SCN_ATTACHMENT_CACHE_MISSES);
+
+	er = m_lpBackend->LoadAttachmentInstance(soap, ulInstanceId, lpiSize, lppData);
+	if (er != erSuccess)
+		return er;
+
+	if (m_lpCache->IsCacheable(*lpiSize))
+		m_lpCache->Store(ulInstanceId, *lppData, *lpiSize);
+	return erSuccess;
+}
+
+ECRESULT ECCachedAttachment::LoadAttachmentInstance(ULONG ulInstanceId, size_t *lpiSize, ECSerializer *lpSink)
+{
+	ECRESULT er = erSuccess;
+	ECCaptureSerializer sCapture(lpSink, m_lpCache->GetMaxObjectSize());
+
+	if (m_lpCache->Load(ulInstanceId, lpiSize, lpSink) == erSuccess) {
+		g_lpStatsCollector->Increment(SCN_ATTACHMENT_CACHE_HITS);
+		return erSuccess;
+	}
+	g_lpStatsCollector->Increment(SCN_ATTACHMENT_CACHE_MISSES);
+
+	er = m_lpBackend->LoadAttachmentInstance(ulInstanceId, lpiSize, &sCapture);
+	if (er != erSuccess)
+		return er;
+
+	if (sCapture.Captured())
+		m_lpCache->Store(ulInstanceId, reinterpret_cast<const unsigned char *>(sCapture.GetData().data()), sCapture.GetData().size());
+	return erSuccess;
+}
+
+ECRESULT ECCachedAttachment::SaveAttachmentInstance(ULONG ulInstanceId, ULONG ulPropId, size_t iSize, unsigned char *lpData)
+{
+	ECRESULT er = erSuccess;
+
+	er = m_lpBackend->SaveAttachmentInstance(ulInstanceId, ulPropId, iSize, lpData);
+	if (er != erSuccess)
+		return er;
+
+	if (m_bTransaction)
+		m_setNewAttachment.insert(ulInstanceId);
+	if (m_lpCache->IsCacheable(iSize))
+		m_lpCache->Store(ulInstanceId, lpData, iSize);
+	return erSuccess;
+}
+
+/**
+ * Save an instance from a serializer
+ *
+ * Instances small enough for the cache are read in full, so they can be
+ * written to both the real storage and the cache. Larger instances are
+ * streamed to the real storage directly.
+ */
+ECRESULT ECCachedAttachment::SaveAttachmentInstance(ULONG ulInstanceId, ULONG ulPropId, size_t iSize, ECSerializer *lpSource)
+{
+	ECRESULT er = erSuccess;
+	std::string strData;
+
+	if (!m_lpCache->IsCacheable(iSize))
+		return m_lpBackend->SaveAttachmentInstance(ulInstanceId, ulPropId, iSize, lpSource);
+
+	strData.resize(iSize);
+	if (iSize > 0) {
+		er = lpSource->Read(&strData[0], 1, iSize);
+		if (er != erSuccess)
+			return er;
+	}
+
+	return SaveAttachmentInstance(ulInstanceId, ulPropId, iSize, reinterpret_cast<unsigned char *>(iSize > 0 ? &strData[0] : NULL));
+}
+
+ECRESULT ECCachedAttachment::DeleteAttachmentInstances(const std::list<ULONG> &lstDeleteInstances, bool bReplace)
+{
+	std::list<ULONG>::const_iterator iterDel;
+
+	for (iterDel = lstDeleteInstances.begin(); iterDel != lstDeleteInstances.end(); ++iterDel)
+		m_lpCache->Remove(*iterDel);
+	return m_lpBackend->DeleteAttachmentInstances(lstDeleteInstances, bReplace);
+}
+
+ECRESULT ECCachedAttachment::DeleteAttachmentInstance(ULONG ulInstanceId, bool bReplace)
+{
+	m_lpCache->Remove(ulInstanceId);
+	return m_lpBackend->DeleteAttachmentInstance(ulInstanceId, bReplace);
+}
+
+/**
+ * Get the size of an instance
+ *
+ * The cache only knows the size. Whether the instance is compressed depends
+ * on how the real storage keeps it, so that question goes to the backend.
+ */
+ECRESULT ECCachedAttachment::GetSizeInstance(ULONG ulInstanceId, size_t *lpulSize, bool *lpbCompressed)
+{
+	if (lpbCompressed == NULL && m_lpCache->GetSize(ulInstanceId, lpulSize) == erSuccess)
+		return erSuccess;
+	return m_lpBackend->GetSizeInstance(ulInstanceId, lpulSize, lpbCompressed);
+}
+
+ECRESULT ECCachedAttachment::Begin()
+{
+	m_bTransaction = true;
+	m_setNewAttachment.clear();
+	return m_lpBackend->Begin();
+}
+
+ECRESULT ECCachedAttachment::Commit()
+{
+	m_bTransaction = false;
+	m_setNewAttachment.clear();
+	return m_lpBackend->Commit();
+}
+
+ECRESULT ECCachedAttachment::Rollback()
+{
+	std::set<ULONG>::const_iterator iterNew;
+
+	// The real storage removes the instances created in this transaction
+	for (iterNew = m_setNewAttachment.begin(); iterNew != m_setNewAttachment.end(); ++iterNew)
+		m_lpCache->Remove(*iterNew);
+
+	m_bTransaction = false;
+	m_setNewAttachment.clear();
+	return m_lpBackend->Rollback();
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EC_ATTACHMENT_CACHE
+#define EC_ATTACHMENT_CACHE
+
+#include <zarafa/zcdefs.h>
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include "ECAttachmentStorage.h"
+
+class ECConfig;
+class ECSerializer;
+
+/**
+ * Local cache of attachment instance data
+ *
+ * Keeps recently used single instances in memory and/or as files in a local
+ * directory, each tier being an LRU bounded by its total size. Instance ids
+ * are never reused for different data, so entries never go stale; they are
+ * only removed when the instance is deleted or when evicted.
+ *
+ * One cache is shared by all ECCachedAttachment objects of the server.
+ */
+class ECAttachmentCache _zcp_final {
+public:
+	ECAttachmentCache(const std::string &strPath, size_t cbDiskMax, size_t cbMemoryMax);
+	~ECAttachmentCache();
+
+	ECRESULT Init();
+
+	bool IsCacheable(size_t cbSize) const;
+	size_t GetMaxObjectSize() const;
+
+	bool Exists(ULONG ulInstanceId);
+	ECRESULT GetSize(ULONG ulInstanceId, size_t *lpiSize);
+	ECRESULT Load(struct soap *soap, ULONG ulInstanceId, size_t *lpiSize, unsigned char **lppData);
+	ECRESULT Load(ULONG ulInstanceId, size_t *lpiSize, ECSerializer *lpSink);
+	void Store(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData);
+	void Remove(ULONG ulInstanceId);
+
+private:
+	typedef struct {
+		std::string strData;
+		std::list<ULONG>::iterator iterLru;
+	} MEMITEM;
+
+	typedef struct {
+		size_t cbSize;
+		std::list<ULONG>::iterator iterLru;
+	} DISKITEM;
+
+	ECRESULT LoadData(ULONG ulInstanceId, std::string *lpstrData);
+	void StoreMemory(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData);
+	void StoreDisk(ULONG ulInstanceId, const unsigned char *lpData, size_t cbData);
+	void RemoveMemory(ULONG ulInstanceId);
+	void RemoveDisk(ULONG ulInstanceId);
+	std::string GetFilename(ULONG ulInstanceId);
+
+	std::string m_strPath;
+	size_t m_cbDiskMax;
+	size_t m_cbMemoryMax;
+
+	pthread_mutex_t m_hMutex;		// protects everything below
+	std::map<ULONG, MEMITEM> m_mapMemory;
+	std::list<ULONG> m_lstMemoryLru;	// most recently used at the front
+	size_t m_cbMemory;
+	std::map<ULONG, DISKITEM> m_mapDisk;
+	std::list<ULONG> m_lstDiskLru;		// most recently used at the front
+	size_t m_cbDisk;
+};
+
+/**
+ * Attachment storage that serves instances from the ECAttachmentCache
+ * and passes everything else on to the real attachment storage.
+ *
+ * Saved instances are written through to the cache, deleted instances are
+ * removed from it. Instances created in a transaction that is rolled back
+ * are removed again on Rollback().
+ */
+class ECCachedAttachment _zcp_final : public ECAttachmentStorage {
+public:
+	static ECRESULT StaticInit(ECConfig *lpConfig);
+	static ECRESULT StaticDeinit(void);
+	static ECAttachmentCache *GetCache(void);
+
+	ECCachedAttachment(ECDatabase *lpDatabase, ECAttachmentStorage *lpBackend, ECAttachmentCache *lpCache);
+
+	/* Single Instance Attachment handlers */
+	virtual bool ExistAttachmentInstance(ULONG ulInstanceId);
+
+	virtual ECRESULT Begin();
+	virtual ECRESULT Commit();
+	virtual ECRESULT Rollback();
+
+protected:
+	virtual ~ECCachedAttachment();
+
+	/* Single Instance Attachment handlers */
+	virtual ECRESULT LoadAttachmentInstance(struct soap *soap, ULONG ulInstanceId, size_t *lpiSize, unsigned char **lppData);
+	virtual ECRESULT LoadAttachmentInstance(ULONG ulInstanceId, size_t *lpiSize, ECSerializer *lpSink);
+	virtual ECRESULT SaveAttachmentInstance(ULONG ulInstanceId, ULONG ulPropId, size_t iSize, unsigned char *lpData);
+	virtual ECRESULT SaveAttachmentInstance(ULONG ulInstanceId, ULONG ulPropId, size_t iSize, ECSerializer *lpSource);
+	virtual ECRESULT DeleteAttachmentInstances(const std::list<ULONG> &lstDeleteInstances, bool bReplace);
+	virtual ECRESULT DeleteAttachmentInstance(ULONG ulInstanceId, bool bReplace);
+	virtual ECRESULT GetSizeInstance(ULONG ulInstanceId, size_t *lpulSize, bool *lpbCompressed = NULL);
+
+private:
+	ECAttachmentStorage *m_lpBackend;
+	ECAttachmentCache *m_lpCache;
+	bool m_bTransaction;
+	std::set<ULONG> m_setNewAttachment;
+};
+
+#endif
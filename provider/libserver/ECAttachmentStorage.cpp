@@ -25,6 +25,7 @@
 #include <fcntl.h>
 
 #include <zlib.h>
+#include <openssl/sha.h>
 
 #include <ECSerializer.h>
 
@@ -42,6 +43,7 @@
 #include <zarafa/stringutil.h>
 #include "StreamUtil.h"
 #include "ECS3Attachment.h"
+#include "ECAttachmentCache.h"
 
 // chunk size for attachment blobs, must be equal or larger than MAX, MAX may never shrink below 384*1024.
 #define CHUNK_SIZE (384 * 1024)
@@ -63,8 +65,65 @@
  * was intended deletes the mail & attachment. In this case the dagent will no longer send the
  * attachment but only the attachment id. When that happens the server can return an error
  * and simply request the dagent to resend the attachment and to obtain a new attachment id.
+ *
+ * Deduplication of instances by content hash is the exception: it links an object to an
+ * instance it did not reference before. To keep a concurrent delete of the last reference
+ * from removing that instance between the lookup and the relink, both paths lock the
+ * `singleinstancehashes` and `singleinstances` rows of the instance with SELECT ... FOR UPDATE
+ * before they check the reference count.
  */
 
+/**
+ * Serializer that passes on reads from another serializer, and computes the
+ * SHA-256 hash of the data read.
+ */
+class ECHashSerializer _zcp_final : public ECSerializer {
+public:
+	ECHashSerializer(ECSerializer *lpSource) : m_lpSource(lpSource) { SHA256_Init(&m_ctx); }
+
+	ECRESULT SetBuffer(void *lpBuffer) _zcp_override { return m_lpSource->SetBuffer(lpBuffer); }
+	ECRESULT Write(const void *ptr, size_t size, size_t nmemb) _zcp_override { return m_lpSource->Write(ptr, size, nmemb); }
+	ECRESULT Flush(void) _zcp_override { return m_lpSource->Flush(); }
+	ECRESULT Stat(ULONG *lpulRead, ULONG *lpulWritten) _zcp_override { return m_lpSource->Stat(lpulRead, lpulWritten); }
+
+	ECRESULT Read(void *ptr, size_t size, size_t nmemb) _zcp_override
+	{
+		ECRESULT er = m_lpSource->Read(ptr, size, nmemb);
+
+		if (er == erSuccess)
+			SHA256_Update(&m_ctx, ptr, size * nmemb);
+		return er;
+	}
+
+	ECRESULT Skip(size_t size, size_t nmemb) _zcp_override
+	{
+		char buffer[4096];
+		size_t cbLeft = size * nmemb;
+		ECRESULT er = erSuccess;
+
+		// Skipped data is part of the instance too
+		while (cbLeft > 0 && er == erSuccess) {
+			size_t cbRead = std::min(cbLeft, sizeof(buffer));
+
+			er = Read(buffer, 1, cbRead);
+			cbLeft -= cbRead;
+		}
+		return er;
+	}
+
+	std::string GetHash()
+	{
+		unsigned char hash[SHA256_DIGEST_LENGTH];
+
+		SHA256_Final(hash, &m_ctx);
+		return std::string(reinterpret_cast<char *>(hash), sizeof(hash));
+	}
+
+private:
+	ECSerializer *m_lpSource;
+	SHA256_CTX m_ctx;
+};
+
 // Generic Attachment storage
 ECAttachmentStorage::ECAttachmentStorage(ECDatabase *lpDatabase, unsigned int ulCompressionLevel)
 	: m_lpDatabase(lpDatabase)
@@ -115,6 +174,7 @@ ECRESULT ECAttachmentStorage::CreateAttachmentStorage(ECDatabase *lpDatabase,
     ECConfig *lpConfig, ECAttachmentStorage **lppAttachmentStorage)
 {
 	ECAttachmentStorage *lpAttachmentStorage = NULL;
+	bool bCache = false;
 
 	if (lpDatabase == NULL) {
 		ec_log_err("ECAttachmentStorage::CreateAttachmentStorage(): DB not available yet");
@@ -134,6 +194,7 @@ ECRESULT ECAttachmentStorage::CreateAttachmentStorage(ECDatabase *lpDatabase,
 		unsigned int complvl = (comp == NULL) ? 0 : strtoul(comp, NULL, 0);
 
 		lpAttachmentStorage = new ECFileAttachment(lpDatabase, dir, complvl, sync_files);
+		bCache = true;
 #ifdef HAVE_LIBS3_H
 	} else if (ans != NULL && strcmp(ans, "s3") == 0) {
 		try {
@@ -149,11 +210,16 @@ ECRESULT ECAttachmentStorage::CreateAttachmentStorage(ECDatabase *lpDatabase,
 			ec_log_warn("Cannot instantiate ECS3Attachment: %s", e.what());
 			return ZARAFA_E_DATABASE_ERROR;
 		}
+		bCache = true;
 #endif
 	} else {
 		lpAttachmentStorage = new ECDatabaseAttachment(lpDatabase);
 	}
 
+	// Serve frequently used instances of external storage from the local cache
+	if (bCache && ECCachedAttachment::GetCache() != NULL)
+		lpAttachmentStorage = new ECCachedAttachment(lpDatabase, lpAttachmentStorage, ECCachedAttachment::GetCache());
+
 	lpAttachmentStorage->AddRef();
 
 	*lppAttachmentStorage = lpAttachmentStorage;
@@ -347,6 +413,7 @@ exit:
 
 /** 
  * Checks if there are no references to a given InstanceID anymore.
+ * The references are locked until the end of the transaction.
  * 
  * @param ulInstanceId InstanceID to check
  * @param bOrphan true if instance isn't referenced anymore
@@ -364,7 +431,7 @@ ECRESULT ECAttachmentStorage::IsOrphanedSingleInstance(ULONG ulInstanceId, bool
 		"SELECT `instanceid` "
 		"FROM `singleinstances` "
 		"WHERE `instanceid` = " + stringify(ulInstanceId) + " "
-		"LIMIT 1";
+		"LIMIT 1 FOR UPDATE";
 
 	er = m_lpDatabase->DoSelect(strQuery, &lpDBResult);
 	if (er != erSuccess)
@@ -386,6 +453,7 @@ exit:
 
 /** 
  * Make a list of all orphaned instances for a list of given InstanceIDs.
+ * The references are locked until the end of the transaction.
  * 
  * @param[in] lstAttachments List of instance ids to check
  * @param[out] lplstOrphanedAttachments List of orphaned instance ids
@@ -409,7 +477,7 @@ ECRESULT ECAttachmentStorage::GetOrphanedSingleInstances(const std::list<ULONG>
 			strQuery += ",";
 		strQuery += stringify(*i);
 	}
-	strQuery +=	")";
+	strQuery +=	") FOR UPDATE";
 
 	er = m_lpDatabase->DoSelect(strQuery, &lpDBResult);
 	if (er != erSuccess) {
@@ -441,6 +509,175 @@ exit:
 	return er;
 }
 
+/**
+ * Replace a newly stored instance by an existing instance with the same data
+ *
+ * Adds the content hash of the new instance to the `singleinstancehashes`
+ * table, or locks the row of the instance that already has that hash and
+ * size. Inserting first means only an existing row is ever locked; locking a
+ * hash that is not in the table yet would take a gap lock that deadlocks with
+ * a concurrent insert of the same hash.
+ *
+ * When another instance with the same data is still in use, the object is
+ * linked to that instance through `singleinstances`, and the data of the new
+ * instance is removed again. When that instance is no longer referenced, the
+ * hash is moved to the new instance.
+ *
+ * @param[in] ulObjId HierarchyID of the object the instance was saved for
+ * @param[in] ulPropId PropertyID the instance was saved for
+ * @param[in] iSize Size of the instance data
+ * @param[in] strHash SHA-256 hash of the instance data
+ * @param[in,out] lpulInstanceId The new instance id, replaced by the existing instance id if found
+ *
+ * @return Zarafa error code
+ */
+ECRESULT ECAttachmentStorage::DeduplicateInstance(ULONG ulObjId, ULONG ulPropId, size_t iSize, const std::string &strHash, ULONG *lpulInstanceId)
+{
+	ECRESULT er = erSuccess;
+	DB_RESULT lpDBResult = NULL;
+	DB_ROW lpDBRow = NULL;
+	ULONG ulExistingId = 0;
+	bool bOrphan = true;
+
+	// On a duplicate hash this locks the existing row instead of inserting
+	er = m_lpDatabase->DoInsertPrepared("INSERT INTO `singleinstancehashes` (`instanceid`, `hash`, `size`) VALUES (?, ?, ?) "
+		"ON DUPLICATE KEY UPDATE `instanceid` = `instanceid`",
+		ECDatabaseParams().Add((unsigned int)*lpulInstanceId).AddBinary(strHash).Add(static_cast<unsigned long long>(iSize)));
+	if (er != erSuccess) {
+		ec_log_err("ECAttachmentStorage::DeduplicateInstance(): DoInsert failed %x", er);
+		goto exit;
+	}
+
+	// The row is locked by now, so this only reads the locked row
+	er = m_lpDatabase->DoSelectPrepared("SELECT `instanceid` FROM `singleinstancehashes` WHERE `hash` = ? AND `size` = ? FOR UPDATE",
+		ECDatabaseParams().AddBinary(strHash).Add(static_cast<unsigned long long>(iSize)), &lpDBResult);
+	if (er != erSuccess) {
+		ec_log_err("ECAttachmentStorage::DeduplicateInstance(): DoSelect failed %x", er);
+		goto exit;
+	}
+
+	lpDBRow = m_lpDatabase->FetchRow(lpDBResult);
+	if (lpDBRow == NULL || lpDBRow[0] == NULL) {
+		er = ZARAFA_E_DATABASE_ERROR;
+		ec_log_err("ECAttachmentStorage::DeduplicateInstance(): no row or column contained NULL");
+		goto exit;
+	}
+	ulExistingId = atoui(lpDBRow[0]);
+
+	if (ulExistingId == *lpulInstanceId)
+		goto exit;
+
+	er = IsOrphanedSingleInstance(ulExistingId, &bOrphan);
+	if (er != erSuccess) {
+		ec_log_err("ECAttachmentStorage::DeduplicateInstance(): IsOrphanedSingleInstance failed %x", er);
+		goto exit;
+	}
+
+	if (!bOrphan && ExistAttachmentInstance(ulExistingId)) {
+		er = m_lpDatabase->DoUpdatePrepared("UPDATE `singleinstances` SET `instanceid` = ? WHERE `hierarchyid` = ? AND `tag` = ?",
+			ECDatabaseParams().Add((unsigned int)ulExistingId).Add((unsigned int)ulObjId).Add((unsigned int)ulPropId));
+		if (er != erSuccess) {
+			ec_log_err("ECAttachmentStorage::DeduplicateInstance(): DoUpdate failed %x", er);
+			goto exit;
+		}
+
+		er = DeleteAttachmentInstance(*lpulInstanceId, false);
+		if (er != erSuccess)
+			goto exit;
+
+		*lpulInstanceId = ulExistingId;
+		goto exit;
+	}
+
+	// The indexed instance is gone, index the new one instead
+	er = m_lpDatabase->DoUpdatePrepared("UPDATE `singleinstancehashes` SET `instanceid` = ? WHERE `instanceid` = ?",
+		ECDatabaseParams().Add((unsigned int)*lpulInstanceId).Add((unsigned int)ulExistingId));
+	if (er != erSuccess) {
+		ec_log_err("ECAttachmentStorage::DeduplicateInstance(): DoUpdate failed %x", er);
+		goto exit;
+	}
+
+exit:
+	if (lpDBResult)
+		m_lpDatabase->FreeResult(lpDBResult);
+
+	return er;
+}
+
+/**
+ * Lock the content hashes of instances until the end of the transaction
+ *
+ * Called before references are removed, so DeduplicateInstance() cannot
+ * link an object to an instance which is about to be deleted.
+ *
+ * @param[in] lstInstanceIds Instance ids to lock
+ *
+ * @return Zarafa error code
+ */
+ECRESULT ECAttachmentStorage::LockInstanceHashes(const std::list<ULONG> &lstInstanceIds)
+{
+	ECRESULT er = erSuccess;
+	std::string strQuery;
+	DB_RESULT lpDBResult = NULL;
+
+	if (lstInstanceIds.empty())
+		return erSuccess;
+
+	strQuery =
+		"SELECT `instanceid` "
+		"FROM `singleinstancehashes` "
+		"WHERE `instanceid` IN (";
+	for (std::list<ULONG>::const_iterator i = lstInstanceIds.begin();
+	     i != lstInstanceIds.end(); ++i) {
+		if (i != lstInstanceIds.begin())
+			strQuery += ",";
+		strQuery += stringify(*i);
+	}
+	strQuery += ") FOR UPDATE";
+
+	er = m_lpDatabase->DoSelect(strQuery, &lpDBResult);
+	if (er != erSuccess)
+		ec_log_err("ECAttachmentStorage::LockInstanceHashes(): DoSelect failed %x", er);
+
+	if (lpDBResult)
+		m_lpDatabase->FreeResult(lpDBResult);
+
+	return er;
+}
+
+/**
+ * Remove the content hashes of deleted instances
+ *
+ * @param[in] lstInstanceIds Instance ids which are no longer referenced
+ *
+ * @return Zarafa error code
+ */
+ECRESULT ECAttachmentStorage::DeleteInstanceHashes(const std::list<ULONG> &lstInstanceIds)
+{
+	ECRESULT er = erSuccess;
+	std::string strQuery;
+
+	if (lstInstanceIds.empty())
+		return erSuccess;
+
+	strQuery =
+		"DELETE FROM `singleinstancehashes` "
+		"WHERE `instanceid` IN (";
+	for (std::list<ULONG>::const_iterator i = lstInstanceIds.begin();
+	     i != lstInstanceIds.end(); ++i) {
+		if (i != lstInstanceIds.begin())
+			strQuery += ",";
+		strQuery += stringify(*i);
+	}
+	strQuery += ")";
+
+	er = m_lpDatabase->DoDelete(strQuery);
+	if (er != erSuccess)
+		ec_log_err("ECAttachmentStorage::DeleteInstanceHashes(): DoDelete failed %x", er);
+
+	return er;
+}
+
 /** 
  * For a given hierarchy id, check if this has a valid instance id
  * 
@@ -542,6 +779,7 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 	ECRESULT er = erSuccess;
 	ULONG ulInstanceId = 0;
 	std::string strQuery;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
 
 	if (!lpData) {
 		er = ZARAFA_E_INVALID_PARAMETER;
@@ -574,6 +812,11 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 	if (er != erSuccess)
 		goto exit;
 
+	SHA256(lpData, iSize, hash);
+	er = DeduplicateInstance(ulObjId, ulPropId, iSize, std::string(reinterpret_cast<char *>(hash), sizeof(hash)), &ulInstanceId);
+	if (er != erSuccess)
+		goto exit;
+
 	if (lpulInstanceId)
 		*lpulInstanceId = ulInstanceId;
 
@@ -598,6 +841,7 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 	ECRESULT er = erSuccess;
 	ULONG ulInstanceId = 0;
 	std::string strQuery;
+	ECHashSerializer sHashSource(lpSource);
 
 	if (bDeleteOld) {
 		/*
@@ -621,7 +865,12 @@ ECRESULT ECAttachmentStorage::SaveAttachment(ULONG ulObjId, ULONG ulPropId, bool
 		goto exit;
 	}
 
-	er = SaveAttachmentInstance(ulInstanceId, ulPropId, iSize, lpSource);
+	// Hash the data while it is stored
+	er = SaveAttachmentInstance(ulInstanceId, ulPropId, iSize, &sHashSource);
+	if (er != erSuccess)
+		goto exit;
+
+	er = DeduplicateInstance(ulObjId, ulPropId, iSize, sHashSource.GetHash(), &ulInstanceId);
 	if (er != erSuccess)
 		goto exit;
 
@@ -738,6 +987,10 @@ ECRESULT ECAttachmentStorage::DeleteAttachments(const std::list<ULONG> &lstDelet
 	if (lstAttachments.empty())
 		goto exit;
 
+	er = LockInstanceHashes(lstAttachments);
+	if (er != erSuccess)
+		goto exit;
+
 	/*
 	 * Remove all objects from `singleinstances` table this will decrease the
 	 * reference count for each attachment.
@@ -767,6 +1020,10 @@ ECRESULT ECAttachmentStorage::DeleteAttachments(const std::list<ULONG> &lstDelet
 		goto exit;
 
 	if (!lstDeleteAttach.empty()) {
+		er = DeleteInstanceHashes(lstDeleteAttach);
+		if (er != erSuccess)
+			goto exit;
+
 		er = DeleteAttachmentInstances(lstDeleteAttach, false);
 		if (er != erSuccess)
 			goto exit;
@@ -815,6 +1072,10 @@ ECRESULT ECAttachmentStorage::DeleteAttachment(ULONG ulObjId, ULONG ulPropId, bo
 		goto exit;
 	}
 
+	er = LockInstanceHashes(std::list<ULONG>(1, ulInstanceId));
+	if (er != erSuccess)
+		goto exit;
+
 	/*
 	 * Remove object from `singleinstances` table, this will decrease the
 	 * reference count for the attachment.
@@ -834,6 +1095,10 @@ ECRESULT ECAttachmentStorage::DeleteAttachment(ULONG ulObjId, ULONG ulPropId, bo
 	 * Check if the attachment can be permanently deleted.
 	 */
 	if (IsOrphanedSingleInstance(ulInstanceId, &bOrphan) == erSuccess && bOrphan) {
+		er = DeleteInstanceHashes(std::list<ULONG>(1, ulInstanceId));
+		if (er != erSuccess)
+			goto exit;
+
 		er = DeleteAttachmentInstance(ulInstanceId, bReplace);
 		if (er != erSuccess)
 			goto exit;
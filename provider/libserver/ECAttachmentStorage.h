@@ -87,8 +87,16 @@ private:
 	ECRESULT IsOrphanedSingleInstance(ULONG ulInstanceId, bool *bOrphan);
 	ECRESULT GetOrphanedSingleInstances(const std::list<ULONG> &lstInstanceIds, std::list<ULONG> *lplstOrphanedInstanceIds);
 
+	/* Content hash index of the Single Instances */
+	ECRESULT DeduplicateInstance(ULONG ulObjId, ULONG ulPropId, size_t iSize, const std::string &strHash, ULONG *lpulInstanceId);
+	ECRESULT LockInstanceHashes(const std::list<ULONG> &lstInstanceIds);
+	ECRESULT DeleteInstanceHashes(const std::list<ULONG> &lstInstanceIds);
+
 	ECRESULT DeleteAttachment(ULONG ulObjId, ULONG ulPropId, bool bReplace);
 
+	/* ECCachedAttachment forwards the instance handlers to the storage it caches */
+	friend class ECCachedAttachment;
+
 protected:
 	ECDatabase *m_lpDatabase;
 	bool m_bFileCompression;
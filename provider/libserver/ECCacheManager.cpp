@@ -78,15 +78,15 @@ unsigned int GetCacheAdditionalSize(const ECsUEIdKey &val) {
 }
 
 ECCacheManager::ECCacheManager(ECConfig *lpConfig, ECDatabaseFactory *lpDatabaseFactory)
-: m_QuotaCache("quota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60)
-, m_QuotaUserDefaultCache("uquota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60)
-, m_ObjectsCache("obj", atoll(lpConfig->GetSetting("cache_object_size")), 0)
-, m_StoresCache("store", atoi(lpConfig->GetSetting("cache_store_size")), 0)
-, m_UserObjectCache("userid", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
+: m_QuotaCache("quota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_QuotaUserDefaultCache("uquota", atoi(lpConfig->GetSetting("cache_quota_size")), atoi(lpConfig->GetSetting("cache_quota_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_ObjectsCache("obj", atoll(lpConfig->GetSetting("cache_object_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_StoresCache("store", atoi(lpConfig->GetSetting("cache_store_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_UserObjectCache("userid", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
 , m_UEIdObjectCache("extern", atoi(lpConfig->GetSetting("cache_user_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
-, m_UserObjectDetailsCache("abinfo", atoi(lpConfig->GetSetting("cache_userdetails_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60)
-, m_AclCache("acl", atoi(lpConfig->GetSetting("cache_acl_size")), 0)
-, m_CellCache("cell", atoll(lpConfig->GetSetting("cache_cell_size")), 0)
+, m_UserObjectDetailsCache("abinfo", atoi(lpConfig->GetSetting("cache_userdetails_size")), atoi(lpConfig->GetSetting("cache_userdetails_lifetime")) * 60, atoui(lpConfig->GetSetting("cache_shards")))
+, m_AclCache("acl", atoi(lpConfig->GetSetting("cache_acl_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
+, m_CellCache("cell", atoll(lpConfig->GetSetting("cache_cell_size")), 0, atoui(lpConfig->GetSetting("cache_shards")))
 , m_ServerDetailsCache("server", atoi(lpConfig->GetSetting("cache_server_size")), atoi(lpConfig->GetSetting("cache_server_lifetime")) * 60)
 , m_PropToObjectCache("index1", atoll(lpConfig->GetSetting("cache_indexedobject_size")), 0)
 , m_ObjectToPropCache("index2", atoll(lpConfig->GetSetting("cache_indexedobject_size")), 0)
@@ -96,7 +96,6 @@ ECCacheManager::ECCacheManager(ECConfig *lpConfig, ECDatabaseFactory *lpDatabase
 	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
 
 	pthread_mutex_init(&m_hCacheMutex, &mattr);
-	pthread_mutex_init(&m_hCacheCellsMutex, &mattr);
 	pthread_mutex_init(&m_hCacheIndPropMutex, &mattr);
 	
 	pthread_mutex_init(&m_hExcludedIndexPropertiesMutex, NULL);
@@ -128,7 +127,6 @@ ECCacheManager::~ECCacheManager()
 	PurgeCache(PURGE_CACHE_ALL);
 	pthread_mutex_destroy(&m_hCacheIndPropMutex);
 	pthread_mutex_destroy(&m_hCacheMutex);
-	pthread_mutex_destroy(&m_hCacheCellsMutex);
 	pthread_mutex_destroy(&m_hExcludedIndexPropertiesMutex);
 }
 
@@ -138,9 +136,7 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 
 	LOG_CACHE_DEBUG("Purge cache, flags 0x%08X", ulFlags);
 
-	// cache mutex items
-	pthread_mutex_lock(&m_hCacheMutex);
-
+	// Sharded caches lock their own segments
 	if (ulFlags & PURGE_CACHE_QUOTA)
 		m_QuotaCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_QUOTADEFAULT)
@@ -151,16 +147,12 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 		m_StoresCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_ACL)
 		m_AclCache.ClearCache();
-
-	pthread_mutex_unlock(&m_hCacheMutex);
-	
-	// Cell cache mutex
-	pthread_mutex_lock(&m_hCacheCellsMutex);
-
 	if(ulFlags & PURGE_CACHE_CELL)
     	m_CellCache.ClearCache();
-
-	pthread_mutex_unlock(&m_hCacheCellsMutex);
+	if (ulFlags & PURGE_CACHE_USEROBJECT)
+		m_UserObjectCache.ClearCache();
+	if (ulFlags & PURGE_CACHE_USERDETAILS)
+		m_UserObjectDetailsCache.ClearCache();
 
 	// Indexed properties mutex
 	pthread_mutex_lock(&m_hCacheIndPropMutex);
@@ -179,12 +171,8 @@ ECRESULT ECCacheManager::PurgeCache(unsigned int ulFlags)
 
 	pthread_mutex_lock(&m_hCacheMutex);
 
-	if (ulFlags & PURGE_CACHE_USEROBJECT)
-		m_UserObjectCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_EXTERNID)
 		m_UEIdObjectCache.ClearCache();
-	if (ulFlags & PURGE_CACHE_USERDETAILS)
-		m_UserObjectDetailsCache.ClearCache();
 	if (ulFlags & PURGE_CACHE_SERVER)
 		m_ServerDetailsCache.ClearCache();
 
@@ -249,9 +237,9 @@ ECRESULT ECCacheManager::_GetObject(unsigned int ulObjId, unsigned int *ulParent
 {
 	ECRESULT	er = erSuccess;
 	ECsObjects	*sObject;
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_ObjectsCache.Mutex(ulObjId));
 
-	er = m_ObjectsCache.GetCacheItem(ulObjId, &sObject);
+	er = m_ObjectsCache.Shard(ulObjId).GetCacheItem(ulObjId, &sObject);
 	if(er != erSuccess)
 		goto exit;
 
@@ -288,8 +276,8 @@ ECRESULT ECCacheManager::SetObject(unsigned int ulObjId, unsigned int ulParent,
 	sObjects.ulFlags	= ulFlags;
 	sObjects.ulType		= ulType;
 
-	scoped_lock lock(m_hCacheMutex);
-	er = m_ObjectsCache.AddCacheItem(ulObjId, sObjects);
+	scoped_lock lock(m_ObjectsCache.Mutex(ulObjId));
+	er = m_ObjectsCache.Shard(ulObjId).AddCacheItem(ulObjId, sObjects);
 
 	LOG_CACHE_DEBUG("Set cache object id %d, parent %d, owner %d, flags %d, type %d", ulObjId, ulParent, ulOwner, ulFlags, ulType);
 	return er;
@@ -298,9 +286,9 @@ ECRESULT ECCacheManager::SetObject(unsigned int ulObjId, unsigned int ulParent,
 ECRESULT ECCacheManager::_DelObject(unsigned int ulObjId)
 {
 	ECRESULT		er = erSuccess;
-	scoped_lock		lock(m_hCacheMutex);
+	scoped_lock		lock(m_ObjectsCache.Mutex(ulObjId));
 
-	er = m_ObjectsCache.RemoveCacheItem(ulObjId);
+	er = m_ObjectsCache.Shard(ulObjId).RemoveCacheItem(ulObjId);
 
 	return er;
 }
@@ -310,9 +298,9 @@ ECRESULT ECCacheManager::_GetStore(unsigned int ulObjId, unsigned int *ulStore,
 	ECRESULT	er = erSuccess;
 	ECsStores	*sStores;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_StoresCache.Mutex(ulObjId));
 
-	er = m_StoresCache.GetCacheItem(ulObjId, &sStores);
+	er = m_StoresCache.Shard(ulObjId).GetCacheItem(ulObjId, &sStores);
 	if(er != erSuccess)
 		goto exit;
 
@@ -336,9 +324,9 @@ ECRESULT ECCacheManager::SetStore(unsigned int ulObjId, unsigned int ulStore,
 	sStores.guidStore = *lpGuid;
 	sStores.ulType = ulType;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_StoresCache.Mutex(ulObjId));
 
-	er = m_StoresCache.AddCacheItem(ulObjId, sStores);
+	er = m_StoresCache.Shard(ulObjId).AddCacheItem(ulObjId, sStores);
 
 	LOG_CACHE_DEBUG("Set store cache id %d, store %d, type %d, guid %s", ulObjId, ulStore, ulType, ((lpGuid)?bin2hex(sizeof(GUID), (const unsigned char*)lpGuid).c_str(): "NULL"));
 	return er;
@@ -347,9 +335,9 @@ ECRESULT ECCacheManager::SetStore(unsigned int ulObjId, unsigned int ulStore,
 ECRESULT ECCacheManager::_DelStore(unsigned int ulObjId)
 {
 	ECRESULT		er = erSuccess;
-	scoped_lock		lock(m_hCacheMutex);
+	scoped_lock		lock(m_StoresCache.Mutex(ulObjId));
 
-	er = m_StoresCache.RemoveCacheItem(ulObjId);
+	er = m_StoresCache.Shard(ulObjId).RemoveCacheItem(ulObjId);
 
 	return er;
 }
@@ -410,7 +398,6 @@ ECRESULT ECCacheManager::GetObject(unsigned int ulObjId, unsigned int *lpulParen
 	ECRESULT	er = erSuccess;
 	DB_RESULT	lpDBResult = NULL;
 	DB_ROW		lpDBRow = NULL;
-	std::string strQuery;
 	ECDatabase	*lpDatabase = NULL;
 	unsigned int	ulParent = 0, ulOwner = 0, ulFlags = 0, ulType = 0;
 	bool bCacheResult = false;
@@ -435,8 +422,8 @@ ECRESULT ECCacheManager::GetObject(unsigned int ulObjId, unsigned int *lpulParen
 		goto exit;
 	}
 
-	strQuery = "SELECT hierarchy.parent, hierarchy.owner, hierarchy.flags, hierarchy.type FROM hierarchy WHERE hierarchy.id = " + stringify(ulObjId);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+	er = lpDatabase->DoSelectPrepared("SELECT hierarchy.parent, hierarchy.owner, hierarchy.flags, hierarchy.type FROM hierarchy WHERE hierarchy.id = ?",
+		ECDatabaseParams().Add(ulObjId), &lpDBResult);
 	if(er != erSuccess)
 		goto exit;
 
@@ -499,22 +486,21 @@ ECRESULT ECCacheManager::GetObjects(const std::list<sObjectTableKey> &lstObjects
 	std::list<sObjectTableKey>::const_iterator i;
 	std::set<sObjectTableKey> setUncached;
 	std::set<sObjectTableKey>::const_iterator j;
+	std::map<sObjectTableKey, ECsObjects> mapFetched;
 
 	er = GetThreadLocalDatabase(this->m_lpDatabaseFactory, &lpDatabase);
 
 	if(er != erSuccess)
 		goto exit;
 		
-    {
-        // Get everything from the cache that we can
-    	scoped_lock lock(m_hCacheMutex);
-
-        for (i = lstObjects.begin(); i != lstObjects.end(); ++i) {
-            if(m_ObjectsCache.GetCacheItem(i->ulObjId, &lpsObject) == erSuccess) {
-                mapObjects[*i] = *lpsObject;
-            } else {
-                setUncached.insert(*i);
-            }
+    // Get everything from the cache that we can
+    for (i = lstObjects.begin(); i != lstObjects.end(); ++i) {
+        scoped_lock lock(m_ObjectsCache.Mutex(i->ulObjId));
+
+        if(m_ObjectsCache.Shard(i->ulObjId).GetCacheItem(i->ulObjId, &lpsObject) == erSuccess) {
+            mapObjects[*i] = *lpsObject;
+        } else {
+            setUncached.insert(*i);
         }
     }
 
@@ -549,7 +535,11 @@ ECRESULT ECCacheManager::GetObjects(const std::list<sObjectTableKey> &lstObjects
             key.ulOrderId = 0;
             
             mapObjects[key] = sObject;
+            mapFetched[key] = sObject;
         }
+
+        // Fill the cache with everything we read, so the next request does not miss again
+        SetObjects(mapFetched);
     }
     
 exit:
@@ -564,6 +554,41 @@ exit:
     return er;
 }
 
+/**
+ * Add a batch of hierarchy objects to the object cache
+ *
+ * The objects are grouped per cache segment, so each segment lock is taken
+ * only once for the whole batch.
+ *
+ * @param[in] mapObjects Objects to add, keyed by object id (order id is ignored)
+ */
+ECRESULT ECCacheManager::SetObjects(const std::map<sObjectTableKey, ECsObjects> &mapObjects)
+{
+	std::vector<std::list<std::map<sObjectTableKey, ECsObjects>::const_iterator> > vShards(m_ObjectsCache.ShardCount());
+	std::map<sObjectTableKey, ECsObjects>::const_iterator i;
+	std::list<std::map<sObjectTableKey, ECsObjects>::const_iterator>::const_iterator j;
+
+	for (i = mapObjects.begin(); i != mapObjects.end(); ++i) {
+		// Same restrictions as SetObject()
+		if (i->first.ulObjId == 0 || i->second.ulParent == 0 || i->second.ulOwner == 0)
+			continue;
+		vShards[m_ObjectsCache.ShardIndex(i->first.ulObjId)].push_back(i);
+	}
+
+	for (size_t n = 0; n < vShards.size(); ++n) {
+		if (vShards[n].empty())
+			continue;
+
+		scoped_lock lock(m_ObjectsCache.MutexAt(n));
+
+		for (j = vShards[n].begin(); j != vShards[n].end(); ++j)
+			m_ObjectsCache.ShardAt(n).AddCacheItem((*j)->first.ulObjId, (*j)->second);
+	}
+
+	LOG_CACHE_DEBUG("Set cache objects, %lu ids", mapObjects.size());
+	return erSuccess;
+}
+
 ECRESULT ECCacheManager::GetObjectsFromProp(unsigned int ulTag,
     const std::vector<unsigned int> &cbdata,
     const std::vector<unsigned char *> &lpdata,
@@ -993,7 +1018,7 @@ ECRESULT ECCacheManager::_AddUserObject(unsigned int ulUserId,
 	ECRESULT	er = erSuccess;
 	ECsUserObject sData;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_UserObjectCache.Mutex(ulUserId));
 
 	if (OBJECTCLASS_ISTYPE(ulClass)) {
 		LOG_USERCACHE_DEBUG("_Add user object. userid %d, class %d, companyid %d, externid '%s', signature '%s'. error incomplete object", ulUserId, ulClass, ulCompanyId, bin2hex(strExternId).c_str(), bin2hex(strSignature).c_str());
@@ -1007,7 +1032,7 @@ ECRESULT ECCacheManager::_AddUserObject(unsigned int ulUserId,
 	sData.strExternId = strExternId;
 	sData.strSignature = strSignature;
 
-	er = m_UserObjectCache.AddCacheItem(ulUserId, sData);
+	er = m_UserObjectCache.Shard(ulUserId).AddCacheItem(ulUserId, sData);
 
 exit:
 	return er;
@@ -1020,9 +1045,9 @@ ECRESULT ECCacheManager::_GetUserObject(unsigned int ulUserId, objectclass_t* lp
 	ECRESULT		er = erSuccess;
 	ECsUserObject	*sData;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_UserObjectCache.Mutex(ulUserId));
 
-	er = m_UserObjectCache.GetCacheItem(ulUserId, &sData);
+	er = m_UserObjectCache.Shard(ulUserId).GetCacheItem(ulUserId, &sData);
 	if(er != erSuccess)
 		goto exit;
 
@@ -1044,10 +1069,10 @@ exit:
 ECRESULT ECCacheManager::_DelUserObject(unsigned int ulUserId)
 {
 	ECRESULT			er = erSuccess;
-	scoped_lock			lock(m_hCacheMutex);
+	scoped_lock			lock(m_UserObjectCache.Mutex(ulUserId));
 
 	// Remove the user
-	er = m_UserObjectCache.RemoveCacheItem(ulUserId);
+	er = m_UserObjectCache.Shard(ulUserId).RemoveCacheItem(ulUserId);
 
 	return er;
 }
@@ -1058,7 +1083,7 @@ ECRESULT ECCacheManager::_AddUserObjectDetails(unsigned int ulUserId,
 	ECRESULT 			er = erSuccess;
 	ECsUserObjectDetails sObjectDetails;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_UserObjectDetailsCache.Mutex(ulUserId));
 
 	if (!details) {
 		er = ZARAFA_E_INVALID_PARAMETER;
@@ -1069,7 +1094,7 @@ ECRESULT ECCacheManager::_AddUserObjectDetails(unsigned int ulUserId,
 
 	sObjectDetails.sDetails = *details;
 
-	er = m_UserObjectDetailsCache.AddCacheItem(ulUserId, sObjectDetails);
+	er = m_UserObjectDetailsCache.Shard(ulUserId).AddCacheItem(ulUserId, sObjectDetails);
 	if (er != erSuccess)
 		goto exit;
 
@@ -1082,14 +1107,14 @@ ECRESULT ECCacheManager::_GetUserObjectDetails(unsigned int ulUserId, objectdeta
 	ECRESULT		er = erSuccess;
 	ECsUserObjectDetails *sObjectDetails;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_UserObjectDetailsCache.Mutex(ulUserId));
 
 	if (!details) { 
 		er = ZARAFA_E_INVALID_PARAMETER; 
 		goto exit; 
 	}
 
-	er = m_UserObjectDetailsCache.GetCacheItem(ulUserId, &sObjectDetails);
+	er = m_UserObjectDetailsCache.Shard(ulUserId).GetCacheItem(ulUserId, &sObjectDetails);
 	if (er != erSuccess)
 		goto exit;
 
@@ -1102,10 +1127,10 @@ exit:
 ECRESULT ECCacheManager::_DelUserObjectDetails(unsigned int ulUserId)
 {
 	ECRESULT			er = erSuccess;
-	scoped_lock			lock(m_hCacheMutex);
+	scoped_lock			lock(m_UserObjectDetailsCache.Mutex(ulUserId));
 
 	// Remove the user details
-	er = m_UserObjectDetailsCache.RemoveCacheItem(ulUserId);
+	er = m_UserObjectDetailsCache.Shard(ulUserId).RemoveCacheItem(ulUserId);
 
 	return er;
 }
@@ -1261,9 +1286,9 @@ ECRESULT ECCacheManager::_GetACLs(unsigned int ulObjId, struct rightsArray **lpp
     ECsACLs *sACL;
     struct rightsArray *lpRights = NULL;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_AclCache.Mutex(ulObjId));
 
-	er = m_AclCache.GetCacheItem(ulObjId, &sACL);
+	er = m_AclCache.Shard(ulObjId).GetCacheItem(ulObjId, &sACL);
 	if(er != erSuccess)
 		goto exit;
 
@@ -1311,8 +1336,8 @@ ECRESULT ECCacheManager::SetACLs(unsigned int ulObjId,
 		LOG_USERCACHE_DEBUG("Set ACLs for objectid %d: userid %d, type %d, permissions %d", ulObjId, lpRights->__ptr[i].ulUserid, lpRights->__ptr[i].ulType, lpRights->__ptr[i].ulRights);
     }
 
-	scoped_lock lock(m_hCacheMutex);
-	er = m_AclCache.AddCacheItem(ulObjId, sACLs);
+	scoped_lock lock(m_AclCache.Mutex(ulObjId));
+	er = m_AclCache.Shard(ulObjId).AddCacheItem(ulObjId, sACLs);
 
 	return er;
 }
@@ -1320,11 +1345,11 @@ ECRESULT ECCacheManager::SetACLs(unsigned int ulObjId,
 ECRESULT ECCacheManager::_DelACLs(unsigned int ulObjId)
 {
     ECRESULT er = erSuccess;
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(m_AclCache.Mutex(ulObjId));
 	
 	LOG_USERCACHE_DEBUG("Remove ACLs for objectid %d", ulObjId);
 
-	er = m_AclCache.RemoveCacheItem(ulObjId);
+	er = m_AclCache.Shard(ulObjId).RemoveCacheItem(ulObjId);
 
     return er;
 }
@@ -1347,14 +1372,13 @@ ECRESULT ECCacheManager::SetQuota(unsigned int ulUserId, bool bIsDefaultQuota,
 	ECRESULT er = erSuccess;
 	ECsQuota	sQuota;
 
+	ECShardedCache<ECMapQuota> &cache = bIsDefaultQuota ? m_QuotaUserDefaultCache : m_QuotaCache;
+
 	sQuota.quota = quota;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(cache.Mutex(ulUserId));
 
-	if (bIsDefaultQuota)
-		er = m_QuotaUserDefaultCache.AddCacheItem(ulUserId, sQuota);
-	else
-		er = m_QuotaCache.AddCacheItem(ulUserId, sQuota);
+	er = cache.Shard(ulUserId).AddCacheItem(ulUserId, sQuota);
 
 	return er;
 }
@@ -1363,18 +1387,16 @@ ECRESULT ECCacheManager::_GetQuota(unsigned int ulUserId, bool bIsDefaultQuota,
 {
 	ECRESULT er = erSuccess;
 	ECsQuota	*sQuota;
+	ECShardedCache<ECMapQuota> &cache = bIsDefaultQuota ? m_QuotaUserDefaultCache : m_QuotaCache;
 
-	scoped_lock lock(m_hCacheMutex);
+	scoped_lock lock(cache.Mutex(ulUserId));
 
 	if (!quota) {
 		er = ZARAFA_E_INVALID_PARAMETER;
 		goto exit;
 	}
 
-	if (bIsDefaultQuota)
-		er = m_QuotaUserDefaultCache.GetCacheItem(ulUserId, &sQuota);
-	else
-		er = m_QuotaCache.GetCacheItem(ulUserId, &sQuota);
+	er = cache.Shard(ulUserId).GetCacheItem(ulUserId, &sQuota);
 
 	if(er != erSuccess)
 		goto exit;
@@ -1388,12 +1410,10 @@ exit:
 ECRESULT ECCacheManager::_DelQuota(unsigned int ulUserId, bool bIsDefaultQuota)
 {
 	ECRESULT er = erSuccess;
-	scoped_lock lock(m_hCacheMutex);
+	ECShardedCache<ECMapQuota> &cache = bIsDefaultQuota ? m_QuotaUserDefaultCache : m_QuotaCache;
+	scoped_lock lock(cache.Mutex(ulUserId));
 
-	if (bIsDefaultQuota)
-		er = m_QuotaUserDefaultCache.RemoveCacheItem(ulUserId);
-	else
-		er = m_QuotaCache.RemoveCacheItem(ulUserId);
+	er = cache.Shard(ulUserId).RemoveCacheItem(ulUserId);
 
 	return er;
 }
@@ -1402,28 +1422,24 @@ void ECCacheManager::ForEachCacheItem(void(callback)(const std::string &, const
 {
 	string value;
 
-	pthread_mutex_lock(&m_hCacheMutex);
-
+	// Sharded caches sum their segments under the segment locks
 	m_ObjectsCache.RequestStats(callback, obj);
 	m_StoresCache.RequestStats(callback, obj);
 	m_AclCache.RequestStats(callback, obj);
 	m_QuotaCache.RequestStats(callback, obj);
 	m_QuotaUserDefaultCache.RequestStats( callback, obj);
-	m_UEIdObjectCache.RequestStats(callback, obj);
 	m_UserObjectCache.RequestStats(callback, obj);
 	m_UserObjectDetailsCache.RequestStats(callback, obj);
+	m_CellCache.RequestStats(callback, obj);
+
+	pthread_mutex_lock(&m_hCacheMutex);
+
+	m_UEIdObjectCache.RequestStats(callback, obj);
 	m_ServerDetailsCache.RequestStats(callback, obj);
 	
 	pthread_mutex_unlock(&m_hCacheMutex);
 
 
-	pthread_mutex_lock(&m_hCacheCellsMutex);
-
-	m_CellCache.RequestStats(callback, obj);
-
-	pthread_mutex_unlock(&m_hCacheCellsMutex);
-
-
 	pthread_mutex_lock(&m_hCacheIndPropMutex);
 
 	m_PropToObjectCache.RequestStats(callback, obj);
@@ -1436,24 +1452,21 @@ ECRESULT ECCacheManager::DumpStats()
 {
 	ec_log_info("Dumping cache stats:");
 
-	pthread_mutex_lock(&m_hCacheMutex);
 	m_ObjectsCache.DumpStats();
 	m_StoresCache.DumpStats();
 	m_AclCache.DumpStats();
 	m_QuotaCache.DumpStats();
 	m_QuotaUserDefaultCache.DumpStats();
-	m_UEIdObjectCache.DumpStats();
 	m_UserObjectCache.DumpStats();
 	m_UserObjectDetailsCache.DumpStats();
+	m_CellCache.DumpStats();
+
+	pthread_mutex_lock(&m_hCacheMutex);
+	m_UEIdObjectCache.DumpStats();
 	m_ServerDetailsCache.DumpStats();
 	pthread_mutex_unlock(&m_hCacheMutex);
 
 
-	pthread_mutex_lock(&m_hCacheCellsMutex);
-	m_CellCache.DumpStats();
-	pthread_mutex_unlock(&m_hCacheCellsMutex);
-
-
 	pthread_mutex_lock(&m_hCacheIndPropMutex);
 	m_PropToObjectCache.DumpStats();
 	m_ObjectToPropCache.DumpStats();
@@ -1473,8 +1486,9 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
 {
     ECRESULT er = erSuccess;
     ECsCells *sCell;
+	ECCache<ECMapCells> &cache = m_CellCache.Shard(lpsRowItem->ulObjId);
 
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(lpsRowItem->ulObjId));
 
     if (m_bCellCacheDisabled) {
         er = ZARAFA_E_NOT_FOUND;
@@ -1487,7 +1501,7 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
 		goto exit;
 	}
 
-	er = m_CellCache.GetCacheItem(lpsRowItem->ulObjId, &sCell);
+	er = cache.GetCacheItem(lpsRowItem->ulObjId, &sCell);
 	if(er != erSuccess)
 	    goto exit;
 
@@ -1496,7 +1510,7 @@ ECRESULT ECCacheManager::GetCell(const sObjectTableKey *lpsRowItem,
             // Object is not complete, and item is not in cache. We simply don't know anything about
             // the item, so return NOT_FOUND. Or, the item is complete but the requested property is computed, and therefore
             // not in the cache.
-			m_CellCache.DecrementValidCount();
+			cache.DecrementValidCount();
             er = ZARAFA_E_NOT_FOUND;
             goto exit;
         } else {
@@ -1520,28 +1534,70 @@ exit:
 ECRESULT ECCacheManager::SetCell(const sObjectTableKey *lpsRowItem,
     unsigned int ulPropTag, const struct propVal *lpSrc)
 {
-    ECRESULT er = erSuccess;
-    ECsCells *sCell;
-
 	if (lpsRowItem->ulOrderId != 0)
 		return ZARAFA_E_NOT_FOUND;
 
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(lpsRowItem->ulObjId));
+
+	return _SetCell(m_CellCache.Shard(lpsRowItem->ulObjId), lpsRowItem, ulPropTag, lpSrc);
+}
+
+/**
+ * Add a batch of cells to the cell cache
+ *
+ * Used by the table engines after reading a block of rows from the database.
+ * The cells are grouped per cache segment, so each segment lock is taken
+ * only once for the whole batch instead of once per cell.
+ *
+ * @param[in] lstCells Cells to add; cells of multi-valued instance rows are skipped
+ */
+ECRESULT ECCacheManager::SetCells(const std::list<ECsCellValue> &lstCells)
+{
+	std::vector<std::list<const ECsCellValue *> > vShards(m_CellCache.ShardCount());
+	std::list<ECsCellValue>::const_iterator i;
+	std::list<const ECsCellValue *>::const_iterator j;
+
+	for (i = lstCells.begin(); i != lstCells.end(); ++i) {
+		if (i->sKey.ulOrderId != 0)
+			continue;
+		vShards[m_CellCache.ShardIndex(i->sKey.ulObjId)].push_back(&*i);
+	}
 
-	if (m_CellCache.GetCacheItem(lpsRowItem->ulObjId, &sCell) == erSuccess) {
+	for (size_t n = 0; n < vShards.size(); ++n) {
+		if (vShards[n].empty())
+			continue;
+
+		scoped_lock lock(m_CellCache.MutexAt(n));
+
+		for (j = vShards[n].begin(); j != vShards[n].end(); ++j)
+			_SetCell(m_CellCache.ShardAt(n), &(*j)->sKey, (*j)->ulPropTag, (*j)->lpPropVal);
+	}
+
+	return erSuccess;
+}
+
+// Caller must hold the lock of the segment which holds the cell
+ECRESULT ECCacheManager::_SetCell(ECCache<ECMapCells> &cache,
+    const sObjectTableKey *lpsRowItem, unsigned int ulPropTag,
+    const struct propVal *lpSrc)
+{
+    ECRESULT er = erSuccess;
+    ECsCells *sCell;
+
+	if (cache.GetCacheItem(lpsRowItem->ulObjId, &sCell) == erSuccess) {
         long long ulSize = sCell->GetSize();
         sCell->AddPropVal(ulPropTag, lpSrc);
         ulSize -= sCell->GetSize();
         
         // ulSize is positive if the cache shrank
         //m_ulCellSize -= ulSize;
-		m_CellCache.AddToSize(-ulSize);
+		cache.AddToSize(-ulSize);
     } else {
         ECsCells sNewCell;
         
         sNewCell.AddPropVal(ulPropTag, lpSrc);
         
-		er = m_CellCache.AddCacheItem(lpsRowItem->ulObjId, sNewCell);
+		er = cache.AddCacheItem(lpsRowItem->ulObjId, sNewCell);
     	if(er != erSuccess)
     	    goto exit;
     }
@@ -1560,9 +1616,9 @@ ECRESULT ECCacheManager::SetComplete(unsigned int ulObjId)
     ECRESULT er = erSuccess;
     ECsCells *sCell;
     
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(ulObjId));
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess) {
+	if (m_CellCache.Shard(ulObjId).GetCacheItem(ulObjId, &sCell) == erSuccess) {
         sCell->SetComplete(true);
     } else {
         er = ZARAFA_E_NOT_FOUND;
@@ -1584,9 +1640,9 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
     ECRESULT er = erSuccess;
     ECsCells *sCell;
     
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(ulObjId));
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess) {
+	if (m_CellCache.Shard(ulObjId).GetCacheItem(ulObjId, &sCell) == erSuccess) {
         sCell->UpdatePropVal(ulPropTag, lDelta);
     } else {
         er = ZARAFA_E_NOT_FOUND;
@@ -1607,9 +1663,9 @@ ECRESULT ECCacheManager::UpdateCell(unsigned int ulObjId, unsigned int ulPropTag
     ECRESULT er = erSuccess;
     ECsCells *sCell;
     
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(ulObjId));
 
-	if (m_CellCache.GetCacheItem(ulObjId, &sCell) == erSuccess) {
+	if (m_CellCache.Shard(ulObjId).GetCacheItem(ulObjId, &sCell) == erSuccess) {
         sCell->UpdatePropVal(ulPropTag, ulMask, ulValue);
     } else {
         er = ZARAFA_E_NOT_FOUND;
@@ -1628,9 +1684,9 @@ exit:
 ECRESULT ECCacheManager::_DelCell(unsigned int ulObjId)
 {
     ECRESULT er = erSuccess;
-	scoped_lock lock(m_hCacheCellsMutex);
+	scoped_lock lock(m_CellCache.Mutex(ulObjId));
     
-	er = m_CellCache.RemoveCacheItem(ulObjId);
+	er = m_CellCache.Shard(ulObjId).RemoveCacheItem(ulObjId);
 
 	return er;
 }
@@ -1785,7 +1841,6 @@ ECRESULT ECCacheManager::GetPropFromObject(unsigned int ulTag, unsigned int ulOb
 	DB_RESULT		lpDBResult = NULL;
 	DB_ROW			lpDBRow = NULL;
 	DB_LENGTHS		lpDBLenths = NULL;
-	std::string		strQuery;
 	ECDatabase*		lpDatabase = NULL;
 	ECsIndexProp	*sObject;
 	ECsIndexObject	sObjectKey;
@@ -1817,8 +1872,8 @@ ECRESULT ECCacheManager::GetPropFromObject(unsigned int ulTag, unsigned int ulOb
 		goto exit;
 
 	// Get them from the database
-	strQuery = "SELECT val_binary FROM indexedproperties FORCE INDEX(PRIMARY) WHERE tag="+stringify(ulTag)+" AND hierarchyid="+stringify(ulObjId);
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+	er = lpDatabase->DoSelectPrepared("SELECT val_binary FROM indexedproperties FORCE INDEX(PRIMARY) WHERE tag=? AND hierarchyid=?",
+		ECDatabaseParams().Add(ulTag).Add(ulObjId), &lpDBResult);
 	if(er != erSuccess)
 		goto exit;
 
@@ -1860,7 +1915,6 @@ ECRESULT ECCacheManager::GetObjectFromProp(unsigned int ulTag, unsigned int cbDa
 	ECRESULT		er = erSuccess;
 	DB_RESULT		lpDBResult = NULL;
 	DB_ROW			lpDBRow = NULL;
-	std::string		strQuery;
 	ECDatabase*		lpDatabase = NULL;
     ECsIndexObject sNewIndexObject;
 	ECsIndexProp	sObject;
@@ -1882,8 +1936,8 @@ ECRESULT ECCacheManager::GetObjectFromProp(unsigned int ulTag, unsigned int cbDa
         goto exit;
 
     // Get them from the database
-    strQuery = "SELECT hierarchyid FROM indexedproperties FORCE INDEX(bin) WHERE tag="+stringify(ulTag)+" AND val_binary="+ lpDatabase->EscapeBinary(lpData, cbData);
-    er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+    er = lpDatabase->DoSelectPrepared("SELECT hierarchyid FROM indexedproperties FORCE INDEX(bin) WHERE tag=? AND val_binary=?",
+        ECDatabaseParams().Add(ulTag).AddBinary(lpData, cbData), &lpDBResult);
     if(er != erSuccess)
         goto exit;
 
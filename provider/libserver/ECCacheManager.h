@@ -425,6 +425,13 @@ typedef struct {
 	unsigned int	ulPropTag;
 }ECsSortKeyKey;
 
+/* One cell for ECCacheManager::SetCells(); lpPropVal is not copied until SetCells() is called */
+typedef struct {
+	sObjectTableKey			sKey;
+	unsigned int			ulPropTag;
+	const struct propVal	*lpPropVal;
+} ECsCellValue;
+
 
 struct lessindexobjectkey {
 	bool operator()(const ECsIndexObject& a, const ECsIndexObject& b) const
@@ -510,6 +517,7 @@ public:
 	ECRESULT QueryParent(unsigned int ulObjId, unsigned int *ulParent);
 	
 	ECRESULT GetObjects(const std::list<sObjectTableKey> &lstObjects, std::map<sObjectTableKey, ECsObjects> &mapObjects);
+	ECRESULT SetObjects(const std::map<sObjectTableKey, ECsObjects> &mapObjects);
 	ECRESULT GetObjectsFromProp(unsigned int ulTag, const std::vector<unsigned int> &cbdata, const std::vector<unsigned char *> &lpdata, std::map<ECsIndexProp, unsigned int> &mapObjects);
 
 	ECRESULT GetStore(unsigned int ulObjId, unsigned int *ulStore, GUID *lpGuid, unsigned int maxdepth = 100);
@@ -549,6 +557,7 @@ public:
 	// Table data functions (pure cache functions, they will never access the DB themselves. Data must be provided through Set functions)
 	ECRESULT GetCell(const sObjectTableKey *, unsigned int tag, struct propVal *, struct soap *, bool computed);
 	ECRESULT SetCell(const sObjectTableKey *, unsigned int tag, const struct propVal *);
+	ECRESULT SetCells(const std::list<ECsCellValue> &lstCells);
 	ECRESULT UpdateCell(unsigned int ulObjId, unsigned int ulPropTag, int lDelta);
 	ECRESULT UpdateCell(unsigned int ulObjId, unsigned int ulPropTag, unsigned int ulMask, unsigned int ulValue);
 	ECRESULT SetComplete(unsigned int ulObjId);
@@ -603,6 +612,7 @@ private:
 	ECRESULT _GetUserObjectDetails(unsigned int ulUserId, objectdetails_t *details);
 	ECRESULT _DelUserObjectDetails(unsigned int ulUserId);
 
+	ECRESULT _SetCell(ECCache<ECMapCells> &cache, const sObjectTableKey *, unsigned int tag, const struct propVal *);
 	ECRESULT _DelCell(unsigned int ulObjId);
 
 	ECRESULT _GetQuota(unsigned int ulUserId, bool bIsDefaultQuota, quotadetails_t *quota);
@@ -613,33 +623,32 @@ private:
 
 private:
 	ECDatabaseFactory*	m_lpDatabaseFactory;
-	pthread_mutex_t		m_hCacheMutex;			// Store, Object, User, ACL, server cache
-	pthread_mutex_t		m_hCacheCellsMutex;		// Cell cache
+	pthread_mutex_t		m_hCacheMutex;			// Extern id and server cache; the others are sharded
 	pthread_mutex_t		m_hCacheIndPropMutex;	// Indexed properties cache
 	
 	// Quota cache, to reduce the impact of the user plugin
 	// m_mapQuota contains user and company cache, except when it's the company user default quota
 	// m_mapQuotaUserDefault contains company user default quota
 	// this can't be in the same map, since the id is the same for "company" and "company user default"
-	ECCache<ECMapQuota>			m_QuotaCache;
-	ECCache<ECMapQuota>			m_QuotaUserDefaultCache;
+	ECShardedCache<ECMapQuota>	m_QuotaCache;
+	ECShardedCache<ECMapQuota>	m_QuotaUserDefaultCache;
 
 	// Object cache, (hierarchy table)
-	ECCache<ECMapObjects>		m_ObjectsCache;
+	ECShardedCache<ECMapObjects>	m_ObjectsCache;
 
 	// Store cache
-	ECCache<ECMapStores>		m_StoresCache;
+	ECShardedCache<ECMapStores>	m_StoresCache;
 
 	// User cache
-	ECCache<ECMapUserObject>	m_UserObjectCache;
+	ECShardedCache<ECMapUserObject>	m_UserObjectCache;
 	ECCache<ECMapUEIdObject>	m_UEIdObjectCache;
-	ECCache<ECMapUserObjectDetails>	m_UserObjectDetailsCache;
+	ECShardedCache<ECMapUserObjectDetails>	m_UserObjectDetailsCache;
 
 	// ACL cache
-	ECCache<ECMapACLs>			m_AclCache;
+	ECShardedCache<ECMapACLs>	m_AclCache;
 
 	// Cell cache, include the column data of a loaded table
-	ECCache<ECMapCells>			m_CellCache;
+	ECShardedCache<ECMapCells>	m_CellCache;
 	
 	// Server cache
 	ECCache<ECMapServerDetails>	m_ServerDetailsCache;
@@ -40,6 +40,7 @@
  * searchresults     | Search folder results
  * settings          | Server dependent settings
  * singleinstances   | The relation between an attachment and one or more message objects
+ * singleinstancehashes | Content hash of the attachment data, to find existing instances with the same data
  * stores            | A list with data stores related to one user and includes the deleted stores.
  * syncedmessages    | Messages which are synced with a specific restriction
  * syncs             | Sync state of a folder
@@ -202,6 +203,14 @@
 										UNIQUE KEY `hkey` (`hierarchyid`, `tag`) \
 									) ENGINE=InnoDB CHARACTER SET utf8 COLLATE utf8_general_ci;"
 
+#define Z_TABLEDEF_SINGLEINSTANCEHASHES	"CREATE TABLE `singleinstancehashes` ( \
+										`instanceid` int(11) unsigned NOT NULL, \
+										`hash` binary(32) NOT NULL, \
+										`size` bigint(20) unsigned NOT NULL, \
+										PRIMARY KEY (`instanceid`), \
+										UNIQUE KEY `hash` (`hash`, `size`) \
+									) ENGINE=InnoDB CHARACTER SET utf8 COLLATE utf8_general_ci;"
+
 #define Z_TABLEDEF_OBJECT			"CREATE TABLE object ( \
 										`id` int(11) unsigned NOT NULL auto_increment, \
 										`externid` blob, \
@@ -412,6 +421,7 @@
 #define Z_UPDATE_UPDATE_STORES					62
 #define Z_UPDATE_UPDATE_WLINK_RECKEY			63
 #define Z_UPDATE_VERSIONTBL_MICRO 64
+#define Z_UPDATE_CREATE_SINGLEINSTANCEHASHES	65
 
 /*
  * The first population of the SQL tables can use both create-type and
@@ -419,9 +429,9 @@
  * version that can be reached with creates only.
  * (This is never less than %Z_UPDATE_LAST.)
  */
-#define Z_UPDATE_RELEASE_ID 64
+#define Z_UPDATE_RELEASE_ID 65
 
 // This is the last update ID always update this to the last ID
-#define Z_UPDATE_LAST 64
+#define Z_UPDATE_LAST 65
 
 #endif
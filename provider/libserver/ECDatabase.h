@@ -18,10 +18,12 @@
 #ifndef ECDATABASE_H
 #define ECDATABASE_H
 
+#include <zarafa/zcdefs.h>
 #include <zarafa/ECConfig.h>
 #include <zarafa/ZarafaCode.h>
 
 #include <string>
+#include <vector>
 
 typedef void *			DB_RESULT;	
 typedef char **			DB_ROW;	
@@ -34,6 +36,61 @@ typedef unsigned int	DB_ERROR;
 #define DB_E_LOCK_DEADLOCK		DB_ERROR(2)
 
 
+/*
+ * Parameters for a prepared statement, bound in order to the '?' placeholders in the
+ * query. String and binary data is not copied, so it must stay valid until the query
+ * has been executed.
+ */
+class ECDatabaseParams _zcp_final {
+public:
+	enum param_type { PARAM_NULL, PARAM_INT, PARAM_DOUBLE, PARAM_STRING, PARAM_BINARY };
+
+	struct param {
+		param_type			type;
+		unsigned long long	ullValue;	// PARAM_INT
+		double				dblValue;	// PARAM_DOUBLE
+		const void *		lpData;		// PARAM_STRING and PARAM_BINARY
+		unsigned long		cbData;
+	};
+
+	ECDatabaseParams &AddNull() { return Push(PARAM_NULL, 0, 0, NULL, 0); }
+	ECDatabaseParams &Add(unsigned int ulValue) { return Push(PARAM_INT, ulValue, 0, NULL, 0); }
+	ECDatabaseParams &Add(unsigned long long ullValue) { return Push(PARAM_INT, ullValue, 0, NULL, 0); }
+	ECDatabaseParams &Add(double dblValue) { return Push(PARAM_DOUBLE, 0, dblValue, NULL, 0); }
+	ECDatabaseParams &Add(const std::string &strValue) { return Push(PARAM_STRING, 0, 0, strValue.data(), strValue.size()); }
+	ECDatabaseParams &AddBinary(const void *lpData, unsigned long cbData) { return Push(PARAM_BINARY, 0, 0, lpData, cbData); }
+	ECDatabaseParams &AddBinary(const std::string &strData) { return Push(PARAM_BINARY, 0, 0, strData.data(), strData.size()); }
+
+	size_t size() const { return m_vParams.size(); }
+	const param &operator[](size_t n) const { return m_vParams[n]; }
+
+private:
+	ECDatabaseParams &Push(param_type type, unsigned long long ullValue, double dblValue, const void *lpData, unsigned long cbData)
+	{
+		param p = { type, ullValue, dblValue, lpData, cbData };
+		m_vParams.push_back(p);
+		return *this;
+	}
+
+	std::vector<param> m_vParams;
+};
+
+class ECDatabase;
+
+// Work that has to be done at the end of each transaction, see ECDatabase::SetCommitHook()
+class ECDatabaseCommitHook
+{
+public:
+	virtual					~ECDatabaseCommitHook() {};
+
+	// Called within the transaction just before COMMIT; on error the transaction is not committed
+	virtual ECRESULT		OnCommit(ECDatabase *lpDatabase) = 0;
+	// Called after the transaction was committed
+	virtual void			OnCommitted() = 0;
+	// Called after the transaction was rolled back, or when committing it failed
+	virtual void			OnRollback() = 0;
+};
+
 // Abstract base class for databases
 class ECDatabase
 {
@@ -56,6 +113,14 @@ public:
 	// Sequence generator - Do NOT CALL THIS FROM WITHIN A TRANSACTION.
 	virtual ECRESULT		DoSequence(const std::string &strSeqName, unsigned int ulCount, unsigned long long *lpllFirstId) = 0;
 
+	// Prepared statements; the query is prepared once per connection, and the parameters are sent
+	// in binary form, so binary data does not need to be escaped. Only use these with constant query
+	// strings, since every distinct query keeps a statement open on the connection.
+	virtual ECRESULT		DoSelectPrepared(const std::string &strQuery, const ECDatabaseParams &params, DB_RESULT *lpResult) = 0;
+	virtual ECRESULT		DoUpdatePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows = NULL) = 0;
+	virtual ECRESULT		DoInsertPrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulInsertId = NULL, unsigned int *lpulAffectedRows = NULL) = 0;
+	virtual ECRESULT		DoDeletePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows = NULL) = 0;
+
 	// Result functions
 	virtual unsigned int	GetNumRows(DB_RESULT sResult) = 0;
 	virtual unsigned int	GetNumRowFields(DB_RESULT sResult) = 0;
@@ -105,6 +170,12 @@ public:
 	virtual ECRESULT		Begin() = 0;
 	virtual ECRESULT		Commit() = 0;
 	virtual ECRESULT		Rollback() = 0;
+	virtual bool			InTransaction() = 0;
+
+	// The commit hook is called on every Commit() and Rollback() of this connection. The
+	// database takes ownership of the hook, and deletes a previously set hook.
+	virtual ECDatabaseCommitHook *GetCommitHook() = 0;
+	virtual void			SetCommitHook(ECDatabaseCommitHook *lpHook) = 0;
 	
 	// Return the maximum size of any query we can send
 	virtual unsigned int	GetMaxAllowedPacket() = 0;
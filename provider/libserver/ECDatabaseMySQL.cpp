@@ -69,6 +69,33 @@ static const char THIS_FILE[] = __FILE__;
 // why.
 #define MAX_ALLOWED_PACKET			16776192
 
+// Size of the per-column buffer used to fetch prepared statement results. Larger
+// values are fetched separately.
+#define PREPARED_COLUMN_SIZE		256
+
+// Maximum number of prepared statements kept open per connection; the least
+// recently used statement is closed when a new one is prepared.
+#define MAX_PREPARED_STATEMENTS		64
+
+/*
+ * Result set of a prepared statement. All rows are copied out of the statement, so the
+ * statement can be executed again while the result is still in use. The rows look the same
+ * as those from mysql_fetch_row(): every value is NUL-terminated, and NULL values are NULL.
+ */
+class ECPreparedResult _zcp_final {
+public:
+	ECPreparedResult() : ulFields(0), ulRows(0), ulNext(0) {}
+
+	unsigned int				ulFields;
+	size_t						ulRows;
+	size_t						ulNext;			// next row for FetchRow()
+	std::vector<std::string>	vFieldNames;
+	std::string					strData;		// all values, each followed by a NUL
+	std::vector<unsigned long>	vOffsets;		// offset in strData per value, (unsigned long)-1 for NULL
+	std::vector<unsigned long>	vLengths;		// length per value
+	std::vector<char *>			vRow;			// the row returned by FetchRow()
+};
+
 typedef struct _sUpdateList {
 	unsigned int ulVersion;
 	unsigned int ulVersionMin; // Version to start the update
@@ -196,6 +223,7 @@ static const sUpdateList_t sUpdateList[] = {
 
 	// New in 7.2.2
 	{ Z_UPDATE_VERSIONTBL_MICRO, 0, "Add \"micro\" column to \"versions\" table", UpdateVersionsTbl },
+	{ Z_UPDATE_CREATE_SINGLEINSTANCEHASHES, 0, "Creating single instance hash table", UpdateDatabaseCreateSingleInstanceHashes },
 };
 
 static const char *const server_groups[] = {
@@ -365,6 +393,16 @@ ECDatabaseMySQL::ECDatabaseMySQL(ECConfig *lpConfig)
 	m_bAutoLock			= true;
 	m_lpConfig			= lpConfig;
 	m_bSuppressLockErrorLogging = false;
+	m_ulStmtErrno		= 0;
+	m_bInTransaction	= false;
+	m_bTransactionLost	= false;
+	m_lpCommitHook		= NULL;
+
+	// Histograms are shared by all connections
+	m_lpSelectLatency	= g_lpStatsCollector->GetHistogram("sql_select", "SQL select queries");
+	m_lpInsertLatency	= g_lpStatsCollector->GetHistogram("sql_insert", "SQL insert queries");
+	m_lpUpdateLatency	= g_lpStatsCollector->GetHistogram("sql_update", "SQL update queries");
+	m_lpDeleteLatency	= g_lpStatsCollector->GetHistogram("sql_delete", "SQL delete queries");
 
 	// Create a mutex handle for mysql
 	pthread_mutexattr_t mattr;
@@ -381,6 +419,7 @@ ECDatabaseMySQL::ECDatabaseMySQL(ECConfig *lpConfig)
 ECDatabaseMySQL::~ECDatabaseMySQL()
 {
 	Close();
+	delete m_lpCommitHook;
 	// Close the mutex handle of mysql
 	pthread_mutex_destroy(&m_hMutexMySql);
 }
@@ -764,6 +803,14 @@ ECRESULT ECDatabaseMySQL::Close()
 
 	m_bConnected = false;
 
+	// Prepared statements belong to the connection
+	CloseStatements();
+
+	// and so does any open transaction
+	if (m_bInTransaction && m_lpCommitHook)
+		m_lpCommitHook->OnRollback();
+	m_bInTransaction = false;
+
 	// Close mysql data connection and deallocate data
 	if(m_bMysqlInitialize)
 		mysql_close(&m_lpMySQL);
@@ -795,7 +842,8 @@ bool ECDatabaseMySQL::isConnected() {
  *
  * Sends a query to the MySQL server, and does a reconnect if the server connection is lost before or during
  * the SQL query. The reconnect is done only once. If the query fails after the reconnect, the entire call
- * fails.
+ * fails. When the connection is lost inside a transaction, the transaction is gone with it, so the query
+ * is not retried; it and every further query fail until the caller issues Rollback().
  * 
  * It is up to the caller to get any result information from the query.
  *
@@ -807,11 +855,20 @@ ECRESULT ECDatabaseMySQL::Query(const string &strQuery) {
 	int err;
 	
 	LOG_SQL_DEBUG("SQL [%08lu]: \"%s;\"", m_lpMySQL.thread_id, strQuery.c_str());
+	m_ulStmtErrno = 0;
+
+	if (m_bTransactionLost) {
+		ec_log_err("SQL [%08lu] Failed: transaction was lost with the connection, Query: \"%s\"", m_lpMySQL.thread_id, strQuery.c_str());
+		er = ZARAFA_E_DATABASE_ERROR;
+		goto exit;
+	}
 
 	// use mysql_real_query to be binary safe ( http://dev.mysql.com/doc/mysql/en/mysql-real-query.html )
 	err = mysql_real_query( &m_lpMySQL, strQuery.c_str(), strQuery.length() );
 
 	if(err && (mysql_errno(&m_lpMySQL) == CR_SERVER_LOST || mysql_errno(&m_lpMySQL) == CR_SERVER_GONE_ERROR)) {
+		bool bInTransaction = m_bInTransaction;
+
 		ec_log_warn("SQL [%08lu] info: Try to reconnect", m_lpMySQL.thread_id);
 			
 		er = Close();
@@ -821,6 +878,14 @@ ECRESULT ECDatabaseMySQL::Query(const string &strQuery) {
 		er = Connect();
 		if(er != erSuccess)
 			goto exit;
+
+		// The earlier statements of the transaction are gone, do not run the rest in autocommit
+		if (bInTransaction) {
+			ec_log_err("SQL [%08lu] Failed: connection lost during a transaction, Query: \"%s\"", m_lpMySQL.thread_id, strQuery.c_str());
+			m_bTransactionLost = true;
+			er = ZARAFA_E_DATABASE_ERROR;
+			goto exit;
+		}
 			
 		// Try again
 		err = mysql_real_query( &m_lpMySQL, strQuery.c_str(), strQuery.length() );
@@ -858,6 +923,7 @@ exit:
 ECRESULT ECDatabaseMySQL::DoSelect(const string &strQuery, DB_RESULT *lppResult, bool fStreamResult) {
 
 	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
 	DB_RESULT lpResult = NULL;
 
 	_ASSERT(strQuery.length()!= 0);
@@ -896,6 +962,8 @@ exit:
 		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
 	}
 
+	g_lpStatsCollector->AddLatency(m_lpSelectLatency, GetTimeOfDay() - dblStart);
+
 	// Autolock, unlock data
 	if(m_bAutoLock)
 		UnLock();
@@ -906,6 +974,7 @@ exit:
 ECRESULT ECDatabaseMySQL::DoSelectMulti(const string &strQuery) {
 
 	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
 
 	_ASSERT(strQuery.length()!= 0);
 
@@ -929,6 +998,8 @@ exit:
 		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
 	}
 
+	g_lpStatsCollector->AddLatency(m_lpSelectLatency, GetTimeOfDay() - dblStart);
+
 	// Autolock, unlock data
 	if(m_bAutoLock)
 		UnLock();
@@ -1043,6 +1114,7 @@ exit:
 ECRESULT ECDatabaseMySQL::DoUpdate(const string &strQuery, unsigned int *lpulAffectedRows) {
 	
 	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
 
 	// Autolock, lock data
 	if(m_bAutoLock)
@@ -1056,6 +1128,7 @@ ECRESULT ECDatabaseMySQL::DoUpdate(const string &strQuery, unsigned int *lpulAff
 	}
 
 	g_lpStatsCollector->Increment(SCN_DATABASE_UPDATES);
+	g_lpStatsCollector->AddLatency(m_lpUpdateLatency, GetTimeOfDay() - dblStart);
 
 	// Autolock, unlock data
 	if(m_bAutoLock)
@@ -1097,6 +1170,7 @@ exit:
 ECRESULT ECDatabaseMySQL::DoInsert(const string &strQuery, unsigned int *lpulInsertId, unsigned int *lpulAffectedRows)
 {
 	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
 
 	// Autolock, lock data
 	if(m_bAutoLock)
@@ -1113,6 +1187,7 @@ ECRESULT ECDatabaseMySQL::DoInsert(const string &strQuery, unsigned int *lpulIns
 	}
 
 	g_lpStatsCollector->Increment(SCN_DATABASE_INSERTS);
+	g_lpStatsCollector->AddLatency(m_lpInsertLatency, GetTimeOfDay() - dblStart);
 
 	// Autolock, unlock data
 	if(m_bAutoLock)
@@ -1133,6 +1208,7 @@ ECRESULT ECDatabaseMySQL::DoInsert(const string &strQuery, unsigned int *lpulIns
 ECRESULT ECDatabaseMySQL::DoDelete(const string &strQuery, unsigned int *lpulAffectedRows) {
 
 	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
 
 	// Autolock, lock data
 	if(m_bAutoLock)
@@ -1146,6 +1222,7 @@ ECRESULT ECDatabaseMySQL::DoDelete(const string &strQuery, unsigned int *lpulAff
 	}
 
 	g_lpStatsCollector->Increment(SCN_DATABASE_DELETES);
+	g_lpStatsCollector->AddLatency(m_lpDeleteLatency, GetTimeOfDay() - dblStart);
 
 	// Autolock, unlock data
 	if(m_bAutoLock)
@@ -1202,6 +1279,464 @@ exit:
 	return er;
 }
 
+/**
+ * Get a prepared statement for a query from the statement cache of this
+ * connection, preparing it on first use. At most MAX_PREPARED_STATEMENTS are
+ * kept, so callers must not build queries with values in the query text.
+ *
+ * @param[in] strQuery SQL query with '?' placeholders
+ * @param[out] lppStmt Prepared statement
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::GetStatement(const std::string &strQuery, MYSQL_STMT **lppStmt)
+{
+	std::map<std::string, stmtentry_t>::iterator iStmt = m_mapStatements.find(strQuery);
+	MYSQL_STMT *lpStmt = NULL;
+	stmtentry_t sEntry;
+
+	if (iStmt != m_mapStatements.end()) {
+		m_lstStatementLRU.splice(m_lstStatementLRU.begin(), m_lstStatementLRU, iStmt->second.iterLRU);
+		*lppStmt = iStmt->second.lpStmt;
+		return erSuccess;
+	}
+
+	if (m_mapStatements.size() >= MAX_PREPARED_STATEMENTS) {
+		// Results are copied out of the statement, so it is not in use anymore
+		iStmt = m_mapStatements.find(m_lstStatementLRU.back());
+		mysql_stmt_close(iStmt->second.lpStmt);
+		m_mapStatements.erase(iStmt);
+		m_lstStatementLRU.pop_back();
+	}
+
+	lpStmt = mysql_stmt_init(&m_lpMySQL);
+	if (lpStmt == NULL) {
+		ec_log_err("SQL [%08lu] statement init failed: %s", m_lpMySQL.thread_id, mysql_error(&m_lpMySQL));
+		return ZARAFA_E_DATABASE_ERROR;
+	}
+
+	if (mysql_stmt_prepare(lpStmt, strQuery.c_str(), strQuery.length()) != 0) {
+		m_ulStmtErrno = mysql_stmt_errno(lpStmt);
+		ec_log_err("SQL [%08lu] prepare failed: %s, Query: \"%s\"", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt), strQuery.c_str());
+		mysql_stmt_close(lpStmt);
+		return ZARAFA_E_DATABASE_ERROR;
+	}
+
+	sEntry.lpStmt = lpStmt;
+	sEntry.iterLRU = m_lstStatementLRU.insert(m_lstStatementLRU.begin(), strQuery);
+	m_mapStatements.insert(std::make_pair(strQuery, sEntry));
+	*lppStmt = lpStmt;
+	return erSuccess;
+}
+
+void ECDatabaseMySQL::CloseStatements()
+{
+	std::map<std::string, stmtentry_t>::const_iterator iStmt;
+
+	for (iStmt = m_mapStatements.begin(); iStmt != m_mapStatements.end(); ++iStmt)
+		mysql_stmt_close(iStmt->second.lpStmt);
+	m_mapStatements.clear();
+	m_lstStatementLRU.clear();
+}
+
+/**
+ * Execute a prepared statement
+ *
+ * Binds the parameters to the (cached) statement for the query and executes it. Like Query(), this
+ * reconnects once if the server connection was lost.
+ *
+ * @param[in] strQuery SQL query with '?' placeholders
+ * @param[in] params Parameters for the placeholders
+ * @param[out] lppStmt The executed statement, for retrieving the results
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::ExecutePrepared(const std::string &strQuery, const ECDatabaseParams &params, MYSQL_STMT **lppStmt)
+{
+	ECRESULT er = erSuccess;
+	MYSQL_STMT *lpStmt = NULL;
+	std::vector<MYSQL_BIND> vBind(params.size());
+
+	LOG_SQL_DEBUG("SQL [%08lu]: \"%s;\" (%lu parameters)", m_lpMySQL.thread_id, strQuery.c_str(), static_cast<unsigned long>(params.size()));
+
+	if (m_bTransactionLost) {
+		ec_log_err("SQL [%08lu] Failed: transaction was lost with the connection, Query: \"%s\"", m_lpMySQL.thread_id, strQuery.c_str());
+		return ZARAFA_E_DATABASE_ERROR;
+	}
+
+	if (!vBind.empty())
+		memset(&vBind[0], 0, sizeof(MYSQL_BIND) * vBind.size());
+	for (size_t i = 0; i < params.size(); ++i) {
+		const ECDatabaseParams::param &p = params[i];
+
+		switch (p.type) {
+		case ECDatabaseParams::PARAM_NULL:
+			vBind[i].buffer_type = MYSQL_TYPE_NULL;
+			break;
+		case ECDatabaseParams::PARAM_INT:
+			vBind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+			vBind[i].buffer = const_cast<unsigned long long *>(&p.ullValue);
+			vBind[i].is_unsigned = 1;
+			break;
+		case ECDatabaseParams::PARAM_DOUBLE:
+			vBind[i].buffer_type = MYSQL_TYPE_DOUBLE;
+			vBind[i].buffer = const_cast<double *>(&p.dblValue);
+			break;
+		case ECDatabaseParams::PARAM_STRING:
+		case ECDatabaseParams::PARAM_BINARY:
+			vBind[i].buffer_type = p.type == ECDatabaseParams::PARAM_STRING ? MYSQL_TYPE_STRING : MYSQL_TYPE_BLOB;
+			vBind[i].buffer = const_cast<void *>(p.lpData);
+			vBind[i].buffer_length = p.cbData;
+			break;
+		}
+	}
+
+	for (int nTry = 0; ; ++nTry) {
+		er = GetStatement(strQuery, &lpStmt);
+		if (er != erSuccess)
+			return er;
+
+		if (mysql_stmt_param_count(lpStmt) != params.size()) {
+			ec_log_err("SQL [%08lu] prepared statement expects %lu parameters, got %lu. Query: \"%s\"", m_lpMySQL.thread_id,
+				mysql_stmt_param_count(lpStmt), static_cast<unsigned long>(params.size()), strQuery.c_str());
+			ASSERT(false);
+			return ZARAFA_E_DATABASE_ERROR;
+		}
+
+		if ((vBind.empty() || mysql_stmt_bind_param(lpStmt, &vBind[0]) == 0) && mysql_stmt_execute(lpStmt) == 0)
+			break;
+
+		m_ulStmtErrno = mysql_stmt_errno(lpStmt);
+		if (nTry == 0 && (m_ulStmtErrno == CR_SERVER_LOST || m_ulStmtErrno == CR_SERVER_GONE_ERROR)) {
+			bool bInTransaction = m_bInTransaction;
+
+			ec_log_warn("SQL [%08lu] info: Try to reconnect", m_lpMySQL.thread_id);
+
+			// Closing the connection also drops the statements, they are prepared again
+			er = Close();
+			if (er != erSuccess)
+				return er;
+			er = Connect();
+			if (er != erSuccess)
+				return er;
+			// As in Query(), a lost transaction is not continued in autocommit
+			if (bInTransaction) {
+				ec_log_err("SQL [%08lu] Failed: connection lost during a transaction, Query: \"%s\"", m_lpMySQL.thread_id, strQuery.c_str());
+				m_bTransactionLost = true;
+				return ZARAFA_E_DATABASE_ERROR;
+			}
+			continue;
+		}
+
+		if (!m_bSuppressLockErrorLogging || GetLastError() == DB_E_UNKNOWN)
+			ec_log_err("SQL [%08lu] Failed: %s, Query: \"%s\"", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt), strQuery.c_str());
+		if (m_ulStmtErrno != ER_NO_SUCH_TABLE)
+			ASSERT(false);
+		return ZARAFA_E_DATABASE_ERROR;
+	}
+
+	m_ulStmtErrno = 0;
+	*lppStmt = lpStmt;
+	return erSuccess;
+}
+
+/**
+ * Copy the result set of an executed prepared statement
+ *
+ * @param[in] lpStmt Executed statement
+ * @param[out] lppResult Result with all rows of the statement
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::StorePreparedResult(MYSQL_STMT *lpStmt, ECPreparedResult **lppResult)
+{
+	ECRESULT er = erSuccess;
+	ECPreparedResult *lpResult = new ECPreparedResult;
+	MYSQL_RES *lpMeta = NULL;
+	MYSQL_FIELD *lpFields = NULL;
+	std::vector<MYSQL_BIND> vBind;
+	std::vector<unsigned long> vLength;
+	std::vector<my_bool> vNull;
+	std::vector<char> vBuffer;
+	int ret = 0;
+
+	lpMeta = mysql_stmt_result_metadata(lpStmt);
+	if (lpMeta == NULL) {
+		ec_log_err("SQL [%08lu] prepared statement has no result set: %s", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt));
+		er = ZARAFA_E_DATABASE_ERROR;
+		goto exit;
+	}
+
+	lpResult->ulFields = mysql_num_fields(lpMeta);
+	lpFields = mysql_fetch_fields(lpMeta);
+	for (unsigned int i = 0; i < lpResult->ulFields; ++i)
+		lpResult->vFieldNames.push_back(lpFields[i].name);
+	lpResult->vRow.resize(lpResult->ulFields);
+
+	if (mysql_stmt_store_result(lpStmt) != 0) {
+		ec_log_err("SQL [%08lu] result failed: %s", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt));
+		er = ZARAFA_E_DATABASE_ERROR;
+		goto exit;
+	}
+
+	// Fetch every column as a string; binary data is returned as-is
+	vBind.resize(lpResult->ulFields);
+	vLength.resize(lpResult->ulFields);
+	vNull.resize(lpResult->ulFields);
+	vBuffer.resize(lpResult->ulFields * PREPARED_COLUMN_SIZE);
+	for (unsigned int i = 0; i < lpResult->ulFields; ++i) {
+		memset(&vBind[i], 0, sizeof(MYSQL_BIND));
+		vBind[i].buffer_type = MYSQL_TYPE_STRING;
+		vBind[i].buffer = &vBuffer[i * PREPARED_COLUMN_SIZE];
+		vBind[i].buffer_length = PREPARED_COLUMN_SIZE;
+		vBind[i].length = &vLength[i];
+		vBind[i].is_null = &vNull[i];
+	}
+
+	if (!vBind.empty() && mysql_stmt_bind_result(lpStmt, &vBind[0]) != 0) {
+		ec_log_err("SQL [%08lu] result bind failed: %s", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt));
+		er = ZARAFA_E_DATABASE_ERROR;
+		goto exit;
+	}
+
+	lpResult->ulRows = mysql_stmt_num_rows(lpStmt);
+	lpResult->vOffsets.reserve(lpResult->ulRows * lpResult->ulFields);
+	lpResult->vLengths.reserve(lpResult->ulRows * lpResult->ulFields);
+
+	while ((ret = mysql_stmt_fetch(lpStmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+		for (unsigned int i = 0; i < lpResult->ulFields; ++i) {
+			size_t ulOffset = lpResult->strData.size();
+
+			if (vNull[i]) {
+				lpResult->vOffsets.push_back((unsigned long)-1);
+				lpResult->vLengths.push_back(0);
+				continue;
+			}
+
+			lpResult->vOffsets.push_back(ulOffset);
+			lpResult->vLengths.push_back(vLength[i]);
+
+			if (vLength[i] <= PREPARED_COLUMN_SIZE) {
+				lpResult->strData.append(&vBuffer[i * PREPARED_COLUMN_SIZE], vLength[i]);
+			} else {
+				// The value did not fit in the column buffer, fetch it separately
+				MYSQL_BIND sBind;
+
+				lpResult->strData.resize(ulOffset + vLength[i]);
+				memset(&sBind, 0, sizeof(sBind));
+				sBind.buffer_type = MYSQL_TYPE_STRING;
+				sBind.buffer = &lpResult->strData[ulOffset];
+				sBind.buffer_length = vLength[i];
+				if (mysql_stmt_fetch_column(lpStmt, &sBind, i, 0) != 0) {
+					ec_log_err("SQL [%08lu] fetch column failed: %s", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt));
+					er = ZARAFA_E_DATABASE_ERROR;
+					goto exit;
+				}
+			}
+			lpResult->strData.push_back('\0');
+		}
+	}
+
+	if (ret != MYSQL_NO_DATA) {
+		ec_log_err("SQL [%08lu] fetch failed: %s", m_lpMySQL.thread_id, mysql_stmt_error(lpStmt));
+		er = ZARAFA_E_DATABASE_ERROR;
+		goto exit;
+	}
+
+	*lppResult = lpResult;
+	lpResult = NULL;
+
+exit:
+	if (lpMeta)
+		mysql_free_result(lpMeta);
+	mysql_stmt_free_result(lpStmt);
+	delete lpResult;
+
+	return er;
+}
+
+ECPreparedResult *ECDatabaseMySQL::GetPreparedResult(DB_RESULT sResult)
+{
+	if (m_setPreparedResults.empty() || m_setPreparedResults.find(sResult) == m_setPreparedResults.end())
+		return NULL;
+	return static_cast<ECPreparedResult *>(sResult);
+}
+
+/**
+ * Perform a SELECT operation with a prepared statement
+ *
+ * The result is read completely from the server, and can be used with the normal result
+ * functions like FetchRow() and FreeResult().
+ *
+ * @param[in] strQuery SELECT query string with '?' placeholders
+ * @param[in] params Parameters for the placeholders
+ * @param[out] lppResult Result output
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::DoSelectPrepared(const std::string &strQuery, const ECDatabaseParams &params, DB_RESULT *lppResult)
+{
+	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
+	MYSQL_STMT *lpStmt = NULL;
+	ECPreparedResult *lpResult = NULL;
+
+	// Autolock, lock data
+	if(m_bAutoLock)
+		Lock();
+
+	er = ExecutePrepared(strQuery, params, &lpStmt);
+	if (er != erSuccess) {
+		ec_log_err("ECDatabaseMySQL::DoSelectPrepared(): query failed");
+		goto exit;
+	}
+
+	er = StorePreparedResult(lpStmt, &lpResult);
+	if (er != erSuccess)
+		goto exit;
+
+	g_lpStatsCollector->Increment(SCN_DATABASE_SELECTS);
+
+	if (lppResult) {
+		m_setPreparedResults.insert(lpResult);
+		*lppResult = lpResult;
+	} else {
+		delete lpResult;
+	}
+
+exit:
+	if (er != erSuccess) {
+		g_lpStatsCollector->Increment(SCN_DATABASE_FAILED_SELECTS);
+		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
+	}
+
+	g_lpStatsCollector->AddLatency(m_lpSelectLatency, GetTimeOfDay() - dblStart);
+
+	// Autolock, unlock data
+	if(m_bAutoLock)
+		UnLock();
+
+	return er;
+}
+
+ECRESULT ECDatabaseMySQL::_UpdatePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulInsertId, unsigned int *lpulAffectedRows)
+{
+	ECRESULT er = erSuccess;
+	MYSQL_STMT *lpStmt = NULL;
+
+	er = ExecutePrepared(strQuery, params, &lpStmt);
+	if (er != erSuccess) {
+		ec_log_err("ECDatabaseMySQL::_UpdatePrepared() query failed");
+		return er;
+	}
+
+	if (lpulAffectedRows)
+		*lpulAffectedRows = (unsigned int)mysql_stmt_affected_rows(lpStmt);
+	if (lpulInsertId)
+		*lpulInsertId = (unsigned int)mysql_stmt_insert_id(lpStmt);
+
+	return erSuccess;
+}
+
+/**
+ * Perform an UPDATE operation with a prepared statement
+ *
+ * @param[in] strQuery UPDATE query string with '?' placeholders
+ * @param[in] params Parameters for the placeholders
+ * @param[out] lpulAffectedRows (optional) Receives the number of affected rows
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::DoUpdatePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows)
+{
+	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
+
+	// Autolock, lock data
+	if(m_bAutoLock)
+		Lock();
+
+	er = _UpdatePrepared(strQuery, params, NULL, lpulAffectedRows);
+
+	if (er != erSuccess) {
+		g_lpStatsCollector->Increment(SCN_DATABASE_FAILED_UPDATES);
+		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
+	}
+
+	g_lpStatsCollector->Increment(SCN_DATABASE_UPDATES);
+	g_lpStatsCollector->AddLatency(m_lpUpdateLatency, GetTimeOfDay() - dblStart);
+
+	// Autolock, unlock data
+	if(m_bAutoLock)
+		UnLock();
+
+	return er;
+}
+
+/**
+ * Perform an INSERT operation with a prepared statement
+ *
+ * @param[in] strQuery INSERT query string with '?' placeholders
+ * @param[in] params Parameters for the placeholders
+ * @param[out] lpulInsertId (optional) Receives the last insert id
+ * @param[out] lpulAffectedRows (optional) Receives the number of inserted rows
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::DoInsertPrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulInsertId, unsigned int *lpulAffectedRows)
+{
+	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
+
+	// Autolock, lock data
+	if(m_bAutoLock)
+		Lock();
+
+	er = _UpdatePrepared(strQuery, params, lpulInsertId, lpulAffectedRows);
+
+	if (er != erSuccess) {
+		g_lpStatsCollector->Increment(SCN_DATABASE_FAILED_INSERTS);
+		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
+	}
+
+	g_lpStatsCollector->Increment(SCN_DATABASE_INSERTS);
+	g_lpStatsCollector->AddLatency(m_lpInsertLatency, GetTimeOfDay() - dblStart);
+
+	// Autolock, unlock data
+	if(m_bAutoLock)
+		UnLock();
+
+	return er;
+}
+
+/**
+ * Perform a DELETE operation with a prepared statement
+ *
+ * @param[in] strQuery DELETE query string with '?' placeholders
+ * @param[in] params Parameters for the placeholders
+ * @param[out] lpulAffectedRows (optional) Receives the number of deleted rows
+ * @return result erSuccess or ZARAFA_E_DATABASE_ERROR
+ */
+ECRESULT ECDatabaseMySQL::DoDeletePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows)
+{
+	ECRESULT er = erSuccess;
+	double dblStart = GetTimeOfDay();
+
+	// Autolock, lock data
+	if(m_bAutoLock)
+		Lock();
+
+	er = _UpdatePrepared(strQuery, params, NULL, lpulAffectedRows);
+
+	if (er != erSuccess) {
+		g_lpStatsCollector->Increment(SCN_DATABASE_FAILED_DELETES);
+		g_lpStatsCollector->SetTime(SCN_DATABASE_LAST_FAILED, time(NULL));
+	}
+
+	g_lpStatsCollector->Increment(SCN_DATABASE_DELETES);
+	g_lpStatsCollector->AddLatency(m_lpDeleteLatency, GetTimeOfDay() - dblStart);
+
+	// Autolock, unlock data
+	if(m_bAutoLock)
+		UnLock();
+
+	return er;
+}
+
 unsigned int ECDatabaseMySQL::GetAffectedRows() {
 
 	return (unsigned int)mysql_affected_rows(&m_lpMySQL);
@@ -1216,17 +1751,32 @@ void ECDatabaseMySQL::FreeResult(DB_RESULT sResult) {
 
 	_ASSERT(sResult != NULL);
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared) {
+		m_setPreparedResults.erase(sResult);
+		delete lpPrepared;
+		return;
+	}
+
 	if(sResult)
 		mysql_free_result((MYSQL_RES *)sResult);
 }
 
 unsigned int ECDatabaseMySQL::GetNumRows(DB_RESULT sResult) {
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared)
+		return lpPrepared->ulRows;
+
 	return (unsigned int)mysql_num_rows((MYSQL_RES *)sResult);
 }
 
 unsigned int ECDatabaseMySQL::GetNumRowFields(DB_RESULT sResult) {
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared)
+		return lpPrepared->ulFields;
+
 	return mysql_num_fields((MYSQL_RES *)sResult);
 }
 
@@ -1236,6 +1786,14 @@ unsigned int ECDatabaseMySQL::GetRowIndex(DB_RESULT sResult, const std::string &
 	unsigned int cbFields;
 	unsigned int ulIndex = (unsigned int)-1;
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared) {
+		for (unsigned int i = 0; i < lpPrepared->ulFields; ++i)
+			if (stricmp(lpPrepared->vFieldNames[i].c_str(), strFieldname.c_str()) == 0)
+				return i;
+		return ulIndex;
+	}
+
 	lpFields = mysql_fetch_fields((MYSQL_RES *)sResult);
 	cbFields = mysql_field_count(&m_lpMySQL);
 
@@ -1248,11 +1806,31 @@ unsigned int ECDatabaseMySQL::GetRowIndex(DB_RESULT sResult, const std::string &
 
 DB_ROW ECDatabaseMySQL::FetchRow(DB_RESULT sResult) {
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared) {
+		if (lpPrepared->ulNext >= lpPrepared->ulRows || lpPrepared->ulFields == 0)
+			return NULL;
+
+		size_t ulBase = lpPrepared->ulNext++ * lpPrepared->ulFields;
+		for (unsigned int i = 0; i < lpPrepared->ulFields; ++i) {
+			unsigned long ulOffset = lpPrepared->vOffsets[ulBase + i];
+			lpPrepared->vRow[i] = ulOffset == (unsigned long)-1 ? NULL : &lpPrepared->strData[ulOffset];
+		}
+		return &lpPrepared->vRow[0];
+	}
+
 	return mysql_fetch_row((MYSQL_RES *)sResult);
 }
 
 DB_LENGTHS ECDatabaseMySQL::FetchRowLengths(DB_RESULT sResult) {
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared) {
+		if (lpPrepared->ulNext == 0 || lpPrepared->ulFields == 0)
+			return NULL;
+		return &lpPrepared->vLengths[(lpPrepared->ulNext - 1) * lpPrepared->ulFields];
+	}
+
 	return (DB_LENGTHS)mysql_fetch_lengths((MYSQL_RES *)sResult);
 }
 
@@ -1346,6 +1924,12 @@ std::string ECDatabaseMySQL::EscapeBinary(const std::string& strData)
 
 void ECDatabaseMySQL::ResetResult(DB_RESULT sResult) {
 
+	ECPreparedResult *lpPrepared = GetPreparedResult(sResult);
+	if (lpPrepared) {
+		lpPrepared->ulNext = 0;
+		return;
+	}
+
 	mysql_data_seek((MYSQL_RES *)sResult, 0);
 }
 
@@ -1361,7 +1945,8 @@ DB_ERROR ECDatabaseMySQL::GetLastError()
 {
 	DB_ERROR dberr;
 	
-	switch (mysql_errno(&m_lpMySQL)) {
+	// Errors of prepared statements are kept in the statement
+	switch (m_ulStmtErrno != 0 ? m_ulStmtErrno : mysql_errno(&m_lpMySQL)) {
 		case ER_LOCK_WAIT_TIMEOUT:
 			dberr = DB_E_LOCK_WAIT_TIMEOUT;
 			break;
@@ -1387,7 +1972,10 @@ bool ECDatabaseMySQL::SuppressLockErrorLogging(bool bSuppress)
 ECRESULT ECDatabaseMySQL::Begin() {
 	ECRESULT er = erSuccess;
 	
+	m_bTransactionLost = false;
 	er = Query("BEGIN");
+	if (er == erSuccess)
+		m_bInTransaction = true;
 
 #ifdef DEBUG
 #if DEBUG_TRANSACTION
@@ -1405,7 +1993,25 @@ ECRESULT ECDatabaseMySQL::Begin() {
 
 ECRESULT ECDatabaseMySQL::Commit() {
 	ECRESULT er = erSuccess;
+
+	if (m_lpCommitHook && m_bInTransaction) {
+		// Leave the transaction open, so the caller can roll it back
+		er = m_lpCommitHook->OnCommit(this);
+		if (er != erSuccess)
+			return er;
+	}
+
+	// Fails if the transaction was lost with the connection
 	er = Query("COMMIT");
+	m_bInTransaction = false;
+	m_bTransactionLost = false;
+
+	if (m_lpCommitHook) {
+		if (er == erSuccess)
+			m_lpCommitHook->OnCommitted();
+		else
+			m_lpCommitHook->OnRollback();
+	}
 	
 #ifdef DEBUG
 #if DEBUG_TRANSACTION
@@ -1428,7 +2034,11 @@ ECRESULT ECDatabaseMySQL::Rollback() {
 	int err = 0;
 #endif
 
+	m_bTransactionLost = false;
 	er = Query("ROLLBACK");
+	m_bInTransaction = false;
+	if (m_lpCommitHook)
+		m_lpCommitHook->OnRollback();
 	
 #ifdef DEBUG
 #if DEBUG_TRANSACTION
@@ -1462,6 +2072,21 @@ ECRESULT ECDatabaseMySQL::Rollback() {
 	return er;
 }
 
+bool ECDatabaseMySQL::InTransaction() {
+	return m_bInTransaction;
+}
+
+ECDatabaseCommitHook *ECDatabaseMySQL::GetCommitHook() {
+	return m_lpCommitHook;
+}
+
+void ECDatabaseMySQL::SetCommitHook(ECDatabaseCommitHook *lpHook) {
+	if (lpHook == m_lpCommitHook)
+		return;
+	delete m_lpCommitHook;
+	m_lpCommitHook = lpHook;
+}
+
 unsigned int ECDatabaseMySQL::GetMaxAllowedPacket() {
     return m_ulMaxAllowedPacket;
 }
@@ -1555,6 +2180,7 @@ ECRESULT ECDatabaseMySQL::CreateDatabase()
 		{"objectrelation", Z_TABLEDEF_OBJECT_RELATION},
 
 		{"singleinstances", Z_TABLEDEF_REFERENCES },
+		{"singleinstancehashes", Z_TABLEDEF_SINGLEINSTANCEHASHES },
 		{"abchanges", Z_TABLEDEF_ABCHANGES },
 		{"syncedmessages", Z_TABLEDEFS_SYNCEDMESSAGES },
 		{"clientupdatestatus", Z_TABLEDEF_CLIENTUPDATESTATUS },
@@ -25,12 +25,17 @@
 #include <zarafa/zcdefs.h>
 #include <pthread.h>
 #include <mysql.h>
+#include <list>
+#include <map>
+#include <set>
 #include <string>
 
 #include "ECDatabase.h"
+#include "ECStatsCollector.h"
 
 class ECConfig;
 class ECLogger;
+class ECPreparedResult;
 class zcp_versiontuple;
 
 class ECDatabaseMySQL _zcp_final : public ECDatabase
@@ -51,6 +56,10 @@ public:
 	ECRESULT DoInsert(const std::string &strQuery, unsigned int *lpulInsertId = NULL, unsigned int *lpulAffectedRows = NULL) _zcp_override;
 	ECRESULT DoDelete(const std::string &strQuery, unsigned int *lpulAffectedRows = NULL) _zcp_override;
 	ECRESULT DoSequence(const std::string &strSeqName, unsigned int ulCount, unsigned long long *lpllFirstId) _zcp_override;
+	ECRESULT DoSelectPrepared(const std::string &strQuery, const ECDatabaseParams &params, DB_RESULT *lpResult) _zcp_override;
+	ECRESULT DoUpdatePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows = NULL) _zcp_override;
+	ECRESULT DoInsertPrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulInsertId = NULL, unsigned int *lpulAffectedRows = NULL) _zcp_override;
+	ECRESULT DoDeletePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulAffectedRows = NULL) _zcp_override;
 
 	//Result functions
 	unsigned int GetNumRows(DB_RESULT sResult) _zcp_override;
@@ -78,6 +87,9 @@ public:
 	ECRESULT Begin(void) _zcp_override;
 	ECRESULT Commit(void) _zcp_override;
 	ECRESULT Rollback(void) _zcp_override;
+	bool InTransaction(void) _zcp_override;
+	ECDatabaseCommitHook *GetCommitHook(void) _zcp_override;
+	void SetCommitHook(ECDatabaseCommitHook *lpHook) _zcp_override;
 	
 	unsigned int GetMaxAllowedPacket(void) _zcp_override;
 
@@ -107,6 +119,14 @@ private:
 	
 	ECRESULT _Update(const std::string &strQuery, unsigned int *lpulAffectedRows);
 	ECRESULT Query(const std::string &strQuery);
+
+	// Prepared statements
+	ECRESULT GetStatement(const std::string &strQuery, MYSQL_STMT **lppStmt);
+	ECRESULT ExecutePrepared(const std::string &strQuery, const ECDatabaseParams &params, MYSQL_STMT **lppStmt);
+	ECRESULT _UpdatePrepared(const std::string &strQuery, const ECDatabaseParams &params, unsigned int *lpulInsertId, unsigned int *lpulAffectedRows);
+	ECRESULT StorePreparedResult(MYSQL_STMT *lpStmt, ECPreparedResult **lppResult);
+	ECPreparedResult *GetPreparedResult(DB_RESULT sResult);
+	void CloseStatements();
 	unsigned int GetAffectedRows();
 	unsigned int GetInsertId();
 
@@ -137,6 +157,22 @@ private:
 	static std::string	m_strDatabaseDir;
 	ECConfig *			m_lpConfig;
 	bool				m_bSuppressLockErrorLogging;
+	typedef std::list<std::string> stmtlru_t;
+	typedef struct {
+		MYSQL_STMT *lpStmt;
+		stmtlru_t::iterator iterLRU;
+	} stmtentry_t;
+	std::map<std::string, stmtentry_t> m_mapStatements;	// prepared statements on this connection, by query
+	stmtlru_t			m_lstStatementLRU;			// queries of m_mapStatements, most recently used first
+	std::set<DB_RESULT>	m_setPreparedResults;		// results returned by DoSelectPrepared()
+	unsigned int		m_ulStmtErrno;				// error of the last failed prepared statement
+	bool				m_bInTransaction;
+	bool				m_bTransactionLost;			// connection dropped in a transaction, fail until rolled back
+	ECDatabaseCommitHook *m_lpCommitHook;
+	ECLatencyHistogram	*m_lpSelectLatency;
+	ECLatencyHistogram	*m_lpInsertLatency;
+	ECLatencyHistogram	*m_lpUpdateLatency;
+	ECLatencyHistogram	*m_lpDeleteLatency;
 #ifdef DEBUG
     unsigned int		m_ulTransactionState;
 #endif
@@ -2701,3 +2701,9 @@ ECRESULT UpdateVersionsTbl(ECDatabase *db)
 		"drop primary key, "
 		"add primary key (`major`, `minor`, `micro`, `revision`, `databaserevision`)");
 }
+
+/* Edit no. 65 */
+ECRESULT UpdateDatabaseCreateSingleInstanceHashes(ECDatabase *lpDatabase)
+{
+	return lpDatabase->DoInsert(Z_TABLEDEF_SINGLEINSTANCEHASHES);
+}
@@ -103,5 +103,6 @@ ECRESULT UpdateDatabaseUpdateStores(ECDatabase *lpDatabase);
 
 ECRESULT UpdateWLinkRecordKeys(ECDatabase *lpDatabase);
 ECRESULT UpdateVersionsTbl(ECDatabase *db);
+ECRESULT UpdateDatabaseCreateSingleInstanceHashes(ECDatabase *lpDatabase);
 
 #endif // #ifndef ECDATABASEUPDATE_H
@@ -52,6 +52,7 @@
 #endif
 
 #include <iostream>
+#include <vector>
 
 #include "Zarafa.h"
 #include "ZarafaUtil.h"
@@ -860,6 +861,46 @@ exit:
 	return er;
 }
 
+/**
+ * Build the binary sort keys for all values of a row
+ *
+ * The string values are collated in one call, so the collator for the table
+ * locale is looked up once per row instead of once per column.
+ *
+ * @param[in]	cValues		Number of values in lpProps
+ * @param[in]	lpProps		The row values
+ * @param[out]	lpSortLen	Array of cValues entries receiving the size of each key
+ * @param[out]	lppSortKeys	Array of cValues entries receiving each key, NULL for unsupported types
+ */
+void ECGenericObjectTable::GetBinarySortKeys(unsigned int cValues, struct propVal *lpProps, unsigned int *lpSortLen, unsigned char **lppSortKeys)
+{
+	std::vector<const char *> vStrings;
+	std::vector<unsigned int> vIndices;
+
+	for (unsigned int i = 0; i < cValues; ++i) {
+		if ((PROP_TYPE(lpProps[i].ulPropTag) == PT_STRING8 || PROP_TYPE(lpProps[i].ulPropTag) == PT_UNICODE) &&
+		    lpProps[i].Value.lpszA != NULL) {
+			vStrings.push_back(lpProps[i].Value.lpszA);
+			vIndices.push_back(i);
+			continue;
+		}
+		if (GetBinarySortKey(&lpProps[i], &lpSortLen[i], &lppSortKeys[i]) != erSuccess)
+			lppSortKeys[i] = NULL;
+	}
+
+	if (vStrings.empty())
+		return;
+
+	std::vector<unsigned int> vSortLen(vStrings.size());
+	std::vector<unsigned char *> vSortKeys(vStrings.size());
+
+	createSortKeysDataFromUTF8(vStrings.size(), &vStrings[0], 255, m_locale, &vSortLen[0], &vSortKeys[0]);
+	for (size_t i = 0; i < vIndices.size(); ++i) {
+		lpSortLen[vIndices[i]] = vSortLen[i];
+		lppSortKeys[vIndices[i]] = vSortKeys[i];
+	}
+}
+
 /**
  * The ECGenericObjectTable::GetSortFlags method gets tablerow flags for a property.
  * 
@@ -2674,9 +2715,8 @@ ECRESULT ECGenericObjectTable::AddCategoryBeforeAddRow(sObjectTableKey sObjKey,
     // Build binary sort keys
     
     // +1 because we may have a trailing category followed by a MINMAX column
+    GetBinarySortKeys(std::min(m_ulCategories + 1, cProps), lpProps, lpSortLen, lppSortKeys);
     for (i = 0; i < m_ulCategories + 1 && i < cProps; ++i) {
-        if(GetBinarySortKey(&lpProps[i], &lpSortLen[i], &lppSortKeys[i]) != erSuccess)
-        	lppSortKeys[i] = NULL;
         if(GetSortFlags(lpProps[i].ulPropTag, &lpSortFlags[i]) != erSuccess)
         	lpSortFlags[i] = 0;
     }
@@ -2992,9 +3032,8 @@ ECRESULT ECGenericObjectTable::UpdateKeyTableRow(ECCategory *lpCategory, sObject
 	}
 	
     // Build binary sort keys from updated data
+    GetBinarySortKeys(n, lpOrderedProps, lpSortLen, lppSortKeys);
     for (int i = 0; i < n; ++i) {
-        if(GetBinarySortKey(&lpOrderedProps[i], &lpSortLen[i], &lppSortKeys[i]) != erSuccess)
-        	lppSortKeys[i] = NULL;
         if(GetSortFlags(lpOrderedProps[i].ulPropTag, &lpSortFlags[i]) != erSuccess)
         	lpSortFlags[i] = 0;
         if(lpsSortOrderArray->__ptr[i].ulOrder == EC_TABLE_SORT_DESCEND)
@@ -200,6 +200,7 @@ protected:
 
 	virtual ECRESULT	ReloadKeyTable();
 	ECRESULT	GetBinarySortKey(struct propVal *lpsPropVal, unsigned int *lpSortLen, unsigned char **lppSortData);
+	void		GetBinarySortKeys(unsigned int cValues, struct propVal *lpProps, unsigned int *lpSortLen, unsigned char **lppSortKeys);
 	ECRESULT	GetSortFlags(unsigned int ulPropTag, unsigned char *lpFlags);
 
 	virtual ECRESULT GetMVRowCount(unsigned int ulObjId, unsigned int *lpulCount);
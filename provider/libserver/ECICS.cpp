@@ -208,6 +208,223 @@ static void AddChangeKeyToChangeList(std::string *strChangeList,
 	}
 }
 
+/**
+ * Per-transaction ICS change log of a database connection.
+ *
+ * Deletions do not need their change id while the transaction is running,
+ * so they are collected here and written with multi-row REPLACE queries just
+ * before the transaction is committed. Since other connections can only see
+ * the changes once they are committed, this is invisible to GetChanges().
+ * Any other change is written directly by AddChange(), after the collected
+ * changes, so the order of the change ids stays the same. The notifications
+ * for the collected changes are sent once the transaction is committed.
+ *
+ * The sync ids of a folder are also remembered for the duration of the
+ * transaction, since the transaction would see the same rows again anyway.
+ */
+class ECChangeLog _zcp_final : public ECDatabaseCommitHook {
+public:
+	ECRESULT GetSyncIds(ECDatabase *lpDatabase, const SOURCEKEY &sParentSourceKey, std::set<unsigned int> *lpsetSyncIds);
+	void Queue(unsigned int ulSyncId, const SOURCEKEY &sSourceKey, const SOURCEKEY &sParentSourceKey, unsigned int ulChange, unsigned int ulFlags, const std::set<unsigned int> &setSyncIds);
+	ECRESULT Flush(ECDatabase *lpDatabase);
+
+	ECRESULT OnCommit(ECDatabase *lpDatabase) _zcp_override;
+	void OnCommitted() _zcp_override;
+	void OnRollback() _zcp_override;
+
+private:
+	typedef struct {
+		unsigned int ulChange;
+		std::string strSourceKey;
+		std::string strParentSourceKey;
+		unsigned int ulSyncId;
+		unsigned int ulFlags;
+		std::set<unsigned int> setSyncIds;	// syncs to notify
+	} CHANGE;
+
+	typedef struct {
+		unsigned int ulChangeId;
+		std::set<unsigned int> setSyncIds;
+	} NOTIFY;
+
+	ECRESULT InsertChanges(ECDatabase *lpDatabase, const std::string &strQuery, std::list<CHANGE>::const_iterator iFirst, std::list<CHANGE>::const_iterator iLast);
+
+	std::list<CHANGE> m_lstChanges;
+	std::map<unsigned int, NOTIFY> m_mapNotify;	// by change type
+	std::map<SOURCEKEY, std::set<unsigned int> > m_mapSyncIds;
+};
+
+static ECChangeLog *GetChangeLog(ECDatabase *lpDatabase)
+{
+	ECChangeLog *lpChangeLog = dynamic_cast<ECChangeLog *>(lpDatabase->GetCommitHook());
+
+	if (lpChangeLog == NULL) {
+		lpChangeLog = new ECChangeLog;
+		lpDatabase->SetCommitHook(lpChangeLog);
+	}
+	return lpChangeLog;
+}
+
+/**
+ * Get the ids of all syncs on a folder
+ *
+ * @param[in]	lpDatabase			Database connection
+ * @param[in]	sParentSourceKey	Source key of the folder
+ * @param[out]	lpsetSyncIds		The sync ids of the folder
+ */
+ECRESULT ECChangeLog::GetSyncIds(ECDatabase *lpDatabase, const SOURCEKEY &sParentSourceKey, std::set<unsigned int> *lpsetSyncIds)
+{
+	ECRESULT er = erSuccess;
+	DB_RESULT lpDBResult = NULL;
+	DB_ROW lpDBRow = NULL;
+	std::set<unsigned int> setSyncIds;
+	std::map<SOURCEKEY, std::set<unsigned int> >::const_iterator iSyncIds;
+
+	if (lpDatabase->InTransaction()) {
+		iSyncIds = m_mapSyncIds.find(sParentSourceKey);
+		if (iSyncIds != m_mapSyncIds.end()) {
+			*lpsetSyncIds = iSyncIds->second;
+			goto exit;
+		}
+	}
+
+	er = lpDatabase->DoSelectPrepared("SELECT id FROM syncs WHERE sourcekey=?",
+		ECDatabaseParams().AddBinary((unsigned char *)sParentSourceKey, sParentSourceKey.size()),
+		&lpDBResult);
+	if(er != erSuccess)
+		goto exit;
+
+	while ((lpDBRow = lpDatabase->FetchRow(lpDBResult)) != NULL)
+		setSyncIds.insert(atoui((char*)lpDBRow[0]));
+
+	if (lpDatabase->InTransaction())
+		m_mapSyncIds[sParentSourceKey] = setSyncIds;
+	lpsetSyncIds->swap(setSyncIds);
+
+exit:
+	if (lpDBResult)
+		lpDatabase->FreeResult(lpDBResult);
+
+	return er;
+}
+
+void ECChangeLog::Queue(unsigned int ulSyncId, const SOURCEKEY &sSourceKey, const SOURCEKEY &sParentSourceKey, unsigned int ulChange, unsigned int ulFlags, const std::set<unsigned int> &setSyncIds)
+{
+	CHANGE sChange;
+
+	sChange.ulChange = ulChange;
+	sChange.strSourceKey = sSourceKey;
+	sChange.strParentSourceKey = sParentSourceKey;
+	sChange.ulSyncId = ulSyncId;
+	sChange.ulFlags = ulFlags;
+	sChange.setSyncIds = setSyncIds;
+
+	m_lstChanges.push_back(sChange);
+}
+
+/**
+ * Write all queued changes to the changes table
+ *
+ * The queries are kept below the maximum packet size of the database.
+ *
+ * @param[in]	lpDatabase		Database connection, in the transaction the changes were made in
+ */
+ECRESULT ECChangeLog::Flush(ECDatabase *lpDatabase)
+{
+	ECRESULT er = erSuccess;
+	std::string strQuery;
+	std::string strValues;
+	std::list<CHANGE>::const_iterator iChange, iFirst;
+
+	iFirst = m_lstChanges.begin();
+	for (iChange = m_lstChanges.begin(); iChange != m_lstChanges.end(); ++iChange) {
+		strValues = "(" + stringify(iChange->ulChange) + "," +
+			lpDatabase->EscapeBinary(iChange->strSourceKey) + "," +
+			lpDatabase->EscapeBinary(iChange->strParentSourceKey) + "," +
+			stringify(iChange->ulSyncId) + "," +
+			stringify(iChange->ulFlags) + ")";
+
+		if (!strQuery.empty() && strQuery.size() + strValues.size() + 1 >= lpDatabase->GetMaxAllowedPacket()) {
+			er = InsertChanges(lpDatabase, strQuery, iFirst, iChange);
+			if (er != erSuccess)
+				goto exit;
+			iFirst = iChange;
+			strQuery.clear();
+		}
+
+		if (strQuery.empty())
+			strQuery = "REPLACE INTO changes(change_type, sourcekey, parentsourcekey, sourcesync, flags) VALUES " + strValues;
+		else
+			strQuery += "," + strValues;
+	}
+
+	if (!strQuery.empty()) {
+		er = InsertChanges(lpDatabase, strQuery, iFirst, m_lstChanges.end());
+		if (er != erSuccess)
+			goto exit;
+	}
+
+	m_lstChanges.clear();
+
+exit:
+	return er;
+}
+
+/**
+ * Run one multi-row insert of Flush(), and remember the notifications for its changes
+ *
+ * The change id used in the notifications is the first id of the first
+ * query, which is always an id that was assigned to one of our changes.
+ */
+ECRESULT ECChangeLog::InsertChanges(ECDatabase *lpDatabase, const std::string &strQuery, std::list<CHANGE>::const_iterator iFirst, std::list<CHANGE>::const_iterator iLast)
+{
+	ECRESULT er = erSuccess;
+	unsigned int ulChangeId = 0;
+	std::map<unsigned int, NOTIFY>::iterator iNotify;
+
+	er = lpDatabase->DoInsert(strQuery, &ulChangeId);
+	if (er != erSuccess)
+		return er;
+
+	for (; iFirst != iLast; ++iFirst) {
+		if (iFirst->setSyncIds.empty())
+			continue;
+
+		iNotify = m_mapNotify.find(iFirst->ulChange);
+		if (iNotify == m_mapNotify.end()) {
+			NOTIFY sNotify;
+			sNotify.ulChangeId = ulChangeId;
+			iNotify = m_mapNotify.insert(std::make_pair(iFirst->ulChange, sNotify)).first;
+		}
+		iNotify->second.setSyncIds.insert(iFirst->setSyncIds.begin(), iFirst->setSyncIds.end());
+	}
+
+	return erSuccess;
+}
+
+ECRESULT ECChangeLog::OnCommit(ECDatabase *lpDatabase)
+{
+	return Flush(lpDatabase);
+}
+
+void ECChangeLog::OnCommitted()
+{
+	std::map<unsigned int, NOTIFY>::const_iterator iNotify;
+
+	for (iNotify = m_mapNotify.begin(); iNotify != m_mapNotify.end(); ++iNotify)
+		g_lpSessionManager->NotificationChange(iNotify->second.setSyncIds, iNotify->second.ulChangeId, iNotify->first);
+
+	m_mapNotify.clear();
+	m_mapSyncIds.clear();
+}
+
+void ECChangeLog::OnRollback()
+{
+	m_lstChanges.clear();
+	m_mapNotify.clear();
+	m_mapSyncIds.clear();
+}
+
 ECRESULT AddChange(BTSession *lpSession, unsigned int ulSyncId,
     const SOURCEKEY &sSourceKey, const SOURCEKEY &sParentSourceKey,
     unsigned int ulChange, unsigned int ulFlags, bool fForceNewChangeKey,
@@ -223,11 +440,14 @@ ECRESULT AddChange(BTSession *lpSession, unsigned int ulSyncId,
 	unsigned int	ulObjId = 0;
 
 	char			szChangeKey[20];
+	std::string		strChangeKey;
 	std::string		strChangeList;
 	bool			bLogAllChanges = false;
 
 	std::set<unsigned int>	syncids;
+	std::set<unsigned int>::const_iterator iSyncId;
 	bool					bIgnored = false;
+	ECChangeLog				*lpChangeLog = NULL;
 
 	if(!isICSChange(ulChange)){
 		er = ZARAFA_E_INVALID_TYPE;
@@ -244,49 +464,57 @@ ECRESULT AddChange(BTSession *lpSession, unsigned int ulSyncId,
 		goto exit;
 
 	bLogAllChanges = parseBool(g_lpSessionManager->GetConfig()->GetSetting("sync_log_all_changes"));
+	lpChangeLog = GetChangeLog(lpDatabase);
 
 	// Always log folder changes, and when "sync_log_all_changes" is enabled.
 	if(ulChange & ICS_MESSAGE) {
 		// See if anybody is interested in this change. If nobody has subscribed to this folder (ie nobody has got a state on this folder)
 		// then we can ignore the change.
 
-        strQuery = 	"SELECT id FROM syncs "
-                    "WHERE sourcekey=" + lpDatabase->EscapeBinary(sParentSourceKey, sParentSourceKey.size());
-
-		er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+		er = lpChangeLog->GetSyncIds(lpDatabase, sParentSourceKey, &syncids);
 		if(er != erSuccess)
 			goto exit;
 
-		while (true) {
-			lpDBRow = lpDatabase->FetchRow(lpDBResult);
-			if (lpDBRow == NULL)
-				break;
-			unsigned int ulTmp = atoui((char*)lpDBRow[0]);
-			if (ulTmp != ulSyncId)
-				syncids.insert(ulTmp);
-			else
-				bIgnored = true;
+		iSyncId = syncids.find(ulSyncId);
+		if (iSyncId != syncids.end()) {
+			syncids.erase(iSyncId);
+			bIgnored = true;
 		}
 
-		lpDatabase->FreeResult(lpDBResult);
-		lpDBResult = NULL;
-
 		if (!bLogAllChanges && !bIgnored && syncids.empty()) {
 			// nothing to do
 			goto exit;
 		}
     }
 
+	if (lpDatabase->InTransaction() &&
+		((ulChange & ICS_HARD_DELETE) == ICS_HARD_DELETE || (ulChange & ICS_SOFT_DELETE) == ICS_SOFT_DELETE))
+	{
+		// Nothing needs the change id of a deletion before the commit, so
+		// write it together with the other deletions of this transaction
+		lpChangeLog->Queue(ulSyncId, sSourceKey, sParentSourceKey, ulChange, ulFlags, syncids);
+		syncids.clear();	// notified on commit
+
+		if (ulSyncId != 0)
+			er = RemoveFromLastSyncedMessagesSet(lpDatabase, ulSyncId, sSourceKey, sParentSourceKey);
+		goto exit;
+	}
+
+	// Keep the change ids in the order of the changes
+	er = lpChangeLog->Flush(lpDatabase);
+	if (er != erSuccess)
+		goto exit;
+
 	// Record the change
-    strQuery = 	"REPLACE INTO changes(change_type, sourcekey, parentsourcekey, sourcesync, flags) "
-				"VALUES (" + stringify(ulChange) +
-				  ", " + lpDatabase->EscapeBinary(sSourceKey, sSourceKey.size()) +
-				  ", " + lpDatabase->EscapeBinary(sParentSourceKey, sParentSourceKey.size()) +
-				  ", " + stringify(ulSyncId) +
-				  ", " + stringify(ulFlags) +
-				")";
-
-	er = lpDatabase->DoInsert(strQuery, &changeid , NULL);
+	er = lpDatabase->DoInsertPrepared("REPLACE INTO changes(change_type, sourcekey, parentsourcekey, sourcesync, flags) "
+				"VALUES (?, ?, ?, ?, ?)",
+			ECDatabaseParams()
+				.Add(ulChange)
+				.AddBinary((unsigned char *)sSourceKey, sSourceKey.size())
+				.AddBinary((unsigned char *)sParentSourceKey, sParentSourceKey.size())
+				.Add(ulSyncId)
+				.Add(ulFlags),
+			&changeid, NULL);
 	if(er != erSuccess)
 		goto exit;
 
@@ -313,46 +541,33 @@ ECRESULT AddChange(BTSession *lpSession, unsigned int ulSyncId,
         goto exit;
 
 	strChangeList = "";
-	strQuery = "SELECT val_binary FROM properties "
-				"WHERE tag = " + stringify(PROP_ID(PR_PREDECESSOR_CHANGE_LIST)) +
-				" AND type = " + stringify(PROP_TYPE(PR_PREDECESSOR_CHANGE_LIST)) +
-				" AND hierarchyid = " + stringify(ulObjId);
-
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
+	er = lpDatabase->DoSelectPrepared("SELECT tag, val_binary FROM properties WHERE hierarchyid=? AND tag IN (?, ?) AND type=?",
+			ECDatabaseParams()
+				.Add(ulObjId)
+				.Add((unsigned int)PROP_ID(PR_PREDECESSOR_CHANGE_LIST))
+				.Add((unsigned int)PROP_ID(PR_CHANGE_KEY))
+				.Add((unsigned int)PROP_TYPE(PR_CHANGE_KEY)),
+			&lpDBResult);
 	if(er != erSuccess)
 		goto exit;
 
-	if(lpDatabase->GetNumRows(lpDBResult) > 0){
-		lpDBRow = lpDatabase->FetchRow(lpDBResult);
+	// The change key has to be added to the predecessor change list, in whatever order they are returned
+	while ((lpDBRow = lpDatabase->FetchRow(lpDBResult)) != NULL) {
 		lpDBLen = lpDatabase->FetchRowLengths(lpDBResult);
 
-		if(lpDBRow && lpDBRow[0] && lpDBLen && lpDBLen[0] >16){
-			strChangeList.assign(lpDBRow[0], lpDBLen[0]);
-		}
-	}
-
-	if(lpDBResult){
-		lpDatabase->FreeResult(lpDBResult);
-		lpDBResult = NULL;
+		if (lpDBRow[0] && atoui(lpDBRow[0]) == PROP_ID(PR_PREDECESSOR_CHANGE_LIST) &&
+		    lpDBRow[1] && lpDBLen && lpDBLen[1] > 16)
+			strChangeList.assign(lpDBRow[1], lpDBLen[1]);
+		else if (lpDBRow[0] && atoui(lpDBRow[0]) == PROP_ID(PR_CHANGE_KEY) &&
+		    lpDBRow[1] && lpDBLen && lpDBLen[1] > 16)
+			strChangeKey.assign(lpDBRow[1], lpDBLen[1]);
 	}
 
-	strQuery = "SELECT val_binary FROM properties "
-				"WHERE tag = " + stringify(PROP_ID(PR_CHANGE_KEY)) +
-				" AND type = " + stringify(PROP_TYPE(PR_CHANGE_KEY)) +
-				" AND hierarchyid = " + stringify(ulObjId);
-
-	er = lpDatabase->DoSelect(strQuery, &lpDBResult);
-	if(er != erSuccess)
-		goto exit;
-
-	if(lpDatabase->GetNumRows(lpDBResult) > 0){
-		lpDBRow = lpDatabase->FetchRow(lpDBResult);
-		lpDBLen = lpDatabase->FetchRowLengths(lpDBResult);
+	lpDatabase->FreeResult(lpDBResult);
+	lpDBResult = NULL;
 
-		if(lpDBRow && lpDBRow[0] && lpDBLen && lpDBLen[0] >16){
-			AddChangeKeyToChangeList(&strChangeList, lpDBLen[0], lpDBRow[0]);
-		}
-	}
+	if (!strChangeKey.empty())
+		AddChangeKeyToChangeList(&strChangeList, strChangeKey.size(), strChangeKey.data());
 
 	/**
 	 * There are two reasons for generating a new change key:
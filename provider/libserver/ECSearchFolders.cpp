@@ -19,11 +19,16 @@
 
 #include <mapidefs.h>
 #include <mapitags.h>
+#include <edkmdb.h>
+
+#include <algorithm>
+#include <vector>
 
 #include "ECMAPI.h"
 #include "ECSession.h"
 #include <zarafa/ECKeyTable.h>
 #include <zarafa/ECLogger.h>
+#include <zarafa/ECConfig.h>
 #include "ECStoreObjectTable.h"
 #include "ECSubRestriction.h"
 #include "ECSearchFolders.h"
@@ -42,19 +47,50 @@
 static const char THIS_FILE[] = __FILE__;
 #endif
 
+/**
+ * Task that runs the searchfolder rebuild queue on one of the rebuild threads.
+ * One task is dispatched for each queued searchfolder.
+ */
+class ECSearchRebuildTask _zcp_final : public ECTask {
+public:
+	ECSearchRebuildTask(ECSearchFolders *lpSearchFolders) : m_lpSearchFolders(lpSearchFolders) {}
+
+protected:
+	virtual void run(void) _zcp_override
+	{
+		m_lpSearchFolders->ProcessRebuildQueue();
+	}
+
+private:
+	ECSearchFolders *m_lpSearchFolders;
+};
+
 typedef struct {
-    SEARCHFOLDER 	*lpFolder;
-    ECSearchFolders *lpSearchFolders;
-} THREADINFO;
+	unsigned int ulFolderId;
+	unsigned int ulStoreId;
+	unsigned int ulStatus;
+	time_t tPriority;
+} LOADFOLDER;
+
+static bool LoadFolderPriority(const LOADFOLDER &a, const LOADFOLDER &b)
+{
+	return a.tPriority > b.tPriority;
+}
 
 ECSearchFolders::ECSearchFolders(ECSessionManager *lpSessionManager,
     ECDatabaseFactory *lpFactory)
 {
+    unsigned int ulThreads = 0;
+
     this->m_lpSessionManager = lpSessionManager;
     this->m_lpDatabaseFactory = lpFactory;
     this->m_bExitThread = false;
     this->m_bRunning = false;
 
+    ulThreads = atoui(lpSessionManager->GetConfig()->GetSetting("search_folder_threads"));
+    if (ulThreads == 0)
+        ulThreads = 1;
+
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
@@ -64,6 +100,9 @@ ECSearchFolders::ECSearchFolders(ECSessionManager *lpSessionManager,
     
     pthread_mutex_init(&m_mutexEvents, &attr);
     pthread_cond_init(&m_condEvents, NULL);
+
+    pthread_mutex_init(&m_mutexRebuildQueue, NULL);
+    m_lpRebuildPool = new ECThreadPool(ulThreads);
     
     pthread_create(&m_threadProcess, NULL, ECSearchFolders::ProcessThread, (void *)this);
     set_thread_name(m_threadProcess, "SearchFolders");
@@ -72,6 +111,30 @@ ECSearchFolders::ECSearchFolders(ECSessionManager *lpSessionManager,
 ECSearchFolders::~ECSearchFolders() {
     STOREFOLDERIDSEARCH::iterator iterStore;
     FOLDERIDSEARCH::iterator iterFolder;
+    REBUILDQUEUE::iterator iterQueue;
+
+	// Stop all rebuilds; deleting the pool waits for the running ones to exit
+	pthread_mutex_lock(&m_mutexRebuildQueue);
+	iterQueue = m_lstRebuildQueue.begin();
+	while (iterQueue != m_lstRebuildQueue.end()) {
+		// Active stores are removed by their rebuild thread
+		iterQueue->lstFolders.clear();
+		if (iterQueue->bActive)
+			++iterQueue;
+		else
+			iterQueue = m_lstRebuildQueue.erase(iterQueue);
+	}
+	pthread_mutex_unlock(&m_mutexRebuildQueue);
+
+	pthread_mutex_lock(&m_mutexMapSearchFolders);
+	for (iterStore = m_mapSearchFolders.begin();
+	     iterStore != m_mapSearchFolders.end(); ++iterStore)
+		for (iterFolder = iterStore->second.begin();
+		     iterFolder != iterStore->second.end(); ++iterFolder)
+			iterFolder->second->bThreadExit = true;
+	pthread_mutex_unlock(&m_mutexMapSearchFolders);
+
+	delete m_lpRebuildPool;
 
 	pthread_mutex_lock(&m_mutexMapSearchFolders);
 
@@ -88,6 +151,7 @@ ECSearchFolders::~ECSearchFolders() {
     
     pthread_mutex_destroy(&m_mutexMapSearchFolders);
     pthread_cond_destroy(&m_condThreadExited);
+    pthread_mutex_destroy(&m_mutexRebuildQueue);
     
 	pthread_mutex_lock(&m_mutexEvents);
     m_bExitThread = true;
@@ -107,9 +171,11 @@ ECRESULT ECSearchFolders::LoadSearchFolders()
     ECDatabase *lpDatabase = NULL;
     DB_RESULT lpResult = NULL;
     DB_ROW lpRow = NULL;
-    unsigned int ulFolderId = 0;
-    unsigned int ulStoreId = 0;
-    unsigned int ulStatus = 0;
+    LOADFOLDER sFolder;
+    std::vector<LOADFOLDER> vFolders;
+    std::vector<LOADFOLDER>::const_iterator iterFolder;
+    std::map<unsigned int, time_t> mapLogonTimes;
+    std::map<unsigned int, time_t>::const_iterator iterLogon;
 
     // Search for all folders with PR_EC_SEARCHCRIT that are not deleted. Note that this query can take quite some time on large databases
     std::string strQuery = "SELECT hierarchy.id, properties.val_ulong FROM hierarchy LEFT JOIN properties ON properties.hierarchyid=hierarchy.id AND properties.tag=" + stringify(PROP_ID(PR_EC_SEARCHFOLDER_STATUS)) +" AND properties.type=" + stringify(PROP_TYPE(PR_EC_SEARCHFOLDER_STATUS)) + " WHERE hierarchy.type=3 AND hierarchy.flags=2";
@@ -120,6 +186,10 @@ ECRESULT ECSearchFolders::LoadSearchFolders()
     if(er != erSuccess)
         goto exit;
 
+    // Rebuild the folders of recently active users first; not knowing the logon times only affects the order
+    if (GetLastLogonTimes(&mapLogonTimes) != erSuccess)
+        mapLogonTimes.clear();
+
     er = lpDatabase->DoSelect(strQuery, &lpResult);
     if(er != erSuccess)
         goto exit;
@@ -130,41 +200,48 @@ ECRESULT ECSearchFolders::LoadSearchFolders()
             continue;
             
         if(lpRow[1] != NULL)
-            ulStatus = atoi(lpRow[1]);
+            sFolder.ulStatus = atoi(lpRow[1]);
         else
-            ulStatus = EC_SEARCHFOLDER_STATUS_RUNNING; // this is the default if no property is found
+            sFolder.ulStatus = EC_SEARCHFOLDER_STATUS_RUNNING; // this is the default if no property is found
             
-        ulFolderId = atoi(lpRow[0]);
+        sFolder.ulFolderId = atoi(lpRow[0]);
         
-        er = m_lpSessionManager->GetCacheManager()->GetStore(ulFolderId, &ulStoreId, NULL);
+        // Only load the table if it is not stopped
+        if(sFolder.ulStatus == EC_SEARCHFOLDER_STATUS_STOPPED)
+            continue;
+
+        if(m_lpSessionManager->GetCacheManager()->GetStore(sFolder.ulFolderId, &sFolder.ulStoreId, NULL) != erSuccess)
+            continue;
+
+        iterLogon = mapLogonTimes.find(sFolder.ulStoreId);
+        sFolder.tPriority = iterLogon != mapLogonTimes.end() ? iterLogon->second : 0;
+
+        vFolders.push_back(sFolder);
+    }
+
+    lpDatabase->FreeResult(lpResult);
+    lpResult = NULL;
+
+    std::stable_sort(vFolders.begin(), vFolders.end(), LoadFolderPriority);
+
+    for (iterFolder = vFolders.begin(); iterFolder != vFolders.end(); ++iterFolder) {
+        er = LoadSearchCriteria(iterFolder->ulStoreId, iterFolder->ulFolderId, &lpSearchCriteria);
         if(er != erSuccess) {
             er = erSuccess;
             continue;
         }
         
-        // Only load the table if it is not stopped
-        if(ulStatus != EC_SEARCHFOLDER_STATUS_STOPPED) {
-            er = LoadSearchCriteria(ulStoreId, ulFolderId, &lpSearchCriteria);
-            if(er != erSuccess) {
-                er = erSuccess;
-                continue;
-            }
+        if(iterFolder->ulStatus == EC_SEARCHFOLDER_STATUS_REBUILD) 
+            ec_log_info("Rebuilding search folder %d", iterFolder->ulFolderId);
             
-            if(ulStatus == EC_SEARCHFOLDER_STATUS_REBUILD) 
-                ec_log_info("Rebuilding search folder %d", ulFolderId);
-                
-            // If the folder was in the process of rebuilding, then completely rebuild the search results (we don't know how far the search got)
-            er = AddSearchFolder(ulStoreId, ulFolderId, ulStatus == EC_SEARCHFOLDER_STATUS_REBUILD, lpSearchCriteria);
-            if(er != erSuccess) {
-                er = erSuccess; // just try to skip the error
-                continue;
-            }
-            
-            
-            if(lpSearchCriteria) {
-                FreeSearchCriteria(lpSearchCriteria);
-                lpSearchCriteria = NULL;
-            }
+        // If the folder was in the process of rebuilding, then completely rebuild the search results (we don't know how far the search got)
+        er = AddSearchFolder(iterFolder->ulStoreId, iterFolder->ulFolderId, iterFolder->ulStatus == EC_SEARCHFOLDER_STATUS_REBUILD, lpSearchCriteria, iterFolder->tPriority);
+        if(er != erSuccess)
+            er = erSuccess; // just try to skip the error
+        
+        if(lpSearchCriteria) {
+            FreeSearchCriteria(lpSearchCriteria);
+            lpSearchCriteria = NULL;
         }
     }
 
@@ -178,6 +255,37 @@ exit:
     return er;
 }
 
+// Last logon time of the owner of each store, as kept by the logon time tracking
+ECRESULT ECSearchFolders::GetLastLogonTimes(std::map<unsigned int, time_t> *lpmapLogonTimes)
+{
+    ECRESULT er = erSuccess;
+    ECDatabase *lpDatabase = NULL;
+    DB_RESULT lpResult = NULL;
+    DB_ROW lpRow = NULL;
+    std::string strQuery = "SELECT hierarchyid, val_hi, val_lo FROM properties WHERE tag=" + stringify(PROP_ID(PR_LAST_LOGON_TIME)) + " AND type=" + stringify(PROP_TYPE(PR_LAST_LOGON_TIME));
+
+    er = GetThreadLocalDatabase(m_lpDatabaseFactory, &lpDatabase);
+    if(er != erSuccess)
+        goto exit;
+
+    er = lpDatabase->DoSelect(strQuery, &lpResult);
+    if(er != erSuccess)
+        goto exit;
+
+    while((lpRow = lpDatabase->FetchRow(lpResult))) {
+        if(lpRow[0] == NULL || lpRow[1] == NULL || lpRow[2] == NULL)
+            continue;
+
+        (*lpmapLogonTimes)[atoui(lpRow[0])] = FileTimeToUnixTime(atoui(lpRow[1]), atoui(lpRow[2]));
+    }
+
+exit:
+    if(lpResult)
+        lpDatabase->FreeResult(lpResult);
+
+    return er;
+}
+
 // Called from IMAPIContainer::SetSearchCriteria
 ECRESULT ECSearchFolders::SetSearchCriteria(unsigned int ulStoreId, unsigned int ulFolderId, struct searchCriteria *lpSearchCriteria)
 {
@@ -188,7 +296,8 @@ ECRESULT ECSearchFolders::SetSearchCriteria(unsigned int ulStoreId, unsigned int
         CancelSearchFolder(ulStoreId, ulFolderId);
     } else {
 
-        er = AddSearchFolder(ulStoreId, ulFolderId, true, lpSearchCriteria);
+        // The user is working with the store right now, so rebuild it before any others
+        er = AddSearchFolder(ulStoreId, ulFolderId, true, lpSearchCriteria, time(NULL));
         if(er != erSuccess)
             goto exit;
 
@@ -242,7 +351,7 @@ exit:
 }
 
 // Add or modify a search folder
-ECRESULT ECSearchFolders::AddSearchFolder(unsigned int ulStoreId, unsigned int ulFolderId, bool bReStartSearch, struct searchCriteria *lpSearchCriteria)
+ECRESULT ECSearchFolders::AddSearchFolder(unsigned int ulStoreId, unsigned int ulFolderId, bool bReStartSearch, struct searchCriteria *lpSearchCriteria, time_t tPriority)
 {
     ECRESULT er = erSuccess;
     struct searchCriteria *lpCriteria = NULL;
@@ -305,29 +414,9 @@ ECRESULT ECSearchFolders::AddSearchFolder(unsigned int ulStoreId, unsigned int u
     iterStore->second.insert(FOLDERIDSEARCH::value_type(ulFolderId, lpSearchFolder));
 	g_lpStatsCollector->Increment(SCN_SEARCHFOLDER_COUNT);
         
-    if(bReStartSearch) {
-        lpSearchFolder->bThreadFree = false;
-        
-        THREADINFO *ti = new THREADINFO;
-        ti->lpSearchFolders = this;
-        ti->lpFolder = lpSearchFolder;
-        
-        // Insert the actual folder with the criteria
-        // Start the thread (will store the thread id in the original list)
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-#ifdef LINUX
-        pthread_attr_setstacksize(&attr, 512*1024); // 512KB stack space for search threads
-#endif
-        int err = 0;
-        
-        if((err = pthread_create(&lpSearchFolder->sThreadId, &attr, ECSearchFolders::SearchThread, (void *)ti)) != 0) {
-            ec_log_crit("Unable to spawn thread for search: %s", strerror(err));
-            er = ZARAFA_E_NOT_ENOUGH_MEMORY;
-        }
-	set_thread_name(lpSearchFolder->sThreadId, "SearchFolders:Folder");
-    }
+    // Queue the rebuild while holding the map lock, so the folder cannot be cancelled before it is queued
+    if(bReStartSearch)
+        QueueRebuild(lpSearchFolder, tPriority, true);
     
     pthread_mutex_unlock(&m_mutexMapSearchFolders);
 
@@ -425,6 +514,23 @@ void ECSearchFolders::DestroySearchFolder(SEARCHFOLDER *lpFolder)
     
     // Signal the thread to exit
     lpFolder->bThreadExit = true;
+
+    // If no thread has picked up the rebuild yet, just remove it from the queue
+    pthread_mutex_lock(&m_mutexRebuildQueue);
+    for (REBUILDQUEUE::iterator iterQueue = m_lstRebuildQueue.begin(); iterQueue != m_lstRebuildQueue.end(); ++iterQueue) {
+        if (iterQueue->ulStoreId != lpFolder->ulStoreId)
+            continue;
+
+        std::list<SEARCHFOLDER *>::iterator iterQueued = std::find(iterQueue->lstFolders.begin(), iterQueue->lstFolders.end(), lpFolder);
+        if (iterQueued != iterQueue->lstFolders.end()) {
+            iterQueue->lstFolders.erase(iterQueued);
+            lpFolder->bThreadFree = true;
+        }
+        if (iterQueue->lstFolders.empty() && !iterQueue->bActive)
+            m_lstRebuildQueue.erase(iterQueue);
+        break;
+    }
+    pthread_mutex_unlock(&m_mutexRebuildQueue);
     
     pthread_mutex_lock(&lpFolder->mMutexThreadFree);
     
@@ -518,19 +624,41 @@ ECRESULT ECSearchFolders::RestartSearches()
 	ECRESULT er = erSuccess;
 	STOREFOLDERIDSEARCH::const_iterator iterStore;
 	FOLDERIDSEARCH::const_iterator iterFolder;
+	std::map<unsigned int, time_t> mapLogonTimes;
+	std::map<unsigned int, time_t>::const_iterator iterLogon;
+	std::list<SEARCHFOLDER *> lstQueued;
+	std::list<SEARCHFOLDER *>::const_iterator iterQueued;
+	SEARCHFOLDER *lpFolder = NULL;
 
     ec_log_crit("Starting rebuild of search folders... This may take a while.");
+
+    if (GetLastLogonTimes(&mapLogonTimes) != erSuccess)
+        mapLogonTimes.clear();
     
     for (iterStore = m_mapSearchFolders.begin();
          iterStore != m_mapSearchFolders.end(); ++iterStore)
     {
+        iterLogon = mapLogonTimes.find(iterStore->first);
+
         ec_log_crit("  Rebuilding searchfolders of store %d", iterStore->first);
         for (iterFolder = iterStore->second.begin();
              iterFolder != iterStore->second.end(); ++iterFolder) {
-            ResetResults(iterStore->first, iterFolder->first);
-            Search(iterStore->first, iterFolder->first, iterFolder->second->lpSearchCriteria, NULL, false);
+            // Folders still rebuilding since LoadSearchFolders() already get a complete rebuild
+            if (iterFolder->second->bThreadFree == false)
+                continue;
+            QueueRebuild(iterFolder->second, iterLogon != mapLogonTimes.end() ? iterLogon->second : 0, false);
+            lstQueued.push_back(iterFolder->second);
         }
-    }    
+    }
+
+    for (iterQueued = lstQueued.begin(); iterQueued != lstQueued.end(); ++iterQueued) {
+        lpFolder = *iterQueued;
+
+        pthread_mutex_lock(&lpFolder->mMutexThreadFree);
+        while (lpFolder->bThreadFree == false)
+            pthread_cond_wait(&m_condThreadExited, &lpFolder->mMutexThreadFree);
+        pthread_mutex_unlock(&lpFolder->mMutexThreadFree);
+    }
 
     ec_log_info("Finished rebuild.");
     
@@ -1370,36 +1498,99 @@ ECRESULT ECSearchFolders::GetState(unsigned int ulStoreId, unsigned int ulFolder
     return er;
 }
 
-// Entrypoint for the SearchThread
-void* ECSearchFolders::SearchThread(void *lpParam)
+// Queue a searchfolder rebuild, stores are kept in order of descending priority
+void ECSearchFolders::QueueRebuild(SEARCHFOLDER *lpFolder, time_t tPriority, bool bNotify)
 {
-    THREADINFO *ti = (THREADINFO*)lpParam;
-    SEARCHFOLDER *lpFolder = ti->lpFolder; 					// The entry in the m_mapSearchFolders map
-    ECSearchFolders *lpSearchFolders = ti->lpSearchFolders; // The main ECSearchFolders object
+    REBUILDQUEUE::iterator iterQueue;
+    REBUILDQUEUE::iterator iterPos;
+    REBUILDSTORE sStore;
 
-    // We no longer need this
-    delete ti;
+    lpFolder->bThreadFree = false;
+    lpFolder->bNotify = bNotify;
 
-	g_lpStatsCollector->Increment(SCN_SEARCHFOLDER_THREADS);
+    pthread_mutex_lock(&m_mutexRebuildQueue);
 
-    // Start the search    
-    lpSearchFolders->Search(lpFolder->ulStoreId, lpFolder->ulFolderId, lpFolder->lpSearchCriteria, &lpFolder->bThreadExit);
+    for (iterQueue = m_lstRebuildQueue.begin(); iterQueue != m_lstRebuildQueue.end(); ++iterQueue)
+        if (iterQueue->ulStoreId == lpFolder->ulStoreId)
+            break;
 
-    // Signal search complete to clients
-    lpSearchFolders->m_lpSessionManager->NotificationSearchComplete(lpFolder->ulFolderId, lpFolder->ulStoreId);
-    
-    // Signal exit from thread
-    pthread_mutex_lock(&lpFolder->mMutexThreadFree);
-    lpFolder->bThreadFree = true;
-    pthread_cond_broadcast(&lpSearchFolders->m_condThreadExited);
-    pthread_mutex_unlock(&lpFolder->mMutexThreadFree);
-    
-    // We may not access lpFolder from this point on (it will be freed when the searchfolder is removed)
-    lpFolder = NULL;
+    if (iterQueue == m_lstRebuildQueue.end()) {
+        sStore.ulStoreId = lpFolder->ulStoreId;
+        sStore.tPriority = tPriority;
+        sStore.bActive = false;
+        iterQueue = m_lstRebuildQueue.insert(m_lstRebuildQueue.end(), sStore);
+    } else if (tPriority > iterQueue->tPriority) {
+        iterQueue->tPriority = tPriority;
+    }
 
-	g_lpStatsCollector->Increment(SCN_SEARCHFOLDER_THREADS, -1);
-    
-    return NULL;
+    // Move the store up past all stores with a lower priority
+    for (iterPos = m_lstRebuildQueue.begin(); iterPos != iterQueue; ++iterPos)
+        if (iterPos->tPriority < iterQueue->tPriority)
+            break;
+    if (iterPos != iterQueue)
+        m_lstRebuildQueue.splice(iterPos, m_lstRebuildQueue, iterQueue);
+
+    iterQueue->lstFolders.push_back(lpFolder);
+
+    pthread_mutex_unlock(&m_mutexRebuildQueue);
+
+    // The task picks whichever folder is next in line, not necessarily this one
+    m_lpRebuildPool->dispatch(new ECSearchRebuildTask(this), true);
+}
+
+// Runs on the rebuild threads
+void ECSearchFolders::ProcessRebuildQueue()
+{
+    REBUILDQUEUE::iterator iterQueue;
+    SEARCHFOLDER *lpFolder = NULL;
+
+    while (true) {
+        pthread_mutex_lock(&m_mutexRebuildQueue);
+
+        // Take the first store that nobody is working on, so one store cannot occupy more than one thread
+        for (iterQueue = m_lstRebuildQueue.begin(); iterQueue != m_lstRebuildQueue.end(); ++iterQueue)
+            if (!iterQueue->bActive)
+                break;
+
+        if (iterQueue == m_lstRebuildQueue.end()) {
+            // Nothing left, or the threads working on the other stores will pick up their remaining folders
+            pthread_mutex_unlock(&m_mutexRebuildQueue);
+            break;
+        }
+
+        lpFolder = iterQueue->lstFolders.front(); // The entry in the m_mapSearchFolders map
+        iterQueue->lstFolders.pop_front();
+        iterQueue->bActive = true;
+
+        pthread_mutex_unlock(&m_mutexRebuildQueue);
+
+        g_lpStatsCollector->Increment(SCN_SEARCHFOLDER_THREADS);
+
+        // Start the search
+        Search(lpFolder->ulStoreId, lpFolder->ulFolderId, lpFolder->lpSearchCriteria, &lpFolder->bThreadExit, lpFolder->bNotify);
+
+        // Signal search complete to clients
+        if (lpFolder->bNotify)
+            m_lpSessionManager->NotificationSearchComplete(lpFolder->ulFolderId, lpFolder->ulStoreId);
+
+        // Signal exit from thread
+        pthread_mutex_lock(&lpFolder->mMutexThreadFree);
+        lpFolder->bThreadFree = true;
+        pthread_cond_broadcast(&m_condThreadExited);
+        pthread_mutex_unlock(&lpFolder->mMutexThreadFree);
+
+        // We may not access lpFolder from this point on (it will be freed when the searchfolder is removed)
+        lpFolder = NULL;
+
+        g_lpStatsCollector->Increment(SCN_SEARCHFOLDER_THREADS, -1);
+
+        // The store entry is not removed while it is active
+        pthread_mutex_lock(&m_mutexRebuildQueue);
+        iterQueue->bActive = false;
+        if (iterQueue->lstFolders.empty())
+            m_lstRebuildQueue.erase(iterQueue);
+        pthread_mutex_unlock(&m_mutexRebuildQueue);
+    }
 }
 
 // Functions to do things in the database
@@ -21,6 +21,7 @@
 #include <zarafa/zcdefs.h>
 #include "ECDatabaseFactory.h"
 #include <zarafa/ECKeyTable.h>
+#include <zarafa/ECThreadPool.h>
 #include "ECStoreObjectTable.h"
 
 #include "soapH.h"
@@ -35,10 +36,10 @@ class ECSessionManager;
 typedef struct SEARCHFOLDER _zcp_final {
 	SEARCHFOLDER(unsigned int ulStoreId, unsigned int ulFolderId) {
 		this->lpSearchCriteria = NULL;
-		/* sThreadId */
 		pthread_mutex_init(&this->mMutexThreadFree, NULL);
 		this->bThreadExit = false;
 		this->bThreadFree = true;
+		this->bNotify = true;
 		this->ulStoreId = ulStoreId;
 		this->ulFolderId = ulFolderId;
 	}
@@ -49,10 +50,10 @@ typedef struct SEARCHFOLDER _zcp_final {
 	}
 
     struct searchCriteria 	*lpSearchCriteria;
-    pthread_t 				sThreadId;
     pthread_mutex_t			mMutexThreadFree;
     bool 					bThreadFree;
     bool					bThreadExit;
+    bool					bNotify;		// Send notifications while rebuilding
     unsigned int			ulStoreId;
     unsigned int			ulFolderId;
 } SEARCHFOLDER;
@@ -71,6 +72,16 @@ typedef std::map<unsigned int, SEARCHFOLDER *> FOLDERIDSEARCH;
 typedef std::map<unsigned int, FOLDERIDSEARCH> STOREFOLDERIDSEARCH;
 typedef std::map<unsigned int, pthread_t> SEARCHTHREADMAP;
 
+// Searchfolders of a single store waiting to be rebuilt
+typedef struct REBUILDSTORE {
+	unsigned int			ulStoreId;
+	time_t					tPriority;	// Last logon of the store owner, higher goes first
+	bool					bActive;	// A rebuild thread is working on this store
+	std::list<SEARCHFOLDER *> lstFolders;
+} REBUILDSTORE;
+
+typedef std::list<REBUILDSTORE> REBUILDQUEUE;
+
 typedef struct tagsSearchFolderStats
 {
 	ULONG ulStores;
@@ -83,8 +94,10 @@ typedef struct tagsSearchFolderStats
  * Searchfolder handler
  *
  * This represents a single manager of all searchfolders on the server; a single thread runs on behalf of this
- * manager to handle all object changes, and another thread can be running for each searchfolder that is rebuilding. Most of
- * the time only the single update thread is running though.
+ * manager to handle all object changes, and a bounded pool of threads rebuilds searchfolders. Rebuilds are queued
+ * per store; stores are served in order of their owner's last logon, and each store is rebuilt by at most one
+ * thread at a time so a single store with many searchfolders cannot hold up the others. Most of the time only the
+ * single update thread is running though.
  *
  * The searchfolder manager does four things:
  * - Loading all searchfolder definitions (restriction and folderlist) at startup
@@ -196,7 +209,7 @@ public:
 
     /** 
      * Restart all searches. 
-     * This is a rather heavy operation, and runs synchronously. You have to wait until it has finished.
+     * This is a rather heavy operation, and runs synchronously on the rebuild threads. You have to wait until it has finished.
      * This is only called with the --restart-searches option of zarafa-server and never used in a running
      * system
      */
@@ -262,9 +275,10 @@ private:
      * @param[in] ulFolderId Folder id of the search folder
      * @param[in] fStartSearch TRUE if a rebuild must take place, FALSE if not (eg this happens at server startup)
      * @param[in] lpSearchCriteria Search criteria for this search folder
+     * @param[in] tPriority Last logon time of the store owner, used to order rebuilds
      */
      
-    virtual ECRESULT AddSearchFolder(unsigned int ulStoreId, unsigned int ulFolderId, bool fStartSearch, struct searchCriteria *lpSearchCriteria);
+    virtual ECRESULT AddSearchFolder(unsigned int ulStoreId, unsigned int ulFolderId, bool fStartSearch, struct searchCriteria *lpSearchCriteria, time_t tPriority);
     
     /** 
      * Cancel a search. 
@@ -305,13 +319,31 @@ private:
      */
     virtual ECRESULT GetState(unsigned int ulStoreId, unsigned int ulFolderId, unsigned int *lpulState);
 
-    /** 
-     * Search thread entrypoint. 
+    /**
+     * Queue a searchfolder for rebuilding on the rebuild threads
      *
-     * Simply a wrapper for Search(), and has code to do thread deregistration.
-     * @param[in] lpParam THREADINFO * thread information
+     * The folder is marked as rebuilding until a rebuild thread has finished with it, or until it is
+     * removed from the queue by DestroySearchFolder().
+     *
+     * @param[in] lpFolder Search folder to rebuild
+     * @param[in] tPriority Last logon time of the store owner; stores with a higher value are rebuilt first
+     * @param[in] bNotify If TRUE, send notifications while rebuilding, else do not (eg when doing RestartSearches())
      */
-    static void* SearchThread(void *lpParam);
+    void QueueRebuild(SEARCHFOLDER *lpFolder, time_t tPriority, bool bNotify);
+
+    /**
+     * Rebuild queued searchfolders until no store is left that is not already being rebuilt by another thread.
+     *
+     * Simply a wrapper for Search(), and has code to do thread deregistration. Runs on the rebuild threads.
+     */
+    void ProcessRebuildQueue();
+
+    /**
+     * Get the last logon time of the owners of all stores
+     *
+     * @param[out] lpmapLogonTimes Map of store id (hierarchyid) to last logon time. Stores which were never logged on to are not listed.
+     */
+    ECRESULT GetLastLogonTimes(std::map<unsigned int, time_t> *lpmapLogonTimes);
 
     // Functions to do things in the database
     
@@ -437,6 +469,13 @@ private:
     // Exit request for processing thread
     bool m_bExitThread;
 	bool m_bRunning;
+
+	// Searchfolders waiting to be rebuilt, ordered by priority, and the threads rebuilding them
+	REBUILDQUEUE m_lstRebuildQueue;
+	pthread_mutex_t m_mutexRebuildQueue;
+	ECThreadPool *m_lpRebuildPool;
+
+	friend class ECSearchRebuildTask;
 };
 
 #endif
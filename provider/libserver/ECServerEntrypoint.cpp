@@ -27,6 +27,7 @@
 
 #include "ECSessionManagerOffline.h"
 #include "ECS3Attachment.h"
+#include "ECAttachmentCache.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -170,6 +171,9 @@ ECRESULT zarafa_init(ECConfig *lpConfig, ECLogger *lpAudit, bool bHostedZarafa,
         if (strcmp(lpConfig->GetSetting("attachment_storage"), "s3") == 0)
                 ECS3Attachment::StaticInit(lpConfig);
 #endif
+	if (strcmp(lpConfig->GetSetting("attachment_storage"), "database") != 0 &&
+	    ECCachedAttachment::StaticInit(lpConfig) != erSuccess)
+		ec_log_warn("Unable to initialize the attachment cache, continuing without it");
 exit:
 	return er;
 }
@@ -195,6 +199,7 @@ ECRESULT zarafa_exit()
         if (g_lpSessionManager && strcmp(g_lpSessionManager->GetConfig()->GetSetting("attachment_storage"), "s3") == 0)
                 ECS3Attachment::StaticDeinit();
 #endif
+	ECCachedAttachment::StaticDeinit();
 
 	// delete our plugin of the mainthread: requires ECPluginFactory to be alive, because that holds the dlopen() result
 	plugin_destroy(pthread_getspecific(plugin_key));
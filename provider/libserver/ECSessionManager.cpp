@@ -41,6 +41,7 @@
 #include "SSLUtil.h"
 
 #include <zarafa/Trace.h>
+#include <zarafa/threadutil.h>
 #include "Zarafa.h"
 
 #include "ECICS.h"
@@ -53,6 +54,9 @@
 static const char THIS_FILE[] = __FILE__;
 #endif
 
+// Seconds after which an unsaved delivery copy is no longer tracked
+#define PENDING_DELIVERY_MAX_AGE 3600
+
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
@@ -86,6 +90,7 @@ ECSessionManager::ECSessionManager(ECConfig *lpConfig, ECLogger *lpAudit,
 	m_lpPluginFactory = new ECPluginFactory(lpConfig, g_lpStatsCollector, bHostedZarafa, bDistributedZarafa);
 	m_lpECCacheManager = new ECCacheManager(lpConfig, m_lpDatabaseFactory);
 	m_lpSearchFolders = new ECSearchFolders(this, m_lpDatabaseFactory);
+	m_lpTableViewCache = new ECTableViewCache();
 	m_lpTPropsPurge = new ECTPropsPurge(lpConfig, m_lpDatabaseFactory);
 	m_ptrLockManager = ECLockManager::Create();
 	
@@ -98,6 +103,7 @@ ECSessionManager::ECSessionManager(ECConfig *lpConfig, ECLogger *lpAudit,
 
 	pthread_mutex_init(&m_hSourceKeyAutoIncrementMutex, NULL);
 	pthread_mutex_init(&m_hSeqMutex, NULL);
+	pthread_mutex_init(&m_hPendingDeliveryMutex, NULL);
 
 	// init ssl randomness for session id's
 	ssl_random_init();
@@ -153,6 +159,7 @@ ECSessionManager::~ECSessionManager()
 	delete m_lpECCacheManager;
 //#endif
 	delete m_lpSearchFolders;
+	delete m_lpTableViewCache;
 	delete m_lpPluginFactory;
 	delete m_lpServerGuid;
 	if (m_lpAudit != NULL)
@@ -166,6 +173,7 @@ ECSessionManager::~ECSessionManager()
 
 	pthread_mutex_destroy(&m_hSourceKeyAutoIncrementMutex);
 	pthread_mutex_destroy(&m_hSeqMutex);
+	pthread_mutex_destroy(&m_hPendingDeliveryMutex);
 
 	pthread_mutex_destroy(&m_hExitMutex);
 	pthread_mutex_destroy(&m_mutexPersistent);
@@ -998,6 +1006,10 @@ ECRESULT ECSessionManager::UpdateTables(ECKeyTable::UpdateType ulType, unsigned
 	if(ulObjType != MAPI_MESSAGE && ulObjType != MAPI_FOLDER)
 		goto exit;
 
+	// Shared views of the folder are outdated now, the open tables are updated below
+	if (ulObjType == MAPI_MESSAGE)
+		m_lpTableViewCache->Invalidate(ulObjId);
+
 	sSubscription.ulType = TABLE_ENTRY::TABLE_TYPE_GENERIC;
 	sSubscription.ulRootObjectId = ulObjId;
 	sSubscription.ulObjectType = ulObjType;
@@ -1605,6 +1617,44 @@ exit:
 	return er;
 }
 
+/**
+ * Remember a message copied for delivery whose ICS change and notifications
+ * are held back until the delivery agent saves it, see
+ * ns__copyMessageToFolders(). Copies that were never saved, because the
+ * delivery was cancelled or the agent went away, are forgotten after
+ * PENDING_DELIVERY_MAX_AGE seconds.
+ *
+ * @param[in] ulObjId Hierarchy id of the copy
+ */
+void ECSessionManager::AddPendingDelivery(unsigned int ulObjId)
+{
+	scoped_lock lock(m_hPendingDeliveryMutex);
+	time_t now = time(NULL);
+	std::map<unsigned int, time_t>::iterator iter = m_mapPendingDeliveries.begin();
+
+	while (iter != m_mapPendingDeliveries.end()) {
+		if (now - iter->second > PENDING_DELIVERY_MAX_AGE)
+			m_mapPendingDeliveries.erase(iter++);
+		else
+			++iter;
+	}
+
+	m_mapPendingDeliveries[ulObjId] = now;
+}
+
+/**
+ * Forget a message copied for delivery
+ *
+ * @param[in] ulObjId Hierarchy id of the object
+ * @return true if ulObjId was a copy that still had to be announced
+ */
+bool ECSessionManager::RemovePendingDelivery(unsigned int ulObjId)
+{
+	scoped_lock lock(m_hPendingDeliveryMutex);
+
+	return m_mapPendingDeliveries.erase(ulObjId) > 0;
+}
+
 ECRESULT ECSessionManager::CreateDatabaseConnection()
 {
     ECRESULT er = erSuccess;
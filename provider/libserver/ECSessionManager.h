@@ -166,6 +166,10 @@ public:
 	enum SEQUENCE { SEQ_IMAP };
 	ECRESULT GetNewSequence(SEQUENCE seq, unsigned long long *lpllSeqId);
 
+	// Delivery copies that are announced when the delivery agent saves them
+	void AddPendingDelivery(unsigned int ulObjId);
+	bool RemovePendingDelivery(unsigned int ulObjId);
+
 	ECRESULT CreateDatabaseConnection();
 
 	ECRESULT GetStoreSortLCID(ULONG ulStoreId, ULONG *lpLcid);
@@ -175,6 +179,7 @@ public:
 
 	ECCacheManager *GetCacheManager(void) { return m_lpECCacheManager; }
 	ECSearchFolders *GetSearchFolders(void) { return m_lpSearchFolders; }
+	ECTableViewCache *GetTableViewCache(void) { return m_lpTableViewCache; }
 	ECConfig *GetConfig(void) { return m_lpConfig; }
 	ECLogger *GetAudit(void) { return m_lpAudit; }
 	ECPluginFactory *GetPluginFactory(void) { return m_lpPluginFactory; }
@@ -203,6 +208,7 @@ protected:
 	ECDatabaseFactory*	m_lpDatabaseFactory;
 	ECPluginFactory*	m_lpPluginFactory;
 	ECSearchFolders*	m_lpSearchFolders;
+	ECTableViewCache*	m_lpTableViewCache;
 	bool				m_bHostedZarafa;
 	bool				m_bDistributedZarafa;
 	GUID*				m_lpServerGuid;
@@ -230,6 +236,9 @@ protected:
 	pthread_mutex_t		m_hSeqMutex;
 	unsigned long long 	m_ulSeqIMAP;
 	unsigned int		m_ulSeqIMAPQueue;
+
+	pthread_mutex_t		m_hPendingDeliveryMutex;
+	std::map<unsigned int, time_t> m_mapPendingDeliveries;	///< Unannounced delivery copies and the time they were made
 };
 
 extern ECSessionManager *g_lpSessionManager;
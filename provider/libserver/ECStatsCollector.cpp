@@ -22,14 +22,19 @@
 using namespace std;
 
 ECStatsCollector::ECStatsCollector() {
+	memset(m_StatData, 0, sizeof(m_StatData));
+	pthread_key_create(&m_ThreadKey, ThreadExit);
+	pthread_mutex_init(&m_ThreadsLock, NULL);
 	pthread_mutex_init(&m_StringsLock, NULL);
+	pthread_mutex_init(&m_HistogramsLock, NULL);
+	m_bHistograms = false;
 
 	// the 'name' parameter may not be longer than 19 characters, since we want to use those in RRDtool
  	AddStat(SCN_SERVER_STARTTIME, SCDT_TIMESTAMP, "server_start_date", "Time when the server was started");
  	AddStat(SCN_SERVER_LAST_CACHECLEARED, SCDT_TIMESTAMP, "cache_purge_date", "Time when the cache was cleared");
  	AddStat(SCN_SERVER_LAST_CONFIGRELOAD, SCDT_TIMESTAMP, "config_reload_date", "Time when the configuration file was reloaded / logrotation (SIGHUP)");
  	AddStat(SCN_SERVER_CONNECTIONS, SCDT_LONGLONG, "connections", "Number of handled incoming connections");
- 	AddStat(SCN_MAX_SOCKET_NUMBER, SCDT_LONGLONG, "max_socket", "Highest socket number used");
+ 	AddStat(SCN_MAX_SOCKET_NUMBER, SCDT_LONGLONG, "max_socket", "Highest socket number used", SCA_MAX);
  	AddStat(SCN_REDIRECT_COUNT, SCDT_LONGLONG, "redirections", "Number of redirected requests");
  	AddStat(SCN_SEARCHFOLDER_COUNT, SCDT_LONGLONG, "searchfld_loaded", "Total number of searchfolders");
  	AddStat(SCN_SEARCHFOLDER_THREADS, SCDT_LONGLONG, "searchfld_threads", "Current number of running searchfolder threads");
@@ -38,6 +43,7 @@ ECStatsCollector::ECStatsCollector() {
  	AddStat(SCN_SOAP_REQUESTS, SCDT_LONGLONG, "soap_request", "Number of soap requests handled by server");
  	AddStat(SCN_RESPONSE_TIME, SCDT_LONGLONG, "response_time", "Response time of soap requests handled in milliseconds (includes time in queue)");
  	AddStat(SCN_PROCESSING_TIME, SCDT_LONGLONG, "processing_time", "Time taken to process soap requests in milliseconds (wallclock time)");
+ 	AddStat(SCN_SERVER_QUEUE_STEALS, SCDT_LONGLONG, "queue_steals", "Number of requests taken from the work queue of another thread");
  
  	AddStat(SCN_DATABASE_CONNECTS, SCDT_LONGLONG, "sql_connect", "Number of connections made to SQL server");
  	AddStat(SCN_DATABASE_SELECTS, SCDT_LONGLONG, "sql_select", "Number of SQL Select commands executed");
@@ -78,58 +84,155 @@ ECStatsCollector::ECStatsCollector() {
  	AddStat(SCN_LDAP_RECONNECTS, SCDT_LONGLONG, "ldap_reconnect", "Number of re-connections made to LDAP server");
  	AddStat(SCN_LDAP_CONNECT_FAILED, SCDT_LONGLONG, "ldap_connect_fail", "Number of failed connections made to LDAP server");
  	AddStat(SCN_LDAP_CONNECT_TIME, SCDT_LONGLONG, "ldap_connect_time", "Total duration of connections made to LDAP server");
- 	AddStat(SCN_LDAP_CONNECT_TIME_MAX, SCDT_LONGLONG, "ldap_max_connect", "Longest connection time made to LDAP server");
+ 	AddStat(SCN_LDAP_CONNECT_TIME_MAX, SCDT_LONGLONG, "ldap_max_connect", "Longest connection time made to LDAP server", SCA_MAX);
  	
  	/* maybe usesless because SCN_LOGIN_* */
  	AddStat(SCN_LDAP_AUTH_LOGINS, SCDT_LONGLONG, "ldap_auth", "Number of LDAP authentications");
  	AddStat(SCN_LDAP_AUTH_DENIED, SCDT_LONGLONG, "ldap_auth_fail", "Number of failed authentications");
  	AddStat(SCN_LDAP_AUTH_TIME, SCDT_LONGLONG, "ldap_auth_time", "Total authentication time");
- 	AddStat(SCN_LDAP_AUTH_TIME_MAX, SCDT_LONGLONG, "ldap_max_auth", "Longest duration of authentication made to LDAP server");
- 	AddStat(SCN_LDAP_AUTH_TIME_AVG, SCDT_LONGLONG, "ldap_avg_auth", "Average duration of authentication made to LDAP server");
+ 	AddStat(SCN_LDAP_AUTH_TIME_MAX, SCDT_LONGLONG, "ldap_max_auth", "Longest duration of authentication made to LDAP server", SCA_MAX);
+ 	AddStat(SCN_LDAP_AUTH_TIME_AVG, SCDT_LONGLONG, "ldap_avg_auth", "Average duration of authentication made to LDAP server", SCA_AVG);
  
  	AddStat(SCN_LDAP_SEARCH, SCDT_LONGLONG, "ldap_search", "Number of searches made to LDAP server");
  	AddStat(SCN_LDAP_SEARCH_FAILED, SCDT_LONGLONG, "ldap_search_fail", "Number of failed searches made to LDAP server");
  	AddStat(SCN_LDAP_SEARCH_TIME, SCDT_LONGLONG, "ldap_search_time", "Total duration of LDAP searches");
- 	AddStat(SCN_LDAP_SEARCH_TIME_MAX, SCDT_LONGLONG, "ldap_max_search", "Longest duration of LDAP search");
+ 	AddStat(SCN_LDAP_SEARCH_TIME_MAX, SCDT_LONGLONG, "ldap_max_search", "Longest duration of LDAP search", SCA_MAX);
+	AddStat(SCN_LDAP_CACHE_HITS, SCDT_LONGLONG, "ldap_cache_hits", "Number of LDAP name and DN lookups answered from the cache");
+	AddStat(SCN_LDAP_CACHE_NEGATIVE_HITS, SCDT_LONGLONG, "ldap_cache_negative_hits", "Number of LDAP name lookups answered as not found from the cache");
+	AddStat(SCN_LDAP_CACHE_MISSES, SCDT_LONGLONG, "ldap_cache_misses", "Number of LDAP name and DN lookups not found in the cache");
 
 	AddStat(SCN_INDEXER_SEARCH_ERRORS, SCDT_LONGLONG, "index_search_errors", "Number of failed indexer queries");
-	AddStat(SCN_INDEXER_SEARCH_MAX, SCDT_LONGLONG, "index_search_max", "Maximum duration of an indexed search query");
-	AddStat(SCN_INDEXER_SEARCH_AVG, SCDT_LONGLONG, "index_search_avg", "Average duration of an indexed search query");
+	AddStat(SCN_INDEXER_SEARCH_MAX, SCDT_LONGLONG, "index_search_max", "Maximum duration of an indexed search query", SCA_MAX);
+	AddStat(SCN_INDEXER_SEARCH_AVG, SCDT_LONGLONG, "index_search_avg", "Average duration of an indexed search query", SCA_AVG);
 	AddStat(SCN_INDEXED_SEARCHES, SCDT_LONGLONG, "search_indexed", "Number of indexed searches performed");
 	AddStat(SCN_DATABASE_SEARCHES, SCDT_LONGLONG, "search_database", "Number of database searches performed");
+
+	AddStat(SCN_ATTACHMENT_CACHE_HITS, SCDT_LONGLONG, "attcache_hits", "Number of attachments loaded from the attachment cache");
+	AddStat(SCN_ATTACHMENT_CACHE_MISSES, SCDT_LONGLONG, "attcache_misses", "Number of attachments not found in the attachment cache");
 }
 
 ECStatsCollector::~ECStatsCollector() {
-	SCMap::iterator iSD;
-
-	for (iSD = m_StatData.begin(); iSD != m_StatData.end(); ++iSD)
-		pthread_mutex_destroy(&iSD->second.lock);
+	std::list<ECThreadStats *>::const_iterator iThread;
+	std::map<std::string, ECLatencyHistogram *>::const_iterator iHistogram;
+
+	pthread_key_delete(m_ThreadKey);
+	for (iThread = m_lstThreads.begin(); iThread != m_lstThreads.end(); ++iThread)
+		delete *iThread;
+	for (iHistogram = m_mapHistograms.begin(); iHistogram != m_mapHistograms.end(); ++iHistogram)
+		delete iHistogram->second;
+	pthread_mutex_destroy(&m_ThreadsLock);
 	pthread_mutex_destroy(&m_StringsLock);
+	pthread_mutex_destroy(&m_HistogramsLock);
 }
 
-void ECStatsCollector::AddStat(SCName index, SCType type, const char *name, const char *description) {
-	ECStat newStat;
+void ECStatsCollector::AddStat(SCName index, SCType type, const char *name, const char *description, SCAggregate aggregate) {
+	ECStat &newStat = m_StatData[index];
 
 	newStat.data.ll = 0;		// reset largest data var in union
-	newStat.avginc = 1;
+	newStat.count = 0;
 	newStat.type = type;
+	newStat.aggregate = aggregate;
 	newStat.name = name;
 	newStat.description = description;
+}
+
+static bool LessData(SCType type, const SCData &a, const SCData &b)
+{
+	switch (type) {
+	case SCDT_FLOAT:
+		return a.f < b.f;
+	case SCDT_LONGLONG:
+		return a.ll < b.ll;
+	case SCDT_TIMESTAMP:
+		return a.ts < b.ts;
+	}
+	return false;
+}
+
+static void AddData(SCType type, SCData *lpData, const SCData &add)
+{
+	switch (type) {
+	case SCDT_FLOAT:
+		lpData->f += add.f;
+		break;
+	case SCDT_LONGLONG:
+		lpData->ll += add.ll;
+		break;
+	case SCDT_TIMESTAMP:
+		lpData->ts += add.ts;
+		break;
+	}
+}
 
-	m_StatData[index] = newStat;
-	pthread_mutex_init(&m_StatData[index].lock, NULL);
+bool ECStatsCollector::IsStat(SCName name, SCType type)
+{
+	if ((unsigned int)name >= SCN_MAX_STATS || m_StatData[name].name == NULL)
+		return false;
+
+	ASSERT(m_StatData[name].type == type);
+	return true;
+}
+
+/**
+ * Get the slot of a stat for the current thread
+ *
+ * The slots of a thread are created the first time it updates a stat, and
+ * merged into m_StatData when the thread exits.
+ *
+ * @param[in]	name	Stat to update
+ * @param[in]	type	Type of the value, which must match the type of the stat
+ * @return The slot, or NULL if the stat does not exist
+ */
+ECStatSlot *ECStatsCollector::GetSlot(SCName name, SCType type)
+{
+	ECThreadStats *lpThread = NULL;
+
+	if (!IsStat(name, type))
+		return NULL;
+
+	lpThread = (ECThreadStats *)pthread_getspecific(m_ThreadKey);
+	if (lpThread == NULL) {
+		lpThread = new ECThreadStats;
+		memset(lpThread, 0, sizeof(ECThreadStats));
+		lpThread->lpCollector = this;
+
+		pthread_mutex_lock(&m_ThreadsLock);
+		m_lstThreads.push_back(lpThread);
+		pthread_mutex_unlock(&m_ThreadsLock);
+
+		pthread_setspecific(m_ThreadKey, lpThread);
+	}
+
+	return &lpThread->slots[name];
+}
+
+void ECStatsCollector::ThreadExit(void *lpThreadStats)
+{
+	ECThreadStats *lpThread = (ECThreadStats *)lpThreadStats;
+	ECStatsCollector *lpThis = lpThread->lpCollector;
+
+	pthread_mutex_lock(&lpThis->m_ThreadsLock);
+	for (unsigned int i = 0; i < SCN_MAX_STATS; ++i) {
+		ECStat &stat = lpThis->m_StatData[i];
+		if (stat.name != NULL)
+			lpThis->Combine(stat, lpThread->slots[i], &stat.data, &stat.count);
+	}
+	lpThis->m_lstThreads.remove(lpThread);
+	pthread_mutex_unlock(&lpThis->m_ThreadsLock);
+
+	delete lpThread;
 }
 
 void ECStatsCollector::Increment(SCName name, float inc) {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	ECStatSlot *lpSlot = GetSlot(name, SCDT_FLOAT);
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_FLOAT);
+	if (lpSlot == NULL)
+		return;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.f += inc;
-	pthread_mutex_unlock(&iSD->second.lock);
+	data.ll = lpSlot->data;
+	data.f += inc;
+	lpSlot->data = data.ll;
 }
 
 void ECStatsCollector::Increment(SCName name, int inc) {
@@ -137,189 +240,186 @@ void ECStatsCollector::Increment(SCName name, int inc) {
 }
 
 void ECStatsCollector::Increment(SCName name, LONGLONG inc) {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	ECStatSlot *lpSlot = GetSlot(name, SCDT_LONGLONG);
 
-	ASSERT(iSD->second.type == SCDT_LONGLONG);
+	if (lpSlot != NULL)
+		lpSlot->data += inc;
+}
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.ll += inc;
-	pthread_mutex_unlock(&iSD->second.lock);
+/**
+ * Set the value of a stat
+ *
+ * The values of all threads are cleared. An update that another thread
+ * makes at the same time may be lost, like with Reset().
+ */
+void ECStatsCollector::SetData(SCName name, SCData data)
+{
+	std::list<ECThreadStats *>::const_iterator iThread;
+
+	pthread_mutex_lock(&m_ThreadsLock);
+	m_StatData[name].data = data;
+	m_StatData[name].count = 1;
+	for (iThread = m_lstThreads.begin(); iThread != m_lstThreads.end(); ++iThread) {
+		(*iThread)->slots[name].data = 0;
+		(*iThread)->slots[name].count = 0;
+	}
+	pthread_mutex_unlock(&m_ThreadsLock);
 }
 
 void ECStatsCollector::Set(SCName name, float set) {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_FLOAT);
+	if (!IsStat(name, SCDT_FLOAT))
+		return;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.f = set;
-	pthread_mutex_unlock(&iSD->second.lock);
+	data.ll = 0;
+	data.f = set;
+	SetData(name, data);
 }
 
 void ECStatsCollector::Set(SCName name, LONGLONG set) {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_LONGLONG);
+	if (!IsStat(name, SCDT_LONGLONG))
+		return;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.ll = set;
-	pthread_mutex_unlock(&iSD->second.lock);
+	data.ll = set;
+	SetData(name, data);
 }
 
 void ECStatsCollector::SetTime(SCName name, time_t set) {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_TIMESTAMP);
+	if (!IsStat(name, SCDT_TIMESTAMP))
+		return;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.ts = set;
-	pthread_mutex_unlock(&iSD->second.lock);
+	data.ll = 0;
+	data.ts = set;
+	SetData(name, data);
 }
 
-void ECStatsCollector::Min(SCName name, float min)
+void ECStatsCollector::MinData(SCName name, SCType type, SCData min)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
+	ECStatSlot *lpSlot = GetSlot(name, type);
+	SCData data;
+
+	if (lpSlot == NULL)
 		return;
 
-	ASSERT(iSD->second.type == SCDT_FLOAT);
+	data.ll = lpSlot->data;
+	if (lpSlot->count == 0 || LessData(type, min, data)) {
+		lpSlot->data = min.ll;
+		lpSlot->count = 1;
+	}
+}
+
+void ECStatsCollector::Min(SCName name, float min)
+{
+	SCData data;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.f > min)
-		iSD->second.data.f = min;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = 0;
+	data.f = min;
+	MinData(name, SCDT_FLOAT, data);
 }
 
 void ECStatsCollector::Min(SCName name, LONGLONG min)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
-
-	ASSERT(iSD->second.type == SCDT_LONGLONG);
+	SCData data;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.ll > min)
-		iSD->second.data.ll = min;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = min;
+	MinData(name, SCDT_LONGLONG, data);
 }
 
 void ECStatsCollector::MinTime(SCName name, time_t min)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_TIMESTAMP);
-
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.ts > min)
-		iSD->second.data.ts = min;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = 0;
+	data.ts = min;
+	MinData(name, SCDT_TIMESTAMP, data);
 }
 
-
-void ECStatsCollector::Max(SCName name, float max)
+void ECStatsCollector::MaxData(SCName name, SCType type, SCData max)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
+	ECStatSlot *lpSlot = GetSlot(name, type);
+	SCData data;
+
+	if (lpSlot == NULL)
 		return;
 
-	ASSERT(iSD->second.type == SCDT_FLOAT);
+	data.ll = lpSlot->data;
+	if (lpSlot->count == 0 || LessData(type, data, max)) {
+		lpSlot->data = max.ll;
+		lpSlot->count = 1;
+	}
+}
+
+void ECStatsCollector::Max(SCName name, float max)
+{
+	SCData data;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.f < max)
-		iSD->second.data.f = max;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = 0;
+	data.f = max;
+	MaxData(name, SCDT_FLOAT, data);
 }
 
 void ECStatsCollector::Max(SCName name, LONGLONG max)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_LONGLONG);
-
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.ll < max)
-		iSD->second.data.ll = max;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = max;
+	MaxData(name, SCDT_LONGLONG, data);
 }
 
 void ECStatsCollector::MaxTime(SCName name, time_t max)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
+	SCData data;
 
-	ASSERT(iSD->second.type == SCDT_TIMESTAMP);
-
-	pthread_mutex_lock(&iSD->second.lock);
-	if (iSD->second.data.ts < max)
-		iSD->second.data.ts = max;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = 0;
+	data.ts = max;
+	MaxData(name, SCDT_TIMESTAMP, data);
 }
 
-
-void ECStatsCollector::Avg(SCName name, float add)
+void ECStatsCollector::AvgData(SCName name, SCType type, SCData add)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
+	ECStatSlot *lpSlot = GetSlot(name, type);
+	SCData data;
+
+	if (lpSlot == NULL)
 		return;
 
-	ASSERT(iSD->second.type == SCDT_FLOAT);
+	data.ll = lpSlot->data;
+	AddData(type, &data, add);
+	lpSlot->data = data.ll;
+	++lpSlot->count;
+}
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.f = ((add - iSD->second.data.f) / iSD->second.avginc) + iSD->second.data.f;
-	++iSD->second.avginc;
-	if (iSD->second.avginc == 0)
-		iSD->second.avginc = 1;
-	pthread_mutex_unlock(&iSD->second.lock);	
+void ECStatsCollector::Avg(SCName name, float add)
+{
+	SCData data;
+
+	data.ll = 0;
+	data.f = add;
+	AvgData(name, SCDT_FLOAT, data);
 }
 
 void ECStatsCollector::Avg(SCName name, LONGLONG add)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
-
-	ASSERT(iSD->second.type == SCDT_LONGLONG);
+	SCData data;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.ll = ((add - iSD->second.data.ll) / iSD->second.avginc) + iSD->second.data.ll;
-	++iSD->second.avginc;
-	if (iSD->second.avginc == 0)
-		iSD->second.avginc = 1;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = add;
+	AvgData(name, SCDT_LONGLONG, data);
 }
 
 void ECStatsCollector::AvgTime(SCName name, time_t add)
 {
-	SCMap::iterator iSD = m_StatData.find(name);
-	if (iSD == m_StatData.end())
-		return;
-
-	ASSERT(iSD->second.type == SCDT_TIMESTAMP);
+	SCData data;
 
-	pthread_mutex_lock(&iSD->second.lock);
-	iSD->second.data.ts = ((add - iSD->second.data.ts) / iSD->second.avginc) + iSD->second.data.ts;
-	++iSD->second.avginc;
-	if (iSD->second.avginc == 0)
-		iSD->second.avginc = 1;
-	pthread_mutex_unlock(&iSD->second.lock);	
+	data.ll = 0;
+	data.ts = add;
+	AvgData(name, SCDT_TIMESTAMP, data);
 }
 
-
-
 void ECStatsCollector::Set(const std::string &name, const std::string &description, const std::string &value)
 {
 	ECStrings data;
@@ -339,21 +439,87 @@ void ECStatsCollector::Remove(const std::string &name)
 	pthread_mutex_unlock(&m_StringsLock);
 }
 
-std::string ECStatsCollector::GetValue(SCMap::const_iterator iSD)
+/**
+ * Add the value of a thread to the combined value of a stat
+ *
+ * For SCA_AVG, the combined value is the sum of the values, and lpCount
+ * the number of values. For SCA_MIN and SCA_MAX, lpCount is 0 until
+ * there is a value.
+ */
+void ECStatsCollector::Combine(const ECStat &stat, const ECStatSlot &slot, SCData *lpData, LONGLONG *lpCount)
+{
+	SCData data;
+
+	data.ll = slot.data;
+
+	switch (stat.aggregate) {
+	case SCA_SUM:
+		AddData(stat.type, lpData, data);
+		break;
+	case SCA_MIN:
+	case SCA_MAX:
+		if (slot.count == 0)
+			break;
+		if (*lpCount == 0 ||
+		    (stat.aggregate == SCA_MIN && LessData(stat.type, data, *lpData)) ||
+		    (stat.aggregate == SCA_MAX && LessData(stat.type, *lpData, data))) {
+			*lpData = data;
+			*lpCount = 1;
+		}
+		break;
+	case SCA_AVG:
+		AddData(stat.type, lpData, data);
+		*lpCount += slot.count;
+		break;
+	}
+}
+
+void ECStatsCollector::GetData(SCName name, SCData *lpData)
+{
+	const ECStat &stat = m_StatData[name];
+	std::list<ECThreadStats *>::const_iterator iThread;
+	SCData data;
+	LONGLONG count;
+
+	pthread_mutex_lock(&m_ThreadsLock);
+	data = stat.data;
+	count = stat.count;
+	for (iThread = m_lstThreads.begin(); iThread != m_lstThreads.end(); ++iThread)
+		Combine(stat, (*iThread)->slots[name], &data, &count);
+	pthread_mutex_unlock(&m_ThreadsLock);
+
+	if (stat.aggregate == SCA_AVG) {
+		switch (stat.type) {
+		case SCDT_FLOAT:
+			data.f = count ? data.f / count : 0;
+			break;
+		case SCDT_LONGLONG:
+			data.ll = count ? data.ll / count : 0;
+			break;
+		case SCDT_TIMESTAMP:
+			data.ts = count ? data.ts / count : 0;
+			break;
+		}
+	}
+
+	*lpData = data;
+}
+
+std::string ECStatsCollector::GetValue(const ECStat &stat, const SCData &data)
 {
 	std::string rv;
 
-	switch(iSD->second.type) {
+	switch(stat.type) {
 	case SCDT_FLOAT:
-		rv = stringify_float(iSD->second.data.f);
+		rv = stringify_float(data.f);
 		break;
 	case SCDT_LONGLONG:
-		rv = stringify_int64(iSD->second.data.ll);
+		rv = stringify_int64(data.ll);
 		break;
 	case SCDT_TIMESTAMP:
-		if (iSD->second.data.ts > 0) {
+		if (data.ts > 0) {
 			char timestamp[128] = { 0 };
-			struct tm *tm = localtime(&iSD->second.data.ts);
+			struct tm *tm = localtime(&data.ts);
 			strftime(timestamp, sizeof timestamp, "%a %b %e %T %Y", tm);
 			rv = timestamp;
 		}
@@ -365,22 +531,25 @@ std::string ECStatsCollector::GetValue(SCMap::const_iterator iSD)
 
 std::string ECStatsCollector::GetValue(SCName name) {
 	std::string rv;
-	SCMap::const_iterator iSD = m_StatData.find(name);
+	SCData data;
 
-	if (iSD != m_StatData.end())
-		rv = GetValue(iSD);
+	if ((unsigned int)name < SCN_MAX_STATS && m_StatData[name].name != NULL) {
+		GetData(name, &data);
+		rv = GetValue(m_StatData[name], data);
+	}
 
 	return rv;
 }
 
 void ECStatsCollector::ForEachStat(void(callback)(const std::string &, const std::string &, const std::string &, void*), void *obj)
 {
-	SCMap::iterator iSD;
+	SCData data;
 
-	for (iSD = m_StatData.begin(); iSD != m_StatData.end(); ++iSD) {
-		pthread_mutex_lock(&iSD->second.lock);
-		callback(iSD->second.name, iSD->second.description, GetValue(iSD), obj);
-		pthread_mutex_unlock(&iSD->second.lock);
+	for (unsigned int i = 0; i < SCN_MAX_STATS; ++i) {
+		if (m_StatData[i].name == NULL)
+			continue;
+		GetData((SCName)i, &data);
+		callback(m_StatData[i].name, m_StatData[i].description, GetValue(m_StatData[i], data), obj);
 	}
 }
 
@@ -394,19 +563,203 @@ void ECStatsCollector::ForEachString(void(callback)(const std::string &, const s
 	pthread_mutex_unlock(&m_StringsLock);
 }
 
+/**
+ * Enable the latency histograms
+ *
+ * Must be called before the first GetHistogram(), since callers keep the
+ * pointer they got. When disabled, GetHistogram() returns NULL and nothing
+ * is recorded or reported.
+ */
+void ECStatsCollector::SetHistogramsEnabled(bool bEnabled)
+{
+	m_bHistograms = bEnabled;
+}
+
+/**
+ * Make a histogram name fit in SC_LATENCY_NAME_MAX characters
+ *
+ * Longer names are cut, and end in a hash of the full name so that names
+ * with the same start stay apart.
+ */
+static std::string ShortHistogramName(const std::string &name)
+{
+	unsigned int ulHash = 2166136261U;
+	char szHash[5];
+
+	if (name.size() <= SC_LATENCY_NAME_MAX)
+		return name;
+
+	// FNV-1a
+	for (size_t i = 0; i < name.size(); ++i)
+		ulHash = (ulHash ^ (unsigned char)name[i]) * 16777619U;
+	snprintf(szHash, sizeof(szHash), "%04x", ulHash & 0xffff);
+
+	return name.substr(0, SC_LATENCY_NAME_MAX - 4) + szHash;
+}
+
+/**
+ * Get a latency histogram
+ *
+ * The histogram is created when it does not exist yet. Callers should
+ * remember the returned pointer, so updates don't need to look it up.
+ *
+ * @param[in]	name		Name of the histogram, shortened to SC_LATENCY_NAME_MAX characters as prefix for its stats
+ * @param[in]	description	Description of the measured durations
+ * @return The histogram, or NULL when histograms are disabled
+ */
+ECLatencyHistogram *ECStatsCollector::GetHistogram(const std::string &name, const std::string &description)
+{
+	ECLatencyHistogram *lpHistogram = NULL;
+	std::map<std::string, ECLatencyHistogram *>::const_iterator iHistogram;
+
+	if (!m_bHistograms)
+		return NULL;
+
+	pthread_mutex_lock(&m_HistogramsLock);
+	iHistogram = m_mapHistograms.find(name);
+	if (iHistogram != m_mapHistograms.end()) {
+		lpHistogram = iHistogram->second;
+	} else {
+		lpHistogram = new ECLatencyHistogram;
+		lpHistogram->name = ShortHistogramName(name);
+		lpHistogram->description = description;
+		for (unsigned int i = 0; i < SC_LATENCY_BUCKETS; ++i)
+			lpHistogram->buckets[i] = 0;
+		lpHistogram->total = 0;
+		lpHistogram->max = 0;
+		m_mapHistograms.insert(std::make_pair(name, lpHistogram));
+	}
+	pthread_mutex_unlock(&m_HistogramsLock);
+
+	return lpHistogram;
+}
+
+void ECStatsCollector::AddLatency(ECLatencyHistogram *lpHistogram, double dblSeconds)
+{
+	LONGLONG llMicros = 0;
+	LONGLONG llMax = 0;
+	unsigned int ulBucket = 0;
+
+	if (lpHistogram == NULL)
+		return;
+	if (dblSeconds > 0)
+		llMicros = (LONGLONG)(dblSeconds * 1000000);
+
+	// bucket n holds [2^(n-1), 2^n) microseconds; bucket 0 is below 1 microsecond
+	if (llMicros > 0)
+		ulBucket = 64 - __builtin_clzll((unsigned long long)llMicros);
+	if (ulBucket >= SC_LATENCY_BUCKETS)
+		ulBucket = SC_LATENCY_BUCKETS - 1;
+
+	__sync_fetch_and_add(&lpHistogram->buckets[ulBucket], 1);
+	__sync_fetch_and_add(&lpHistogram->total, llMicros);
+
+	llMax = lpHistogram->max;
+	while (llMicros > llMax && !__sync_bool_compare_and_swap(&lpHistogram->max, llMax, llMicros))
+		llMax = lpHistogram->max;
+}
+
+/**
+ * Get a percentile of a histogram, in milliseconds
+ *
+ * The position within the bucket is interpolated linearly, which is
+ * exact to within a factor of 2.
+ */
+static double GetPercentile(const LONGLONG *lpBuckets, LONGLONG llCount, LONGLONG llMax, double dblPercentile)
+{
+	LONGLONG llTarget = (LONGLONG)(llCount * dblPercentile + 0.5);
+	LONGLONG llSeen = 0;
+	double dblLow = 0, dblHigh = 0, dblMicros = 0;
+
+	if (llTarget < 1)
+		llTarget = 1;
+
+	for (unsigned int i = 0; i < SC_LATENCY_BUCKETS; ++i) {
+		if (llSeen + lpBuckets[i] < llTarget) {
+			llSeen += lpBuckets[i];
+			continue;
+		}
+		dblLow = i == 0 ? 0 : (double)(1ULL << (i - 1));
+		dblHigh = (double)(1ULL << i);
+		dblMicros = dblLow + (dblHigh - dblLow) * (llTarget - llSeen) / lpBuckets[i];
+		break;
+	}
+
+	if (dblMicros > llMax)
+		dblMicros = llMax;
+	return dblMicros / 1000;
+}
+
+/**
+ * Report the count, average, percentiles and maximum of all histograms that have values
+ *
+ * Durations are reported in milliseconds.
+ */
+void ECStatsCollector::ForEachHistogram(void(callback)(const std::string &, const std::string &, const std::string &, void*), void *obj)
+{
+	std::list<ECLatencyHistogram *> lstHistograms;
+	std::list<ECLatencyHistogram *>::const_iterator iHistogram;
+	std::map<std::string, ECLatencyHistogram *>::const_iterator iMap;
+	LONGLONG buckets[SC_LATENCY_BUCKETS];
+	LONGLONG llCount, llTotal, llMax;
+
+	// histograms are never removed, so they can be read without the lock
+	pthread_mutex_lock(&m_HistogramsLock);
+	for (iMap = m_mapHistograms.begin(); iMap != m_mapHistograms.end(); ++iMap)
+		lstHistograms.push_back(iMap->second);
+	pthread_mutex_unlock(&m_HistogramsLock);
+
+	for (iHistogram = lstHistograms.begin(); iHistogram != lstHistograms.end(); ++iHistogram) {
+		const ECLatencyHistogram *lpHistogram = *iHistogram;
+
+		llCount = 0;
+		for (unsigned int i = 0; i < SC_LATENCY_BUCKETS; ++i) {
+			buckets[i] = lpHistogram->buckets[i];
+			llCount += buckets[i];
+		}
+		if (llCount == 0)
+			continue;
+		llTotal = lpHistogram->total;
+		llMax = lpHistogram->max;
+
+		callback(lpHistogram->name + "_cnt", "Number of " + lpHistogram->description, stringify_int64(llCount), obj);
+		callback(lpHistogram->name + "_avg", "Average duration of " + lpHistogram->description + " in milliseconds", stringify_double((double)llTotal / llCount / 1000, 3), obj);
+		callback(lpHistogram->name + "_p50", "Median duration of " + lpHistogram->description + " in milliseconds", stringify_double(GetPercentile(buckets, llCount, llMax, 0.50), 3), obj);
+		callback(lpHistogram->name + "_p90", "90th percentile duration of " + lpHistogram->description + " in milliseconds", stringify_double(GetPercentile(buckets, llCount, llMax, 0.90), 3), obj);
+		callback(lpHistogram->name + "_p99", "99th percentile duration of " + lpHistogram->description + " in milliseconds", stringify_double(GetPercentile(buckets, llCount, llMax, 0.99), 3), obj);
+		callback(lpHistogram->name + "_max", "Longest duration of " + lpHistogram->description + " in milliseconds", stringify_double((double)llMax / 1000, 3), obj);
+	}
+}
+
 void ECStatsCollector::Reset() {
-	SCMap::iterator iSD;
+	std::map<std::string, ECLatencyHistogram *>::const_iterator iHistogram;
 
-	for (iSD = m_StatData.begin(); iSD != m_StatData.end(); ++iSD)
-		// reset largest var in union
-		iSD->second.data.ll = 0;
+	for (unsigned int i = 0; i < SCN_MAX_STATS; ++i)
+		Reset((SCName)i);
+
+	pthread_mutex_lock(&m_HistogramsLock);
+	for (iHistogram = m_mapHistograms.begin(); iHistogram != m_mapHistograms.end(); ++iHistogram) {
+		for (unsigned int i = 0; i < SC_LATENCY_BUCKETS; ++i)
+			iHistogram->second->buckets[i] = 0;
+		iHistogram->second->total = 0;
+		iHistogram->second->max = 0;
+	}
+	pthread_mutex_unlock(&m_HistogramsLock);
 }
 
 void ECStatsCollector::Reset(SCName name) {
-	SCMap::iterator iSD = m_StatData.find(name);
+	std::list<ECThreadStats *>::const_iterator iThread;
+
+	if ((unsigned int)name >= SCN_MAX_STATS)
+		return;
 
-	if (iSD != m_StatData.end()) {
-		// reset largest var in union
-		iSD->second.data.ll = 0;
+	pthread_mutex_lock(&m_ThreadsLock);
+	// reset largest var in union
+	m_StatData[name].data.ll = 0;
+	m_StatData[name].count = 0;
+	for (iThread = m_lstThreads.begin(); iThread != m_lstThreads.end(); ++iThread) {
+		(*iThread)->slots[name].data = 0;
+		(*iThread)->slots[name].count = 0;
 	}
+	pthread_mutex_unlock(&m_ThreadsLock);
 }
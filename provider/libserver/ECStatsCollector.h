@@ -20,6 +20,7 @@
 
 #include <zarafa/zcdefs.h>
 #include <string>
+#include <list>
 #include <map>
 #include <pthread.h>
 
@@ -33,22 +34,56 @@ typedef union _statdata {
 
 enum SCType { SCDT_FLOAT, SCDT_LONGLONG, SCDT_TIMESTAMP };
 
+/* How the values of the threads are combined into the value of a stat */
+enum SCAggregate { SCA_SUM, SCA_MIN, SCA_MAX, SCA_AVG };
+
 typedef struct _ECStat {
-	SCData data;
-	LONGLONG avginc;
+	SCData data;		/* value from Set(), combined with the values of exited threads */
+	LONGLONG count;		/* number of values averaged in data (SCA_AVG), or 0 if data was not set (SCA_MIN) */
 	SCType type;
+	SCAggregate aggregate;
 	const char *name;
 	const char *description;
-	pthread_mutex_t lock;
 } ECStat;
 
-typedef std::map<SCName, ECStat> SCMap;
+/* The value of a stat in one thread, which is only written by that thread */
+typedef struct _ECStatSlot {
+	volatile LONGLONG data;	/* SCData, stored as its largest member */
+	volatile LONGLONG count;
+} ECStatSlot;
+
+class ECStatsCollector;
+
+typedef struct _ECThreadStats {
+	ECStatsCollector *lpCollector;
+	ECStatSlot slots[SCN_MAX_STATS];
+} ECThreadStats;
+
+/* Number of buckets of a latency histogram; bucket n counts durations below 2^n microseconds */
+#define SC_LATENCY_BUCKETS 32
+/* Longest histogram name; with the 4 character suffix of its stats it stays within the 19 characters of RRDtool */
+#define SC_LATENCY_NAME_MAX 15
+
+/* Latency histogram, updated without locking */
+typedef struct _ECLatencyHistogram {
+	std::string name;
+	std::string description;
+	volatile LONGLONG buckets[SC_LATENCY_BUCKETS];
+	volatile LONGLONG total;	/* sum of all durations, in microseconds */
+	volatile LONGLONG max;		/* in microseconds */
+} ECLatencyHistogram;
 
 typedef struct _ECStrings {
 	std::string description;
 	std::string value;
 } ECStrings;
 
+/**
+ * Server statistics
+ *
+ * Updating a stat does not take any lock: every thread has its own copy of
+ * the stats, which are combined into the actual values when they are read.
+ */
 class ECStatsCollector _zcp_final : public IECStatsCollector {
 public:
 	ECStatsCollector();
@@ -78,21 +113,44 @@ public:
 	void Set(const std::string &name, const std::string &description, const std::string &value) _zcp_override;
 	void Remove(const std::string &name) _zcp_override;
 
-	std::string GetValue(SCMap::const_iterator iSD);
 	std::string GetValue(SCName name) _zcp_override;
 
 	void ForEachStat(void(callback)(const std::string &, const std::string &, const std::string &, void*), void *obj);
 	void ForEachString(void(callback)(const std::string &, const std::string &, const std::string &, void*), void *obj);
 
+	/* latency histograms, created on first use; they exist until the collector is deleted */
+	void SetHistogramsEnabled(bool bEnabled);
+	ECLatencyHistogram *GetHistogram(const std::string &name, const std::string &description);
+	void AddLatency(ECLatencyHistogram *lpHistogram, double dblSeconds);
+	void ForEachHistogram(void(callback)(const std::string &, const std::string &, const std::string &, void*), void *obj);
+
 	void Reset(void) _zcp_override;
 	void Reset(SCName name) _zcp_override;
 
 private:
-	void AddStat(SCName index, SCType type, const char *name, const char *description);
-
-	SCMap m_StatData;
+	void AddStat(SCName index, SCType type, const char *name, const char *description, SCAggregate aggregate = SCA_SUM);
+	bool IsStat(SCName name, SCType type);
+	ECStatSlot *GetSlot(SCName name, SCType type);
+	void SetData(SCName name, SCData data);
+	void MinData(SCName name, SCType type, SCData min);
+	void MaxData(SCName name, SCType type, SCData max);
+	void AvgData(SCName name, SCType type, SCData add);
+
+	void Combine(const ECStat &stat, const ECStatSlot &slot, SCData *lpData, LONGLONG *lpCount);
+	void GetData(SCName name, SCData *lpData);
+	std::string GetValue(const ECStat &stat, const SCData &data);
+
+	static void ThreadExit(void *lpThreadStats);
+
+	ECStat m_StatData[SCN_MAX_STATS];
+	pthread_key_t m_ThreadKey;
+	pthread_mutex_t m_ThreadsLock;	/* protects m_lstThreads and the data in m_StatData */
+	std::list<ECThreadStats *> m_lstThreads;
 	pthread_mutex_t m_StringsLock;
 	std::map<std::string, ECStrings> m_StatStrings;
+	bool m_bHistograms;
+	pthread_mutex_t m_HistogramsLock;
+	std::map<std::string, ECLatencyHistogram *> m_mapHistograms;
 };
 
 /* actual variable is in ECServerEntryPoint.cpp */
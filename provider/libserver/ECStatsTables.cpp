@@ -75,6 +75,7 @@ ECRESULT ECSystemStatsTable::Load()
 	id = 0;
 	g_lpStatsCollector->ForEachString(this->GetStatsCollectorData, (void*)this);
 	g_lpStatsCollector->ForEachStat(this->GetStatsCollectorData, (void*)this);
+	g_lpStatsCollector->ForEachHistogram(this->GetStatsCollectorData, (void*)this);
 	lpSession->GetSessionManager()->GetCacheManager()->ForEachCacheItem(this->GetStatsCollectorData, (void*)this);
 
 	// Receive session stats
@@ -133,10 +133,21 @@ ECStoreObjectTable::ECStoreObjectTable(ECSession *lpSession, unsigned int ulStor
 	
 	ulPermission = 0;
 	fPermissionRead = false;
+
+	m_bViewRegistered = false;
+	m_ulViewGeneration = 0;
+	m_lpView = NULL;
 }
 
 ECStoreObjectTable::~ECStoreObjectTable()
 {
+	// Drop the rows before the view they point into
+	lpKeyTable->Clear();
+	ReleaseSharedView();
+
+	if (m_bViewRegistered)
+		lpSession->GetSessionManager()->GetTableViewCache()->UnregisterTable(((ECODStore *)m_lpObjectData)->ulFolderId, this);
+
 	if(m_lpObjectData) {
 		ECODStore* lpODStore = (ECODStore*)m_lpObjectData;
 		delete lpODStore->lpGuid;
@@ -387,20 +398,20 @@ ECRESULT ECStoreObjectTable::QueryRowData(ECGenericObjectTable *lpThis, struct s
 	{
 	    bool bRowComplete = true;
 	    
+        // Get StoreId if needed, once per row
+        if(lpODStore->lpGuid == NULL) {
+            // No store specified, so determine the store ID & guid from the object id
+            lpSession->GetSessionManager()->GetCacheManager()->GetStore(iterRowList->ulObjId, &ulRowStoreId, &sRowGuid);
+        } else {
+            ulRowStoreId = lpODStore->ulStoreId;
+        }
+
 	    for (k = 0; k < lpsPropTagArray->__size; ++k) {
 	    	unsigned int ulPropTag;
 	    	
 	    	if(iterRowList->ulObjId == 0 || ECGenProps::GetPropSubstitute(lpODStore->ulObjType, lpsPropTagArray->__ptr[k], &ulPropTag) != erSuccess)
 	    		ulPropTag = lpsPropTagArray->__ptr[k];
 	    	
-            // Get StoreId if needed
-            if(lpODStore->lpGuid == NULL) {
-                // No store specified, so determine the store ID & guid from the object id
-                lpSession->GetSessionManager()->GetCacheManager()->GetStore(iterRowList->ulObjId, &ulRowStoreId, &sRowGuid);
-            } else {
-                ulRowStoreId = lpODStore->ulStoreId;
-            }
-
             // Handle category header rows
             if(iterRowList->ulObjId == 0) {
             	if(lpThis->GetPropCategory(soap, lpsPropTagArray->__ptr[k], *iterRowList, &lpsRowSet->__ptr[i].__ptr[k]) != erSuccess) {
@@ -652,6 +663,8 @@ ECRESULT ECStoreObjectTable::QueryRowDataByRow(ECGenericObjectTable *lpThis,
     std::set<unsigned int> setSubQueries;
 	std::multimap<unsigned int, unsigned int>::iterator iterColumns;
 	std::multimap<unsigned int, unsigned int>::const_iterator iterDelete;
+	std::list<ECsCellValue> lstCells;
+	ECsCellValue	sCell;
 
 	// Select correct property column query according to whether we want to truncate or not
 	std::string strPropColOrder = bTableLimit ? PROPCOLORDER_TRUNCATED : PROPCOLORDER;
@@ -796,7 +809,10 @@ ECRESULT ECStoreObjectTable::QueryRowDataByRow(ECGenericObjectTable *lpThis,
 
                 if ((lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second].ulPropTag & MV_FLAG) == 0) {
 					// Cache value
-					lpSession->GetSessionManager()->GetCacheManager()->SetCell(&sKey, iterColumns->first, &lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second]);
+					sCell.sKey = sKey;
+					sCell.ulPropTag = iterColumns->first;
+					sCell.lpPropVal = &lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second];
+					lstCells.push_back(sCell);
 				} else if ((lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second].ulPropTag & MVI_FLAG) == MVI_FLAG) {
 					// Get rid of the MVI_FLAG
 					lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second].ulPropTag &= ~MVI_FLAG;
@@ -815,9 +831,14 @@ ECRESULT ECStoreObjectTable::QueryRowDataByRow(ECGenericObjectTable *lpThis,
     for (iterColumns = mapColumns.begin(); iterColumns != mapColumns.end(); ++iterColumns) {
     	ASSERT(lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second].ulPropTag == 0);
 		CopyEmptyCellToSOAPPropVal(soap, iterColumns->first, &lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second]);
-		lpSession->GetSessionManager()->GetCacheManager()->SetCell(&sKey, iterColumns->first, &lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second]);
+		sCell.sKey = sKey;
+		sCell.ulPropTag = iterColumns->first;
+		sCell.lpPropVal = &lpsRowSet->__ptr[ulRowNum].__ptr[iterColumns->second];
+		lstCells.push_back(sCell);
 	}
 
+	lpSession->GetSessionManager()->GetCacheManager()->SetCells(lstCells);
+
 	er = erSuccess;
 
 exit:
@@ -868,6 +889,8 @@ ECRESULT ECStoreObjectTable::QueryRowDataByColumn(ECGenericObjectTable *lpThis,
     std::set<unsigned int>::const_iterator iterSubQueries;
     std::string		strSubquery;
     std::string		strPropColOrder;
+    std::list<ECsCellValue> lstCells;
+    ECsCellValue	sCell;
 
 	if (mapColumns.empty() || mapObjIds.empty())
 		goto exit;
@@ -997,9 +1020,13 @@ ECRESULT ECStoreObjectTable::QueryRowDataByColumn(ECGenericObjectTable *lpThis,
 				else
 					lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second].ulPropTag = iterColumns->first;
 
-				if ((lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second].ulPropTag & MV_FLAG) == 0)
-					lpSession->GetSessionManager()->GetCacheManager()->SetCell((sObjectTableKey*)&iterObjIds->first, iterColumns->first, &lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second]);
-
+				if ((lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second].ulPropTag & MV_FLAG) == 0) {
+					// Cache value, the whole block is added in one go below
+					sCell.sKey = iterObjIds->first;
+					sCell.ulPropTag = iterColumns->first;
+					sCell.lpPropVal = &lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second];
+					lstCells.push_back(sCell);
+				}
 				else if ((lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second].ulPropTag & MVI_FLAG) == MVI_FLAG)
 					lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second].ulPropTag &= ~MVI_FLAG;
 				
@@ -1024,8 +1051,13 @@ ECRESULT ECStoreObjectTable::QueryRowDataByColumn(ECGenericObjectTable *lpThis,
 					FreePropVal(&lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second], false);
 				}
 				CopyEmptyCellToSOAPPropVal(soap, iterColumns->first, &lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second]);
-				lpSession->GetSessionManager()->GetCacheManager()->SetCell((sObjectTableKey*)&iterObjIds->first, iterColumns->first, &lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second]);
+				sCell.sKey = iterObjIds->first;
+				sCell.ulPropTag = iterColumns->first;
+				sCell.lpPropVal = &lpsRowSet->__ptr[iterObjIds->second].__ptr[iterColumns->second];
+				lstCells.push_back(sCell);
 			}
+
+	lpSession->GetSessionManager()->GetCacheManager()->SetCells(lstCells);
 	
 exit:
 	if(lpDBResult)
@@ -1126,6 +1158,21 @@ ECRESULT ECStoreObjectTable::Load()
         // Clear old entries
         Clear();
 
+        // Contents tables may be copied from another session that has the same view on the folder
+        if (ulObjType == MAPI_MESSAGE && lpData->ulStoreId) {
+            ECTableViewCache *lpViewCache = lpSession->GetSessionManager()->GetTableViewCache();
+
+            if (!m_bViewRegistered) {
+                m_ulViewGeneration = lpViewCache->RegisterTable(ulFolderId);
+                m_bViewRegistered = true;
+            } else {
+                m_ulViewGeneration = lpViewCache->GetGeneration(ulFolderId);
+            }
+
+            if (LoadSharedView() == erSuccess)
+                goto exit;
+        }
+
         // Load the table with all the objects of type ulObjType and flags ulFlags in container ulParent
         
 		strQuery = "SELECT hierarchy.id FROM hierarchy WHERE hierarchy.parent=" + stringify(ulFolderId);
@@ -1174,7 +1221,8 @@ ECRESULT ECStoreObjectTable::Load()
         }
 
         LoadRows(&lstObjIds, 0);
-        
+
+        AddSharedView();
     }
     
 exit:
@@ -1235,6 +1283,161 @@ exit:
 
 }
 
+ECRESULT ECStoreObjectTable::Clear()
+{
+	pthread_mutex_lock(&m_hLock);
+
+	ECGenericObjectTable::Clear();
+
+	// No rows point into the view anymore
+	ReleaseSharedView();
+
+	pthread_mutex_unlock(&m_hLock);
+
+	return erSuccess;
+}
+
+ECRESULT ECStoreObjectTable::ReloadKeyTable()
+{
+	ECRESULT er = erSuccess;
+
+	pthread_mutex_lock(&m_hLock);
+
+	// When resorting, another session may already have the folder sorted this way
+	if (m_bPopulated && !mapObjects.empty() && LoadSharedView() == erSuccess)
+		goto exit;
+
+	er = ECGenericObjectTable::ReloadKeyTable();
+	if (er != erSuccess)
+		goto exit;
+
+	ReleaseSharedView();
+	AddSharedView();
+
+exit:
+	pthread_mutex_unlock(&m_hLock);
+
+	return er;
+}
+
+/**
+ * Get the key of this table in the ECTableViewCache
+ *
+ * Only plain contents tables can be shared: no restriction, no categories,
+ * no multi-valued instances and no sorting on properties that are computed
+ * for the session, like PR_ACCESS.
+ *
+ * @param[out] lpsKey Key of the table
+ * @return true if the table can be shared
+ */
+bool ECStoreObjectTable::GetSharedViewKey(TABLEVIEWKEY *lpsKey)
+{
+	ECODStore *lpData = (ECODStore *)m_lpObjectData;
+
+	if (!m_bViewRegistered || lpsRestrict != NULL || m_ulCategories != 0 || m_bMVCols || m_bMVSort)
+		return false;
+
+	lpsKey->ulFolderId = lpData->ulFolderId;
+	lpsKey->ulFlags = lpData->ulFlags;
+	lpsKey->vSortOrder.clear();
+	lpsKey->strLocale = m_locale.getName();
+
+	for (int i = 0; lpsSortOrderArray != NULL && i < lpsSortOrderArray->__size; ++i) {
+		unsigned int ulPropTag = lpsSortOrderArray->__ptr[i].ulPropTag;
+
+		if ((PROP_TYPE(ulPropTag) & MVI_FLAG) || ECGenProps::IsPropComputedUncached(ulPropTag, MAPI_MESSAGE) == erSuccess)
+			return false;
+
+		lpsKey->vSortOrder.push_back(ulPropTag);
+		lpsKey->vSortOrder.push_back(lpsSortOrderArray->__ptr[i].ulOrder);
+	}
+
+	return true;
+}
+
+/**
+ * Replace the rows of the table with those of a shared view
+ *
+ * @return ZARAFA_E_NOT_FOUND if there is no view the table can use
+ */
+ECRESULT ECStoreObjectTable::LoadSharedView()
+{
+	ECRESULT er = erSuccess;
+	ECODStore *lpData = (ECODStore *)m_lpObjectData;
+	ECTableViewCache *lpViewCache = lpSession->GetSessionManager()->GetTableViewCache();
+	ECCategoryMap::const_iterator iterCategories;
+	TABLEVIEWKEY sKey;
+	TABLEVIEW *lpView = NULL;
+	unsigned int ulGeneration = 0;
+
+	pthread_mutex_lock(&m_hLock);
+
+	if (!GetSharedViewKey(&sKey)) {
+		er = ZARAFA_E_NOT_FOUND;
+		goto exit;
+	}
+
+	er = lpViewCache->GetView(sKey, this, &lpView, &ulGeneration);
+	if (er != erSuccess)
+		goto exit;
+
+	// All messages in the folder are visible, or none at all
+	er = CheckPermissions(lpData->ulFolderId);
+	if (er != erSuccess) {
+		lpViewCache->ReleaseView(lpView);
+		goto exit;
+	}
+
+	// Same as the default sort order set by UpdateRows()
+	if (lpsSortOrderArray == NULL) {
+		lpsSortOrderArray = new struct sortOrderArray;
+		lpsSortOrderArray->__size = 0;
+		lpsSortOrderArray->__ptr = NULL;
+	}
+
+	lpKeyTable->CopyRows(lpView->lpKeyTable, true);
+	mapObjects = lpView->mapObjects;
+
+	m_mapLeafs.clear();
+	for (iterCategories = m_mapCategories.begin();
+	     iterCategories != m_mapCategories.end(); ++iterCategories)
+		delete iterCategories->second;
+	m_mapCategories.clear();
+	m_mapSortedCategories.clear();
+
+	ReleaseSharedView();
+	m_lpView = lpView;
+	m_ulViewGeneration = ulGeneration;
+
+exit:
+	pthread_mutex_unlock(&m_hLock);
+
+	return er;
+}
+
+// Offer the rows of the table to other sessions that asked for the same view
+void ECStoreObjectTable::AddSharedView()
+{
+	TABLEVIEWKEY sKey;
+
+	pthread_mutex_lock(&m_hLock);
+
+	if (GetSharedViewKey(&sKey))
+		lpSession->GetSessionManager()->GetTableViewCache()->AddView(sKey, this, m_ulViewGeneration, lpKeyTable, mapObjects);
+
+	pthread_mutex_unlock(&m_hLock);
+}
+
+// Must only be called when no rows point into the view anymore
+void ECStoreObjectTable::ReleaseSharedView()
+{
+	if (m_lpView == NULL)
+		return;
+
+	lpSession->GetSessionManager()->GetTableViewCache()->ReleaseView(m_lpView);
+	m_lpView = NULL;
+}
+
 ECRESULT ECStoreObjectTable::AddRowKey(ECObjectTableList* lpRows, unsigned int *lpulLoaded, unsigned int ulFlags, bool bLoad, bool bOverride, struct restrictTable *lpOverride)
 {
     ECRESULT er = erSuccess;
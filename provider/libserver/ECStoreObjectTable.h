@@ -22,6 +22,7 @@
 #include "ECDatabase.h"
 
 #include "ECGenericObjectTable.h"
+#include "ECTableManager.h"
 
 /*
  * This object is an actual table, with a cursor in-memory. We also keep the complete
@@ -52,6 +53,7 @@ protected:
 public:
 	static ECRESULT Create(ECSession *lpSession, unsigned int ulStoreId, GUID *lpGuid, unsigned int ulFolderId, unsigned int ulObjType, unsigned int ulFlags, unsigned int ulTableFlags, const ECLocale &locale, ECStoreObjectTable **lppTable);
 	virtual ECRESULT Load();
+	virtual ECRESULT Clear();
 
 	//Overrides
 	virtual ECRESULT GetColumnsAll(ECListInt* lplstProps);
@@ -65,6 +67,7 @@ public:
 	static ECRESULT QueryRowData(ECGenericObjectTable *lpThis, struct soap *soap, ECSession *lpSession, ECObjectTableList* lpRowList, struct propTagArray *lpsPropTagArray, void* lpObjectData, struct rowSet **lppRowSet, bool bCacheTableData, bool bTableLimit, bool bSubObjects);
 
 protected:
+	virtual ECRESULT ReloadKeyTable();
 	virtual ECRESULT AddRowKey(ECObjectTableList* lpRows, unsigned int *lpulLoaded, unsigned int ulFlags, bool bInitialLoad, bool bOverride, struct restrictTable *lpOverride);
 	
 	static ECRESULT QueryRowDataByColumn(ECGenericObjectTable *lpThis, struct soap *soap, ECSession *lpSesion, const std::multimap<unsigned int, unsigned int> &mapColumns, unsigned int ulFolderId, const std::map<sObjectTableKey, unsigned int> &mapObjIds, struct rowSet *lpRowSet);
@@ -75,9 +78,19 @@ private:
 	virtual ECRESULT ReloadTableMVData(ECObjectTableList* lplistRows, ECListInt* lplistMVPropTag);
 	virtual ECRESULT CheckPermissions(unsigned int ulObjId);
 
+	// Sharing the sorted rows with other sessions through the ECTableViewCache
+	bool GetSharedViewKey(TABLEVIEWKEY *lpsKey);
+	ECRESULT LoadSharedView();
+	void AddSharedView();
+	void ReleaseSharedView();
+
 	unsigned int ulPermission;
 	bool		 fPermissionRead;
 
+	bool		 m_bViewRegistered;		// Registered with the ECTableViewCache
+	unsigned int m_ulViewGeneration;	// Folder generation the rows are current with
+	TABLEVIEW	 *m_lpView;				// View the rows share their sort data with
+
 };
 
 ECRESULT GetDeferredTableUpdates(ECDatabase *lpDatabase, unsigned int ulFolderId, std::list<unsigned int> *lpDeferred);
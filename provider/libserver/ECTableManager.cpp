@@ -736,3 +736,261 @@ ECRESULT ECTableManager::GetStats(unsigned int *lpulTables, unsigned int *lpulOb
 
 	return erSuccess;
 }
+
+ECTableViewCache::ECTableViewCache()
+{
+	pthread_mutex_init(&m_hMutex, NULL);
+}
+
+ECTableViewCache::~ECTableViewCache()
+{
+	std::map<TABLEVIEWKEY, TABLEVIEW *>::const_iterator iterViews;
+
+	for (iterViews = m_mapViews.begin(); iterViews != m_mapViews.end(); ++iterViews) {
+		delete iterViews->second->lpKeyTable;
+		delete iterViews->second;
+	}
+
+	pthread_mutex_destroy(&m_hMutex);
+}
+
+/**
+ * Register a contents table on a folder
+ *
+ * Views are only kept for folders that have at least one table registered.
+ *
+ * @param[in] ulFolderId Folder the table is loaded from
+ * @return The current generation of the folder
+ */
+unsigned int ECTableViewCache::RegisterTable(unsigned int ulFolderId)
+{
+	unsigned int ulGeneration = 0;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	std::map<unsigned int, FOLDERVIEWS>::iterator iterFolder = m_mapFolders.find(ulFolderId);
+
+	if (iterFolder == m_mapFolders.end()) {
+		FOLDERVIEWS sFolder = {0, 0};
+		iterFolder = m_mapFolders.insert(std::make_pair(ulFolderId, sFolder)).first;
+	}
+
+	++iterFolder->second.ulTables;
+	ulGeneration = iterFolder->second.ulGeneration;
+
+	pthread_mutex_unlock(&m_hMutex);
+
+	return ulGeneration;
+}
+
+/**
+ * Unregister a contents table on a folder
+ *
+ * @param[in] ulFolderId Folder the table was loaded from
+ * @param[in] lpTable The table, as passed to GetView()
+ */
+void ECTableViewCache::UnregisterTable(unsigned int ulFolderId, const void *lpTable)
+{
+	TABLEVIEWKEY sKey;
+	std::map<TABLEVIEWKEY, std::set<const void *> >::iterator iterRequest;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	sKey.ulFolderId = ulFolderId;
+	sKey.ulFlags = 0;
+
+	iterRequest = m_mapRequests.lower_bound(sKey);
+	while (iterRequest != m_mapRequests.end() && iterRequest->first.ulFolderId == ulFolderId) {
+		iterRequest->second.erase(lpTable);
+		if (iterRequest->second.empty())
+			m_mapRequests.erase(iterRequest++);
+		else
+			++iterRequest;
+	}
+
+	std::map<unsigned int, FOLDERVIEWS>::iterator iterFolder = m_mapFolders.find(ulFolderId);
+
+	if (iterFolder != m_mapFolders.end() && --iterFolder->second.ulTables == 0) {
+		RemoveViews(ulFolderId);
+		m_mapFolders.erase(iterFolder);
+	}
+
+	pthread_mutex_unlock(&m_hMutex);
+}
+
+unsigned int ECTableViewCache::GetGeneration(unsigned int ulFolderId)
+{
+	unsigned int ulGeneration = 0;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	std::map<unsigned int, FOLDERVIEWS>::const_iterator iterFolder = m_mapFolders.find(ulFolderId);
+
+	if (iterFolder != m_mapFolders.end())
+		ulGeneration = iterFolder->second.ulGeneration;
+
+	pthread_mutex_unlock(&m_hMutex);
+
+	return ulGeneration;
+}
+
+/**
+ * Get a view to copy the rows from
+ *
+ * The view stays valid until it is passed to ReleaseView(), even if the
+ * folder changes in the meantime. A miss is remembered, so the next table
+ * that loads this view publishes it.
+ *
+ * @param[in] sKey Folder, flags and sort order of the table
+ * @param[in] lpTable The table asking for the view
+ * @param[out] lppView The view
+ * @param[out] lpulGeneration Generation of the folder the view belongs to
+ * @return ZARAFA_E_NOT_FOUND if there is no view for sKey
+ */
+ECRESULT ECTableViewCache::GetView(const TABLEVIEWKEY &sKey, const void *lpTable, TABLEVIEW **lppView, unsigned int *lpulGeneration)
+{
+	ECRESULT er = erSuccess;
+	std::map<TABLEVIEWKEY, TABLEVIEW *>::const_iterator iterView;
+	std::map<unsigned int, FOLDERVIEWS>::const_iterator iterFolder;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iterView = m_mapViews.find(sKey);
+	iterFolder = m_mapFolders.find(sKey.ulFolderId);
+	if (iterFolder == m_mapFolders.end()) {
+		er = ZARAFA_E_NOT_FOUND;
+		goto exit;
+	}
+	if (iterView == m_mapViews.end()) {
+		m_mapRequests[sKey].insert(lpTable);
+		er = ZARAFA_E_NOT_FOUND;
+		goto exit;
+	}
+
+	++iterView->second->ulRefs;
+
+	*lppView = iterView->second;
+	*lpulGeneration = iterFolder->second.ulGeneration;
+
+exit:
+	pthread_mutex_unlock(&m_hMutex);
+
+	return er;
+}
+
+void ECTableViewCache::ReleaseView(TABLEVIEW *lpView)
+{
+	bool bFree = false;
+
+	pthread_mutex_lock(&m_hMutex);
+	bFree = --lpView->ulRefs == 0 && lpView->bRemoved;
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (bFree) {
+		delete lpView->lpKeyTable;
+		delete lpView;
+	}
+}
+
+/**
+ * Add the rows of a table as a view
+ *
+ * Nothing is added unless another table than lpTable asked for this view,
+ * so a table that is alone with its view does not copy its rows. Nothing is
+ * added either if the folder changed since ulGeneration, if no table is
+ * registered on the folder, or if there already is a view for sKey.
+ *
+ * @param[in] sKey Folder, flags and sort order of the table
+ * @param[in] lpTable The table offering its rows
+ * @param[in] ulGeneration Generation of the folder when the table started loading
+ * @param[in] lpKeyTable Rows of the table, copied into the view
+ * @param[in] mapObjects Objects in the table
+ */
+void ECTableViewCache::AddView(const TABLEVIEWKEY &sKey, const void *lpTable, unsigned int ulGeneration, ECKeyTable *lpKeyTable, const ECObjectTableMap &mapObjects)
+{
+	TABLEVIEW *lpView = NULL;
+	std::map<TABLEVIEWKEY, std::set<const void *> >::const_iterator iterRequest;
+	std::map<unsigned int, FOLDERVIEWS>::const_iterator iterFolder;
+	bool bWanted = false;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iterRequest = m_mapRequests.find(sKey);
+	iterFolder = m_mapFolders.find(sKey.ulFolderId);
+	bWanted = iterRequest != m_mapRequests.end() &&
+		(iterRequest->second.size() > 1 || iterRequest->second.count(lpTable) == 0) &&
+		iterFolder != m_mapFolders.end() && iterFolder->second.ulGeneration == ulGeneration &&
+		m_mapViews.find(sKey) == m_mapViews.end();
+
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (!bWanted)
+		return;
+
+	// Copy the rows without holding the lock, and check again before adding the view
+	lpView = new TABLEVIEW;
+	lpView->sKey = sKey;
+	lpView->lpKeyTable = new ECKeyTable;
+	lpView->lpKeyTable->CopyRows(lpKeyTable, false);
+	lpView->mapObjects = mapObjects;
+	lpView->ulRefs = 0;
+	lpView->bRemoved = false;
+
+	pthread_mutex_lock(&m_hMutex);
+
+	iterFolder = m_mapFolders.find(sKey.ulFolderId);
+
+	if (iterFolder != m_mapFolders.end() && iterFolder->second.ulGeneration == ulGeneration &&
+		m_mapViews.find(sKey) == m_mapViews.end()) {
+		m_mapViews[sKey] = lpView;
+		m_mapRequests.erase(sKey);
+		lpView = NULL;
+	}
+
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (lpView) {
+		delete lpView->lpKeyTable;
+		delete lpView;
+	}
+}
+
+/**
+ * Remove all views of a folder after a change in that folder
+ *
+ * @param[in] ulFolderId Folder that changed
+ */
+void ECTableViewCache::Invalidate(unsigned int ulFolderId)
+{
+	pthread_mutex_lock(&m_hMutex);
+
+	std::map<unsigned int, FOLDERVIEWS>::iterator iterFolder = m_mapFolders.find(ulFolderId);
+
+	if (iterFolder != m_mapFolders.end()) {
+		++iterFolder->second.ulGeneration;
+		RemoveViews(ulFolderId);
+	}
+
+	pthread_mutex_unlock(&m_hMutex);
+}
+
+// Must be called with m_hMutex held
+void ECTableViewCache::RemoveViews(unsigned int ulFolderId)
+{
+	TABLEVIEWKEY sKey;
+	std::map<TABLEVIEWKEY, TABLEVIEW *>::iterator iterView;
+
+	sKey.ulFolderId = ulFolderId;
+	sKey.ulFlags = 0;
+
+	iterView = m_mapViews.lower_bound(sKey);
+	while (iterView != m_mapViews.end() && iterView->first.ulFolderId == ulFolderId) {
+		if (iterView->second->ulRefs == 0) {
+			delete iterView->second->lpKeyTable;
+			delete iterView->second;
+		} else {
+			iterView->second->bRemoved = true;
+		}
+		m_mapViews.erase(iterView++);
+	}
+}
@@ -20,6 +20,9 @@
 
 #include <zarafa/zcdefs.h>
 #include <map>
+#include <set>
+#include <vector>
+#include <string>
 
 #include "ECDatabase.h"
 #include "ECGenericObjectTable.h"
@@ -35,10 +38,9 @@ class ECSessionManager;
  * a change is made to the underlying data and sending notifications to clients
  * which require table update notifications.
  *
- * Each session has its own table manager. This could be optimised in the future
- * by having one large table manager, with each table having multiple cursors for
- * each user that has the table open. This would save memory on overlapping tables
- * (probably resulting in around 30% less memory usage for the server).
+ * Each session has its own table manager. Contents tables on the same folder and
+ * sort order share their sort data through the ECTableViewCache of the session
+ * manager, each table keeping its own cursor.
  */
 
 typedef struct {
@@ -65,6 +67,76 @@ typedef struct {
 
 typedef std::map<unsigned int, TABLE_ENTRY *> TABLEENTRYMAP;
 
+typedef struct TABLEVIEWKEY {
+	unsigned int ulFolderId;
+	unsigned int ulFlags;
+	std::vector<unsigned int> vSortOrder;	// property tag and order of each sort column
+	std::string strLocale;		// locale the string sort keys were built with
+
+	bool operator<(const TABLEVIEWKEY &b) const {
+		if (ulFolderId != b.ulFolderId)
+			return ulFolderId < b.ulFolderId;
+		if (ulFlags != b.ulFlags)
+			return ulFlags < b.ulFlags;
+		if (vSortOrder != b.vSortOrder)
+			return vSortOrder < b.vSortOrder;
+		return strLocale < b.strLocale;
+	}
+} TABLEVIEWKEY;
+
+typedef struct {
+	TABLEVIEWKEY sKey;
+	ECKeyTable *lpKeyTable;		// Sorted rows, never modified after the view is added
+	ECObjectTableMap mapObjects;
+	unsigned int ulRefs;		// Number of tables sharing the sort data
+	bool bRemoved;				// No longer in the cache, freed on the last release
+} TABLEVIEW;
+
+/*
+ * Sorted contents tables shared between sessions
+ *
+ * When many sessions have the same folder open with the same sort order, a
+ * table that loads adds its sorted rows as a view here once another table
+ * asked for the same view and did not find it; a table that is the only one
+ * with its view never pays for the copy. Later tables then copy the tree of
+ * the view instead of reading and sorting the folder themselves; the copied
+ * rows point at the sort keys of the view, so those are in memory only once.
+ * The cursor and bookmarks stay per table. Changes are still applied through
+ * the UpdateRow() of each table, which replaces the changed rows with private
+ * copies. String sort keys depend on the locale, so that is part of the key.
+ *
+ * A change in a folder removes the views of that folder, and a view is only
+ * added if its folder did not change while the rows were loaded. The views
+ * of a folder are freed when the last contents table on it is closed.
+ */
+class ECTableViewCache _zcp_final {
+public:
+	ECTableViewCache();
+	~ECTableViewCache();
+
+	unsigned int RegisterTable(unsigned int ulFolderId);
+	void		UnregisterTable(unsigned int ulFolderId, const void *lpTable);
+	unsigned int GetGeneration(unsigned int ulFolderId);
+
+	ECRESULT	GetView(const TABLEVIEWKEY &sKey, const void *lpTable, TABLEVIEW **lppView, unsigned int *lpulGeneration);
+	void		ReleaseView(TABLEVIEW *lpView);
+	void		AddView(const TABLEVIEWKEY &sKey, const void *lpTable, unsigned int ulGeneration, ECKeyTable *lpKeyTable, const ECObjectTableMap &mapObjects);
+	void		Invalidate(unsigned int ulFolderId);
+
+private:
+	typedef struct {
+		unsigned int ulTables;		// Number of tables open on the folder
+		unsigned int ulGeneration;	// Incremented on each change in the folder
+	} FOLDERVIEWS;
+
+	void		RemoveViews(unsigned int ulFolderId);
+
+	pthread_mutex_t							m_hMutex;
+	std::map<unsigned int, FOLDERVIEWS>		m_mapFolders;
+	std::map<TABLEVIEWKEY, TABLEVIEW *>		m_mapViews;
+	std::map<TABLEVIEWKEY, std::set<const void *> > m_mapRequests;	// Tables that missed a view, per key
+};
+
 class ECTableManager _zcp_final {
 public:
 	ECTableManager(ECSession *lpSession);
@@ -68,6 +68,23 @@ static const char THIS_FILE[] = __FILE__;
 
 extern ECSessionManager*	g_lpSessionManager;
 
+/*
+ * High-water marks of the delta synchronization of object lists, shared by
+ * all sessions and kept per company and object class. They are not stored
+ * in the database, so the first synchronization after a restart always
+ * compares the full object list.
+ */
+typedef struct {
+	std::string strHighWater;	// highest object signature seen
+	std::string strSource;		// user source the signatures were read from, see UserPlugin::getSignatureSource()
+	time_t tLastFull;			// time of the last full object list sync
+} syncmark_t;
+
+typedef std::map<std::pair<unsigned int, objectclass_t>, syncmark_t> syncmarks_t;
+
+static syncmarks_t g_mapSyncMarks;
+static pthread_mutex_t g_hSyncMarksLock = PTHREAD_MUTEX_INITIALIZER;
+
 static bool execute_script(const char *scriptname, ...)
 {
 	va_list v;
@@ -470,6 +487,9 @@ exit:
  *                objects will be used in the addressbook, so filter 'hidden' items, USERMANAGEMENT_FORCE_SYNC: always
  *                perform a sync with the plugin, even if sync_gab_realtime is set to 'no'
  * @return result
+ *
+ * With sync_gab_delta enabled, only the objects changed since the previous sync are requested from the plugin,
+ * see GetSyncMark(). Deleted objects are then not noticed until the next full sync.
  */
 ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass, unsigned int ulCompanyId, std::list<localobjectdetails_t> **lppObjects, unsigned int ulFlags)
 {
@@ -500,6 +520,11 @@ ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass, u
 	string signature;
 	unsigned ulObjectId = 0;
 	bool bMoved = false;
+	bool bDeltaSync = false;
+	bool bCreateFailed = false;
+	bool bSourceChanged = false;
+	std::string strHighWater;
+	std::string strSource;
 
 	ECSecurity *lpSecurity = NULL;
 	UserPlugin *lpPlugin = NULL;
@@ -566,10 +591,33 @@ ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass, u
 	}
 
 	if (bSync && !bIsSafeMode) {
+		bDeltaSync = GetSyncMark(objclass, ulCompanyId, &strHighWater, &strSource);
+
 		// We now have a map, mapping external id's to local user id's (and their signatures)
 		try {
-			// Get full user list
-			lpExternSignatures = lpPlugin->getAllObjects(extcompany, objclass);
+			/*
+			 * The high-water mark can only be compared to signatures of the same source, so
+			 * a failover to another ldap_uri before or during the search needs a full sync.
+			 */
+			if (bDeltaSync && lpPlugin->getSignatureSource() != strSource)
+				bDeltaSync = false;
+			if (bDeltaSync) {
+				try {
+					// Get the users changed since the last sync
+					lpExternSignatures = lpPlugin->getChangedObjects(extcompany, objclass, strHighWater);
+					if (lpPlugin->getSignatureSource() != strSource)
+						bDeltaSync = false;
+				} catch (notsupported &) {
+					bDeltaSync = false;
+				}
+			}
+			if (!bDeltaSync) {
+				// Get full user list
+				strSource = lpPlugin->getSignatureSource();
+				lpExternSignatures = lpPlugin->getAllObjects(extcompany, objclass);
+				bSourceChanged = lpPlugin->getSignatureSource() != strSource;
+				strSource = lpPlugin->getSignatureSource();
+			}
 			// TODO: check requested 'objclass'
 		} catch (notsupported &) {
 			er = ZARAFA_E_NO_SUPPORT;
@@ -595,6 +643,7 @@ ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass, u
 				if(er != erSuccess) {
 					// Create failed, so skip this entry
 					er = erSuccess;
+					bCreateFailed = true;
 					continue;
 				}
 
@@ -625,6 +674,22 @@ ECRESULT ECUserManagement::GetCompanyObjectListAndSync(objectclass_t objclass, u
 			// Add to conversion map so we can obtain the details
 			mapExternIdToLocal.insert(make_pair(iterExternSignatures->id, ulObjectId));
 		}
+
+		// Do not move past an object which has to be created on the next sync, and do not
+		// keep a mark when the signatures may come from two sources
+		if (!bCreateFailed)
+			SetSyncMark(objclass, ulCompanyId, bSourceChanged ? signatures_t() : *lpExternSignatures, strSource, !bDeltaSync);
+
+		if (bDeltaSync) {
+			// All objects which were not returned are unchanged, so keep them as they are
+			for (iterSignatureIdToLocal = mapSignatureIdToLocal.begin();
+			     iterSignatureIdToLocal != mapSignatureIdToLocal.end();
+			     ++iterSignatureIdToLocal) {
+				lpExternSignatures->push_back(objectsignature_t(iterSignatureIdToLocal->first, iterSignatureIdToLocal->second.second));
+				mapExternIdToLocal.insert(std::make_pair(iterSignatureIdToLocal->first, iterSignatureIdToLocal->second.first));
+			}
+			mapSignatureIdToLocal.clear();
+		}
 	} else {
 		if (bIsSafeMode)
 			ec_log_info("user_safe_mode: skipping retrieve/sync users from LDAP");
@@ -681,6 +746,156 @@ exit:
 	return er;
 }
 
+/**
+ * Bring a signature in generalized time format (eg. modifyTimestamp) in a
+ * form that compares correctly as a string: YYYYMMDDHHMMSS.ffffff in UTC.
+ * As is, "20151018120000.5Z" would sort before "20151018120000Z", and
+ * times with a different timezone offset would not compare at all.
+ *
+ * @param[in]	strTime		Signature to normalize
+ *
+ * @return The normalized time, or strTime when it is not a generalized time
+ */
+static std::string NormalizeGeneralizedTime(const std::string &strTime)
+{
+	std::string::size_type pos = strTime.find_first_not_of("0123456789");
+	std::string::size_type end;
+	std::string strDigits = strTime.substr(0, pos);
+	std::string strFraction;
+	std::string strOffset;
+	struct tm sTm;
+	time_t tTime;
+	char szTime[16];
+
+	// YYYYMMDDHH, optionally followed by MM and SS
+	if (strDigits.size() != 10 && strDigits.size() != 12 && strDigits.size() != 14)
+		return strTime;
+	strDigits.append(14 - strDigits.size(), '0');
+
+	// A fraction is only taken for seconds, not for a fraction of an hour or minute
+	if (pos != std::string::npos && (strTime[pos] == '.' || strTime[pos] == ',')) {
+		if (pos != 14)
+			return strTime;
+		end = strTime.find_first_not_of("0123456789", pos + 1);
+		strFraction = strTime.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+		pos = end;
+	}
+	strFraction.resize(6, '0');
+
+	// Z, +HH[MM] or -HH[MM]; a local time without offset is taken as is
+	if (pos != std::string::npos) {
+		strOffset = strTime.substr(pos);
+		if (strOffset != "Z" &&
+		    !((strOffset[0] == '+' || strOffset[0] == '-') &&
+		      (strOffset.size() == 3 || strOffset.size() == 5) &&
+		      strOffset.find_first_not_of("0123456789", 1) == std::string::npos))
+			return strTime;
+	}
+
+	if (strOffset.size() > 1) {
+		memset(&sTm, 0, sizeof(sTm));
+		sTm.tm_year = atoi(strDigits.substr(0, 4).c_str()) - 1900;
+		sTm.tm_mon = atoi(strDigits.substr(4, 2).c_str()) - 1;
+		sTm.tm_mday = atoi(strDigits.substr(6, 2).c_str());
+		sTm.tm_hour = atoi(strDigits.substr(8, 2).c_str());
+		sTm.tm_min = atoi(strDigits.substr(10, 2).c_str());
+		sTm.tm_sec = atoi(strDigits.substr(12, 2).c_str());
+
+		tTime = timegm(&sTm) - (strOffset[0] == '-' ? -1 : 1) *
+		        (atoi(strOffset.substr(1, 2).c_str()) * 3600 + atoi(strOffset.substr(3).c_str()) * 60);
+		gmtime_r(&tTime, &sTm);
+		strftime(szTime, sizeof(szTime), "%Y%m%d%H%M%S", &sTm);
+		strDigits = szTime;
+	}
+
+	return strDigits + "." + strFraction;
+}
+
+/**
+ * Compare two object signatures. Numeric signatures (eg. uSNChanged in
+ * Active Directory) are compared by value, others (eg. modifyTimestamp in
+ * generalized time format) by their normalized string representation.
+ *
+ * @return <0, 0 or >0 when strLeft is lower than, equal to or higher than strRight
+ */
+static int CompareSignature(const std::string &strLeft, const std::string &strRight)
+{
+	if (!strLeft.empty() && !strRight.empty() &&
+	    strLeft.find_first_not_of("0123456789") == std::string::npos &&
+	    strRight.find_first_not_of("0123456789") == std::string::npos) {
+		if (strLeft.size() != strRight.size())
+			return strLeft.size() < strRight.size() ? -1 : 1;
+		return strLeft.compare(strRight);
+	}
+
+	return NormalizeGeneralizedTime(strLeft).compare(NormalizeGeneralizedTime(strRight));
+}
+
+/**
+ * Get the high-water mark from which the object list of a company may be
+ * synchronized with only the changed objects.
+ *
+ * @param[in]	objclass		Object class of the list
+ * @param[in]	ulCompanyId		Company of the list
+ * @param[out]	lpstrHighWater	Highest signature seen by the previous sync
+ * @param[out]	lpstrSource		User source lpstrHighWater was read from
+ *
+ * @return false when the full object list must be synchronized: sync_gab_delta is
+ *         disabled, the list was never synchronized, or sync_gab_full_interval expired
+ */
+bool ECUserManagement::GetSyncMark(objectclass_t objclass, unsigned int ulCompanyId, std::string *lpstrHighWater, std::string *lpstrSource)
+{
+	bool bDelta = false;
+	time_t tFullInterval = atoi(m_lpConfig->GetSetting("sync_gab_full_interval"));
+	syncmarks_t::const_iterator iterMark;
+
+	if (!parseBool(m_lpConfig->GetSetting("sync_gab_delta")))
+		return false;
+
+	pthread_mutex_lock(&g_hSyncMarksLock);
+	iterMark = g_mapSyncMarks.find(std::make_pair(ulCompanyId, objclass));
+	if (iterMark != g_mapSyncMarks.end() && !iterMark->second.strHighWater.empty() &&
+	    (tFullInterval == 0 || iterMark->second.tLastFull + tFullInterval > time(NULL))) {
+		*lpstrHighWater = iterMark->second.strHighWater;
+		*lpstrSource = iterMark->second.strSource;
+		bDelta = true;
+	}
+	pthread_mutex_unlock(&g_hSyncMarksLock);
+
+	return bDelta;
+}
+
+/**
+ * Advance the high-water mark of an object list to the highest signature
+ * returned by the plugin.
+ *
+ * @param[in]	objclass		Object class of the list
+ * @param[in]	ulCompanyId		Company of the list
+ * @param[in]	lstSignatures	Signatures returned by the plugin
+ * @param[in]	strSource		User source lstSignatures were read from
+ * @param[in]	bFull			lstSignatures is the full object list
+ */
+void ECUserManagement::SetSyncMark(objectclass_t objclass, unsigned int ulCompanyId, const signatures_t &lstSignatures, const std::string &strSource, bool bFull)
+{
+	syncmark_t *lpMark = NULL;
+	signatures_t::const_iterator iterSignatures;
+
+	if (!parseBool(m_lpConfig->GetSetting("sync_gab_delta")))
+		return;
+
+	pthread_mutex_lock(&g_hSyncMarksLock);
+	lpMark = &g_mapSyncMarks[std::make_pair(ulCompanyId, objclass)];
+	if (bFull) {
+		lpMark->strHighWater.clear();
+		lpMark->strSource = strSource;
+		lpMark->tLastFull = time(NULL);
+	}
+	for (iterSignatures = lstSignatures.begin(); iterSignatures != lstSignatures.end(); ++iterSignatures)
+		if (CompareSignature(iterSignatures->signature, lpMark->strHighWater) > 0)
+			lpMark->strHighWater = iterSignatures->signature;
+	pthread_mutex_unlock(&g_hSyncMarksLock);
+}
+
 ECRESULT ECUserManagement::GetSubObjectsOfObjectAndSync(userobject_relation_t relation, unsigned int ulParentId,
 														std::list<localobjectdetails_t> **lppObjects, unsigned int ulFlags)
 {
@@ -4962,6 +5177,8 @@ ECRESULT ECUserManagement::ProcessModification(unsigned int ulId, const std::str
 	ECDatabase *lpDatabase = NULL;
 	ABEID eid(MAPI_ABCONT, MUIDECSAB, 1);
 	SOURCEKEY sSourceKey;
+	objectid_t sExternId;
+	UserPlugin *lpPlugin = NULL;
 
 	// Log the change to ICS
 	er = GetABSourceKeyV1(ulId, &sSourceKey);
@@ -4985,6 +5202,16 @@ ECRESULT ECUserManagement::ProcessModification(unsigned int ulId, const std::str
 	if (er != erSuccess)
 		goto exit;
 
+	// The plugin may have cached lookups of the object, eg. its old name
+	if (GetExternalId(ulId, &sExternId) == erSuccess &&
+	    GetThreadLocalPlugin(m_lpPluginFactory, &lpPlugin) == erSuccess) {
+		try {
+			lpPlugin->flushObjectCache(sExternId);
+		} catch (std::exception &e) {
+			ec_log_warn("Unable to flush the plugin cache of object %u: %s", ulId, e.what());
+		}
+	}
+
 exit:
 	return er;
 }
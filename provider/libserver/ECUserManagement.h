@@ -275,6 +275,10 @@ private:
 	ECRESULT	CheckObjectModified(unsigned int ulObjectId, const string &localsignature, const string &remotesignature);
 	ECRESULT	ProcessModification(unsigned int ulId, const std::string &newsignature);
 
+	// High-water marks for synchronizing only the changed objects
+	bool		GetSyncMark(objectclass_t objclass, unsigned int ulCompanyId, std::string *lpstrHighWater, std::string *lpstrSource);
+	void		SetSyncMark(objectclass_t objclass, unsigned int ulCompanyId, const signatures_t &lstSignatures, const std::string &strSource, bool bFull);
+
 	ECRESULT	ResolveObject(objectclass_t objclass, const std::string &strName, const objectid_t &sCompany, objectid_t *lpsExternId);
 	ECRESULT	CreateABEntryID(struct soap *soap, const objectid_t &sExternId, struct propVal *lpPropVal);
 	ECRESULT	CreateABEntryID(struct soap *soap, unsigned int ulObjId, unsigned int ulType, struct propVal *lpPropVal);
@@ -945,6 +945,7 @@ exit:
     ECSession		*lpecSession = NULL; \
     unsigned int 	*lpResultVar = &resultvar; \
 	const char *szFname = #fname; \
+	static ECLatencyHistogram *lpSoapLatency = g_lpStatsCollector->GetHistogram("s_" #fname, "SOAP " #fname " calls"); \
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &startTimes); \
 	LOG_SOAP_DEBUG("%020" PRIu64 ": S %s", ulSessionId, szFname); \
 	er = g_lpSessionManager->ValidateSession(soap, ulSessionId, &lpecSession, true);\
@@ -960,6 +961,7 @@ exit:
 __soapentry_exit: \
     *lpResultVar = er; \
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &endTimes); \
+	g_lpStatsCollector->AddLatency(lpSoapLatency, GetTimeOfDay() - dblStart); \
     if(lpecSession) { \
 		LOG_SOAP_DEBUG("%020" PRIu64 ": E %s 0x%08x %f %f", ulSessionId, szFname, er, timespec2dbl(endTimes) - timespec2dbl(startTimes), GetTimeOfDay() - dblStart); \
 		lpecSession->UpdateBusyState(pthread_self(), SESSION_STATE_SENDING); \
@@ -2968,6 +2970,7 @@ SOAP_ENTRY_START(saveObject, lpsLoadObjectResponse->er, entryId sParentEntryId,
 	unsigned int	ulParentObjType = 0;
 	unsigned int	ulObjType = lpsSaveObj->ulObjType;
 	unsigned int	ulObjFlags = 0;
+	unsigned int	ulParentFlags = 0;
 	unsigned int	ulPrevReadState = 0;
 	unsigned int	ulNewReadState = 0;
 	SOURCEKEY		sSourceKey;
@@ -2978,6 +2981,7 @@ SOAP_ENTRY_START(saveObject, lpsLoadObjectResponse->er, entryId sParentEntryId,
 
 	BOOL			fNewItem = false;
 	bool			fHaveChangeKey = false;
+	bool			fDelivered = false;
 	unsigned int	ulObjId = 0;
 	struct propVal	*pvCommitTime = NULL;
 
@@ -3160,7 +3164,11 @@ SOAP_ENTRY_START(saveObject, lpsLoadObjectResponse->er, entryId sParentEntryId,
 		GetSourceKey(ulParentObjId, &sParentSourceKey);
 
 		if (sReturnObject.ulObjType == MAPI_MESSAGE && ulParentObjType == MAPI_FOLDER) {
-			if (lpsSaveObj->ulServerId == 0) {
+			// A delivery copy is first announced when the delivery agent saves it
+			if (lpsSaveObj->ulServerId != 0)
+				fDelivered = g_lpSessionManager->RemovePendingDelivery(ulObjId);
+
+			if (lpsSaveObj->ulServerId == 0 || fDelivered) {
 				AddChange(lpecSession, ulSyncId, sSourceKey, sParentSourceKey, ICS_MESSAGE_NEW, 0, !fHaveChangeKey, &strChangeKey, &strChangeList);
 			} else {
 				AddChange(lpecSession, ulSyncId, sSourceKey, sParentSourceKey, ICS_MESSAGE_CHANGE, 0, !fHaveChangeKey, &strChangeKey, &strChangeList);
@@ -3220,11 +3228,25 @@ SOAP_ENTRY_START(saveObject, lpsLoadObjectResponse->er, entryId sParentEntryId,
 	// but don't nofity if parent object is a store and object type is attachment or message
 	CreateNotifications(ulObjId, ulObjType, ulParentObjId, ulGrandParent, fNewItem, &lpsSaveObj->modProps, pvCommitTime);
 
+	if (fDelivered) {
+		// The folder counts were already updated by copyMessageToFolders
+		g_lpSessionManager->NotificationCreated(MAPI_MESSAGE, ulObjId, ulParentObjId);
+		g_lpSessionManager->NotificationModified(MAPI_FOLDER, ulParentObjId);
+		if (ulGrandParent) {
+			g_lpSessionManager->GetCacheManager()->GetObjectFlags(ulParentObjId, &ulParentFlags);
+			g_lpSessionManager->UpdateTables(ECKeyTable::TABLE_ROW_MODIFY, ulParentFlags & MSGFLAG_NOTIFY_FLAGS, ulGrandParent, ulParentObjId, MAPI_FOLDER);
+		}
+	}
+
 	lpsLoadObjectResponse->sSaveObject = sReturnObject;
 
 	g_lpStatsCollector->Increment(SCN_DATABASE_MWOPS);
 	
 exit:
+	if (er != erSuccess && fDelivered)
+		// Announce the copy on the next save instead
+		g_lpSessionManager->AddPendingDelivery(ulObjId);
+
 	if (er != erSuccess && lpAttachmentStorage)
 		lpAttachmentStorage->Rollback();
 
@@ -8334,6 +8356,8 @@ exit:
  * @param[in] bDoNotification true if you want to send object notifications.
  * @param[in] bDoTableNotification true if you want to send table notifications.
  * @param[in] ulSyncId Client sync identify.
+ * @param[out] lpulNewObjectId Receives the id of the new object, may be NULL.
+ * @param[in] bAddChange false to leave adding the ICS change of the new message to the caller.
  *
  * @FIXME It is possible to send notifications before a commit, this can give issues with the cache! 
  * 			This function should be refactored
@@ -8341,7 +8365,8 @@ exit:
 static ECRESULT CopyObject(ECSession *lpecSession,
     ECAttachmentStorage *lpAttachmentStorage, unsigned int ulObjId,
     unsigned int ulDestFolderId, bool bIsRoot, bool bDoNotification,
-    bool bDoTableNotification, unsigned int ulSyncId)
+    bool bDoTableNotification, unsigned int ulSyncId,
+    unsigned int *lpulNewObjectId = NULL, bool bAddChange = true)
 {
 	ECRESULT		er = erSuccess;
 	ECDatabase		*lpDatabase = NULL;
@@ -8637,8 +8662,10 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 		}
 
 		// Update ICS system
-		GetSourceKey(ulDestFolderId, &sParentSourceKey);
-		AddChange(lpecSession, ulSyncId, sSourceKey, sParentSourceKey, ICS_MESSAGE_NEW);
+		if (bAddChange) {
+			GetSourceKey(ulDestFolderId, &sParentSourceKey);
+			AddChange(lpecSession, ulSyncId, sSourceKey, sParentSourceKey, ICS_MESSAGE_NEW);
+		}
 
 		// Hack, when lpInternalAttachmentStorage exist your are in a transaction!
 		if (lpInternalAttachmentStorage) {
@@ -8699,6 +8726,9 @@ static ECRESULT CopyObject(ECSession *lpecSession,
 		g_lpSessionManager->NotificationCopied(MAPI_MESSAGE, ulNewObjectId, ulDestFolderId, ulObjId, ulParent);
 	}
 
+	if (lpulNewObjectId)
+		*lpulNewObjectId = ulNewObjectId;
+
 exit:
 	if(er != erSuccess && lpInternalAttachmentStorage) {
 		// Rollback attachments and database!
@@ -9089,6 +9119,192 @@ exit:
 }
 SOAP_ENTRY_END()
 
+/**
+ * Copy one message into several folders in one call
+ *
+ * Used for delivery of one message to many local recipients: each copy shares
+ * the attachment instances of the source through single instancing, and the
+ * recipient dependent properties of each target are written to its copy here
+ * instead of being sent along with a full copy of the message.
+ *
+ * Targets that cannot be written to (permissions, quota) get their own error
+ * in the response; all other copies are made in a single transaction.
+ *
+ * The delivery agent still runs its plugins and rules on each copy before
+ * saving it, and may remove it again. So the ICS change and the table and
+ * object notifications of a copy are held back until that save, see
+ * ECSessionManager::AddPendingDelivery().
+ */
+SOAP_ENTRY_START(copyMessageToFolders, lpsResponse->er, entryId sEntryId, struct deliveryTargetArray *lpsTargets, unsigned int ulFlags, struct copyMessageToFoldersResponse *lpsResponse)
+{
+	unsigned int	ulObjId = 0;
+	unsigned int	ulFolderType = 0;
+	unsigned int	ulStoreId = 0;
+	unsigned int	ulSize = 0;
+	std::vector<unsigned int> vFolderIds;
+	std::vector<unsigned int> vObjIds;
+	std::set<EntryId> setEntryIds;
+	struct deliveryResult *lpResult = NULL;
+	struct propVal	*lpPropVal = NULL;
+	ECAttachmentStorage *lpAttachmentStorage = NULL;
+	int				i, j;
+
+	USE_DATABASE();
+
+	if (lpsTargets == NULL) {
+		er = ZARAFA_E_INVALID_PARAMETER;
+		goto exit;
+	}
+
+	lpsResponse->sResults.__size = lpsTargets->__size;
+	lpsResponse->sResults.__ptr = s_alloc<deliveryResult>(soap, lpsTargets->__size);
+	memset(lpsResponse->sResults.__ptr, 0, sizeof(deliveryResult) * lpsTargets->__size);
+	vFolderIds.resize(lpsTargets->__size, 0);
+	vObjIds.resize(lpsTargets->__size, 0);
+
+	setEntryIds.insert(EntryId(sEntryId));
+	for (i = 0; i < lpsTargets->__size; ++i)
+		setEntryIds.insert(EntryId(lpsTargets->__ptr[i].sFolderId));
+
+	er = CreateAttachmentStorage(lpDatabase, &lpAttachmentStorage);
+	if (er != erSuccess)
+		goto exit;
+
+	er = lpAttachmentStorage->Begin();
+	if (er != erSuccess)
+		goto exit;
+
+	er = BeginLockFolders(lpDatabase, setEntryIds, LOCK_EXCLUSIVE);
+	if (er != erSuccess) {
+		ec_log_err("SOAP::copyMessageToFolders: failed locking folders: %s (%x)", GetMAPIErrorMessage(er), er);
+		goto exit;
+	}
+
+	er = lpecSession->GetObjectFromEntryId(&sEntryId, &ulObjId);
+	if (er != erSuccess)
+		goto exit;
+
+	// Check each target first, a target that cannot be delivered to must not fail the others
+	for (i = 0; i < lpsTargets->__size; ++i) {
+		lpResult = &lpsResponse->sResults.__ptr[i];
+
+		lpResult->er = lpecSession->GetObjectFromEntryId(&lpsTargets->__ptr[i].sFolderId, &vFolderIds[i]);
+		if (lpResult->er == erSuccess)
+			lpResult->er = g_lpSessionManager->GetCacheManager()->GetObject(vFolderIds[i], NULL, NULL, NULL, &ulFolderType);
+		if (lpResult->er == erSuccess && ulFolderType != MAPI_FOLDER)
+			lpResult->er = ZARAFA_E_INVALID_ENTRYID;
+		if (lpResult->er == erSuccess)
+			lpResult->er = lpecSession->GetSecurity()->CheckPermission(vFolderIds[i], ecSecurityCreate);
+		if (lpResult->er == erSuccess)
+			lpResult->er = g_lpSessionManager->GetCacheManager()->GetStore(vFolderIds[i], &ulStoreId, NULL);
+		if (lpResult->er == erSuccess)
+			lpResult->er = CheckQuota(lpecSession, ulStoreId);
+
+		for (j = 0; lpResult->er == erSuccess && j < lpsTargets->__ptr[i].sProps.__size; ++j)
+			if (PROP_TYPE(lpsTargets->__ptr[i].sProps.__ptr[j].ulPropTag) & MV_FLAG)
+				lpResult->er = ZARAFA_E_INVALID_TYPE;
+	}
+
+	for (i = 0; i < lpsTargets->__size; ++i) {
+		lpResult = &lpsResponse->sResults.__ptr[i];
+		if (lpResult->er != erSuccess)
+			continue;
+
+		er = CopyObject(lpecSession, lpAttachmentStorage, ulObjId, vFolderIds[i], true, false, false, 0, &vObjIds[i], false);
+		if (er != erSuccess) {
+			ec_log_err("SOAP::copyMessageToFolders: failed copying object %u to folder %u: %s (%x)", ulObjId, vFolderIds[i], GetMAPIErrorMessage(er), er);
+			goto exit;
+		}
+
+		if (lpsTargets->__ptr[i].sDelProps.__size > 0) {
+			er = DeleteProps(lpecSession, lpDatabase, vObjIds[i], &lpsTargets->__ptr[i].sDelProps, lpAttachmentStorage);
+			if (er != erSuccess)
+				goto exit;
+		}
+
+		// Written as-is, the copy is still an unmodified delivered message
+		for (j = 0; j < lpsTargets->__ptr[i].sProps.__size; ++j) {
+			lpPropVal = &lpsTargets->__ptr[i].sProps.__ptr[j];
+
+			if (PROP_TYPE(lpPropVal->ulPropTag) == PT_STRING8 || PROP_TYPE(lpPropVal->ulPropTag) == PT_UNICODE) {
+				lpPropVal->Value.lpszA = stringCompat.to_UTF8(soap, lpPropVal->Value.lpszA);
+				lpPropVal->ulPropTag = CHANGE_PROP_TYPE(lpPropVal->ulPropTag, PT_STRING8);
+			}
+
+			er = WriteProp(lpDatabase, vObjIds[i], vFolderIds[i], lpPropVal);
+			if (er != erSuccess)
+				goto exit;
+
+			sObjectTableKey key(vObjIds[i], 0);
+			g_lpSessionManager->GetCacheManager()->SetCell(&key, lpPropVal->ulPropTag, lpPropVal);
+		}
+
+		if (lpsTargets->__ptr[i].sDelProps.__size > 0 || lpsTargets->__ptr[i].sProps.__size > 0) {
+			// CopyObject() accounted for the size of the unmodified copy
+			er = g_lpSessionManager->GetCacheManager()->GetStore(vObjIds[i], &ulStoreId, NULL);
+			if (er != erSuccess)
+				goto exit;
+
+			if (GetObjectSize(lpDatabase, vObjIds[i], &ulSize) == erSuccess) {
+				er = UpdateObjectSize(lpDatabase, ulStoreId, MAPI_STORE, UPDATE_SUB, ulSize);
+				if (er != erSuccess)
+					goto exit;
+			}
+
+			if (CalculateObjectSize(lpDatabase, vObjIds[i], MAPI_MESSAGE, &ulSize) == erSuccess) {
+				er = UpdateObjectSize(lpDatabase, vObjIds[i], MAPI_MESSAGE, UPDATE_SET, ulSize);
+				if (er != erSuccess)
+					goto exit;
+
+				er = UpdateObjectSize(lpDatabase, ulStoreId, MAPI_STORE, UPDATE_ADD, ulSize);
+				if (er != erSuccess)
+					goto exit;
+			}
+		}
+
+		// update the destination folder for disconnected clients
+		er = WriteLocalCommitTimeMax(NULL, lpDatabase, vFolderIds[i], NULL);
+		if (er != erSuccess)
+			goto exit;
+
+		er = g_lpSessionManager->GetCacheManager()->GetEntryIdFromObject(vObjIds[i], soap, 0, &lpResult->sEntryId);
+		if (er != erSuccess)
+			goto exit;
+
+		// CopyObject() only queued the deferred table update, since it ran in our transaction
+		er = ECTPropsPurge::NormalizeDeferredUpdates(lpecSession, lpDatabase, vFolderIds[i]);
+		if (er != erSuccess)
+			goto exit;
+	}
+
+	er = lpAttachmentStorage->Commit();
+	if (er != erSuccess)
+		goto exit;
+
+	er = lpDatabase->Commit();
+	if (er != erSuccess)
+		goto exit;
+
+	for (i = 0; i < lpsTargets->__size; ++i) {
+		if (lpsResponse->sResults.__ptr[i].er != erSuccess)
+			continue;
+
+		g_lpSessionManager->GetCacheManager()->Update(fnevObjectModified, vFolderIds[i]);
+		g_lpSessionManager->AddPendingDelivery(vObjIds[i]);
+	}
+
+exit:
+	if (er != erSuccess) {
+		if (lpAttachmentStorage)
+			lpAttachmentStorage->Rollback();
+		lpDatabase->Rollback();
+	}
+
+	if (lpAttachmentStorage)
+		lpAttachmentStorage->Release();
+}
+SOAP_ENTRY_END()
+
 SOAP_ENTRY_START(copyFolder, *result, entryId sEntryId, entryId sDestFolderId, char *lpszNewFolderName, unsigned int ulFlags, unsigned int ulSyncId, unsigned int *result)
 {
 	unsigned int	ulAffRows = 0;
@@ -1338,11 +1338,10 @@ exit:
  * @return result
  */
 ECRESULT UpdateTProp(ECDatabase *lpDatabase, unsigned int ulPropTag, unsigned int ulFolderId, unsigned int ulObjId) {
-    ECListInt list;
-    
-    list.push_back(ulObjId);
-    
-    return UpdateTProp(lpDatabase, ulPropTag, ulFolderId, &list);
+    // Same as the list version, but with a fixed query so the statement can be reused
+    return lpDatabase->DoUpdatePrepared("UPDATE tproperties JOIN properties on properties.hierarchyid=tproperties.hierarchyid AND properties.tag=tproperties.tag AND properties.type=tproperties.type SET tproperties.val_ulong = properties.val_ulong "
+        "WHERE properties.tag = ? AND properties.type = ? AND tproperties.folderid = ? AND properties.hierarchyid = ?",
+        ECDatabaseParams().Add(PROP_ID(ulPropTag)).Add(PROP_TYPE(ulPropTag)).Add(ulFolderId).Add(ulObjId));
 }
 
 /**
@@ -1360,7 +1359,6 @@ ECRESULT UpdateTProp(ECDatabase *lpDatabase, unsigned int ulPropTag, unsigned in
 ECRESULT UpdateFolderCount(ECDatabase *lpDatabase, unsigned int ulFolderId, unsigned int ulPropTag, int lDelta)
 {
 	ECRESULT er = erSuccess;
-	std::string strQuery;
 	unsigned int ulParentId;
 	unsigned int ulType;
 	
@@ -1376,14 +1374,13 @@ ECRESULT UpdateFolderCount(ECDatabase *lpDatabase, unsigned int ulFolderId, unsi
 		goto exit;
 	}
 
-	strQuery = "UPDATE properties SET val_ulong = ";
 	// make sure val_ulong stays a positive number
 	if (lDelta < 0)
-		strQuery += "IF (val_ulong >= " + stringify(abs(lDelta),false,true) + ", val_ulong + " + stringify(lDelta,false,true) + ", 0)";
+		er = lpDatabase->DoUpdatePrepared("UPDATE properties SET val_ulong = IF (val_ulong >= ?, val_ulong - ?, 0) WHERE hierarchyid = ? AND tag = ? AND type = ?",
+			ECDatabaseParams().Add((unsigned int)abs(lDelta)).Add((unsigned int)abs(lDelta)).Add(ulFolderId).Add(PROP_ID(ulPropTag)).Add(PROP_TYPE(ulPropTag)));
 	else
-		strQuery += "val_ulong + " + stringify(lDelta,false,true);
-	strQuery += " WHERE hierarchyid = " + stringify(ulFolderId) + " AND tag = " + stringify(PROP_ID(ulPropTag)) + " AND type = " + stringify(PROP_TYPE(ulPropTag));
-	er = lpDatabase->DoUpdate(strQuery);
+		er = lpDatabase->DoUpdatePrepared("UPDATE properties SET val_ulong = val_ulong + ? WHERE hierarchyid = ? AND tag = ? AND type = ?",
+			ECDatabaseParams().Add((unsigned int)lDelta).Add(ulFolderId).Add(PROP_ID(ulPropTag)).Add(PROP_TYPE(ulPropTag)));
 	if(er != erSuccess)
 		goto exit;
 
@@ -967,6 +967,20 @@ auto_ptr<abprops_t> DBPlugin::getExtraAddressbookProperties()
 	return proplist;
 }
 
+auto_ptr<signatures_t> DBPlugin::getChangedObjects(const objectid_t &company, objectclass_t objclass, const string &since)
+{
+	throw notsupported("changed objects");
+}
+
+string DBPlugin::getSignatureSource()
+{
+	return string();
+}
+
+void DBPlugin::flushObjectCache(const objectid_t &objectid)
+{
+}
+
 void DBPlugin::removeAllObjects(objectid_t except)
 {
 	ECRESULT er = erSuccess;
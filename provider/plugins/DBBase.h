@@ -169,6 +169,30 @@ public:
 	 */
 	virtual auto_ptr<signatures_t> getAllObjects(const objectid_t &company, objectclass_t objclass);
 
+	/**
+	 * Request a list of changed objects
+	 *
+	 * @note The database has no modification history, all
+	 *       objects are always compared through getAllObjects()
+	 *
+	 * @throw notsupported Always when the function is called.
+	 */
+	virtual auto_ptr<signatures_t> getChangedObjects(const objectid_t &company, objectclass_t objclass, const string &since);
+
+	/**
+	 * Obtain the identity of the user source
+	 *
+	 * @return Always empty, there is only one database
+	 */
+	virtual string getSignatureSource();
+
+	/**
+	 * Notify the plugin that the signature of an object changed
+	 *
+	 * @note Nothing is cached, so there is nothing to flush
+	 */
+	virtual void flushObjectCache(const objectid_t &objectid);
+
 	/**
 	 * Obtain the object details for the given object
 	 *
@@ -22,12 +22,45 @@
 #include "LDAPUserPlugin.h"
 #include <zarafa/stringutil.h>
 
+template<>
+unsigned int GetCacheAdditionalSize(const name_key_t &val) {
+	return MEMORY_USAGE_STRING(val.company) + MEMORY_USAGE_STRING(val.name);
+}
+
+template<>
+unsigned int GetCacheAdditionalSize(const name_entry_t &val) {
+	return MEMORY_USAGE_STRING(val.signature.id.id) + MEMORY_USAGE_STRING(val.signature.signature);
+}
+
+template<>
+unsigned int GetCacheAdditionalSize(const objectid_t &val) {
+	return MEMORY_USAGE_STRING(val.id);
+}
+
+template<>
+unsigned int GetCacheAdditionalSize(const dn_entry_t &val) {
+	return MEMORY_USAGE_STRING(val.dn);
+}
+
+static name_key_t MakeNameKey(objectclass_t objclass, const std::string &name, const objectid_t &company)
+{
+	name_key_t key;
+
+	key.objclass = objclass;
+	key.company = company.id;
+	key.name = name;
+	return key;
+}
+
 LDAPCache::LDAPCache()
 {
 	pthread_mutexattr_init(&m_hMutexAttrib);
 	pthread_mutexattr_settype(&m_hMutexAttrib, PTHREAD_MUTEX_RECURSIVE);
 
 	pthread_mutex_init(&m_hMutex, &m_hMutexAttrib);
+	pthread_mutex_init(&m_hLookupMutex, NULL);
+	m_lMaxAge = 0;
+	m_tObjectNamesPruned = time(NULL);
 
 	m_lpCompanyCache = std::auto_ptr<dn_cache_t>(new dn_cache_t());
 	m_lpGroupCache = std::auto_ptr<dn_cache_t>(new dn_cache_t());
@@ -37,6 +70,7 @@ LDAPCache::LDAPCache()
 
 LDAPCache::~LDAPCache()
 {
+	pthread_mutex_destroy(&m_hLookupMutex);
 	pthread_mutex_destroy(&m_hMutex);
 	pthread_mutexattr_destroy(&m_hMutexAttrib);
 }
@@ -218,3 +252,174 @@ bool LDAPCache::isDNInList(const std::auto_ptr<dn_list_t> &lpList, const std::st
 
 	return false;
 }
+
+void LDAPCache::setLookupCacheLimits(ECCacheBase::size_type ulMaxSize, long lMaxAge, long lNegativeMaxAge)
+{
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	/* ECCache never expires entries with a max age of 0, so such a cache is disabled */
+	if (m_lpNameCache.get() == NULL) {
+		m_lpNameCache.reset(new name_lookup_cache_t("ldapname", lMaxAge > 0 ? ulMaxSize : 0, lMaxAge));
+		m_lpNegativeCache.reset(new negative_lookup_cache_t("ldapnegative", lNegativeMaxAge > 0 ? ulMaxSize : 0, lNegativeMaxAge));
+		m_lpDNCache.reset(new dn_lookup_cache_t("ldapdn", lMaxAge > 0 ? ulMaxSize : 0, lMaxAge));
+		m_lMaxAge = lMaxAge;
+	}
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+LDAPCache::lookup_result_t LDAPCache::getCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company, objectsignature_t *lpSignature)
+{
+	lookup_result_t result = LOOKUP_MISS;
+	name_key_t key = MakeNameKey(objclass, name, company);
+	name_entry_t *lpEntry = NULL;
+	negative_entry_t *lpNegative = NULL;
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpNameCache.get() == NULL)
+		goto exit;
+
+	if (m_lpNameCache->GetCacheItem(key, &lpEntry) == erSuccess) {
+		*lpSignature = lpEntry->signature;
+		result = LOOKUP_FOUND;
+	} else if (m_lpNegativeCache->GetCacheItem(key, &lpNegative) == erSuccess) {
+		result = LOOKUP_NOTFOUND;
+	}
+
+exit:
+	pthread_mutex_unlock(&m_hLookupMutex);
+
+	return result;
+}
+
+void LDAPCache::setCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company, const objectsignature_t *lpSignature)
+{
+	name_key_t key = MakeNameKey(objclass, name, company);
+	name_entry_t entry;
+	time_t tNow = time(NULL);
+	object_names_t::iterator iter;
+	std::map<name_key_t, time_t>::iterator iterName;
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpNameCache.get() != NULL) {
+		if (lpSignature != NULL) {
+			entry.signature = *lpSignature;
+			m_lpNegativeCache->RemoveCacheItem(key);
+			m_lpNameCache->AddCacheItem(key, entry);
+			if (m_lpNameCache->MaxSize() != 0)
+				m_mapObjectNames[lpSignature->id][key] = tNow;
+
+			/* Evicted names stay in the index until they would have expired */
+			if (tNow - m_tObjectNamesPruned > m_lMaxAge) {
+				for (iter = m_mapObjectNames.begin(); iter != m_mapObjectNames.end(); ) {
+					for (iterName = iter->second.begin(); iterName != iter->second.end(); ) {
+						if (tNow - iterName->second > m_lMaxAge)
+							iter->second.erase(iterName++);
+						else
+							++iterName;
+					}
+					if (iter->second.empty())
+						m_mapObjectNames.erase(iter++);
+					else
+						++iter;
+				}
+				m_tObjectNamesPruned = tNow;
+			}
+		} else {
+			m_lpNameCache->RemoveCacheItem(key);
+			m_lpNegativeCache->AddCacheItem(key, negative_entry_t());
+		}
+	}
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+void LDAPCache::removeCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company)
+{
+	name_key_t key = MakeNameKey(objclass, name, company);
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpNameCache.get() != NULL) {
+		m_lpNameCache->RemoveCacheItem(key);
+		m_lpNegativeCache->RemoveCacheItem(key);
+	}
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+LDAPCache::lookup_result_t LDAPCache::getCachedDN(const objectid_t &externid, std::string *lpstrDN)
+{
+	lookup_result_t result = LOOKUP_MISS;
+	dn_entry_t *lpEntry = NULL;
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpDNCache.get() != NULL && m_lpDNCache->GetCacheItem(externid, &lpEntry) == erSuccess) {
+		*lpstrDN = lpEntry->dn;
+		result = LOOKUP_FOUND;
+	}
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+
+	return result;
+}
+
+void LDAPCache::setCachedDN(const objectid_t &externid, const std::string &dn)
+{
+	dn_entry_t entry;
+
+	entry.dn = dn;
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpDNCache.get() != NULL)
+		m_lpDNCache->AddCacheItem(externid, entry);
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+void LDAPCache::removeCachedDN(const objectid_t &externid)
+{
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpDNCache.get() != NULL)
+		m_lpDNCache->RemoveCacheItem(externid);
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+void LDAPCache::removeCachedObject(const objectid_t &externid)
+{
+	object_names_t::iterator iter;
+	std::map<name_key_t, time_t>::const_iterator iterName;
+
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpNameCache.get() == NULL)
+		goto exit;
+
+	iter = m_mapObjectNames.find(externid);
+	if (iter != m_mapObjectNames.end()) {
+		for (iterName = iter->second.begin(); iterName != iter->second.end(); ++iterName)
+			m_lpNameCache->RemoveCacheItem(iterName->first);
+		m_mapObjectNames.erase(iter);
+	}
+
+	m_lpDNCache->RemoveCacheItem(externid);
+
+exit:
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
+
+void LDAPCache::flushNegativeCache()
+{
+	pthread_mutex_lock(&m_hLookupMutex);
+
+	if (m_lpNegativeCache.get() != NULL)
+		m_lpNegativeCache->ClearCache();
+
+	pthread_mutex_unlock(&m_hLookupMutex);
+}
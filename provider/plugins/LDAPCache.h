@@ -25,6 +25,9 @@
 
 #include <zarafa/ECDefs.h>
 #include <zarafa/ZarafaUser.h>
+#include <zarafa/ZarafaCode.h>
+#include <ECCache.h>
+#include "plugin.h"
 
 class LDAPUserPlugin;
 
@@ -41,9 +44,56 @@ class LDAPUserPlugin;
 typedef std::map<objectid_t, std::string> dn_cache_t;
 typedef std::list<std::string> dn_list_t;
 
+/**
+ * Key for the name lookup cache, a name is only unique
+ * within its object class and company.
+ */
+typedef struct {
+	objectclass_t objclass;
+	std::string company;
+	std::string name;
+} name_key_t;
+
+inline bool operator<(const name_key_t &a, const name_key_t &b)
+{
+	if (a.objclass != b.objclass)
+		return a.objclass < b.objclass;
+	if (a.company != b.company)
+		return a.company < b.company;
+	return a.name < b.name;
+}
+
+class name_entry_t _zcp_final : public ECsCacheEntry {
+public:
+	objectsignature_t signature;
+};
+
+/* Entry for a name which was not found in LDAP */
+class negative_entry_t _zcp_final : public ECsCacheEntry {
+};
+
+class dn_entry_t _zcp_final : public ECsCacheEntry {
+public:
+	std::string dn;
+};
+
+typedef ECCache<std::map<name_key_t, name_entry_t> > name_lookup_cache_t;
+typedef ECCache<std::map<name_key_t, negative_entry_t> > negative_lookup_cache_t;
+typedef ECCache<std::map<objectid_t, dn_entry_t> > dn_lookup_cache_t;
+
+/**
+ * Names cached per object, with the time they were cached
+ */
+typedef std::map<objectid_t, std::map<name_key_t, time_t> > object_names_t;
+
 /**
  * LDAP Cache which collects DNs with the matching
  * objectid and name.
+ *
+ * Next to the complete DN lists per object class, single lookups of
+ * names and DNs are kept in size bounded caches which expire entries
+ * after a fixed time. Names which were not found are cached as well, so
+ * repeated logins of unknown users do not each cost an LDAP search.
  */
 class LDAPCache {
 private:
@@ -56,7 +106,27 @@ private:
 	std::auto_ptr<dn_cache_t> m_lpUserCache;		/* OBJECTCLASS_USER */
 	std::auto_ptr<dn_cache_t> m_lpAddressListCache; /* CONTAINER_ADDRESSLIST */
 
+	/* Protects the lookup caches, which are created by setLookupCacheLimits() */
+	pthread_mutex_t m_hLookupMutex;
+	std::auto_ptr<name_lookup_cache_t> m_lpNameCache;
+	std::auto_ptr<negative_lookup_cache_t> m_lpNegativeCache;
+	std::auto_ptr<dn_lookup_cache_t> m_lpDNCache;
+
+	/* Reverse index of m_lpNameCache, entries older than m_lMaxAge have expired */
+	object_names_t m_mapObjectNames;
+	long m_lMaxAge;
+	time_t m_tObjectNamesPruned;
+
 public:
+	/**
+	 * Result of a lookup cache query
+	 */
+	enum lookup_result_t {
+		LOOKUP_MISS,		/* not cached, LDAP must be queried */
+		LOOKUP_FOUND,		/* cached, result is returned */
+		LOOKUP_NOTFOUND		/* cached as not present in LDAP */
+	};
+
 	/**
 	 * Default constructor
 	 */
@@ -142,6 +212,89 @@ public:
 	 * @return TRUE if the DN is found in the list
 	 */
 	static bool isDNInList(const std::auto_ptr<dn_list_t> &lpList, const std::string &dn);
+
+	/**
+	 * Create the lookup caches. Only the first call has effect, since the
+	 * cache is shared by all plugin instances.
+	 *
+	 * @param[in]	ulMaxSize
+	 *					Maximum memory usage of each lookup cache, 0 disables the caches.
+	 * @param[in]	lMaxAge
+	 *					Time in seconds after which an entry expires, 0 disables the
+	 *					name and DN caches.
+	 * @param[in]	lNegativeMaxAge
+	 *					Time in seconds after which a not found entry expires, 0 disables
+	 *					the cache of names which were not found.
+	 */
+	void setLookupCacheLimits(ECCacheBase::size_type ulMaxSize, long lMaxAge, long lNegativeMaxAge);
+
+	/**
+	 * Search the lookup cache for the result of resolving a name.
+	 *
+	 * @param[in]	objclass
+	 *					The objectclass the name was resolved for.
+	 * @param[in]	name
+	 *					The name which was resolved.
+	 * @param[in]	company
+	 *					The company the name was resolved in.
+	 * @param[out]	lpSignature
+	 *					The signature of the object when LOOKUP_FOUND is returned.
+	 * @return The lookup result
+	 */
+	lookup_result_t getCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company, objectsignature_t *lpSignature);
+
+	/**
+	 * Store the result of resolving a name in the lookup cache.
+	 *
+	 * @param[in]	objclass
+	 *					The objectclass the name was resolved for.
+	 * @param[in]	name
+	 *					The name which was resolved.
+	 * @param[in]	company
+	 *					The company the name was resolved in.
+	 * @param[in]	lpSignature
+	 *					The signature of the object, or NULL if the name was not found.
+	 */
+	void setCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company, const objectsignature_t *lpSignature);
+
+	/**
+	 * Remove the result of resolving a name from the lookup cache.
+	 */
+	void removeCachedName(objectclass_t objclass, const std::string &name, const objectid_t &company);
+
+	/**
+	 * Search the lookup cache for the DN of an object.
+	 *
+	 * @param[in]	externid
+	 *					The objectid which should be found in the cache
+	 * @param[out]	lpstrDN
+	 *					The DN of the object when LOOKUP_FOUND is returned.
+	 * @return LOOKUP_FOUND or LOOKUP_MISS
+	 */
+	lookup_result_t getCachedDN(const objectid_t &externid, std::string *lpstrDN);
+
+	/**
+	 * Store the DN of an object in the lookup cache.
+	 */
+	void setCachedDN(const objectid_t &externid, const std::string &dn);
+
+	/**
+	 * Remove the DN of an object from the lookup cache.
+	 */
+	void removeCachedDN(const objectid_t &externid);
+
+	/**
+	 * Remove all names and the DN of an object from the lookup caches.
+	 *
+	 * @param[in]	externid
+	 *					The objectid which should be removed from the cache
+	 */
+	void removeCachedObject(const objectid_t &externid);
+
+	/**
+	 * Remove all names which were not found from the lookup cache.
+	 */
+	void flushNegativeCache();
 };
 
 /** @} */
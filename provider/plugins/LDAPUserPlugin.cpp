@@ -106,7 +106,7 @@ typedef auto_free<struct berval*, auto_free_dealloc<struct berval**, void, ldap_
 	do { \
 		if (m_ldap == NULL) \
 			/* this either returns a connection or throws an exception */ \
-			m_ldap = ConnectLDAP(m_config->GetSetting("ldap_bind_user"), m_config->GetSetting("ldap_bind_passwd")); \
+			m_ldap = ConnectLDAP(m_config->GetSetting("ldap_bind_user"), m_config->GetSetting("ldap_bind_passwd"), &m_strLDAPServer); \
 		/* set critical to 'F' to not force paging? @todo find an ldap server without support. */ \
 		rc = ldap_create_page_control(m_ldap, ldap_page_size, &sCookie, 0, &pageControl); \
 		if (rc != LDAP_SUCCESS) {										\
@@ -372,6 +372,9 @@ LDAPUserPlugin::LDAPUserPlugin(pthread_mutex_t *pluginlock,
 		{ "ldap_object_search_filter", "", CONFIGSETTING_RELOADABLE },
 		{ "ldap_filter_cutoff_elements", "1000", CONFIGSETTING_RELOADABLE },
 		{ "ldap_page_size", "1000", CONFIGSETTING_RELOADABLE }, // MaxPageSize in ADS defaults to 1000
+		{ "ldap_cache_size", "1M", CONFIGSETTING_SIZE },
+		{ "ldap_cache_lifetime", "300" },
+		{ "ldap_cache_negative_lifetime", "30" },
 
 		/* Aliases, they should be loaded through the propmap directive */
 		{ "0x6788001E", "", 0, CONFIGGROUP_PROPMAP },								/* PR_EC_EXCHANGE_DN */
@@ -417,6 +420,10 @@ LDAPUserPlugin::LDAPUserPlugin(pthread_mutex_t *pluginlock,
 		throw ldap_error(string("No LDAP servers configured in ldap.cfg"));
 	m_timeout.tv_sec = atoui(m_config->GetSetting("ldap_network_timeout"));
 	m_timeout.tv_usec = 0;
+
+	m_lpCache->setLookupCacheLimits(atoll(m_config->GetSetting("ldap_cache_size")),
+		atoi(m_config->GetSetting("ldap_cache_lifetime")),
+		atoi(m_config->GetSetting("ldap_cache_negative_lifetime")));
 }
 
 void LDAPUserPlugin::InitPlugin()
@@ -425,7 +432,7 @@ void LDAPUserPlugin::InitPlugin()
 	const char *ldap_bindpw = m_config->GetSetting("ldap_bind_passwd");
 
 	/* FIXME encode the user and password, now it depends on which charset the config is saved in */
-	m_ldap = ConnectLDAP(ldap_binddn, ldap_bindpw);
+	m_ldap = ConnectLDAP(ldap_binddn, ldap_bindpw, &m_strLDAPServer);
 
 	const char *ldap_server_charset = m_config->GetSetting("ldap_server_charset");
 	m_iconv = new ECIConv("UTF-8", ldap_server_charset);
@@ -437,7 +444,7 @@ void LDAPUserPlugin::InitPlugin()
 		throw ldap_error(format("Cannot convert UTF-8 to %s", ldap_server_charset));
 }
 
-LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn, const char *bind_pw) {
+LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn, const char *bind_pw, std::string *lpstrServer) {
 	int rc = -1;
 	LDAP *ld = NULL;
 	struct timeval tstart, tend;
@@ -533,7 +540,7 @@ LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn, const char *bind_pw) {
 		ld = NULL;
 
 		if (loop == ldap_servers.size() - 1)
-			throw ldap_error("Failure connecting any of the LDAP servers");
+			throw ldap_error("Failure connecting any of the LDAP servers", rc);
 	}
 
 	gettimeofday(&tend, NULL);
@@ -546,6 +553,9 @@ LDAP *LDAPUserPlugin::ConnectLDAP(const char *bind_dn, const char *bind_pw) {
 
 	LOG_PLUGIN_DEBUG("ldaptiming [%08.2f] connected to ldap", llelapsedtime / 1000000.0);
 
+	if (lpstrServer != NULL)
+		*lpstrServer = ldap_servers.at(ldapServerIndex);
+
 	return ld;
 }
 
@@ -605,7 +615,7 @@ void LDAPUserPlugin::my_ldap_search_s(char *base, int scope, char *filter, char
 		}
 
 		/// @todo encode the user and password, now it's depended in which charset the config is saved
-		m_ldap = ConnectLDAP(ldap_binddn, ldap_bindpw);
+		m_ldap = ConnectLDAP(ldap_binddn, ldap_bindpw, &m_strLDAPServer);
 
 		m_lpStatsCollector->Increment(SCN_LDAP_RECONNECTS);
 
@@ -1367,6 +1377,7 @@ string LDAPUserPlugin::objectUniqueIDtoObjectDN(const objectid_t &uniqueid, bool
 	}
 
 	dn = GetLDAPEntryDN(entry);
+	m_lpCache->setCachedDN(uniqueid, dn);
 
 	return dn;
 }
@@ -1509,6 +1520,33 @@ auto_ptr<signatures_t> LDAPUserPlugin::resolveObjectsFromAttributesType(objectcl
 }
 
 objectsignature_t LDAPUserPlugin::resolveName(objectclass_t objclass, const string &name, const objectid_t &company)
+{
+	objectsignature_t signature;
+
+	switch (m_lpCache->getCachedName(objclass, name, company, &signature)) {
+	case LDAPCache::LOOKUP_FOUND:
+		m_lpStatsCollector->Increment(SCN_LDAP_CACHE_HITS);
+		return signature;
+	case LDAPCache::LOOKUP_NOTFOUND:
+		m_lpStatsCollector->Increment(SCN_LDAP_CACHE_NEGATIVE_HITS);
+		throw objectnotfound(name+" not found in LDAP");
+	default:
+		m_lpStatsCollector->Increment(SCN_LDAP_CACHE_MISSES);
+		break;
+	}
+
+	try {
+		signature = resolveNameFromLDAP(objclass, name, company);
+	} catch (objectnotfound &) {
+		m_lpCache->setCachedName(objclass, name, company, NULL);
+		throw;
+	}
+
+	m_lpCache->setCachedName(objclass, name, company, &signature);
+	return signature;
+}
+
+objectsignature_t LDAPUserPlugin::resolveNameFromLDAP(objectclass_t objclass, const string &name, const objectid_t &company)
 {
 	list<string> objects;
 	auto_ptr<attrArray> attrs = auto_ptr<attrArray>(new attrArray(6));
@@ -1638,17 +1676,54 @@ objectsignature_t LDAPUserPlugin::authenticateUserBind(const string &username, c
 {
 	LDAP*		ld = NULL;
 	string		dn;
+	string		strUncachedDN;
 	objectsignature_t	signature;
 
 	try {
 		signature = resolveName(ACTIVE_USER, username, company);
+
+		if (m_lpCache->getCachedDN(signature.id, &dn) != LDAPCache::LOOKUP_FOUND) {
+			m_lpStatsCollector->Increment(SCN_LDAP_CACHE_MISSES);
+			/*
+			 * ZCP-11720: When looking for users, explicitly request
+			 * skipping the cache.
+			 */
+			dn = objectUniqueIDtoObjectDN(signature.id, false);
+			ld = ConnectLDAP(dn.c_str(), m_iconvrev->convert(password).c_str());
+		} else {
+			m_lpStatsCollector->Increment(SCN_LDAP_CACHE_HITS);
+			try {
+				ld = ConnectLDAP(dn.c_str(), m_iconvrev->convert(password).c_str());
+			} catch (ldap_error &) {
+				/*
+				 * slapd and AD report a DN which no longer exists as invalid
+				 * credentials, so check the cached DN with an uncached search
+				 * before giving up (ZCP-11720).
+				 */
+				strUncachedDN = objectUniqueIDtoObjectDN(signature.id, false);
+				if (strUncachedDN == dn)
+					throw;
+				dn = strUncachedDN;
+				ld = ConnectLDAP(dn.c_str(), m_iconvrev->convert(password).c_str());
+			}
+		}
+	} catch (ldap_error &e) {
 		/*
-		 * ZCP-11720: When looking for users, explicitly request
-		 * skipping the cache.
+		 * The user may have been moved or renamed, look it up again next time.
+		 * A wrong password must not cause lookups, so other errors keep the cache.
 		 */
-		dn = objectUniqueIDtoObjectDN(signature.id, false);
-
-		ld = ConnectLDAP(dn.c_str(), m_iconvrev->convert(password).c_str());
+		if (e.GetLDAPError() == LDAP_NO_SUCH_OBJECT || e.GetLDAPError() == LDAP_INVALID_DN_SYNTAX) {
+			m_lpCache->removeCachedName(ACTIVE_USER, username, company);
+			m_lpCache->removeCachedDN(signature.id);
+		}
+		throw login_error((string)"Trying to authenticate failed: " + e.what() + (string)"; username = " + username);
+	} catch (objectnotfound &e) {
+		/* The cached name refers to an object which no longer exists */
+		if (!signature.id.id.empty()) {
+			m_lpCache->removeCachedName(ACTIVE_USER, username, company);
+			m_lpCache->removeCachedDN(signature.id);
+		}
+		throw login_error((string)"Trying to authenticate failed: " + e.what() + (string)"; username = " + username);
 	} catch (exception &e) {
 		throw login_error((string)"Trying to authenticate failed: " + e.what() + (string)"; username = " + username);
 	}
@@ -1769,9 +1844,56 @@ auto_ptr<signatures_t> LDAPUserPlugin::getAllObjects(const objectid_t &company,
 	} else {
 		LOG_PLUGIN_DEBUG("%s Class %x", __FUNCTION__, objclass);
 	}
+
+	/* New objects may have been cached as not found */
+	m_lpCache->flushNegativeCache();
+
 	return getAllObjectsByFilter(getSearchBase(company), LDAP_SCOPE_SUBTREE, getSearchFilter(objclass), companyDN, true);
 }
 
+auto_ptr<signatures_t> LDAPUserPlugin::getChangedObjects(const objectid_t &company, objectclass_t objclass, const string &since)
+{
+	const char *modify_attr = m_config->GetSetting("ldap_last_modification_attribute", "", NULL);
+	string companyDN;
+	string ldap_filter;
+	auto_ptr<signatures_t> signatures;
+
+	if (modify_attr == NULL)
+		throw notsupported("changed objects without ldap_last_modification_attribute");
+
+	if (!company.id.empty()) {
+		LOG_PLUGIN_DEBUG("%s Company %s, Class %x, Since %s", __FUNCTION__, company.id.c_str(), objclass, since.c_str());
+		companyDN = getSearchBase(company);
+	} else {
+		LOG_PLUGIN_DEBUG("%s Class %x, Since %s", __FUNCTION__, objclass, since.c_str());
+	}
+
+	ldap_filter = "(&" + getSearchFilter(objclass) + "(" + modify_attr + ">=" + StringEscapeSequence(since) + "))";
+
+	/* The result is not complete, so it must not replace the DN cache */
+	signatures = getAllObjectsByFilter(getSearchBase(company), LDAP_SCOPE_SUBTREE, ldap_filter, companyDN, false);
+
+	/* Changed objects may have been created, renamed or moved */
+	if (!signatures->empty())
+		m_lpCache->flushNegativeCache();
+	for (signatures_t::const_iterator iter = signatures->begin(); iter != signatures->end(); ++iter)
+		m_lpCache->removeCachedObject(iter->id);
+
+	return signatures;
+}
+
+string LDAPUserPlugin::getSignatureSource()
+{
+	return m_strLDAPServer;
+}
+
+void LDAPUserPlugin::flushObjectCache(const objectid_t &objectid)
+{
+	LOG_PLUGIN_DEBUG("%s", __FUNCTION__);
+
+	m_lpCache->removeCachedObject(objectid);
+}
+
 string LDAPUserPlugin::getLDAPAttributeValue(char *attribute, LDAPMessage *entry) {
 	list<string> l = getLDAPAttributeValues(attribute, entry);
 	if (!l.empty())
@@ -132,6 +132,43 @@ public:
 	 */
 	virtual auto_ptr<signatures_t> getAllObjects(const objectid_t &company, objectclass_t objclass);
 
+	/**
+	 * Request a list of objects for a particular company and specified objectclass
+	 * which were changed since a previous synchronization.
+	 *
+	 * The objects are found by searching for a ldap_last_modification_attribute
+	 * which is equal or higher than the given signature.
+	 *
+	 * @param[in]	company
+	 *					The company beneath which the objects should be listed.
+	 *					This objectid can be empty.
+	 * @param[in]	objclass
+	 *					The objectclass of the objects which should be returned.
+	 *					The objectclass can be partially unknown (OBJECTCLASS_UNKNOWN, MAILUSER_UNKNOWN, ...)
+	 * @param[in]	since
+	 *					The highest object signature seen by the previous synchronization.
+	 * @return The list of object signatures of all changed objects which were found
+	 * @throw notsupported when no ldap_last_modification_attribute is configured
+	 */
+	virtual auto_ptr<signatures_t> getChangedObjects(const objectid_t &company, objectclass_t objclass, const string &since);
+
+	/**
+	 * Obtain the identity of the user source the object signatures were
+	 * last read from.
+	 *
+	 * @return The URI of the LDAP server of the current connection, which
+	 *         changes when the plugin fails over to another ldap_uri
+	 */
+	virtual string getSignatureSource();
+
+	/**
+	 * Drop the cached lookups, since the object may have been renamed or moved.
+	 *
+	 * @param[in]	objectid
+	 *					The object whose signature changed
+	 */
+	virtual void flushObjectCache(const objectid_t &objectid);
+
 	/**
 	 * Obtain the object details for the given object
 	 *
@@ -449,10 +486,12 @@ private:
 	 *					The DN for the administrator
 	 * @param[in]	bind_pw
 	 *					The password for the administrator
+	 * @param[out]	lpstrServer
+	 *					The URI of the server that was connected to, may be NULL
 	 * @return LDAP pointer
 	 * @throw ldap_error When no connection could be established
 	 */
-	LDAP *ConnectLDAP(const char *bind_dn, const char *bind_pw);
+	LDAP *ConnectLDAP(const char *bind_dn, const char *bind_pw, std::string *lpstrServer = NULL);
 
 	/**
 	 * Authenticate by user bind
@@ -680,6 +719,14 @@ private:
 														const list<string> &objects, const char** lppAttr,
 														const objectid_t &company = objectid_t(CONTAINER_COMPANY));
 
+	/**
+	 * Resolve a name to an object signature by querying LDAP,
+	 * LDAPUserPlugin::resolveName() caches the result.
+	 *
+	 * @see LDAPUserPlugin::resolveName()
+	 */
+	objectsignature_t resolveNameFromLDAP(objectclass_t objclass, const string &name, const objectid_t &company);
+
 	/**
 	 * Resolve object from attribute data depending on the attribute type
 	 *
@@ -895,6 +942,7 @@ private:
 
 	long unsigned int ldapServerIndex; // index of the last ldap server to which we could connect
 	std::vector<std::string> ldap_servers;
+	std::string m_strLDAPServer; // URI of the server of m_ldap, or the last one when not connected
 };
 
 extern "C" {
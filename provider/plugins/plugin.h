@@ -194,6 +194,45 @@ public:
 	 */
 	virtual auto_ptr<signatures_t> getAllObjects(const objectid_t &company, objectclass_t objclass) = 0;
 
+	/**
+	 * Request a list of objects for a particular company and specified objectclass
+	 * which were changed since a previous synchronization. Deleted objects are not
+	 * returned, those can only be found by comparing with getAllObjects().
+	 *
+	 * @param[in]	company
+	 *					The company beneath which the objects should be listed.
+	 *					This objectid can be empty.
+	 * @param[in]	objclass
+	 *					The objectclass of the objects which should be returned.
+	 *					The objectclass can be partially unknown (OBJECTCLASS_UNKNOWN, MAILUSER_UNKNOWN, ...)
+	 * @param[in]	since
+	 *					The highest object signature seen by the previous synchronization.
+	 *					Objects with this signature are returned as well.
+	 * @return The list of object signatures of all changed objects which were found
+	 * @throw notsupported when the plugin cannot determine changed objects
+	 * @throw std::exception
+	 */
+	virtual auto_ptr<signatures_t> getChangedObjects(const objectid_t &company, objectclass_t objclass, const string &since) = 0;
+
+	/**
+	 * Obtain the identity of the user source the object signatures were
+	 * last read from. Signatures of different sources cannot be compared
+	 * (e.g. uSNChanged is counted per Active Directory server), so
+	 * getChangedObjects() is only used when the source did not change.
+	 *
+	 * @return Identity of the user source, empty when there is only one
+	 */
+	virtual string getSignatureSource() = 0;
+
+	/**
+	 * Notify the plugin that the signature of an object changed, so data it
+	 * cached about the object must not be used anymore.
+	 *
+	 * @param[in]	objectid
+	 *					The object whose signature changed
+	 */
+	virtual void flushObjectCache(const objectid_t &objectid) = 0;
+
 	/**
 	 * Obtain the object details for the given object
 	 *
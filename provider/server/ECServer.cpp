@@ -939,6 +939,9 @@ int running_server(char *szName, const char *szConfig, int argc, char *argv[])
 #endif
 		{ "attachment_path",			"/var/lib/zarafa/attachments" },
 		{ "attachment_compression",		"6" },
+		{ "attachment_cache_path",		"/var/lib/zarafa/attachment-cache" },
+		{ "attachment_cache_size",		"0", CONFIGSETTING_SIZE },
+		{ "attachment_cache_memory_size",	"0", CONFIGSETTING_SIZE },
 
 		// Log options
 		{ "log_method",					"file" },
@@ -995,6 +998,7 @@ int running_server(char *szName, const char *szConfig, int argc, char *argv[])
 		{ "cache_store_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb, store table cache (storeid, storeguid), 40 bytes
 		{ "cache_server_size",			"1M", CONFIGSETTING_SIZE },		// 1Mb
 		{ "cache_server_lifetime",		"30" },							// 30 minutes
+		{ "cache_shards",				"16" },							// independently locked segments per cache
 		// default no quota's. Note: quota values are in Mb, and thus have no size flag.
 		{ "quota_warn",				"0", CONFIGSETTING_RELOADABLE },
 		{ "quota_soft",				"0", CONFIGSETTING_RELOADABLE },
@@ -1019,6 +1023,7 @@ int running_server(char *szName, const char *szConfig, int argc, char *argv[])
 		{ "enable_gab",				"yes", CONFIGSETTING_RELOADABLE },			// whether the GAB is enabled
         { "enable_enhanced_ics",    "yes", CONFIGSETTING_RELOADABLE },			// (dis)allow enhanced ICS operations (stream and notifications)
         { "enable_sql_procedures",  "no" },			// (dis)allow SQL procedures (requires mysql config stack adjustment), not reloadable because in the middle of the streaming flip
+		{ "latency_stats",			"no" },			// latency histograms of SOAP calls and SQL queries in the system stats, not reloadable because the histograms are looked up once
 		
 		{ "report_path",			"/etc/zarafa/report", CONFIGSETTING_RELOADABLE },
 		{ "report_ca_path",			"/etc/zarafa/report-ca", CONFIGSETTING_RELOADABLE },
@@ -1047,12 +1052,18 @@ int running_server(char *szName, const char *szConfig, int argc, char *argv[])
 		{ "search_timeout",			"10", CONFIGSETTING_RELOADABLE },
 
 		{ "threads",				"8", CONFIGSETTING_RELOADABLE },
+		{ "server_work_queues",		"1" },
+		{ "search_folder_threads",	"4" },
+		{ "threads_max",			"40", CONFIGSETTING_RELOADABLE },
+		{ "threads_idle_timeout",	"30", CONFIGSETTING_RELOADABLE },
 		{ "watchdog_max_age",		"500", CONFIGSETTING_RELOADABLE },
 		{ "watchdog_frequency",		"1", CONFIGSETTING_RELOADABLE },
         
 		{ "folder_max_items",		"1000000", CONFIGSETTING_RELOADABLE },
 		{ "default_sort_locale_id",		"en_US", CONFIGSETTING_RELOADABLE },
 		{ "sync_gab_realtime",			"yes", CONFIGSETTING_RELOADABLE },
+		{ "sync_gab_delta",				"no", CONFIGSETTING_RELOADABLE },
+		{ "sync_gab_full_interval",		"86400", CONFIGSETTING_RELOADABLE },
 		{ "max_deferred_records",		"0", CONFIGSETTING_RELOADABLE },
 		{ "max_deferred_records_folder", "20", CONFIGSETTING_RELOADABLE },
 		{ "enable_test_protocol",		"no", CONFIGSETTING_RELOADABLE },
@@ -1221,6 +1232,7 @@ int running_server(char *szName, const char *szConfig, int argc, char *argv[])
 #endif //#ifdef HAVE_OFFLINE_SUPPORT
 
 	zarafa_initlibrary(g_lpConfig->GetSetting("mysql_database_path"), g_lpConfig->GetSetting("mysql_config_file"));
+	g_lpStatsCollector->SetHistogramsEnabled(parseBool(g_lpConfig->GetSetting("latency_stats")));
 
 	if(!strcmp(g_lpConfig->GetSetting("server_pipe_enabled"), "yes"))
 		bPipeEnabled = true;
@@ -98,6 +98,7 @@ ECWorkerThread::ECWorkerThread(ECLogger *lpLogger, ECThreadManager *lpManager, E
 	m_lpLogger->AddRef();
 	m_lpManager = lpManager;
 	m_lpDispatcher = lpDispatcher;
+	m_ulQueue = lpDispatcher->AssignWorkQueue();
 
 	if (!bDoNotStart) {
 		if(pthread_create(&m_thread, NULL, ECWorkerThread::Work, this) != 0) {
@@ -144,7 +145,7 @@ void *ECWorkerThread::Work(void *lpParam)
 		set_thread_name(pthread_self(), "z-s: idle thread");
 
         // Get the next work item, don't wait for new items
-        if(lpThis->m_lpDispatcher->GetNextWorkItem(&lpWorkItem, false, lpPrio != NULL) != erSuccess) {
+        if(lpThis->m_lpDispatcher->GetNextWorkItem(&lpWorkItem, false, lpPrio != NULL, lpThis->m_ulQueue) != erSuccess) {
             // Nothing in the queue, notify that we're idle now
             lpThis->m_lpManager->NotifyIdle(lpThis, &fStop);
             
@@ -155,7 +156,7 @@ void *ECWorkerThread::Work(void *lpParam)
             }
                 
             // Wait for next work item in the queue
-            er = lpThis->m_lpDispatcher->GetNextWorkItem(&lpWorkItem, true, lpPrio != NULL);
+            er = lpThis->m_lpDispatcher->GetNextWorkItem(&lpWorkItem, true, lpPrio != NULL, lpThis->m_ulQueue);
             if(er != erSuccess) {
                 // This could happen because we were waken up because we are exiting
                 continue;
@@ -266,7 +267,8 @@ done:
     return NULL;
 }
 
-ECThreadManager::ECThreadManager(ECLogger *lpLogger, ECDispatcher *lpDispatcher, unsigned int ulThreads)
+ECThreadManager::ECThreadManager(ECLogger *lpLogger, ECDispatcher *lpDispatcher, unsigned int ulThreads) :
+	m_scaler(ulThreads, 0, 0, 0)
 {
     m_lpLogger = lpLogger;
     m_lpLogger->AddRef();
@@ -335,6 +337,7 @@ ECRESULT ECThreadManager::SetThreadCount(unsigned int ulThreads)
 
     // Set the default thread count
     m_ulThreads = ulThreads;
+    m_scaler.setLimits(ulThreads, m_scaler.maxThreads(), m_scaler.maxAge(), m_scaler.cooldown());
 
     while(ulThreads > m_lstThreads.size())
         m_lstThreads.push_back(new ECWorkerThread(m_lpLogger, this, m_lpDispatcher));
@@ -346,6 +349,38 @@ ECRESULT ECThreadManager::SetThreadCount(unsigned int ulThreads)
     return erSuccess;
 }
 
+ECRESULT ECThreadManager::SetThreadLimits(unsigned int ulMaxThreads, double dblMaxAge, double dblCooldown)
+{
+    pthread_mutex_lock(&m_mutexThreads);
+    m_scaler.setLimits(m_ulThreads, ulMaxThreads, dblMaxAge, dblCooldown);
+    pthread_mutex_unlock(&m_mutexThreads);
+
+    return erSuccess;
+}
+
+ECRESULT ECThreadManager::AdjustThreadCount(double dblAge)
+{
+    unsigned int ulAdd = 0;
+    bool bShrink = false;
+    double dblNow = GetTimeOfDay();
+
+    pthread_mutex_lock(&m_mutexThreads);
+    ulAdd = m_scaler.threadsToAdd(m_lstThreads.size(), dblAge, dblNow);
+    for (unsigned int i = 0; i < ulAdd; ++i)
+        m_lstThreads.push_back(new ECWorkerThread(m_lpLogger, this, m_lpDispatcher));
+    bShrink = m_scaler.canRemoveThread(m_lstThreads.size(), dblNow);
+    pthread_mutex_unlock(&m_mutexThreads);
+
+    if (ulAdd > 0)
+        m_lpLogger->Log(EC_LOGLEVEL_DEBUG, "Queue age %.3fs, started %u extra threads", dblAge, ulAdd);
+
+    // Idle threads are waiting for a work item; wake them so they can exit through NotifyIdle()
+    if (bShrink)
+        m_lpDispatcher->WakeAllWorkers();
+
+    return erSuccess;
+}
+
 // Called by worker threads only when it is idle. This is the only place where the worker thread can be
 // deleted.
 ECRESULT ECThreadManager::NotifyIdle(ECWorkerThread *lpThread, bool *lpfStop)
@@ -361,8 +396,9 @@ ECRESULT ECThreadManager::NotifyIdle(ECWorkerThread *lpThread, bool *lpfStop)
 		*lpfStop = (m_ulThreads == 0);
 		goto exit;
 	}
-    if(m_ulThreads < m_lstThreads.size()) {
-        // We are currently running more threads than we want, so tell the thread to stop
+    if (m_ulThreads < m_lstThreads.size() &&
+        (m_ulThreads == 0 || m_scaler.canRemoveThread(m_lstThreads.size(), GetTimeOfDay()))) {
+        // We are currently running more threads than we want, and the cooldown has passed, so tell the thread to stop
         iterThreads = std::find(m_lstThreads.begin(), m_lstThreads.end(), lpThread);
         if(iterThreads == m_lstThreads.end()) {
             // HUH
@@ -430,12 +466,11 @@ void *ECWatchDog::Watch(void *lpParam)
 			break;
 
         double dblMaxFreq = atoi(lpThis->m_lpConfig->GetSetting("watchdog_frequency"));
-        double dblMaxAge = atoi(lpThis->m_lpConfig->GetSetting("watchdog_max_age")) / 1000.0;
         
-        // If the age of the front item in the queue is older than the specified maximum age, force
-        // a new thread to be started
-        if(lpThis->m_lpDispatcher->GetFrontItemAge(&dblAge) == erSuccess && dblAge > dblMaxAge)
-            lpThis->m_lpThreadManager->ForceAddThread(1);
+        // If the age of the front item in the queue is older than the specified maximum age, the
+        // thread manager starts new threads
+        if(lpThis->m_lpDispatcher->GetFrontItemAge(&dblAge) == erSuccess)
+            lpThis->m_lpThreadManager->AdjustThreadCount(dblAge);
 
         // Check to see if exit flag is set, and limit rate to dblMaxFreq Hz
         pthread_mutex_lock(&lpThis->m_mutexExit);
@@ -469,12 +504,28 @@ ECDispatcher::ECDispatcher(ECLogger *lpLogger, ECConfig *lpConfig, CREATEPIPESOC
 	m_nSendTimeout = atoi(m_lpConfig->GetSetting("server_send_timeout"));
     
     m_ulIdle = 0;
+    m_lpThreadManager = NULL;
         
     pthread_mutex_init(&m_mutexItems, NULL);
     pthread_mutex_init(&m_mutexSockets, NULL);
     pthread_mutex_init(&m_mutexIdle, NULL);
-    pthread_cond_init(&m_condItems, NULL);
     pthread_cond_init(&m_condPrioItems, NULL);
+
+	// Normal work items are spread over one or more queues, see GetNextWorkItem()
+	unsigned int ulQueues = atoui(m_lpConfig->GetSetting("server_work_queues"));
+	if (ulQueues == 0)
+		ulQueues = 1;
+	for (unsigned int i = 0; i < ulQueues; ++i) {
+		WORKQUEUE *lpQueue = new WORKQUEUE;
+
+		pthread_mutex_init(&lpQueue->hMutex, NULL);
+		pthread_cond_init(&lpQueue->hCond, NULL);
+		lpQueue->ulIdle = 0;
+		lpQueue->ulWakeups = 0;
+		m_vWorkQueues.push_back(lpQueue);
+	}
+	m_ulNextQueue = 0;
+	m_ulNextHomeQueue = 0;
     
     m_bExit = false;
 	m_lpCreatePipeSocketCallback = lpCallback;
@@ -487,8 +538,12 @@ ECDispatcher::~ECDispatcher()
     pthread_mutex_destroy(&m_mutexItems);
     pthread_mutex_destroy(&m_mutexSockets);
     pthread_mutex_destroy(&m_mutexIdle);
-    pthread_cond_destroy(&m_condItems);
     pthread_cond_destroy(&m_condPrioItems);
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		pthread_mutex_destroy(&(*i)->hMutex);
+		pthread_cond_destroy(&(*i)->hCond);
+		delete *i;
+	}
     m_lpLogger->Release();
 }
 
@@ -507,20 +562,29 @@ exit:
 }
 
 // Get the age (in seconds) of the next-in-line item in the queue, or 0 if the queue is empty
+// With multiple work queues, the oldest front item of all queues is used
 ECRESULT ECDispatcher::GetFrontItemAge(double *lpdblAge)
 {
     double dblNow = GetTimeOfDay();
     double dblAge = 0;
-    
-    pthread_mutex_lock(&m_mutexItems);
-    if(m_queueItems.empty() && m_queuePrioItems.empty())
-        dblAge = 0;
-    else if (m_queueItems.empty()) // normal items queue is more important when checking queue age
-        dblAge = dblNow - m_queuePrioItems.front()->dblReceiveStamp;
-	else
-        dblAge = dblNow - m_queueItems.front()->dblReceiveStamp;
-        
-    pthread_mutex_unlock(&m_mutexItems);
+    bool bFound = false;
+
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		pthread_mutex_lock(&(*i)->hMutex);
+		if (!(*i)->queueItems.empty()) {
+			dblAge = std::max(dblAge, dblNow - (*i)->queueItems.front()->dblReceiveStamp);
+			bFound = true;
+		}
+		pthread_mutex_unlock(&(*i)->hMutex);
+	}
+
+    // normal items queue is more important when checking queue age
+    if (!bFound) {
+        pthread_mutex_lock(&m_mutexItems);
+        if (!m_queuePrioItems.empty())
+            dblAge = dblNow - m_queuePrioItems.front()->dblReceiveStamp;
+        pthread_mutex_unlock(&m_mutexItems);
+    }
     
     *lpdblAge = dblAge;
     
@@ -530,8 +594,15 @@ ECRESULT ECDispatcher::GetFrontItemAge(double *lpdblAge)
 ECRESULT ECDispatcher::GetQueueLength(unsigned int *lpulLength)
 {
     unsigned int ulLength = 0;
+
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		pthread_mutex_lock(&(*i)->hMutex);
+		ulLength += (*i)->queueItems.size();
+		pthread_mutex_unlock(&(*i)->hMutex);
+	}
+
     pthread_mutex_lock(&m_mutexItems);
-    ulLength = m_queueItems.size() + m_queuePrioItems.size();
+    ulLength += m_queuePrioItems.size();
     pthread_mutex_unlock(&m_mutexItems);
     
     *lpulLength = ulLength;
@@ -558,35 +629,130 @@ ECRESULT ECDispatcher::QueueItem(struct soap *soap)
 	item->dblReceiveStamp = GetTimeOfDay();
 	ulType = SOAP_CONNECTION_TYPE(soap);
 
-	pthread_mutex_lock(&m_mutexItems);
 	if (ulType == CONNECTION_TYPE_NAMED_PIPE_PRIORITY) {
+		pthread_mutex_lock(&m_mutexItems);
 		m_queuePrioItems.push(item);
 		pthread_cond_signal(&m_condPrioItems);
-	} else {
-		m_queueItems.push(item);
-		pthread_cond_signal(&m_condItems);
+		pthread_mutex_unlock(&m_mutexItems);
+		return erSuccess;
+	}
+
+	/*
+	 * Spread the items round-robin over the work queues. The item is pushed before looking
+	 * for an idle thread, so a thread which became idle in the meantime will find it while
+	 * scanning the queues, and a thread that is already waiting is woken up here.
+	 */
+	unsigned int ulQueues = m_vWorkQueues.size();
+	unsigned int ulTarget = m_ulNextQueue++ % ulQueues;
+	WORKQUEUE *lpQueue = m_vWorkQueues[ulTarget];
+
+	pthread_mutex_lock(&lpQueue->hMutex);
+	lpQueue->queueItems.push(item);
+	pthread_mutex_unlock(&lpQueue->hMutex);
+
+	// Wake one idle thread, preferably one that has the target queue as home queue
+	for (unsigned int i = 0; i < ulQueues; ++i) {
+		lpQueue = m_vWorkQueues[(ulTarget + i) % ulQueues];
+		pthread_mutex_lock(&lpQueue->hMutex);
+		if (lpQueue->ulIdle > 0) {
+			--lpQueue->ulIdle;
+			++lpQueue->ulWakeups;
+			pthread_cond_signal(&lpQueue->hCond);
+			pthread_mutex_unlock(&lpQueue->hMutex);
+			break;
+		}
+		pthread_mutex_unlock(&lpQueue->hMutex);
 	}
-	pthread_mutex_unlock(&m_mutexItems);
 
 	return erSuccess;
 }
 
+unsigned int ECDispatcher::AssignWorkQueue()
+{
+	return m_ulNextHomeQueue++ % m_vWorkQueues.size();
+}
+
+/**
+ * Take the front item from a work queue
+ *
+ * @param[in] ulQueue index of the work queue
+ *
+ * @return work item or NULL when the queue is empty
+ */
+WORKITEM *ECDispatcher::PopWorkItem(unsigned int ulQueue)
+{
+	WORKQUEUE *lpQueue = m_vWorkQueues[ulQueue];
+	WORKITEM *lpItem = NULL;
+
+	pthread_mutex_lock(&lpQueue->hMutex);
+	if (!lpQueue->queueItems.empty()) {
+		lpItem = lpQueue->queueItems.front();
+		lpQueue->queueItems.pop();
+	}
+	pthread_mutex_unlock(&lpQueue->hMutex);
+
+	return lpItem;
+}
+
+/**
+ * Take an item from the work queue of another thread. The queues are scanned
+ * starting at the neighbour of ulQueue.
+ *
+ * @param[in] ulQueue home queue of the calling thread
+ * @param[in] bIncludeOwn also check the home queue, as the last queue
+ *
+ * @return work item or NULL when all queues are empty
+ */
+WORKITEM *ECDispatcher::StealWorkItem(unsigned int ulQueue, bool bIncludeOwn)
+{
+	unsigned int ulQueues = m_vWorkQueues.size();
+	unsigned int ulScan = bIncludeOwn ? ulQueues : ulQueues - 1;
+	WORKITEM *lpItem = NULL;
+
+	for (unsigned int i = 1; i <= ulScan; ++i) {
+		unsigned int ulVictim = (ulQueue + i) % ulQueues;
+
+		lpItem = PopWorkItem(ulVictim);
+		if (lpItem == NULL)
+			continue;
+		if (ulVictim != ulQueue)
+			g_lpStatsCollector->Increment(SCN_SERVER_QUEUE_STEALS);
+		break;
+	}
+
+	return lpItem;
+}
+
+// Called with the queue mutex locked when a thread stops waiting on a queue
+void ECDispatcher::LeaveIdle(WORKQUEUE *lpQueue)
+{
+	// If QueueItem() already took us off the idle count, consume that wakeup instead
+	if (lpQueue->ulWakeups > 0)
+		--lpQueue->ulWakeups;
+	else
+		--lpQueue->ulIdle;
+}
+
 /** 
  * Called by worker threads to get an item to work on
  * 
  * @param[out] lppItem soap call to process
  * @param[in] bWait wait for an item until present or return immediately
  * @param[in] bPrio handle priority or normal queue
+ * @param[in] ulQueue home work queue of the thread, for normal items
  * 
  * @return error code
  * @retval ZARAFA_E_NOT_FOUND no soap call in the queue present
  */
-ECRESULT ECDispatcher::GetNextWorkItem(WORKITEM **lppItem, bool bWait, bool bPrio)
+ECRESULT ECDispatcher::GetNextWorkItem(WORKITEM **lppItem, bool bWait, bool bPrio, unsigned int ulQueue)
 {
     WORKITEM *lpItem = NULL;
     ECRESULT er = erSuccess;
-	std::queue<WORKITEM *>* queue = bPrio ? &m_queuePrioItems : &m_queueItems;
-    pthread_cond_t *condItems = bPrio ? &m_condPrioItems : &m_condItems;
+	std::queue<WORKITEM *>* queue = &m_queuePrioItems;
+    pthread_cond_t *condItems = &m_condPrioItems;
+
+	if (!bPrio)
+		return GetNextNormalWorkItem(lppItem, bWait, ulQueue % m_vWorkQueues.size());
 
     pthread_mutex_lock(&m_mutexItems);
 
@@ -631,6 +797,66 @@ exit:
     return er;
 }
 
+/**
+ * Get a normal work item. The home queue of the thread is checked first, after
+ * that items are stolen from the other queues. A waiting thread is registered
+ * as idle on its home queue before the final scan, so an item queued while
+ * scanning either is found, or QueueItem() sees the idle thread and wakes it.
+ *
+ * @param[out] lppItem soap call to process
+ * @param[in] bWait wait for an item until present or return immediately
+ * @param[in] ulQueue home work queue of the thread
+ *
+ * @return error code
+ * @retval ZARAFA_E_NOT_FOUND no soap call in the queues present
+ */
+ECRESULT ECDispatcher::GetNextNormalWorkItem(WORKITEM **lppItem, bool bWait, unsigned int ulQueue)
+{
+	WORKQUEUE *lpQueue = m_vWorkQueues[ulQueue];
+	WORKITEM *lpItem = NULL;
+
+	lpItem = PopWorkItem(ulQueue);
+	if (lpItem == NULL)
+		lpItem = StealWorkItem(ulQueue, false);
+	if (lpItem != NULL)
+		goto found;
+
+	// No item waiting, and no wait requested or exiting
+	if (!bWait || m_bExit)
+		return ZARAFA_E_NOT_FOUND;
+
+	pthread_mutex_lock(&m_mutexIdle);
+	++m_ulIdle;
+	pthread_mutex_unlock(&m_mutexIdle);
+
+	pthread_mutex_lock(&lpQueue->hMutex);
+	++lpQueue->ulIdle;
+	pthread_mutex_unlock(&lpQueue->hMutex);
+
+	lpItem = StealWorkItem(ulQueue, true);
+
+	pthread_mutex_lock(&lpQueue->hMutex);
+	// If requested, wait until item is available
+	if (lpItem == NULL && lpQueue->queueItems.empty() && lpQueue->ulWakeups == 0 && !m_bExit)
+		pthread_cond_wait(&lpQueue->hCond, &lpQueue->hMutex);
+	LeaveIdle(lpQueue);
+	pthread_mutex_unlock(&lpQueue->hMutex);
+
+	pthread_mutex_lock(&m_mutexIdle);
+	--m_ulIdle;
+	pthread_mutex_unlock(&m_mutexIdle);
+
+	if (lpItem == NULL && !m_bExit)
+		lpItem = StealWorkItem(ulQueue, true);
+	if (lpItem == NULL)
+		// Condition fired, but still nothing there. Probably exit requested or another thread was faster
+		return ZARAFA_E_NOT_FOUND;
+
+found:
+	*lppItem = lpItem;
+	return erSuccess;
+}
+
 // Called by a worker thread when it's done with an item
 ECRESULT ECDispatcher::NotifyDone(struct soap *soap)
 {
@@ -682,23 +908,65 @@ ECRESULT ECDispatcher::SetThreadCount(unsigned int ulThreads)
     // Since the threads may be blocking while waiting for the next queue item, broadcast
     // a wakeup for all threads so that they re-check their idle state (and exit if the thread count
     // is now lower)
-    pthread_mutex_lock(&m_mutexItems);
-    pthread_cond_broadcast(&m_condItems);
-    pthread_mutex_unlock(&m_mutexItems);
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		pthread_mutex_lock(&(*i)->hMutex);
+		pthread_cond_broadcast(&(*i)->hCond);
+		pthread_mutex_unlock(&(*i)->hMutex);
+	}
         
 exit:
     return er;
 }
 
+void ECDispatcher::WakeAllWorkers()
+{
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		pthread_mutex_lock(&(*i)->hMutex);
+		pthread_cond_broadcast(&(*i)->hCond);
+		pthread_mutex_unlock(&(*i)->hMutex);
+	}
+
+	pthread_mutex_lock(&m_mutexItems);
+	pthread_cond_broadcast(&m_condPrioItems);
+	pthread_mutex_unlock(&m_mutexItems);
+}
+
+void ECDispatcher::FlushWorkQueues()
+{
+	for (std::vector<WORKQUEUE *>::const_iterator i = m_vWorkQueues.begin(); i != m_vWorkQueues.end(); ++i) {
+		std::queue<WORKITEM *> &queue = (*i)->queueItems;
+
+		pthread_mutex_lock(&(*i)->hMutex);
+		while (!queue.empty()) { zarafa_end_soap_connection(queue.front()->soap); soap_free(queue.front()->soap); delete queue.front(); queue.pop(); }
+		pthread_mutex_unlock(&(*i)->hMutex);
+	}
+
+	pthread_mutex_lock(&m_mutexItems);
+	while (!m_queuePrioItems.empty()) { zarafa_end_soap_connection(m_queuePrioItems.front()->soap); soap_free(m_queuePrioItems.front()->soap); delete m_queuePrioItems.front(); m_queuePrioItems.pop(); }
+	pthread_mutex_unlock(&m_mutexItems);
+}
+
 ECRESULT ECDispatcher::DoHUP()
 {
 	m_nMaxKeepAlive = atoi(m_lpConfig->GetSetting("server_max_keep_alive_requests"));
 	m_nRecvTimeout = atoi(m_lpConfig->GetSetting("server_recv_timeout"));
 	m_nReadTimeout = atoi(m_lpConfig->GetSetting("server_read_timeout"));
 	m_nSendTimeout = atoi(m_lpConfig->GetSetting("server_send_timeout"));
+	ApplyThreadLimits();
 	return SetThreadCount(atoi(m_lpConfig->GetSetting("threads")));
 }
 
+void ECDispatcher::ApplyThreadLimits()
+{
+	// if we receive a signal before the MainLoop() has started, we don't have thread manager yet
+	if (m_lpThreadManager == NULL)
+		return;
+
+	m_lpThreadManager->SetThreadLimits(atoui(m_lpConfig->GetSetting("threads_max")),
+		atoi(m_lpConfig->GetSetting("watchdog_max_age")) / 1000.0,
+		atoui(m_lpConfig->GetSetting("threads_idle_timeout")));
+}
+
 ECRESULT ECDispatcher::ShutDown()
 {
     m_bExit = true;
@@ -738,6 +1006,7 @@ ECRESULT ECDispatcherSelect::MainLoop()
 
     // This will start the threads
     m_lpThreadManager = new ECThreadManager(m_lpLogger, this, atoui(m_lpConfig->GetSetting("threads")));
+    ApplyThreadLimits();
     
     // Start the watchdog
     lpWatchDog = new ECWatchDog(m_lpConfig, m_lpLogger, this, m_lpThreadManager);
@@ -894,20 +1163,14 @@ ECRESULT ECDispatcherSelect::MainLoop()
     m_lpThreadManager->SetThreadCount(0);
 
     // Notify threads that they should re-query their idle state (and exit)
-    pthread_mutex_lock(&m_mutexItems);
-    pthread_cond_broadcast(&m_condItems);
-    pthread_cond_broadcast(&m_condPrioItems);
-    pthread_mutex_unlock(&m_mutexItems);
+    WakeAllWorkers();
     
     // Delete thread manager (waits for threads to become idle). During this time
     // the threads may report back a workitem as being done. If this is the case, we directly close that socket too.
     delete m_lpThreadManager;
     
     // Empty the queue
-    pthread_mutex_lock(&m_mutexItems);
-    while(!m_queueItems.empty()) { zarafa_end_soap_connection(m_queueItems.front()->soap); soap_free(m_queueItems.front()->soap); m_queueItems.pop(); }
-    while(!m_queuePrioItems.empty()) { zarafa_end_soap_connection(m_queuePrioItems.front()->soap); soap_free(m_queuePrioItems.front()->soap); m_queuePrioItems.pop(); }
-    pthread_mutex_unlock(&m_mutexItems);
+    FlushWorkQueues();
 
 	// Close all listener sockets. 
 	for (iterListenSockets = m_setListenSockets.begin();
@@ -988,6 +1251,7 @@ ECRESULT ECDispatcherEPoll::MainLoop()
 
 	// This will start the threads
 	m_lpThreadManager = new ECThreadManager(m_lpLogger, this, atoui(m_lpConfig->GetSetting("threads")));
+	ApplyThreadLimits();
 
 	// Start the watchdog
 	lpWatchDog = new ECWatchDog(m_lpConfig, m_lpLogger, this, m_lpThreadManager);
@@ -1100,18 +1364,12 @@ ECRESULT ECDispatcherEPoll::MainLoop()
     m_lpThreadManager->SetThreadCount(0);
 
     // Notify threads that they should re-query their idle state (and exit)
-    pthread_mutex_lock(&m_mutexItems);
-    pthread_cond_broadcast(&m_condItems);
-    pthread_cond_broadcast(&m_condPrioItems);
-    pthread_mutex_unlock(&m_mutexItems);
+    WakeAllWorkers();
 
 	delete m_lpThreadManager;
 
     // Empty the queue
-    pthread_mutex_lock(&m_mutexItems);
-    while(!m_queueItems.empty()) { zarafa_end_soap_connection(m_queueItems.front()->soap); soap_free(m_queueItems.front()->soap); m_queueItems.pop(); }
-    while(!m_queuePrioItems.empty()) { zarafa_end_soap_connection(m_queuePrioItems.front()->soap); soap_free(m_queuePrioItems.front()->soap); m_queuePrioItems.pop(); }
-    pthread_mutex_unlock(&m_mutexItems);
+    FlushWorkQueues();
 
 	// Close all listener sockets.
 	for (iterListenSockets = m_setListenSockets.begin();
@@ -21,9 +21,11 @@
 #include <zarafa/zcdefs.h>
 #include <queue>
 #include <set>
+#include <vector>
 
 #include <zarafa/ECLogger.h>
 #include <zarafa/ECConfig.h>
+#include <zarafa/ECThreadPool.h>
 #include <zarafa/ZarafaCode.h>
 #include "SOAPUtils.h"
 #include "soapH.h"
@@ -37,6 +39,19 @@ typedef struct {
     double dblReceiveStamp;		// time at which activity was detected on the socket
 } WORKITEM;
 
+/*
+ * One of the dispatcher's normal work queues. With more than one queue, each worker thread
+ * has a home queue that it waits on, and steals items from the other queues when its own
+ * queue is empty. This way a single request only touches one queue mutex and wakes one thread.
+ */
+typedef struct {
+    pthread_mutex_t			hMutex;
+    pthread_cond_t			hCond;
+    std::queue<WORKITEM *>	queueItems;
+    unsigned int			ulIdle;		// threads waiting on hCond which have not been signalled yet
+    unsigned int			ulWakeups;	// threads signalled by QueueItem() that have not woken up yet
+} WORKQUEUE;
+
 typedef struct ACTIVESOCKET _zcp_final {
     struct soap *soap;
     time_t ulLastActivity;
@@ -85,6 +100,7 @@ protected:
     ECLogger *m_lpLogger;
     ECThreadManager *m_lpManager;
     ECDispatcher *m_lpDispatcher;
+    unsigned int m_ulQueue;		// home work queue in the dispatcher
 };
 
 class ECPriorityWorkerThread _zcp_final : public ECWorkerThread {
@@ -96,7 +112,8 @@ public:
 
 /*
  * It is the thread manager's job to keep track of processing threads, and adding or removing threads
- * when requested. 
+ * when requested. Threads above the normal thread count are added by the watchdog when the queue
+ * gets too old, and exit again once they have been idle for the cooldown period.
  */
 class ECThreadManager _zcp_final {
 public:
@@ -113,6 +130,13 @@ public:
     
     // This is the same parameter as passed in the constructor
     ECRESULT SetThreadCount(unsigned int ulThreads);
+
+    // Set the limits for adding and removing threads above the normal thread count
+    ECRESULT SetThreadLimits(unsigned int ulMaxThreads, double dblMaxAge, double dblCooldown);
+
+    // Called by the watchdog with the current queue age; adds threads when needed, and wakes
+    // idle threads when they may exit
+    ECRESULT AdjustThreadCount(double dblAge);
     
     // Called by the worker thread when it is idle. *lpfStop is set to TRUE then the thread will terminate and delete itself.
     ECRESULT NotifyIdle(ECWorkerThread *, bool *lpfStop);
@@ -124,13 +148,14 @@ private:
     ECLogger *					m_lpLogger;
     ECDispatcher *				m_lpDispatcher;
     unsigned int				m_ulThreads;
+    ECThreadScaler				m_scaler;
 };
 
 /*
  * Represents the watchdog thread. This monitors the dispatcher and acts when needed.
  *
- * We check the age of the first item in the queue dblMaxFreq times per second. If it is higher
- * than dblMaxAge, a new thread is added
+ * We check the age of the first item in the queue dblMaxFreq times per second, and pass it to
+ * the thread manager, which adds threads when it is higher than watchdog_max_age.
  *
  * Thread deletion is done by the Thread Manager.
  */
@@ -172,6 +197,9 @@ public:
     ECRESULT GetQueueLength(unsigned int *lpulQueueLength);	// Number of requests in the queue
 
     ECRESULT SetThreadCount(unsigned int ulThreads);
+
+    // Wake up all threads waiting for a work item, so they re-check their idle state
+    void WakeAllWorkers();
     
     // Add a listen socket
     ECRESULT AddListenSocket(struct soap *soap);
@@ -181,7 +209,10 @@ public:
 
     // Get the next work item on the queue, if bWait is TRUE, will block until a work item is available. The returned
     // workitem should not be freed, but returned to the class via NotifyDone(), at which point it will be cleaned up
-    ECRESULT GetNextWorkItem(WORKITEM **item, bool bWait, bool bPrio);
+    ECRESULT GetNextWorkItem(WORKITEM **item, bool bWait, bool bPrio, unsigned int ulQueue = 0);
+
+    // Returns the home work queue for a new worker thread. Only called by the thread manager, with its thread list locked
+    unsigned int AssignWorkQueue();
 
     // Reload variables from config
     ECRESULT DoHUP();
@@ -203,9 +234,23 @@ protected:
     ECConfig *				m_lpConfig;
     ECThreadManager *		m_lpThreadManager;
 
-    pthread_mutex_t 		m_mutexItems;
-    std::queue<WORKITEM *> 	m_queueItems;
-    pthread_cond_t			m_condItems;
+    // Pass the thread limits from the config to the thread manager
+    void ApplyThreadLimits();
+    // Close all connections still waiting in the work queues
+    void FlushWorkQueues();
+
+private:
+    ECRESULT GetNextNormalWorkItem(WORKITEM **lppItem, bool bWait, unsigned int ulQueue);
+    WORKITEM *PopWorkItem(unsigned int ulQueue);
+    WORKITEM *StealWorkItem(unsigned int ulQueue, bool bIncludeOwn);
+    void LeaveIdle(WORKQUEUE *lpQueue);
+
+protected:
+    std::vector<WORKQUEUE *> m_vWorkQueues;
+    unsigned int			m_ulNextQueue;		// round-robin target for QueueItem(), only used by the MainLoop() thread
+    unsigned int			m_ulNextHomeQueue;	// round-robin home queue for AssignWorkQueue()
+
+    pthread_mutex_t 		m_mutexItems;		// guards the priority queue
     std::queue<WORKITEM *> 	m_queuePrioItems;
     pthread_cond_t			m_condPrioItems;
 
@@ -113,6 +113,7 @@
 #include "rules.h"
 #include "archive.h"
 #include "helpers/MAPIPropHelper.h"
+#include "IECSpooler.h"
 #include <inetmapi/options.h>
 #include <zarafa/charset/convert.h>
 #include <zarafa/base64.h>
@@ -130,6 +131,8 @@
 #include <csignal>
 #include "SSLUtil.h"
 #include "StatsClient.h"
+#include <zarafa/ECThreadPool.h>
+#include "sessionpool.h"
 #include <execinfo.h>
     
 using namespace std;
@@ -276,6 +279,9 @@ exit:
 static bool g_bQuit = false;
 static bool g_bTempfail = true; // Most errors are tempfails
 static unsigned int g_nLMTPThreads = 0;
+static bool g_bThreads = false; // LMTP connections are handled in threads instead of processes
+static pthread_mutex_t g_hMutexLMTPThreads = PTHREAD_MUTEX_INITIALIZER; // protects g_nLMTPThreads in threaded mode
+static SessionPool *g_lpSessionPool = NULL; // admin sessions shared by the LMTP threads
 ECLogger *g_lpLogger = NULL;
 ECConfig *g_lpConfig = NULL;
 
@@ -1278,11 +1284,11 @@ exit:
  * Make the message a fallback message.
  * 
  * @param[in,out] lpMessage Message to place fallback data in
- * @param[in] msg original rfc2822 received message
+ * @param[in] fp file containing the original rfc2822 received message
  * 
  * @return MAPI Error code
  */
-static HRESULT FallbackDelivery(LPMESSAGE lpMessage, const string &msg)
+static HRESULT FallbackDelivery(LPMESSAGE lpMessage, FILE *fp)
 {
 	HRESULT			hr;
 	LPSPropValue	lpPropValue = NULL;
@@ -1294,6 +1300,8 @@ static HRESULT FallbackDelivery(LPMESSAGE lpMessage, const string &msg)
 	LPSPropValue	lpAttPropValue = NULL;
 	unsigned int	ulAttPropPos;
 	string			newbody;
+	char			buffer[4096];
+	size_t			ulRead = 0;
 
 	sc -> countInc("DAgent", "FallbackDelivery");
 
@@ -1347,10 +1355,13 @@ static HRESULT FallbackDelivery(LPMESSAGE lpMessage, const string &msg)
 		goto exit;
 	}
 
-	hr = lpStream->Write(msg.c_str(), msg.size(), NULL);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "FallbackDelivery(): lpStream->Write failed %x", hr);
-		goto exit;
+	rewind(fp);
+	while ((ulRead = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+		hr = lpStream->Write(buffer, ulRead, NULL);
+		if (hr != hrSuccess) {
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "FallbackDelivery(): lpStream->Write failed %x", hr);
+			goto exit;
+		}
 	}
 
 	hr = lpStream->Commit(0);
@@ -1848,8 +1859,11 @@ exit:
 
 /** 
  * Convert the received rfc2822 email into a MAPI message
+ *
+ * The email is parsed from the file, so attachments are copied into the
+ * message without loading the whole email into memory.
  * 
- * @param[in] strMail the received email
+ * @param[in] fpMail file containing the received email
  * @param[in] lpSession a MAPI Session
  * @param[in] lpMsgStore The store of the delivery
  * @param[in] lpAdrBook The Global Addressbook
@@ -1861,7 +1875,7 @@ exit:
  * 
  * @return MAPI Error code
  */
-static HRESULT HrStringToMAPIMessage(const string &strMail,
+static HRESULT HrFileToMAPIMessage(FILE *fpMail,
     IMAPISession *lpSession, IMsgStore *lpMsgStore, LPADRBOOK lpAdrBook,
     IMAPIFolder *lpDeliveryFolder, IMessage *lpMessage, ECRecipient *lpRecip,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
@@ -1873,7 +1887,7 @@ static HRESULT HrStringToMAPIMessage(const string &strMail,
 	lpArgs->sDeliveryOpts.add_imap_data = lpRecip->bHasIMAP;
 
 	// Set the properties on the object
-	hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, strMail, lpArgs->sDeliveryOpts, g_lpLogger);
+	hr = IMToMAPI(lpSession, lpMsgStore, lpAdrBook, lpMessage, fpMail, lpArgs->sDeliveryOpts, g_lpLogger);
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_WARNING, "E-mail parsing failed: 0x%08X. Starting fallback delivery.", hr);
 
@@ -1884,7 +1898,7 @@ static HRESULT HrStringToMAPIMessage(const string &strMail,
 			goto exit;
 		}
 
-		hr = FallbackDelivery(lpFallbackMessage, strMail);
+		hr = FallbackDelivery(lpFallbackMessage, fpMail);
 		if (hr != hrSuccess) {
 			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to deliver fallback message, error code: 0x%08X", hr);
 			goto exit;
@@ -1898,7 +1912,7 @@ static HRESULT HrStringToMAPIMessage(const string &strMail,
 	// return the filled (real or fallback) message
 	hr = lpMessage->QueryInterface(IID_IMessage, (void**)lppMessage);
 	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrStringToMAPIMessage(): QueryInterface failed %x", hr);
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrFileToMAPIMessage(): QueryInterface failed %x", hr);
 		goto exit;
 	}
 
@@ -1987,20 +2001,21 @@ exit:
 }
 
 /** 
- * Replace To recipient data in message with new recipient
+ * Get the To recipient data of a message for a new recipient
  * 
- * @param[in] lpMessage delivery message to set new recipient data in
+ * @param[in] lpMessage delivery message to read the recipients from
  * @param[in] lpRecip new recipient to deliver same message for
+ * @param[out] lpPropRecip the PR_MESSAGE_*_ME properties (3 values)
  * 
  * @return MAPI Error code
  */
-static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
+static HRESULT HrGetRecipProps(IMessage *lpMessage, ECRecipient *lpRecip,
+    LPSPropValue lpPropRecip)
 {
 	HRESULT hr = hrSuccess;
 	LPMAPITABLE lpRecipTable = NULL;
 	LPSRestriction lpRestrictRecipient = NULL;
 	LPSRowSet lpsRows = NULL;
-	SPropValue sPropRecip[3];
 	SPropValue sCmp[2];
 	bool bToMe = false;
 	bool bCcMe = false;
@@ -2015,13 +2030,13 @@ static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
 
 	hr = lpMessage->GetRecipientTable (0, &lpRecipTable);
 	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrOverrideRecipProps(): GetRecipientTable failed %x", hr);
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrGetRecipProps(): GetRecipientTable failed %x", hr);
 		goto exit;
 	}
 
 	hr = lpRecipTable->SetColumns((LPSPropTagArray)&sptaColumns, 0);
 	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrOverrideRecipProps(): SetColumns failed %x", hr);
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrGetRecipProps(): SetColumns failed %x", hr);
 		goto exit;
 	}
 
@@ -2040,7 +2055,7 @@ static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
 	if (hr == hrSuccess) {
 		hr = lpRecipTable->QueryRows (1, 0, &lpsRows);
 		if (hr != hrSuccess) {
-			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrOverrideRecipProps(): QueryRows failed %x", hr);
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrGetRecipProps(): QueryRows failed %x", hr);
 			goto exit;
 		}
 
@@ -2061,18 +2076,12 @@ static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
 		hr = hrSuccess;
 	}
 
-	sPropRecip[0].ulPropTag = PR_MESSAGE_RECIP_ME;
-	sPropRecip[0].Value.b = bRecipMe;
-	sPropRecip[1].ulPropTag = PR_MESSAGE_TO_ME;
-	sPropRecip[1].Value.b = bToMe;
-	sPropRecip[2].ulPropTag = PR_MESSAGE_CC_ME;
-	sPropRecip[2].Value.b = bCcMe;
-
-	hr = lpMessage->SetProps(3, sPropRecip, NULL);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrOverrideRecipProps(): SetProps failed %x", hr);
-		goto exit;
-	}
+	lpPropRecip[0].ulPropTag = PR_MESSAGE_RECIP_ME;
+	lpPropRecip[0].Value.b = bRecipMe;
+	lpPropRecip[1].ulPropTag = PR_MESSAGE_TO_ME;
+	lpPropRecip[1].Value.b = bToMe;
+	lpPropRecip[2].ulPropTag = PR_MESSAGE_CC_ME;
+	lpPropRecip[2].Value.b = bCcMe;
 
 exit:
 	if (lpsRows)
@@ -2087,20 +2096,46 @@ exit:
 }
 
 /** 
- * Replace To and From recipient data in fallback message with new recipient
+ * Replace To recipient data in message with new recipient
  * 
- * @param[in] lpMessage fallback message to set new recipient data in
+ * @param[in] lpMessage delivery message to set new recipient data in
  * @param[in] lpRecip new recipient to deliver same message for
  * 
  * @return MAPI Error code
  */
-static HRESULT HrOverrideFallbackProps(IMessage *lpMessage,
-    ECRecipient *lpRecip)
+static HRESULT HrOverrideRecipProps(IMessage *lpMessage, ECRecipient *lpRecip)
+{
+	HRESULT hr = hrSuccess;
+	SPropValue sPropRecip[3];
+
+	hr = HrGetRecipProps(lpMessage, lpRecip, sPropRecip);
+	if (hr != hrSuccess)
+		return hr;
+
+	hr = lpMessage->SetProps(3, sPropRecip, NULL);
+	if (hr != hrSuccess)
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrOverrideRecipProps(): SetProps failed %x", hr);
+
+	return hr;
+}
+
+/** 
+ * Get the To and From recipient data of a fallback message for a new recipient
+ * 
+ * @param[in] lpRecip new recipient to deliver same message for
+ * @param[in] lpBase MAPI buffer to allocate the sender entryid on
+ * @param[out] sPropOverride the fallback properties (at most 17 values)
+ * @param[out] lpcValues number of properties in sPropOverride
+ * 
+ * @return MAPI Error code
+ */
+static HRESULT HrGetFallbackProps(ECRecipient *lpRecip, void *lpBase,
+    LPSPropValue sPropOverride, ULONG *lpcValues)
 {
 	HRESULT hr = hrSuccess;
 	LPENTRYID lpEntryIdSender = NULL;
+	LPENTRYID lpEntryIdCopy = NULL;
 	ULONG cbEntryIdSender;
-	SPropValue sPropOverride[17];
 	ULONG ulPropPos = 0;
 
 	// Set From: and To: to the receiving party, reply will be to yourself...
@@ -2162,29 +2197,30 @@ static HRESULT HrOverrideFallbackProps(IMessage *lpMessage,
 	hr = ECCreateOneOff((LPTSTR)lpRecip->wstrFullname.c_str(), (LPTSTR)L"SMTP", (LPTSTR)convert_to<wstring>(lpRecip->strSMTP).c_str(),
 						MAPI_UNICODE | MAPI_SEND_NO_RICH_INFO, &cbEntryIdSender, &lpEntryIdSender);
 	if (hr == hrSuccess) {
+		hr = MAPIAllocateMore(cbEntryIdSender, lpBase, (void **)&lpEntryIdCopy);
+		if (hr != hrSuccess)
+			goto exit;
+		memcpy(lpEntryIdCopy, lpEntryIdSender, cbEntryIdSender);
+
 		// PR_SENDER_ENTRYID
 		sPropOverride[ulPropPos].ulPropTag = PR_SENDER_ENTRYID;
 		sPropOverride[ulPropPos].Value.bin.cb = cbEntryIdSender;
-		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdSender;
+		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdCopy;
 
 		// PR_RECEIVED_BY_ENTRYID
 		sPropOverride[ulPropPos].ulPropTag = PR_RECEIVED_BY_ENTRYID;
 		sPropOverride[ulPropPos].Value.bin.cb = cbEntryIdSender;
-		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdSender;
+		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdCopy;
 
 		// PR_SENT_REPRESENTING_ENTRYID
 		sPropOverride[ulPropPos].ulPropTag = PR_SENT_REPRESENTING_ENTRYID;
 		sPropOverride[ulPropPos].Value.bin.cb = cbEntryIdSender;
-		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdSender;
+		sPropOverride[ulPropPos++].Value.bin.lpb = (LPBYTE)lpEntryIdCopy;
 	} else {
 		hr = hrSuccess;
 	}
 
-	hr = lpMessage->SetProps(ulPropPos, sPropOverride, NULL);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to set fallback delivery properties: 0x%08X", hr);
-		goto exit;
-	}
+	*lpcValues = ulPropPos;
 
 exit:
 	MAPIFreeBuffer(lpEntryIdSender);
@@ -2192,20 +2228,48 @@ exit:
 }
 
 /** 
- * Set new To recipient data in message
+ * Replace To and From recipient data in fallback message with new recipient
  * 
- * @param[in] lpMessage message to update recipient data in
- * @param[in] lpRecip recipient data to use
+ * @param[in] lpMessage fallback message to set new recipient data in
+ * @param[in] lpRecip new recipient to deliver same message for
  * 
- * @return MAPI error code
+ * @return MAPI Error code
  */
-static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
+static HRESULT HrOverrideFallbackProps(IMessage *lpMessage,
     ECRecipient *lpRecip)
 {
 	HRESULT hr = hrSuccess;
-	SPropValue sPropReceived[5];
+	LPSPropValue lpPropOverride = NULL;
+	ULONG cValues = 0;
+
+	hr = MAPIAllocateBuffer(sizeof(SPropValue) * 17, (void **)&lpPropOverride);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = HrGetFallbackProps(lpRecip, lpPropOverride, lpPropOverride, &cValues);
+	if (hr != hrSuccess)
+		goto exit;
 
-	/* First set the PR_RECEIVED_BY_* properties */
+	hr = lpMessage->SetProps(cValues, lpPropOverride, NULL);
+	if (hr != hrSuccess) {
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to set fallback delivery properties: 0x%08X", hr);
+		goto exit;
+	}
+
+exit:
+	MAPIFreeBuffer(lpPropOverride);
+	return hr;
+}
+
+/** 
+ * Get the new To recipient data for a message
+ * 
+ * @param[in] lpRecip recipient data to use
+ * @param[out] sPropReceived the PR_RECEIVED_BY_* properties (5 values)
+ */
+static void GetReceivedByProps(ECRecipient *lpRecip,
+    LPSPropValue sPropReceived)
+{
 	sPropReceived[0].ulPropTag = PR_RECEIVED_BY_ADDRTYPE_A;
 	sPropReceived[0].Value.lpszA = (char *)lpRecip->strAddrType.c_str();
 
@@ -2222,6 +2286,23 @@ static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
 	sPropReceived[4].ulPropTag = PR_RECEIVED_BY_SEARCH_KEY;
 	sPropReceived[4].Value.bin.cb = lpRecip->sSearchKey.cb;
 	sPropReceived[4].Value.bin.lpb = lpRecip->sSearchKey.lpb;
+}
+
+/** 
+ * Set new To recipient data in message
+ * 
+ * @param[in] lpMessage message to update recipient data in
+ * @param[in] lpRecip recipient data to use
+ * 
+ * @return MAPI error code
+ */
+static HRESULT HrOverrideReceivedByProps(IMessage *lpMessage,
+    ECRecipient *lpRecip)
+{
+	HRESULT hr = hrSuccess;
+	SPropValue sPropReceived[5];
+
+	GetReceivedByProps(lpRecip, sPropReceived);
 
 	hr = lpMessage->SetProps(5, sPropReceived, NULL);
 	if (hr != hrSuccess) {
@@ -2233,6 +2314,44 @@ exit:
 	return hr;
 }
 
+/* Recipient dependent properties, never copied from a previous delivery */
+static SizedSPropTagArray(11, sptaReceivedBy) = {
+	11, {
+		/* Overriden by HrOverrideRecipProps() */
+		PR_MESSAGE_RECIP_ME,
+		PR_MESSAGE_TO_ME,
+		PR_MESSAGE_CC_ME,
+		/* HrOverrideReceivedByProps() */
+		PR_RECEIVED_BY_ADDRTYPE,
+		PR_RECEIVED_BY_EMAIL_ADDRESS,
+		PR_RECEIVED_BY_ENTRYID,
+		PR_RECEIVED_BY_NAME,
+		PR_RECEIVED_BY_SEARCH_KEY,
+		/* Written by rules */
+		PR_LAST_VERB_EXECUTED,
+		PR_LAST_VERB_EXECUTION_TIME,
+		PR_ICON_INDEX,
+	}
+};
+
+static SizedSPropTagArray(12, sptaFallback) = {
+	12, {
+		/* Overriden by HrOverrideFallbackProps() */
+		PR_SENDER_ADDRTYPE,
+		PR_SENDER_EMAIL_ADDRESS,
+		PR_SENDER_ENTRYID,
+		PR_SENDER_NAME,
+		PR_SENDER_SEARCH_KEY,
+		PR_SENT_REPRESENTING_ADDRTYPE,
+		PR_SENT_REPRESENTING_EMAIL_ADDRESS,
+		PR_SENT_REPRESENTING_ENTRYID,
+		PR_SENT_REPRESENTING_NAME,
+		PR_SENT_REPRESENTING_SEARCH_KEY,
+		PR_RCVD_REPRESENTING_ADDRTYPE,
+		PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
+	}
+};
+
 /** 
  * Copy a delivered message to another recipient
  * 
@@ -2257,43 +2376,6 @@ static HRESULT HrCopyMessageForDelivery(IMessage *lpOrigMessage,
 	IMAPIFolder *lpFolder = NULL;
 	za::helpers::MAPIPropHelperPtr ptrArchiveHelper;
 
-	SizedSPropTagArray(13, sptaReceivedBy) = {
-		13, {
-			/* Overriden by HrOverrideRecipProps() */
-			PR_MESSAGE_RECIP_ME,
-			PR_MESSAGE_TO_ME,
-			PR_MESSAGE_CC_ME,
-			/* HrOverrideReceivedByProps() */
-			PR_RECEIVED_BY_ADDRTYPE,
-			PR_RECEIVED_BY_EMAIL_ADDRESS,
-			PR_RECEIVED_BY_ENTRYID,
-			PR_RECEIVED_BY_NAME,
-			PR_RECEIVED_BY_SEARCH_KEY,
-			/* Written by rules */
-			PR_LAST_VERB_EXECUTED,
-			PR_LAST_VERB_EXECUTION_TIME,
-			PR_ICON_INDEX,
-		}
-	};
-
-	SizedSPropTagArray(12, sptaFallback) = {
-		12, {
-			/* Overriden by HrOverrideFallbackProps() */
-			PR_SENDER_ADDRTYPE,
-			PR_SENDER_EMAIL_ADDRESS,
-			PR_SENDER_ENTRYID,
-			PR_SENDER_NAME,
-			PR_SENDER_SEARCH_KEY,
-			PR_SENT_REPRESENTING_ADDRTYPE,
-			PR_SENT_REPRESENTING_EMAIL_ADDRESS,
-			PR_SENT_REPRESENTING_ENTRYID,
-			PR_SENT_REPRESENTING_NAME,
-			PR_SENT_REPRESENTING_SEARCH_KEY,
-			PR_RCVD_REPRESENTING_ADDRTYPE,
-			PR_RCVD_REPRESENTING_EMAIL_ADDRESS,
-		}
-	};
-
 	hr = HrCreateMessage(lpDeliverFolder, lpFallbackFolder, &lpFolder, &lpMessage);
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HrCopyMessageForDelivery(): HrCreateMessage failed %x", hr);
@@ -2350,6 +2432,167 @@ exit:
 	return hr;
 }
 
+/**
+ * Delivery folders of a recipient and the copy of the message the server
+ * made there, see HrCopyMessageToDeliveryTarget()
+ */
+struct DeliveryTarget {
+	MsgStorePtr ptrStore;
+	MAPIFolderPtr ptrInbox;
+	MAPIFolderPtr ptrFolder;
+	std::string strEntryId;		// entryid of the copy
+};
+
+/** 
+ * Let the server copy a delivered message to the delivery folder of a
+ * recipient on that same server
+ *
+ * The copy is prepared like HrCopyMessageForDelivery() does, but the
+ * message is not read and sent back again by the dagent. This is done
+ * just before the recipient is delivered to, since the copy is visible
+ * as soon as the server made it. When this fails (e.g. no write access
+ * to the delivery folder) the recipient is delivered to with
+ * HrCopyMessageForDelivery() as before.
+ * 
+ * @param[in] lpStore Store of the admin
+ * @param[in] lpSession MAPI Admin session
+ * @param[in] lpOrigMessage The original delivered message, saved on the same server
+ * @param[in] bFallbackDelivery lpOrigMessage is a fallback delivery message
+ * @param[in] lpRecip recipient to copy the message for
+ * @param[in] lpArgs delivery options
+ * @param[out] lpTarget The delivery folders and the copy for lpRecip
+ * 
+ * @return MAPI Error code
+ */
+static HRESULT HrCopyMessageToDeliveryTarget(IMsgStore *lpStore,
+    IMAPISession *lpSession, IMessage *lpOrigMessage, bool bFallbackDelivery,
+    ECRecipient *lpRecip, DeliveryArgs *lpArgs, DeliveryTarget *lpTarget)
+{
+	HRESULT hr = hrSuccess;
+	IECSpooler *lpSpooler = NULL;
+	SPropValuePtr ptrObject;
+	SPropValuePtr ptrEntryId;
+	SPropValuePtr ptrFolderEntryId;
+	SPropValuePtr ptrProps;
+	SPropTagArrayPtr ptrDelProps;
+	ULONG cValues = 0;
+	ULONG i = 0;
+	ECDELIVERYTARGET sTarget;
+
+	SizedSPropTagArray(4, sptaIMAP) = {
+		4, { PR_EC_IMAP_EMAIL_SIZE,
+			 PR_EC_IMAP_EMAIL,
+			 PR_EC_IMAP_BODY,
+			 PR_EC_IMAP_BODYSTRUCTURE
+		}
+	};
+
+	memset(&sTarget, 0, sizeof(sTarget));
+
+	hr = HrGetOneProp(lpStore, PR_EC_OBJECT, &ptrObject);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = ((IECUnknown *)ptrObject->Value.lpszA)->QueryInterface(IID_IECSpooler, (void **)&lpSpooler);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = HrGetOneProp(lpOrigMessage, PR_ENTRYID, &ptrEntryId);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = HrGetDeliveryStoreAndFolder(lpSession, lpStore, lpRecip, lpArgs, &lpTarget->ptrStore, &lpTarget->ptrInbox, &lpTarget->ptrFolder);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = HrGetOneProp(lpTarget->ptrFolder, PR_ENTRYID, &ptrFolderEntryId);
+	if (hr != hrSuccess)
+		goto exit;
+
+	// Same properties HrCopyMessageForDelivery() does not copy or removes afterwards
+	hr = MAPIAllocateBuffer(CbNewSPropTagArray(sptaReceivedBy.cValues + sptaFallback.cValues + sptaIMAP.cValues), &ptrDelProps);
+	if (hr != hrSuccess)
+		goto exit;
+
+	ptrDelProps->cValues = 0;
+	for (i = 0; i < sptaReceivedBy.cValues; ++i)
+		ptrDelProps->aulPropTag[ptrDelProps->cValues++] = sptaReceivedBy.aulPropTag[i];
+	if (bFallbackDelivery)
+		for (i = 0; i < sptaFallback.cValues; ++i)
+			ptrDelProps->aulPropTag[ptrDelProps->cValues++] = sptaFallback.aulPropTag[i];
+	if (!lpRecip->bHasIMAP)
+		for (i = 0; i < sptaIMAP.cValues; ++i)
+			ptrDelProps->aulPropTag[ptrDelProps->cValues++] = sptaIMAP.aulPropTag[i];
+
+	hr = MAPIAllocateBuffer(sizeof(SPropValue) * (3 + 17), &ptrProps);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = HrGetRecipProps(lpOrigMessage, lpRecip, ptrProps);
+	if (hr != hrSuccess)
+		goto exit;
+	sTarget.cValues = 3;
+
+	if (bFallbackDelivery) {
+		hr = HrGetFallbackProps(lpRecip, ptrProps, ptrProps + 3, &cValues);
+		if (hr != hrSuccess)
+			goto exit;
+		sTarget.cValues += cValues;
+	} else {
+		GetReceivedByProps(lpRecip, ptrProps + 3);
+		sTarget.cValues += 5;
+	}
+
+	sTarget.cbFolderEntryID = ptrFolderEntryId->Value.bin.cb;
+	sTarget.lpFolderEntryID = (LPENTRYID)ptrFolderEntryId->Value.bin.lpb;
+	sTarget.lpProps = ptrProps;
+	sTarget.lpDelProps = ptrDelProps;
+
+	hr = lpSpooler->CopyMessageToFolders(ptrEntryId->Value.bin.cb, (LPENTRYID)ptrEntryId->Value.bin.lpb, 1, &sTarget, 0);
+	if (hr != hrSuccess)
+		goto exit;
+
+	hr = sTarget.hResult;
+	if (hr != hrSuccess)
+		goto exit;
+
+	lpTarget->strEntryId.assign((char *)sTarget.lpEntryID, sTarget.cbEntryID);
+
+exit:
+	MAPIFreeBuffer(sTarget.lpEntryID);
+
+	if (lpSpooler)
+		lpSpooler->Release();
+
+	return hr;
+}
+
+/**
+ * Remove the copy of a message the server made for a recipient that was
+ * not delivered to after all
+ *
+ * @param[in] lpTarget The copy made by HrCopyMessageToDeliveryTarget()
+ *
+ * @return MAPI Error code
+ */
+static HRESULT HrDeleteDeliveryTarget(const DeliveryTarget *lpTarget)
+{
+	HRESULT hr = hrSuccess;
+	SBinary sEntryId;
+	ENTRYLIST sEntryList;
+
+	sEntryId.cb = lpTarget->strEntryId.size();
+	sEntryId.lpb = (LPBYTE)lpTarget->strEntryId.data();
+	sEntryList.cValues = 1;
+	sEntryList.lpbin = &sEntryId;
+
+	hr = lpTarget->ptrFolder->DeleteMessages(&sEntryList, 0, NULL, DELETE_HARD_DELETE);
+	if (hr != hrSuccess)
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to remove undelivered copy of message: 0x%08X", hr);
+
+	return hr;
+}
+
 /** 
  * Make a new MAPI session under a specific username
  * 
@@ -2493,13 +2736,12 @@ exit:
  * Find spam header if needed, and mark delivery as spam delivery if
  * header found.
  * 
- * @param[in] strMail rfc2822 email being delivered
+ * @param[in] fpMail file containing the rfc2822 email being delivered
  * @param[in,out] lpArgs delivery options
  * 
  * @return MAPI Error code
  */
-static HRESULT FindSpamMarker(const std::string &strMail,
-    DeliveryArgs *lpArgs)
+static HRESULT FindSpamMarker(FILE *fpMail, DeliveryArgs *lpArgs)
 {
 	HRESULT hr = hrSuccess;
 	const char *szHeader = g_lpConfig->GetSetting("spam_header_name", "", NULL);
@@ -2507,19 +2749,28 @@ static HRESULT FindSpamMarker(const std::string &strMail,
 	size_t end, pos;
 	string match;
 	string strHeaders;
+	char buffer[4096];
+	bool bLineStart = true;
+	bool bHeaderEnd = false;
 
 	if (!szHeader || !szValue)
 		goto exit;
 
-	// find end of headers
-	end = strMail.find("\r\n\r\n");
-	if (end == string::npos)
+	// read only the headers, up to the first empty line
+	rewind(fpMail);
+	while (fgets(buffer, sizeof(buffer), fpMail) != NULL) {
+		if (bLineStart && strcmp(buffer, "\r\n") == 0) {
+			bHeaderEnd = true;
+			break;
+		}
+		strHeaders += buffer;
+		bLineStart = strHeaders[strHeaders.size() - 1] == '\n';
+	}
+	if (!bHeaderEnd)
 		goto exit;
-	end += 2;
 
-	// copy headers in upper case, need to resize destination first
-	strHeaders.resize(end);
-	transform(strMail.begin(), strMail.begin() +end, strHeaders.begin(), ::toupper);
+	// headers in upper case
+	transform(strHeaders.begin(), strHeaders.end(), strHeaders.begin(), ::toupper);
 
 	match = string("\r\n") + szHeader;
 	transform(match.begin(), match.end(), match.begin(), ::toupper);
@@ -2561,19 +2812,22 @@ exit:
  * @param[in] lpAdrBook Global Addressbook
  * @param[in] lpOrigMessage a previously delivered message, if any
  * @param[in] bFallbackDelivery previously delivered message was a fallback message
- * @param[in] strMail original received rfc2822 email
+ * @param[in] fpMail file containing the original received rfc2822 email
  * @param[in] lpRecip recipient to deliver message to
  * @param[in] lpArgs delivery options
- * @param[out] lppMessage the newly delivered message
+ * @param[in] lpTarget copy of lpOrigMessage the server made for this recipient, if any, removed again when it is not delivered
+ * @param[out] lppMessage the newly delivered message, not set when lpTarget was removed again
  * @param[out] lpbFallbackDelivery newly delivered message is a fallback message
+ * @param[out] lpbSaved the newly delivered message was saved in the store of the recipient
  * 
  * @return MAPI Error code
  */
 static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
     IMAPISession *lpSession, IMsgStore *lpStore, bool bIsAdmin,
     LPADRBOOK lpAdrBook, IMessage *lpOrigMessage, bool bFallbackDelivery,
-    const std::string &strMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
-    IMessage **lppMessage, bool *lpbFallbackDelivery)
+    FILE *fpMail, ECRecipient *lpRecip, DeliveryArgs *lpArgs,
+    const DeliveryTarget *lpTarget, IMessage **lppMessage,
+    bool *lpbFallbackDelivery, bool *lpbSaved)
 {
 	HRESULT hr = hrSuccess;
 	LPMDB lpTargetStore = NULL;
@@ -2585,6 +2839,9 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 	IABContainer *lpAddrDir = NULL;
 	ULONG ulResult = 0;
 	ULONG ulNewMailNotify = 0;
+	ULONG ulObjType = 0;
+	bool bSaved = false;
+	za::helpers::MAPIPropHelperPtr ptrArchiveHelper;
 
 	// single user deliver did not lookup the user
 	if (lpRecip->strSMTP.empty()) {
@@ -2601,10 +2858,16 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 	}
 	}
 
-	hr = HrGetDeliveryStoreAndFolder(lpSession, lpStore, lpRecip, lpArgs, &lpTargetStore, &lpInbox, &lpTargetFolder);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrGetDeliveryStoreAndFolder failed %x", hr);
-		goto exit;
+	if (lpTarget) {
+		lpTarget->ptrStore->QueryInterface(IID_IMsgStore, (void **)&lpTargetStore);
+		lpTarget->ptrInbox->QueryInterface(IID_IMAPIFolder, (void **)&lpInbox);
+		lpTarget->ptrFolder->QueryInterface(IID_IMAPIFolder, (void **)&lpTargetFolder);
+	} else {
+		hr = HrGetDeliveryStoreAndFolder(lpSession, lpStore, lpRecip, lpArgs, &lpTargetStore, &lpInbox, &lpTargetFolder);
+		if (hr != hrSuccess) {
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrGetDeliveryStoreAndFolder failed %x", hr);
+			goto exit;
+		}
 	}
 
 	if (!lpOrigMessage) {
@@ -2617,9 +2880,9 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 			goto exit;
 		}
 
-		hr = HrStringToMAPIMessage(strMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &lpDeliveryMessage, &bFallbackDelivery);
+		hr = HrFileToMAPIMessage(fpMail, lpSession, lpTargetStore, lpAdrBook, lpFolder, lpMessageTmp, lpRecip, lpArgs, &lpDeliveryMessage, &bFallbackDelivery);
 		if (hr != hrSuccess) {
-			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrStringToMAPIMessage failed %x", hr);
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrFileToMAPIMessage failed %x", hr);
 			goto exit;
 		}
 
@@ -2646,6 +2909,26 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 
 		// TODO do something with ulResult
 
+	} else if (lpTarget) {
+		/* The server already copied the message and set the recipient properties */
+		hr = lpTargetStore->OpenEntry(lpTarget->strEntryId.size(), (LPENTRYID)lpTarget->strEntryId.data(), &IID_IMessage, MAPI_MODIFY, &ulObjType, (LPUNKNOWN *)&lpDeliveryMessage);
+		if (hr != hrSuccess) {
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): OpenEntry failed %x", hr);
+			goto exit;
+		}
+
+		// Make sure the message is not attached to an archive
+		hr = za::helpers::MAPIPropHelper::Create(MAPIPropPtr(lpDeliveryMessage, true), &ptrArchiveHelper);
+		if (hr != hrSuccess) {
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): za::helpers::MAPIPropHelper::Create failed %x", hr);
+			goto exit;
+		}
+
+		hr = ptrArchiveHelper->DetachFromArchives();
+		if (hr != hrSuccess) {
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): DetachFromArchives failed %x", hr);
+			goto exit;
+		}
 	} else {
 		/* Copy message to prepare for new delivery */
 		hr = HrCopyMessageForDelivery(lpOrigMessage, lpTargetFolder, lpRecip, lpArgs, lpInbox, bFallbackDelivery, &lpFolder, &lpDeliveryMessage);
@@ -2655,24 +2938,26 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 	}
 	}
 
-	hr = HrOverrideRecipProps(lpDeliveryMessage, lpRecip);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideRecipProps failed %x", hr);
-		goto exit;
-	}
-
-	if (bFallbackDelivery) {
-		hr = HrOverrideFallbackProps(lpDeliveryMessage, lpRecip);
+	if (!lpTarget) {
+		hr = HrOverrideRecipProps(lpDeliveryMessage, lpRecip);
 		if (hr != hrSuccess) {
-			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideFallbackProps failed %x", hr);
+			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideRecipProps failed %x", hr);
 			goto exit;
 		}
-	} else {
-		hr = HrOverrideReceivedByProps(lpDeliveryMessage, lpRecip);
-		if (hr != hrSuccess) {
-			g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideReceivedByProps failed %x", hr);
-			goto exit;
-	}
+
+		if (bFallbackDelivery) {
+			hr = HrOverrideFallbackProps(lpDeliveryMessage, lpRecip);
+			if (hr != hrSuccess) {
+				g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideFallbackProps failed %x", hr);
+				goto exit;
+			}
+		} else {
+			hr = HrOverrideReceivedByProps(lpDeliveryMessage, lpRecip);
+			if (hr != hrSuccess) {
+				g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToRecipient(): HrOverrideReceivedByProps failed %x", hr);
+				goto exit;
+			}
+		}
 	}
 
 	hr = lppyMapiPlugin->MessageProcessing("PreDelivery", lpSession, lpAdrBook, lpTargetStore, lpTargetFolder, lpDeliveryMessage, &ulResult);
@@ -2683,7 +2968,8 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 
 	// TODO do something with ulResult
 	if (ulResult == MP_STOP_SUCCESS) {
-		if (lppMessage)
+		// A server copy is removed again on exit, so it cannot be handed out
+		if (lppMessage && lpTarget == NULL)
 			lpDeliveryMessage->QueryInterface(IID_IMessage, (void**)lppMessage);
 
 		if (lpbFallbackDelivery)
@@ -2707,6 +2993,7 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 				g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to commit message: 0x%08X", hr);
 			goto exit;
 		}
+		bSaved = true;
 
 		hr = lppyMapiPlugin->MessageProcessing("PostDelivery", lpSession, lpAdrBook, lpTargetStore, lpTargetFolder, lpDeliveryMessage, &ulResult);
 		if (hr != hrSuccess) {
@@ -2770,13 +3057,20 @@ static HRESULT ProcessDeliveryToRecipient(PyMapiPlugin *lppyMapiPlugin,
 		}
 	}
 
-	if (lppMessage)
+	if (lppMessage && (bSaved || lpTarget == NULL))
 		lpDeliveryMessage->QueryInterface(IID_IMessage, (void**)lppMessage);
 
 	if (lpbFallbackDelivery)
 		*lpbFallbackDelivery = bFallbackDelivery;
 
 exit:
+	// A copy made by the server is only announced once saved, remove it when the message was not delivered after all
+	if (lpTarget && !bSaved)
+		HrDeleteDeliveryTarget(lpTarget);
+
+	if (lpbSaved)
+		*lpbSaved = bSaved;
+
 	if (lpMessageTmp)
 		lpMessageTmp->Release();
 
@@ -2827,7 +3121,7 @@ static void RespondMessageExpired(recipients_t::const_iterator start,
  * @param[in] lpUserSession optional session of one user the message is being delivered to (cmdline dagent, NULL on LMTP mode)
  * @param[in] lpMessage an already delivered message
  * @param[in] bFallbackDelivery already delivered message is an fallback message
- * @param[in] strMail the rfc2822 received email
+ * @param[in] fpMail file containing the rfc2822 received email
  * @param[in] strServer uri of the zarafa server to connect to
  * @param[in] listRecipients list of recipients present on the server connecting to
  * @param[in] lpAdrBook Global addressbook
@@ -2839,7 +3133,7 @@ static void RespondMessageExpired(recipients_t::const_iterator start,
  */
 static HRESULT ProcessDeliveryToServer(PyMapiPlugin *lppyMapiPlugin,
     IMAPISession *lpUserSession, IMessage *lpMessage, bool bFallbackDelivery,
-    const std::string &strMail, const std::string &strServer,
+    FILE *fpMail, const std::string &strServer,
     const recipients_t &listRecipients, LPADRBOOK lpAdrBook,
     DeliveryArgs *lpArgs, IMessage **lppMessage, bool *lpbFallbackDelivery)
 {
@@ -2850,20 +3144,37 @@ static HRESULT ProcessDeliveryToServer(PyMapiPlugin *lppyMapiPlugin,
 	IMessage *lpOrigMessage = NULL;
 	IMessage *lpMessageTmp = NULL;
 	bool bFallbackDeliveryTmp = false;
+	bool bSaved = false;
+	bool bServerCopy = false;
 	convert_context converter;
+	struct stat sMailStat;
+	DeliveryTarget sTarget;
+	HRESULT hrCopy = hrSuccess;
+	bool bPooledSession = false;
 
 	sc -> countInc("DAgent", "to_server");
 
+	if (fstat(fileno(fpMail), &sMailStat) != 0)
+		sMailStat.st_size = 0;
+
 	// if we already had a message, we can create a copy.
 	if (lpMessage)
 		lpMessage->QueryInterface(IID_IMessage, (void**)&lpOrigMessage);
 
 	if (lpUserSession)
 		hr = lpUserSession->QueryInterface(IID_IMAPISession, (void **)&lpSession);
-	else
+	else if (g_lpSessionPool) {
+		hr = g_lpSessionPool->GetSession(strServer, &lpSession);
+		bPooledSession = true;
+	} else
 		hr = HrOpenECAdminSession(g_lpLogger, &lpSession, "spooler/dagent/delivery:system", PROJECT_SVN_REV_STR, strServer.c_str(), EC_PROFILE_FLAGS_NO_NOTIFICATIONS, g_lpConfig->GetSetting("sslkey_file","",NULL), g_lpConfig->GetSetting("sslkey_pass","",NULL));
 	if (hr != hrSuccess || (hr = HrOpenDefaultStore(lpSession, &lpStore)) != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to open default store for system account, error code: 0x%08X", hr);
+		if (bPooledSession) {
+			// do not hand out this session again
+			g_lpSessionPool->DiscardSession(strServer, lpSession);
+			lpSession = NULL;
+		}
 
 		// notify LMTP client soft error to try again later
 		for (iter = listRecipients.begin(); iter != listRecipients.end(); ++iter)
@@ -2879,9 +3190,18 @@ static HRESULT ProcessDeliveryToServer(PyMapiPlugin *lppyMapiPlugin,
 		 * pointles to continue delivering the mail. However we must continue looping through all recipients
 		 * to inform the MTA we did handle the email properly.
 		 */
-		hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession, lpStore, lpUserSession == NULL, lpAdrBook, lpOrigMessage, bFallbackDelivery, strMail, *iter, lpArgs, &lpMessageTmp, &bFallbackDeliveryTmp);
+		// Let the server copy the message we delivered before for this recipient
+		hrCopy = MAPI_E_NOT_FOUND;
+		if (bServerCopy) {
+			sTarget = DeliveryTarget();
+			hrCopy = HrCopyMessageToDeliveryTarget(lpStore, lpSession, lpOrigMessage, bFallbackDelivery, *iter, lpArgs, &sTarget);
+			if (hrCopy != hrSuccess)
+				g_lpLogger->Log(EC_LOGLEVEL_DEBUG, "Unable to copy message for '%ls' on the server, copying through the client: 0x%08X", (*iter)->wstrUsername.c_str(), hrCopy);
+		}
+
+		hr = ProcessDeliveryToRecipient(lppyMapiPlugin, lpSession, lpStore, lpUserSession == NULL, lpAdrBook, lpOrigMessage, bFallbackDelivery, fpMail, *iter, lpArgs, hrCopy == hrSuccess ? &sTarget : NULL, &lpMessageTmp, &bFallbackDeliveryTmp, &bSaved);
 		if (hr == hrSuccess || hr == MAPI_E_CANCEL) {
-			if (hr == hrSuccess) {
+			if (hr == hrSuccess && lpMessageTmp) {
 				LPSPropValue lpMessageId = NULL;
 				LPSPropValue lpSubject = NULL;
 				wstring wMessageId;
@@ -2894,7 +3214,7 @@ static HRESULT ProcessDeliveryToServer(PyMapiPlugin *lppyMapiPlugin,
 					"Delivered message to '%ls', Subject: \"%ls\", Message-Id: %ls, size %lu",
 					(*iter)->wstrUsername.c_str(),
 					(lpSubject != NULL) ? lpSubject->Value.lpszW : L"<none>",
-					wMessageId.c_str(), static_cast<unsigned long>(strMail.size()));
+					wMessageId.c_str(), static_cast<unsigned long>(sMailStat.st_size));
 				MAPIFreeBuffer(lpSubject);
 			}
 			// cancel already logged.
@@ -2920,6 +3240,9 @@ static HRESULT ProcessDeliveryToServer(PyMapiPlugin *lppyMapiPlugin,
 				// If we delivered the message for the first time,
 				// we keep the intermediate message to make copies of.
 				lpMessageTmp->QueryInterface(IID_IMessage, (void**)&lpOrigMessage);
+
+				// Only a message saved on this server can be copied by the server
+				bServerCopy = bSaved && lpMessage == NULL;
 			}
 			bFallbackDelivery = bFallbackDeliveryTmp;
 
@@ -2945,7 +3268,12 @@ exit:
 	if (lpStore)
 		lpStore->Release();
 
-	if (lpSession)
+	if (lpSession && bPooledSession) {
+		if (hr == MAPI_E_NETWORK_ERROR || hr == MAPI_E_END_OF_SESSION)
+			g_lpSessionPool->DiscardSession(strServer, lpSession);
+		else
+			g_lpSessionPool->PutSession(strServer, lpSession);
+	} else if (lpSession)
 		lpSession->Release();
 
 	return hr;
@@ -2972,29 +3300,17 @@ static HRESULT ProcessDeliveryToSingleRecipient(PyMapiPlugin *lppyMapiPlugin,
     recipients_t &lstSingleRecip, DeliveryArgs *lpArgs)
 {
 	HRESULT hr = hrSuccess;
-	std::string strMail;
 
 	sc -> countInc("DAgent", "to_single_recipient");
 
-	/* Always start at the beginning of the file */
-	rewind(fp);
-
-	/* Read file into string */
-	hr = HrMapFileToString(fp, &strMail);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to map input to memory: %s (%x)",
-			GetMAPIErrorMessage(hr), hr);
-		goto exit;
-	}
-
-	FindSpamMarker(strMail, lpArgs);
+	/* The email is read from the file when needed, it is never loaded into memory as a whole */
+	FindSpamMarker(fp, lpArgs);
 	
-	hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, NULL, false, strMail, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, NULL, NULL);
+	hr = ProcessDeliveryToServer(lppyMapiPlugin, lpSession, NULL, false, fp, lpArgs->strPath, lstSingleRecip, lpAdrBook, lpArgs, NULL, NULL);
 
 	if (hr != hrSuccess)
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "ProcessDeliveryToSingleRecipient: ProcessDeliveryToServer failed %x", hr);
 
-exit:
 	return hr;
 }
 
@@ -3016,7 +3332,6 @@ static HRESULT ProcessDeliveryToCompany(PyMapiPlugin *lppyMapiPlugin,
 {
 	HRESULT hr = hrSuccess;
 	IMessage *lpMasterMessage = NULL;
-	std::string strMail;
 	serverrecipients_t listServerPathRecips;
 	serverrecipients_t::const_iterator iter;
 	bool bFallbackDelivery = false;
@@ -3029,18 +3344,8 @@ static HRESULT ProcessDeliveryToCompany(PyMapiPlugin *lppyMapiPlugin,
 		goto exit;
 	}
 
-	/* Always start at the beginning of the file */
-	rewind(fp);
-
-	/* Read file into string */
-	hr = HrMapFileToString(fp, &strMail);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to map input to memory: %s (%x)",
-			GetMAPIErrorMessage(hr), hr);
-		goto exit;
-	}
-
-	FindSpamMarker(strMail, lpArgs);
+	/* The email is read from the file when needed, it is never loaded into memory as a whole */
+	FindSpamMarker(fp, lpArgs);
 
 	hr = ResolveServerToPath(lpSession, lpServerNameRecips, lpArgs->strPath, &listServerPathRecips);
 	if (hr != hrSuccess) {
@@ -3053,7 +3358,7 @@ static HRESULT ProcessDeliveryToCompany(PyMapiPlugin *lppyMapiPlugin,
 		bool bFallbackDeliveryTmp = false;
 
 		if (!bExpired) {
-			hr = ProcessDeliveryToServer(lppyMapiPlugin, NULL, lpMasterMessage, bFallbackDelivery, strMail, convert_to<string>(iter->first), iter->second, lpAdrBook, lpArgs, &lpMessageTmp, &bFallbackDeliveryTmp);
+			hr = ProcessDeliveryToServer(lppyMapiPlugin, NULL, lpMasterMessage, bFallbackDelivery, fp, convert_to<string>(iter->first), iter->second, lpAdrBook, lpArgs, &lpMessageTmp, &bFallbackDeliveryTmp);
 			if (hr == MAPI_W_CANCEL_MESSAGE) {
 				bExpired =  true;
 				/* Don't report the error further */
@@ -3267,7 +3572,10 @@ static void *HandlerLMTP(void *lpArg)
 		goto exit;
 	}
 
-	hr = HrGetSession(lpArgs, ZARAFA_SYSTEM_USER_W, &lpSession);
+	if (g_lpSessionPool)
+		hr = g_lpSessionPool->GetSession(lpArgs->strPath, &lpSession);
+	else
+		hr = HrGetSession(lpArgs, ZARAFA_SYSTEM_USER_W, &lpSession);
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HandlerLMTP(): HrGetSession failed %x", hr);
 		lmtp.HrResponse("421 internal error: GetSession failed");
@@ -3278,6 +3586,11 @@ static void *HandlerLMTP(void *lpArg)
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "HandlerLMTP(): OpenResolveAddrFolder failed %x", hr);
 		lmtp.HrResponse("421 internal error: OpenResolveAddrFolder failed");
+		if (g_lpSessionPool) {
+			// do not hand out this session again
+			g_lpSessionPool->DiscardSession(lpArgs->strPath, lpSession);
+			lpSession = NULL;
+		}
 		goto exit;
 	}
 
@@ -3342,6 +3655,10 @@ static void *HandlerLMTP(void *lpArg)
 			continue;
 		}
 
+		// gather multi-line responses (LHLO, per-recipient DATA replies);
+		// flushed by the next HrSelect() or read
+		lpArgs->lpChannel->HrCork(true);
+
 		switch (eCommand) {
 		case LMTP_Command_LHLO:
 			if (lmtp.HrCommandLHLO(inBuffer, heloName) == hrSuccess) {
@@ -3550,7 +3867,9 @@ exit:
 	if (lpAdrBook)
 		lpAdrBook->Release();
 
-	if (lpSession)
+	if (lpSession && g_lpSessionPool)
+		g_lpSessionPool->PutSession(lpArgs->strPath, lpSession);
+	else if (lpSession)
 		lpSession->Release();
 
 	g_lpLogger->Log(EC_LOGLEVEL_INFO, "LMTP thread exiting");
@@ -3559,6 +3878,37 @@ exit:
 	return NULL;
 }
 
+/**
+ * Handles one LMTP connection on the worker thread pool in the
+ * threaded process model.
+ */
+class LMTPTask _zcp_final : public ECTask {
+public:
+	LMTPTask(DeliveryArgs *lpArgs) : m_lpArgs(lpArgs) {}
+
+protected:
+	virtual void run() _zcp_override
+	{
+		HandlerLMTP(m_lpArgs);	// deletes m_lpArgs
+		pthread_mutex_lock(&g_hMutexLMTPThreads);
+		--g_nLMTPThreads;
+		pthread_mutex_unlock(&g_hMutexLMTPThreads);
+	}
+
+private:
+	DeliveryArgs *m_lpArgs;
+};
+
+static unsigned int GetLMTPThreads(void)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&g_hMutexLMTPThreads);
+	n = g_nLMTPThreads;
+	pthread_mutex_unlock(&g_hMutexLMTPThreads);
+	return n;
+}
+
 /**
  * Runs the LMTP service daemon. Listens on the LMTP port for incoming
  * connections and starts a new thread or child process to handle the
@@ -3579,6 +3929,8 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 	int err = 0;
 	unsigned int nMaxThreads;
 	int nCloseFDs = 0, pCloseFDs[1] = {0};
+	ECThreadPool *lpThreadPool = NULL;
+	bool bBusy;
 
 #ifdef LINUX
     stack_t st;
@@ -3618,7 +3970,9 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 
 #ifdef LINUX
 	signal(SIGHUP, sighup);		// logrotate
-	signal(SIGCHLD, sigchld);
+	// in threaded mode, leave the children of unix_system() to waitpid()
+	if (!g_bThreads)
+		signal(SIGCHLD, sigchld);
 	signal(SIGPIPE, SIG_IGN);
 
 	// SIGSEGV backtrace support
@@ -3668,6 +4022,11 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 	sc = new StatsClient(g_lpLogger);
 	sc->startup(g_lpConfig->GetSetting("z_statsd_stats"));
 
+	if (g_bThreads) {
+		lpThreadPool = new ECThreadPool(nMaxThreads);
+		g_lpSessionPool = new SessionPool("spooler/dagent:system", EC_PROFILE_FLAGS_NO_NOTIFICATIONS, nMaxThreads);
+	}
+
 	g_lpLogger->Log(EC_LOGLEVEL_ALWAYS, "Starting zarafa-dagent LMTP mode version " PROJECT_VERSION_DAGENT_STR " (" PROJECT_SVN_REV_STR "), pid %d", getpid());
 
 	// Mainloop
@@ -3692,15 +4051,19 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 			continue;
 		}
 
-		// don't start more "threads" that lmtp_max_threads config option
-		if (g_nLMTPThreads == nMaxThreads) {
+		// don't start more "threads" that lmtp_max_threads config option,
+		// the MTA is kept waiting in the listen backlog meanwhile
+		pthread_mutex_lock(&g_hMutexLMTPThreads);
+		bBusy = g_nLMTPThreads == nMaxThreads;
+		if (!bBusy)
+			++g_nLMTPThreads;
+		pthread_mutex_unlock(&g_hMutexLMTPThreads);
+		if (bBusy) {
 			sc -> countInc("DAgent", "max_thread_count");
 			Sleep(100);
 			continue;
 		}
 
-		++g_nLMTPThreads;
-
 		// One socket has signalled a new incoming connection
 		DeliveryArgs *lpDeliveryArgs = new DeliveryArgs();
 		*lpDeliveryArgs = *lpArgs;
@@ -3712,12 +4075,29 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 				g_lpLogger->Log(EC_LOGLEVEL_ERROR, "running_service(): HrAccept failed %x", hr);
 				// just keep running
 				delete lpDeliveryArgs;
+				pthread_mutex_lock(&g_hMutexLMTPThreads);
+				--g_nLMTPThreads;
+				pthread_mutex_unlock(&g_hMutexLMTPThreads);
 				hr = hrSuccess;
 				continue;
 			}
 
 			sc -> countInc("DAgent", "incoming_session");
 
+			if (g_bThreads) {
+				// the task is never queued behind others, since at most
+				// nMaxThreads connections are in progress
+				if (!lpThreadPool->dispatch(new LMTPTask(lpDeliveryArgs), true)) {
+					g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Can't create LMTP thread.");
+					delete lpDeliveryArgs;
+					pthread_mutex_lock(&g_hMutexLMTPThreads);
+					--g_nLMTPThreads;
+					pthread_mutex_unlock(&g_hMutexLMTPThreads);
+				}
+				hr = hrSuccess;
+				continue;
+			}
+
 			if (unix_fork_function(HandlerLMTP, lpDeliveryArgs, nCloseFDs, pCloseFDs) < 0) {
 				g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Can't create LMTP process.");
 				// just keep running
@@ -3737,22 +4117,30 @@ static HRESULT running_service(const char *servicename, bool bDaemonize,
 
 #ifdef LINUX
 	// in forked mode, send all children the exit signal
-	signal(SIGTERM, SIG_IGN);
-	kill(0, SIGTERM);
+	if (!g_bThreads) {
+		signal(SIGTERM, SIG_IGN);
+		kill(0, SIGTERM);
+	}
 
-	// wait max 30 seconds
-	for (int i = 30; g_nLMTPThreads && i; --i) {
+	// wait max 30 seconds, threads see g_bQuit after their next command or timeout
+	for (int i = 30; GetLMTPThreads() && i; --i) {
 		if (i % 5 == 0)
-			g_lpLogger->Log(EC_LOGLEVEL_DEBUG, "Waiting for %d processes to terminate", g_nLMTPThreads);
+			g_lpLogger->Log(EC_LOGLEVEL_DEBUG, "Waiting for %d %s to terminate", GetLMTPThreads(), g_bThreads ? "threads" : "processes");
 		sleep(1);
 	}
 
-	if (g_nLMTPThreads)
-		g_lpLogger->Log(EC_LOGLEVEL_NOTICE, "Forced shutdown with %d processes left", g_nLMTPThreads);
-	else
+	if (GetLMTPThreads()) {
+		g_lpLogger->Log(EC_LOGLEVEL_NOTICE, "Forced shutdown with %d %s left", GetLMTPThreads(), g_bThreads ? "threads" : "processes");
+		// threads still using MAPI, leave cleanup to process exit
+		if (g_bThreads)
+			goto exit;
+	} else
 		g_lpLogger->Log(EC_LOGLEVEL_INFO, "LMTP service shutdown complete");
 #endif
 
+	delete lpThreadPool;
+	delete g_lpSessionPool;
+	g_lpSessionPool = NULL;
 	MAPIUninitialize();
 
 exit:
@@ -3792,12 +4180,18 @@ static HRESULT deliver_recipient(PyMapiPlugin *lppyMapiPlugin,
 
 	sc -> countInc("DAgent::STDIN", "received");
 
-	/* Make sure file uses CRLF */
-	HRESULT hr2 = HrFileLFtoCRLF(file, &fpMail);
-	if (hr2 != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_WARNING, "Unable to convert input to CRLF format: %s (%x)",
-			GetMAPIErrorMessage(hr2), hr2);
-		fpMail = file;
+	/*
+	 * Make sure file uses CRLF. The copy is also what makes the mail
+	 * seekable for parsing, since the input may be a pipe. When it fails,
+	 * part of the input has been consumed already, so we can only fail
+	 * (temporarily) and let the MTA retry.
+	 */
+	hr = HrFileLFtoCRLF(file, &fpMail);
+	if (hr != hrSuccess) {
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to copy the input to a temporary file: %s (%x)",
+			GetMAPIErrorMessage(hr), hr);
+		fpMail = NULL;
+		goto exit;
 	}
 
 	strUsername = recipient;
@@ -4022,7 +4416,7 @@ int main(int argc, char *argv[]) {
 #endif
 		{ "lmtp_port", "2003" },
 		{ "lmtp_max_threads", "20" },
-		{ "process_model", "", CONFIGSETTING_UNUSED },
+		{ "process_model", "fork" },
 		{ "log_method", "file" },
 		{ "log_file", "-" },
 		{ "log_level", "3", CONFIGSETTING_RELOADABLE },
@@ -4237,6 +4631,16 @@ int main(int argc, char *argv[]) {
 
 	sDeliveryArgs.sDeliveryOpts.default_charset = g_lpConfig->GetSetting("default_charset");
 
+	if (bListenLMTP && strncmp(g_lpConfig->GetSetting("process_model"), "thread", strlen("thread")) == 0) {
+		// the embedded python interpreter cannot be shared by multiple deliveries
+		if (parseBool(g_lpConfig->GetSetting("plugin_enabled")))
+			g_lpLogger->Log(EC_LOGLEVEL_WARNING, "process_model = thread cannot be used with plugin_enabled, using fork instead");
+		else {
+			g_bThreads = true;
+			g_lpLogger->SetLogprefix(LP_TID);
+		}
+	}
+
 	if (bListenLMTP) {
 		/* MAPIInitialize done inside running_service */
 		hr = running_service(argv[0], bDaemonize, &sDeliveryArgs);
@@ -81,6 +81,8 @@
 #include <zarafa/ECGetText.h>
 #include "StatsClient.h"
 #include "TmpPath.h"
+#include <zarafa/ECThreadPool.h>
+#include "sessionpool.h"
 
 #include <map>
 #include "spmain.h"
@@ -134,6 +136,13 @@ static map<pid_t, SendData> mapSendData;
 static map<pid_t, int> mapFinished;	// exit status of finished processes
 static pthread_mutex_t hMutexFinished;	// mutex for mapFinished
 
+// threaded process model
+static bool bThreads = false;
+static ECThreadPool *lpThreadPool = NULL;
+static SessionPool *lpSessionPool = NULL;
+static SessionPool *lpUserSessionPool = NULL;
+static pid_t ulLastTaskId = 0;	// send tasks use negative ids in place of a pid
+
 static HRESULT running_server(const char *szSMTP, int port, const char *szPath);
 
 /**
@@ -222,6 +231,67 @@ static LONG __stdcall AdviseCallback(void *lpContext, ULONG cNotif,
  * if (szSMTP)  smtp host
  * if (szSMTPPport) smtp port
  */
+/**
+ * Translates the result of sending a message to the exit code of the
+ * mailer, as interpreted by CleanFinishedMessages().
+ *
+ * @param[in]	hr	Result of ProcessMessageForked()
+ * @return		EXIT_* code
+ */
+static int GetExitCode(HRESULT hr)
+{
+	switch(hr) {
+	case hrSuccess:
+		return EXIT_OK;
+
+	case MAPI_E_WAIT:			// Timed message
+	case MAPI_W_NO_SERVICE:		// SMTP server did not react in forked mode, mail should be retried later
+		return EXIT_WAIT;
+	}
+
+	// forked: failed sending message, but is already removed from the queue
+	return EXIT_FAILED;
+}
+
+/**
+ * Fills the SendData struct for a message about to be sent.
+ *
+ * @param[in]	szUsername	The username. This name is in unicode.
+ * @param[in]	cbStoreEntryId	Length of lpStoreEntryId
+ * @param[in]	lpStoreEntryId	Entry ID of store of user containing the message to be sent
+ * @param[in]	cbMsgEntryId	Length of lpMsgEntryId
+ * @param[in]	lpMsgEntryId	Entry ID of message to be sent
+ * @param[in]	ulFlags		PR_EC_OUTGOING_FLAGS of message
+ * @param[out]	lpSendData	Struct to fill, entryids must be freed with MAPIFreeBuffer
+ * @return		HRESULT
+ */
+static HRESULT InitSendData(const wchar_t *szUsername, ULONG cbStoreEntryId,
+    BYTE *lpStoreEntryId, ULONG cbMsgEntryId, BYTE *lpMsgEntryId,
+    ULONG ulFlags, SendData *lpSendData)
+{
+	HRESULT hr = hrSuccess;
+
+	lpSendData->cbStoreEntryId = cbStoreEntryId;
+	hr = MAPIAllocateBuffer(cbStoreEntryId, (void**)&lpSendData->lpStoreEntryId);
+	if (hr != hrSuccess) {
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "InitSendData(): MAPIAllocateBuffer failed(1) %x", hr);
+		return hr;
+	}
+
+	memcpy(lpSendData->lpStoreEntryId, lpStoreEntryId, cbStoreEntryId);
+	lpSendData->cbMessageEntryId = cbMsgEntryId;
+	hr = MAPIAllocateBuffer(cbMsgEntryId, (void**)&lpSendData->lpMessageEntryId);
+	if (hr != hrSuccess) {
+		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "InitSendData(): MAPIAllocateBuffer failed(2) %x", hr);
+		MAPIFreeBuffer(lpSendData->lpStoreEntryId);
+		return hr;
+	}
+	memcpy(lpSendData->lpMessageEntryId, lpMsgEntryId, cbMsgEntryId);
+	lpSendData->ulFlags = ulFlags;
+	lpSendData->strUsername = szUsername;
+	return hrSuccess;
+}
+
 #ifdef LINUX
 /**
  * Starts a forked process which sends the actual mail, and removes it
@@ -253,23 +323,9 @@ static HRESULT StartSpoolerFork(const wchar_t *szUsername, const char *szSMTP,
 	std::string strPort = stringify(ulSMTPPort);
 
 	// place pid with entryid copy in map
-	sSendData.cbStoreEntryId = cbStoreEntryId;
-	hr = MAPIAllocateBuffer(cbStoreEntryId, (void**)&sSendData.lpStoreEntryId);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "StartSpoolerFork(): MAPIAllocateBuffer failed(1) %x", hr);
+	hr = InitSendData(szUsername, cbStoreEntryId, lpStoreEntryId, cbMsgEntryId, lpMsgEntryId, ulFlags, &sSendData);
+	if (hr != hrSuccess)
 		goto exit;
-	}
-
-	memcpy(sSendData.lpStoreEntryId, lpStoreEntryId, cbStoreEntryId);
-	sSendData.cbMessageEntryId = cbMsgEntryId;
-	hr = MAPIAllocateBuffer(cbMsgEntryId, (void**)&sSendData.lpMessageEntryId);
-	if (hr != hrSuccess) {
-		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "StartSpoolerFork(): MAPIAllocateBuffer failed(2) %x", hr);
-		goto exit;
-	}
-	memcpy(sSendData.lpMessageEntryId, lpMsgEntryId, cbMsgEntryId);
-	sSendData.ulFlags = ulFlags;
-	sSendData.strUsername = szUsername;
 
 	// execute the new spooler process to send the email
 	pid = vfork();
@@ -320,6 +376,99 @@ exit:
 }
 #endif
 
+/**
+ * Sends one message on the worker thread pool in the threaded process
+ * model. This does the same as the process started by StartSpoolerFork,
+ * but uses the admin and user sessions from the session pools. The result
+ * is reported in mapFinished, as if the process had exited.
+ */
+class SendTask _zcp_final : public ECTask {
+public:
+	SendTask(pid_t ulTaskId, const wchar_t *szUsername, const char *szSMTP,
+	    int ulPort, const char *szPath, ULONG cbMsgEntryId,
+	    const BYTE *lpMsgEntryId, bool bDoSentMail) :
+		m_ulTaskId(ulTaskId), m_strUsername(szUsername), m_strSMTP(szSMTP),
+		m_ulPort(ulPort), m_strPath(szPath),
+		m_strMsgEntryId(reinterpret_cast<const char *>(lpMsgEntryId), cbMsgEntryId),
+		m_bDoSentMail(bDoSentMail)
+	{}
+
+protected:
+	virtual void run() _zcp_override
+	{
+		HRESULT hr = hrSuccess;
+		IMAPISession *lpAdminSession = NULL;
+		IMAPISession *lpUserSession = NULL;
+
+		// on failure, ProcessMessageForked opens and logs its own sessions
+		if (lpSessionPool->GetSession(m_strPath, &lpAdminSession) != hrSuccess)
+			lpAdminSession = NULL;
+		if (lpUserSessionPool->GetSession(m_strPath, &lpUserSession, m_strUsername) != hrSuccess)
+			lpUserSession = NULL;
+
+		hr = ProcessMessageForked(m_strUsername.c_str(), m_strSMTP.c_str(), m_ulPort, m_strPath.c_str(), m_strMsgEntryId.size(), (LPENTRYID)m_strMsgEntryId.data(), m_bDoSentMail, lpAdminSession, lpUserSession);
+
+		if (hr == MAPI_E_NETWORK_ERROR || hr == MAPI_E_END_OF_SESSION) {
+			lpSessionPool->DiscardSession(m_strPath, lpAdminSession);
+			lpUserSessionPool->DiscardSession(m_strPath, lpUserSession);
+		} else {
+			lpSessionPool->PutSession(m_strPath, lpAdminSession);
+			lpUserSessionPool->PutSession(m_strPath, lpUserSession, m_strUsername);
+		}
+
+		pthread_mutex_lock(&hMutexFinished);
+		mapFinished[m_ulTaskId] = W_EXITCODE(GetExitCode(hr), 0);
+		pthread_mutex_unlock(&hMutexFinished);
+		// Trigger condition so the message gets cleaned from the queue
+		pthread_mutex_lock(&hMutexMessagesWaiting);
+		pthread_cond_signal(&hCondMessagesWaiting);
+		pthread_mutex_unlock(&hMutexMessagesWaiting);
+	}
+
+private:
+	pid_t m_ulTaskId;
+	std::wstring m_strUsername;
+	std::string m_strSMTP;
+	int m_ulPort;
+	std::string m_strPath;
+	std::string m_strMsgEntryId;
+	bool m_bDoSentMail;
+};
+
+/**
+ * Queues a message on the worker thread pool, the threaded counterpart
+ * of StartSpoolerFork. Parameters are the same.
+ *
+ * @return		HRESULT
+ */
+static HRESULT StartSpoolerThread(const wchar_t *szUsername,
+    const char *szSMTP, int ulSMTPPort, const char *szPath,
+    ULONG cbStoreEntryId, BYTE *lpStoreEntryId, ULONG cbMsgEntryId,
+    BYTE *lpMsgEntryId, ULONG ulFlags)
+{
+	HRESULT hr = hrSuccess;
+	SendData sSendData;
+	pid_t ulTaskId = --ulLastTaskId;
+	bool bDoSentMail = ulFlags & EC_SUBMIT_DOSENTMAIL;
+
+	hr = InitSendData(szUsername, cbStoreEntryId, lpStoreEntryId, cbMsgEntryId, lpMsgEntryId, ulFlags, &sSendData);
+	if (hr != hrSuccess)
+		return hr;
+
+	// the task may finish before dispatch() returns, so place it in the map first
+	mapSendData[ulTaskId] = sSendData;
+	if (!lpThreadPool->dispatch(new SendTask(ulTaskId, szUsername, szSMTP, ulSMTPPort, szPath, cbMsgEntryId, lpMsgEntryId, bDoSentMail), true)) {
+		g_lpLogger->Log(EC_LOGLEVEL_FATAL, "Unable to start new spooler thread");
+		mapSendData.erase(ulTaskId);
+		MAPIFreeBuffer(sSendData.lpStoreEntryId);
+		MAPIFreeBuffer(sSendData.lpMessageEntryId);
+		return MAPI_E_CALL_FAILED;
+	}
+
+	g_lpLogger->Log(EC_LOGLEVEL_INFO, "Spooler thread started for task %d", -ulTaskId);
+	return hrSuccess;
+}
+
 /**
  * Opens all required objects of the administrator to move an error
  * mail out of the queue.
@@ -597,6 +746,9 @@ static HRESULT ProcessAllEntries(IMAPISession *lpAdminSession,
 	ulMaxThreads = atoi(g_lpConfig->GetSetting("max_threads"));
 	if (ulMaxThreads == 0)
 		ulMaxThreads = 1;
+	// follow a reloaded max_threads
+	if (lpThreadPool && lpThreadPool->threadCount() != ulMaxThreads)
+		lpThreadPool->setThreadCount(ulMaxThreads);
 
 	while(!bQuit) {
 		if (lpsRowSet) {
@@ -677,8 +829,11 @@ static HRESULT ProcessAllEntries(IMAPISession *lpAdminSession,
 		if (bMatch)
 			continue;
 
-		// Start new process to send the mail
-		hr = StartSpoolerFork(strUsername.c_str(), szSMTP, ulPort, szPath, lpsRowSet->aRow[0].lpProps[1].Value.bin.cb, lpsRowSet->aRow[0].lpProps[1].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[2].Value.bin.cb, lpsRowSet->aRow[0].lpProps[2].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[3].Value.ul);
+		// Start new process or thread to send the mail
+		if (bThreads)
+			hr = StartSpoolerThread(strUsername.c_str(), szSMTP, ulPort, szPath, lpsRowSet->aRow[0].lpProps[1].Value.bin.cb, lpsRowSet->aRow[0].lpProps[1].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[2].Value.bin.cb, lpsRowSet->aRow[0].lpProps[2].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[3].Value.ul);
+		else
+			hr = StartSpoolerFork(strUsername.c_str(), szSMTP, ulPort, szPath, lpsRowSet->aRow[0].lpProps[1].Value.bin.cb, lpsRowSet->aRow[0].lpProps[1].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[2].Value.bin.cb, lpsRowSet->aRow[0].lpProps[2].Value.bin.lpb, lpsRowSet->aRow[0].lpProps[3].Value.ul);
 		if (hr != hrSuccess) {
 			g_lpLogger->Log(EC_LOGLEVEL_WARNING, "ProcessAllEntries(): Failed starting spooler: %x", hr);
 			goto exit;
@@ -1123,6 +1278,7 @@ int main(int argc, char *argv[]) {
 		{ "sslkey_file", "" },
 		{ "sslkey_pass", "", CONFIGSETTING_EXACT },
 		{ "max_threads", "5", CONFIGSETTING_RELOADABLE },
+		{ "process_model", "fork" },
 		{ "fax_domain", "", CONFIGSETTING_RELOADABLE },
 		{ "fax_international", "+", CONFIGSETTING_RELOADABLE },
 		{ "always_send_delegates", "no", CONFIGSETTING_RELOADABLE },
@@ -1277,6 +1433,14 @@ int main(int argc, char *argv[]) {
 	}
 #endif
 
+	if (!bForked && bNPTL && strncmp(g_lpConfig->GetSetting("process_model"), "thread", strlen("thread")) == 0) {
+		// the embedded python interpreter cannot be shared by multiple messages
+		if (parseBool(g_lpConfig->GetSetting("plugin_enabled")))
+			g_lpLogger->Log(EC_LOGLEVEL_WARNING, "process_model = thread cannot be used with plugin_enabled, using fork instead");
+		else
+			bThreads = true;
+	}
+
 	// set socket filename
 	if (!szPath)
 		szPath = g_lpConfig->GetSetting("server_socket");
@@ -1345,7 +1509,7 @@ int main(int argc, char *argv[]) {
 	g_lpLogger = StartLoggerProcess(g_lpConfig, g_lpLogger);
 	ec_log_set(g_lpLogger);
 #endif
-	g_lpLogger->SetLogprefix(LP_PID);
+	g_lpLogger->SetLogprefix(bThreads ? LP_TID : LP_PID);
 
 	hr = MAPIInitialize(NULL);
 	if (hr != hrSuccess) {
@@ -1377,11 +1541,25 @@ int main(int argc, char *argv[]) {
 	sc = new StatsClient(g_lpLogger);
 	sc->startup(g_lpConfig->GetSetting("z_statsd_stats"));
 
+	if (bThreads) {
+		ULONG ulMaxThreads = atoi(g_lpConfig->GetSetting("max_threads"));
+
+		if (ulMaxThreads == 0)
+			ulMaxThreads = 1;
+		lpThreadPool = new ECThreadPool(ulMaxThreads);
+		lpSessionPool = new SessionPool("spooler/mailer:admin", EC_PROFILE_FLAGS_NO_PUBLIC_STORE, ulMaxThreads);
+		lpUserSessionPool = new SessionPool("spooler/mailer", EC_PROFILE_FLAGS_NO_PUBLIC_STORE, ulMaxThreads);
+	}
+
 	if (bForked)
 		hr = ProcessMessageForked(strUsername.c_str(), szSMTP, ulPort, szPath, strMsgEntryId.length(), (LPENTRYID)strMsgEntryId.data(), bDoSentMail);
 	else
 			hr = running_server(szSMTP, ulPort, szPath);
 
+	// waits for messages still being sent
+	delete lpThreadPool;
+	delete lpSessionPool;
+	delete lpUserSessionPool;
 	delete sc;
 
 #ifdef LINUX
@@ -1408,15 +1586,5 @@ exit:
 	free(st.ss_sp);
 #endif
 
-	switch(hr) {
-	case hrSuccess:
-		return EXIT_OK;
-
-	case MAPI_E_WAIT:			// Timed message
-		case MAPI_W_NO_SERVICE:	// SMTP server did not react in forked mode, mail should be retried later
-		return EXIT_WAIT;
-	}
-
-		// forked: failed sending message, but is already removed from the queue
-		return EXIT_FAILED;
+	return GetExitCode(hr);
 }
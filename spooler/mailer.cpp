@@ -2690,11 +2690,14 @@ exit:
  * @param[in]	cbMsgEntryId The number of bytes in lpMsgEntryId
  * @param[in]	lpMsgEntryId The EntryID of the message to send
  * @param[in]	bDoSentMail	true if the mail should be moved to the "Sent Items" folder of the user.
+ * @param[in]	lpSharedAdminSession	Optional admin session to use, instead of opening a new one (threaded mode).
+ * @param[in]	lpSharedUserSession	Optional session of szUsername to use, instead of opening a new one (threaded mode).
  * @return		HRESULT
  */
 HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
     int ulPort, const char *szPath, ULONG cbMsgEntryId, LPENTRYID lpMsgEntryId,
-    bool bDoSentMail)
+    bool bDoSentMail, IMAPISession *lpSharedAdminSession,
+    IMAPISession *lpSharedUserSession)
 {
 	HRESULT			hr = hrSuccess;
 	IMAPISession	*lpAdminSession = NULL;
@@ -2717,9 +2720,12 @@ HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
 	}
 
 	// The Admin session is used for checking delegates and archiving
-	hr = HrOpenECAdminSession(g_lpLogger, &lpAdminSession, "spooler/mailer:admin", PROJECT_SVN_REV_STR, szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
-							  g_lpConfig->GetSetting("sslkey_file", "", NULL),
-							  g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+	if (lpSharedAdminSession)
+		hr = lpSharedAdminSession->QueryInterface(IID_IMAPISession, (void **)&lpAdminSession);
+	else
+		hr = HrOpenECAdminSession(g_lpLogger, &lpAdminSession, "spooler/mailer:admin", PROJECT_SVN_REV_STR, szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
+								  g_lpConfig->GetSetting("sslkey_file", "", NULL),
+								  g_lpConfig->GetSetting("sslkey_pass", "", NULL));
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to open admin session: %s (%x)",
 			GetMAPIErrorMessage(hr), hr);
@@ -2734,9 +2740,12 @@ HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP,
 	 * usersession for email sending we will let the server handle all
 	 * permissions and can correctly resolve everything.
 	 */
-	hr = HrOpenECSession(g_lpLogger, &lpUserSession, "spooler/mailer", PROJECT_SVN_REV_STR, szUsername, L"", szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
-						 g_lpConfig->GetSetting("sslkey_file", "", NULL),
-						 g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+	if (lpSharedUserSession)
+		hr = lpSharedUserSession->QueryInterface(IID_IMAPISession, (void **)&lpUserSession);
+	else
+		hr = HrOpenECSession(g_lpLogger, &lpUserSession, "spooler/mailer", PROJECT_SVN_REV_STR, szUsername, L"", szPath, EC_PROFILE_FLAGS_NO_PUBLIC_STORE,
+							 g_lpConfig->GetSetting("sslkey_file", "", NULL),
+							 g_lpConfig->GetSetting("sslkey_pass", "", NULL));
 	if (hr != hrSuccess) {
 		g_lpLogger->Log(EC_LOGLEVEL_ERROR, "Unable to open user session: %s (%x)",
 			GetMAPIErrorMessage(hr), hr);
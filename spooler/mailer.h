@@ -19,10 +19,11 @@
 #define MAILER_H
 
 #include <mapidefs.h>
+#include <mapix.h>
 #include <inetmapi/inetmapi.h>
 #include <zarafa/ECDefs.h>
 
 HRESULT SendUndeliverable(LPADRBOOK lpAddrBook, ECSender *lpMailer, LPMDB lpStore, ECUSER *lpUserAdmin, LPMESSAGE lpMessage);
-HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP, int ulPort, const char *szPath, ULONG cbMsgEntryId, LPENTRYID lpMsgEntryId, bool bDoSentMail);
+HRESULT ProcessMessageForked(const wchar_t *szUsername, const char *szSMTP, int ulPort, const char *szPath, ULONG cbMsgEntryId, LPENTRYID lpMsgEntryId, bool bDoSentMail, IMAPISession *lpSharedAdminSession = NULL, IMAPISession *lpSharedUserSession = NULL);
 
 #endif
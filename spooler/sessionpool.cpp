@@ -0,0 +1,153 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <zarafa/platform.h>
+#include "sessionpool.h"
+
+#include <list>
+#include <zarafa/CommonUtil.h>
+#include <zarafa/ECConfig.h>
+#include <zarafa/ECLogger.h>
+#include <zarafa/ecversion.h>
+#include "spmain.h"
+
+/**
+ * @param[in]	szAppName		Application name passed to the server on logon
+ * @param[in]	ulProfileFlags	EC_PROFILE_FLAGS_* for the sessions
+ * @param[in]	ulMaxIdle		Maximum number of unused sessions to keep
+ */
+SessionPool::SessionPool(const char *szAppName, ULONG ulProfileFlags,
+    size_t ulMaxIdle) :
+	m_strAppName(szAppName), m_ulProfileFlags(ulProfileFlags),
+	m_ulMaxIdle(ulMaxIdle)
+{
+	pthread_mutex_init(&m_hMutex, NULL);
+}
+
+SessionPool::~SessionPool()
+{
+	sessionmap_t::const_iterator iter;
+
+	for (iter = m_mapIdle.begin(); iter != m_mapIdle.end(); ++iter)
+		iter->second->Release();
+
+	pthread_mutex_destroy(&m_hMutex);
+}
+
+/**
+ * Get a session for a server, reusing an idle one when available.
+ *
+ * @param[in]	strPath		Connection path of the server
+ * @param[out]	lppSession	Session, to be returned with PutSession() or released
+ * @param[in]	strUsername	User to log on as, empty for an admin session
+ *
+ * @return MAPI error code
+ */
+HRESULT SessionPool::GetSession(const std::string &strPath,
+    IMAPISession **lppSession, const std::wstring &strUsername)
+{
+	sessionmap_t::iterator iter;
+	IMAPISession *lpSession = NULL;
+
+	pthread_mutex_lock(&m_hMutex);
+	iter = m_mapIdle.find(sessionkey_t(strPath, strUsername));
+	if (iter != m_mapIdle.end()) {
+		lpSession = iter->second;
+		m_mapIdle.erase(iter);
+	}
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (lpSession != NULL) {
+		*lppSession = lpSession;
+		return hrSuccess;
+	}
+
+	if (!strUsername.empty())
+		return HrOpenECSession(g_lpLogger, lppSession, m_strAppName.c_str(),
+		       PROJECT_SVN_REV_STR, strUsername.c_str(), L"",
+		       strPath.c_str(), m_ulProfileFlags,
+		       g_lpConfig->GetSetting("sslkey_file", "", NULL),
+		       g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+
+	return HrOpenECAdminSession(g_lpLogger, lppSession, m_strAppName.c_str(),
+	       PROJECT_SVN_REV_STR, strPath.c_str(), m_ulProfileFlags,
+	       g_lpConfig->GetSetting("sslkey_file", "", NULL),
+	       g_lpConfig->GetSetting("sslkey_pass", "", NULL));
+}
+
+/**
+ * Return a session obtained with GetSession() to the pool. When the pool
+ * already holds the maximum number of idle sessions, one of those is
+ * released to make room, so sessions of users that stopped sending do not
+ * keep the pool filled.
+ *
+ * @param[in]	strPath		Connection path the session was requested for
+ * @param[in]	lpSession	Session to return, ownership is transferred
+ * @param[in]	strUsername	User the session was requested for
+ */
+void SessionPool::PutSession(const std::string &strPath,
+    IMAPISession *lpSession, const std::wstring &strUsername)
+{
+	IMAPISession *lpEvicted = NULL;
+
+	if (lpSession == NULL)
+		return;
+	if (m_ulMaxIdle == 0) {
+		lpSession->Release();
+		return;
+	}
+
+	pthread_mutex_lock(&m_hMutex);
+	if (m_mapIdle.size() >= m_ulMaxIdle) {
+		lpEvicted = m_mapIdle.begin()->second;
+		m_mapIdle.erase(m_mapIdle.begin());
+	}
+	m_mapIdle.insert(sessionmap_t::value_type(sessionkey_t(strPath, strUsername), lpSession));
+	pthread_mutex_unlock(&m_hMutex);
+
+	if (lpEvicted != NULL)
+		lpEvicted->Release();
+}
+
+/**
+ * Release a session obtained with GetSession() that returned an error,
+ * together with all idle sessions for the same server, since those are
+ * most likely broken in the same way.
+ *
+ * @param[in]	strPath		Connection path the session was requested for
+ * @param[in]	lpSession	Session to release, may be NULL
+ */
+void SessionPool::DiscardSession(const std::string &strPath,
+    IMAPISession *lpSession)
+{
+	sessionmap_t::iterator iter;
+	std::list<IMAPISession *> lstStale;
+	std::list<IMAPISession *>::const_iterator iterStale;
+
+	pthread_mutex_lock(&m_hMutex);
+	iter = m_mapIdle.lower_bound(sessionkey_t(strPath, std::wstring()));
+	while (iter != m_mapIdle.end() && iter->first.first == strPath) {
+		lstStale.push_back(iter->second);
+		m_mapIdle.erase(iter++);
+	}
+	pthread_mutex_unlock(&m_hMutex);
+
+	for (iterStale = lstStale.begin(); iterStale != lstStale.end(); ++iterStale)
+		(*iterStale)->Release();
+	if (lpSession != NULL)
+		lpSession->Release();
+}
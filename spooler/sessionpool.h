@@ -0,0 +1,65 @@
+/*
+ * Copyright 2005 - 2015  Zarafa B.V. and its licensors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License, version 3,
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SPOOLER_SESSIONPOOL_H
+#define SPOOLER_SESSIONPOOL_H 1
+
+#include <zarafa/zcdefs.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <mapix.h>
+
+/**
+ * Pool of MAPI sessions for the threaded process model.
+ *
+ * Opening a session costs a logon round trip to the server, which the forked
+ * workers pay for every connection or message. Worker threads take a session
+ * for a server path with GetSession() and hand it back with PutSession() when
+ * done, so it can be reused by the next delivery. A session is only used by
+ * one thread at a time. A session that failed, e.g. because the server was
+ * restarted, is handed back with DiscardSession() instead.
+ *
+ * Sessions are admin sessions, unless a username is passed. User sessions
+ * are only handed out again for the same user.
+ */
+class SessionPool _zcp_final {
+public:
+	SessionPool(const char *szAppName, ULONG ulProfileFlags, size_t ulMaxIdle);
+	~SessionPool();
+
+	HRESULT GetSession(const std::string &strPath, IMAPISession **lppSession, const std::wstring &strUsername = std::wstring());
+	void PutSession(const std::string &strPath, IMAPISession *lpSession, const std::wstring &strUsername = std::wstring());
+	void DiscardSession(const std::string &strPath, IMAPISession *lpSession);
+
+private:
+	typedef std::pair<std::string, std::wstring> sessionkey_t;	// server path, username
+	typedef std::multimap<sessionkey_t, IMAPISession *> sessionmap_t;
+
+	// Inhibit copying
+	SessionPool(const SessionPool &);
+	SessionPool &operator=(const SessionPool &);
+
+	std::string m_strAppName;
+	ULONG m_ulProfileFlags;
+	size_t m_ulMaxIdle;
+
+	pthread_mutex_t m_hMutex;	// protects m_mapIdle
+	sessionmap_t m_mapIdle;
+};
+
+#endif /* SPOOLER_SESSIONPOOL_H */